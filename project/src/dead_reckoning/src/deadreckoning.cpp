@@ -1,4 +1,5 @@
 #include "deadreckoning.h"
+#include "sdlutils.h"
 #include "../../utilities.h"
 
 
@@ -16,64 +17,6 @@ static SDL_Color createColor(int r, int g, int b)
     return color;
 }
 
-/**
- * @brief Sets a pixel of an SDL Surface to a specific color.
- *
- * The surface should be locked (see SDL_LockSurface()) before calling this function.
- * This function comes from the SDL documentation.
- *
- * @param surface The SDL Surface.
- * @param x The x-coordinate of the pixel to set.
- * @param y The y-coordinate of the pixel to set.
- * @param pixel The color to set to the pixel, as a 32-bits unsigned integer (use SDL_MapRGB() / SDL_MapRGBA() to create it).
- * @param check True if the provided coordinates must be checked before setting the pixel. If check is False and invalid coordinates are set, this might cause a segfault.
- * @return True if the pixel was successfully set.
- */
-static bool putPixel(SDL_Surface *surface, int x, int y, Uint32 pixel, bool check=true)
-{
-    if (check)
-    {
-        if (x < 0 || y < 0 || x >= surface->w || y >= surface->h)
-            return false;
-    }
-
-    int bpp = surface->format->BytesPerPixel;
-    /* Here p is the address to the pixel we want to set */
-    Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
-
-    switch(bpp)
-    {
-        case 1:
-            *p = pixel;
-            break;
-
-        case 2:
-            *(Uint16 *)p = pixel;
-            break;
-
-        case 3:
-            if(SDL_BYTEORDER == SDL_BIG_ENDIAN)
-            {
-                p[0] = (pixel >> 16) & 0xff;
-                p[1] = (pixel >> 8) & 0xff;
-                p[2] = pixel & 0xff;
-            }
-            else
-            {
-                p[0] = pixel & 0xff;
-                p[1] = (pixel >> 8) & 0xff;
-                p[2] = (pixel >> 16) & 0xff;
-            }
-            break;
-
-        case 4:
-            *(Uint32 *)p = pixel;
-            break;
-    }
-
-    return true;
-}
-
 /**
  * @brief Draw a line segment on a SDL Surface.
  *
@@ -137,437 +80,124 @@ static void drawLine(SDL_Surface *surf, float x1, float y1, float x2, float y2,
 }
 
 /**
- * @brief Creates internal storage and cleans it.
- */
-void Grid::init()
-{
-    updateSize();
-    m_data = new ProbabilisticPoint*[m_height*m_width];
-    //TODO check if m_data != NULL
-    memset(m_data, 0, sizeof(ProbabilisticPoint*)*m_height*m_width);
-    
-    //ROS_INFO("(%d x %d) = %d", m_width, m_height, m_height*m_width);
-}
-
-/**
- * @brief Frees internal storage.
- */
-void Grid::empty()
-{
-    if (m_data != NULL)
-    {
-        int n = m_width*m_height;
-        for (int i=0 ; i < n ; i++)
-        {
-            if (m_data[i] != NULL)
-                delete m_data[i];
-        }
-        delete m_data;
-        m_data = NULL;
-    }
-}
-
-/**
- * @brief Rounds the coordinates of the upper-left and lower-right corners and updates the height and width.
- */
-void Grid::updateSize()
-{
-    m_minX = m_precision * round(m_minX / m_precision);
-    m_minY = m_precision * round(m_minY / m_precision);
-    m_maxX = m_precision * round(m_maxX / m_precision);
-    m_maxY = m_precision * round(m_maxY / m_precision);
-    m_height = round((m_maxY - m_minY) / m_precision)+1;
-    m_width = round((m_maxX - m_minX) / m_precision)+1;
-}
-
-/**
- * @brief Accesses the probability of a point at given grid coordinates.
- *
- * @param ix The x-coordinate of the point to access.
- * @param iy The y-coordinate of the point to access.
- * @return The obstacle probability  at this point, between 0 and 1, negative means unknown.
- */
-double Grid::_get(int ix, int iy)
-{
-    if (ix < 0 || iy < 0 || ix >= m_width || iy >= m_height)
-        return -1;
-    
-    int k = ix*m_height+iy;
-    int minTime = ros::Time::now().toSec() - m_ttl.toSec();
-    if (m_data[k] == NULL || m_data[k]->t.toSec() < minTime)
-        return -1;
-    
-    return m_data[k]->p;
-}
-
-/**
- * @brief Standard constructor.
- *
- * Creates an empty Grid mapped at specified coordinates in the real world.
- *
- * @param precision The precision of the discretization, in m / unit.
- * @param ttl The Time To Live of a point in the Grid.
- * @param minX The x-coordinate of the upper-left corner of the Grid in the real world.
- * @param maxX The x-coordinate of the lower-right corner of the Grid in the real world.
- * @param minY The y-coordinate of the upper-left corner of the Grid in the real world.
- * @param maxY The y-coordinate of the lower-right corner of the Grid in the real world.
- * @param resizeable True if the grid can be automatically resized to integrate new points. !WARNING! This is an untested feature.
- */
-Grid::Grid(double precision, ros::Duration ttl, double minX, double maxX, double minY, double maxY, bool resizeable):
-    m_precision(precision), m_ttl(ttl), m_minX(minX), m_maxX(maxX), m_minY(minY), m_maxY(maxY), m_resizeable(resizeable)
-{
-    init();
-}
-
-/**
- * @brief Copy constructor.
- *
- * Creates an EMPTY Grid with the same settings as the one provided.
- *
- * @param grid The Grid to copy.
- */
-Grid::Grid(const Grid& grid):
-    m_precision(grid.m_precision), m_ttl(grid.m_ttl), m_minX(grid.m_minX), m_maxX(grid.m_maxX), m_minY(grid.m_minY), m_maxY(grid.m_maxY), m_resizeable(grid.m_resizeable)
-{
-    init();            
-}
-
-/**
- * @brief Assignment operator.
- *
- * Empties the Grid and assigns the same settings as the one provided. The Grid is EMPTY after the operation and needs to be filled again.
- *
- * @param grid The Grid to copy.
- * @return This Grid.
+ * @brief Maps an angle to fit in the range [0 ; 2*M_PI].
  */
-Grid& Grid::operator=(const Grid& grid)
+double DeadReckoning::modAngle(double rad)
 {
-    empty();
-    m_precision = grid.m_precision;
-    m_ttl = grid.m_ttl;
-    m_minX = grid.m_minX;
-    m_maxX = grid.m_maxX;
-    m_minY = grid.m_minY;
-    m_maxY = grid.m_maxY;
-    m_resizeable = grid.m_resizeable;
-    init();
-    return *this;
+    return fmod(fmod(rad, 2*M_PI) + 2*M_PI, 2*M_PI);
 }
 
 /**
- * @brief Destructor.
+ * @brief Wrapper to load an image into a SDL Surface.
  *
- * Frees internal storage.
- */
-Grid::~Grid()
-{
-    empty();
-}
-
-/**
- * @brief Gets the Grid precision, in m / unit.
- */
-double Grid::precision() const
-{
-    return m_precision;
-}
-
-/**
- * @brief Gets x-coordinate of the upper-left corner of the Grid in the real world.
- */
-double Grid::minX() const
-{
-    return m_minX;
-}
-
-/**
- * @brief Gets y-coordinate of the upper-left corner of the Grid in the real world.
+ * @param path The path to the image to load.
+ * @return The newly allocated surface containing the image (deletion is caller's job - see SDL_FreeSurface()).
  */
-double Grid::minY() const
+SDL_Surface* DeadReckoning::loadImg(std::string path)
 {
-    return m_minY;
+    SDL_Surface *surf = IMG_Load(path.c_str());
+    if (!surf)
+        ROS_ERROR("Unable to load image \"%s\": %s", path.c_str(), IMG_GetError());
+    return surf;
 }
 
 /**
- * @brief Adds a new point in the Grid.
+ * @brief Gets the last estimation of the robot's position.
  *
- * @param x The x-coordinate of the point in the real world.
- * @param y The y-coordinate of the point in the real world.
- * @param t The time stamp of the point.
- * @param p The obstacle probability  at this point.
- * @return True if the point was successfully added.
- */
-bool Grid::addPoint(double x, double y, ros::Time t, double p)
-{
-    ProbabilisticPoint point = {x, y, t, p};
-    return addPoint(point);
-}
-
-/**
- * @brief Adds a new point in the Grid.
+ * Can be called from any thread, the position is read under m_poseLock.
  *
- * @param point The point to add, with coordinates expressed in the real world.
- * @return True if the point was successfully added.
+ * @param generation A pointer to store the number of corrections applied to the position (see m_nbCorrections), can be NULL.
+ * @return The estimated position, with a time stamp.
  */
-bool Grid::addPoint(ProbabilisticPoint point)
+DeadReckoning::StampedPos DeadReckoning::getPosition(int *generation) const
 {
-    double x = m_precision * round(point.x / m_precision);
-    double y = m_precision * round(point.y / m_precision);
-    
-    //ROS_INFO("Add point to grid at (%.3f, %.3f)", x, y);
-
-    if (x < m_minX || x > m_maxX || y < m_minY || y > m_maxX)
+    StampedPos pos;
+    int nbCorrections;
+    unsigned seq;
+    do
     {
-        //ROS_INFO("Out of grid: (%.3f, %.3f)", x, y);
-        if (!m_resizeable)
-            return false;
-
-        //ROS_INFO("Resizing grid");
-
-        int xShift = 0;
-        if (x < m_minX)
-        {
-            xShift = round((m_minX - x) / m_precision);
-            m_minX = x;
-        }
-        else if (x > m_maxX)
-            m_maxX = std::max(m_maxX+1, x);
-        
-        int yShift = 0;
-        if (y < m_minY)
-        {
-            yShift = round((m_minY - y) / m_precision);
-            m_minY = y;
-        }
-        else if (y > m_maxY)
-            m_maxY = std::max(m_maxY+1, y);
-        
-        int prevWidth = m_width;
-        int prevHeight = m_height;
-        updateSize();
-        ProbabilisticPoint** newData = new ProbabilisticPoint*[m_height*m_width];
-        memset(newData, 0, sizeof(ProbabilisticPoint*)*m_height*m_width);
-        
-        for (int i=0 ; i < prevWidth ; i++)
-            memcpy(&(newData[(i+xShift)*m_height+yShift]), &(m_data[prevHeight*i]), sizeof(ProbabilisticPoint*)*prevHeight);
-        
-        delete m_data;
-        m_data = newData;
-    }
-    
-    int ix = round((x-m_minX) / m_precision);
-    int iy = round((y-m_minY) / m_precision);
-    //ROS_INFO("Grid coord: (%d, %d)", ix, iy);
-    //ROS_INFO("(%d x %d)", m_width, m_height);
-    
-    int k = ix*m_height+iy;
-    //ROS_INFO("%d", k);
-    //ROS_INFO("%lu", sizeof(m_data)/sizeof(std::list<BooleanPoint>*));
-    
-    if (m_data[k] == NULL)
-        m_data[k] = new ProbabilisticPoint;
-    else if (point.t == m_data[k]->t)
-        point.p = 1 - (1-point.p)*(1-m_data[k]->p);
-    *(m_data[k]) = point;
-
-    //ROS_INFO("Added to grid");
-    return true;
+        seq = m_poseLock.readBegin();
+        pos = m_position;
+        nbCorrections = m_nbCorrections;
+    } while (m_poseLock.readRetry(seq));
+    if (generation != NULL)
+        *generation = nbCorrections;
+    return pos;
 }
 
 /**
- * @brief Gets the obstacle probability at a given point.
+ * @brief Gets the estimated position of the robot at a given time, according to history records.
  *
- * @param x The x-coordinate of the point in the real world.
- * @param y The y-coordinate of the point in the real world.
- * @return The obstacle probability  at this point, between 0 and 1, negative means unknown.
- */
-double Grid::get(double x, double y)
-{
-    int ix = round((x-m_minX) / m_precision);
-    int iy = round((y-m_minY) / m_precision);
-    return _get(ix, iy);
-}
-
-/**
- * @brief Gets obstacle probabilities for all points in the Grid.
+ * Can be called from any thread, the history is read under m_poseLock.
  *
- * @param width Pointer to a variable which will receive the width of the Grid in Grid units, can be NULL.
- * @param height Pointer to a variable which will receive the height of the Grid in Grid units, can be NULL.
- * @param scale Pointer to a variable which will receive the scale of the grid in m / unit, can be NULL.
- * @return Pointer to newly allocated data (must be freed with delete when not needed anymore) containing the obstacles probabilities
- * (between 0 and 1, negative means unknown) as a 1D array arranged in column-major order.
+ * @param time The time at which the robot position is to be estimated.
+ * @param generation A pointer to store the number of corrections applied to the position (see m_nbCorrections), can be NULL.
+ * @return The estimated position, with a time stamp.
  */
-double* Grid::getAll(int* width, int *height, double *scale) const
+DeadReckoning::StampedPos DeadReckoning::getPosForTime(const ros::Time& time, int *generation)
 {
-    double *data = new double[m_width*m_height];
-    if (data == NULL)
-    {
-        ROS_ERROR("Unable to create double array (%dx%d)", m_width, m_height);
-        return NULL;
-    }
-    
-    for (int x=0 ; x < m_width ; x++)
-    {
-        int k = x * m_height;
-        for (int y=0 ; y < m_height ; y++)
-        {
-            ProbabilisticPoint *pt = m_data[k+y];
-            data[k+y] = pt != NULL ? pt->p : -1;
-        }
-    }
-    if (width != NULL)
-        *width = m_width;
-    if (height != NULL)
-        *height = m_height;
-    if (scale != NULL)
-        *scale = m_precision;
-    return data;
-}
+    if (m_simulation)
+        return getPosition(generation);
 
-/**
- * @brief Draws the Grid on an SDL Surface.
- *
- * @param w The surface's width.
- * @param h The surface's height.
- * @param minX The real world x-coordinate of the point which should be mapped to the surface's upper-left pixel.
- * @param maxX The real world x-coordinate of the point which should be mapped to the surface's lower-right pixel.
- * @param minY The real world y-coordinate of the point which should be mapped to the surface's upper-left pixel.
- * @param maxY The real world y-coordinate of the point which should be mapped to the surface's lower-right pixel.
- * @param surf The surface to draw on, can be NULL, in this case it will be created (deletion is caller's job - see SDL_FreeSurface()).
- * @return The surface with the Grid drawn on it.
- */
-SDL_Surface* Grid::draw(int w, int h, double minX, double maxX, double minY, double maxY, SDL_Surface *surf)
-{
-    //ROS_INFO("Drawing grid");
-    if (surf == NULL)
-        surf = SDL_CreateRGBSurface(SDL_HWSURFACE, w, h, 32,0,0,0,0);
-    if (surf == NULL)
-        return NULL;
-    
-    //ROS_INFO("Surface created");
-    SDL_LockSurface(surf);
-    for (int y=0 ; y < h ; y++)
+    StampedPos pos;
+    int nbCorrections;
+    unsigned seq;
+    do
     {
-        double fy = (h-y) * (maxY-minY) / h + minY;
-        for (int x=0 ;  x < w ; x++)
-        {
-            double fx = x * (maxX-minX) / w + minX;
-            //ROS_INFO("Drawing at (%d,%d) (%d, %d)", ix, iy, x, y);
-            double p = get(fx, fy);
-            if (p >= 0)
-                putPixel(surf, x, y, SDL_MapRGB(surf->format, 255, 255*(1-p), 255*(1-p)), false);
-            else
-                putPixel(surf, x, y, SDL_MapRGB(surf->format, 200, 200, 255), false);
-        }
-    }
-    SDL_UnlockSurface(surf);
-    
-    //ROS_INFO("Grid drawn");
-    return surf;
-}
-
-/**
- * @brief Maps an angle to fit in the range [0 ; 2*M_PI].
- */
-double DeadReckoning::modAngle(double rad)
-{
-    return fmod(fmod(rad, 2*M_PI) + 2*M_PI, 2*M_PI);
+        seq = m_poseLock.readBegin();
+        pos = searchPosForTime(time);
+        nbCorrections = m_nbCorrections;
+    } while (m_poseLock.readRetry(seq));
+    if (generation != NULL)
+        *generation = nbCorrections;
+    return pos;
 }
 
 /**
- * @brief Converts a points cloud message into a laser scan message, possibly loosing information.
+ * @brief Looks for the position of the robot at a given time in the history records, see DeadReckoning::getPosForTime().
  *
- * This function was adapted from https://github.com/ros-perception/pointcloud_to_laserscan/blob/indigo-devel/src/pointcloud_to_laserscan_nodelet.cpp
- *
- * @param cloud_msg The points cloud message to convert.
- * @param output A reference to the laser scan message to fill.
- */
-void DeadReckoning::pointCloudToLaserScan(const sensor_msgs::PointCloud2ConstPtr &cloud_msg, sensor_msgs::LaserScan& output)
-{
-    output.angle_min = -30.0 * M_PI/180;
-    output.angle_max = 30.0 * M_PI/180;
-    output.angle_increment = ANGLE_PRECISION * M_PI / 180;
-    output.time_increment = 0.0;
-    output.scan_time = 1.0 / 30.0;
-    output.range_min = 0.45;
-    output.range_max = 15.0;
-
-    //determine amount of rays to create
-    uint32_t ranges_size = std::ceil((output.angle_max - output.angle_min) / output.angle_increment);
-    output.ranges.assign(ranges_size, std::numeric_limits<double>::infinity());
-
-    // Iterate through pointcloud
-    for (sensor_msgs::PointCloud2ConstIterator<float>
-            iter_x(*cloud_msg, "x"), iter_y(*cloud_msg, "y"), iter_z(*cloud_msg, "z");
-            iter_x != iter_x.end();
-            ++iter_x, ++iter_y, ++iter_z)
-    {
-
-        if (std::isnan(*iter_x) || std::isnan(*iter_y) || std::isnan(*iter_z))
-            continue;
-
-        if (*iter_y > 0.5 || *iter_y < -0.5)
-            continue;
-        
-        double range = hypot(*iter_x, *iter_z);
-        if (range < output.range_min || range > output.range_max)
-            continue;
-
-        //ROS_INFO("Range at (%.3f, %.3f): %.3f", *iter_x, *iter_y, range);
-        
-        double angle = -atan2(*iter_x, *iter_z);
-        if (angle < output.angle_min || angle > output.angle_max)
-            continue;
-        
-        //ROS_INFO("Range at angle %.3f: %.3f", angle*180/M_PI, range);
-
-        //overwrite range at laserscan ray if new range is smaller
-        int index = (angle - output.angle_min) / output.angle_increment;
-        if (range < output.ranges[index])
-        {
-            output.ranges[index] = range;
-        }
-    }
-}
-
-/**
- * @brief Wrapper to load an image into a SDL Surface.
- *
- * @param path The path to the image to load.
- * @return The newly allocated surface containing the image (deletion is caller's job - see SDL_FreeSurface()).
- */
-SDL_Surface* DeadReckoning::loadImg(std::string path)
-{
-    SDL_Surface *surf = IMG_Load(path.c_str());
-    if (!surf)
-        ROS_ERROR("Unable to load image \"%s\": %s", path.c_str(), IMG_GetError());
-    return surf;
-}
-
-/**
- * @brief Gets the estimated position of the robot at a given time, according to history records.
+ * The records surrounding the given time are found by binary search, and the position is interpolated between them
+ * (linearly for the coordinates, along the shortest arc for the orientation).
+ * Times outside of the history get the oldest or the newest record.
  *
  * @param time The time at which the robot position is to be estimated.
  * @return The estimated position, with a time stamp.
  */
-DeadReckoning::StampedPos DeadReckoning::getPosForTime(const ros::Time& time)
+DeadReckoning::StampedPos DeadReckoning::searchPosForTime(const ros::Time& time) const
 {
-    if (m_simulation)
+    if (m_positionsHistSize == 0)
         return m_position;
-    
-    StampedPos prevPos = m_positionsHist[m_positionsHistIdx];
-    if (isnan(prevPos.x) || isnan(prevPos.y) || isnan(prevPos.z) || prevPos.t >= time)
-        return prevPos;
-    
-    for (int i=1 ; i < SIZE_POSITIONS_HIST ; i++)
+
+    // Records are sorted by time, from the oldest (index 0) to the newest (index m_positionsHistSize-1).
+    int oldest = (m_positionsHistIdx - m_positionsHistSize + m_positionsHistCapacity) % m_positionsHistCapacity;
+    int first = 0, count = m_positionsHistSize;
+    while (count > 0)
     {
-        StampedPos pos = m_positionsHist[(m_positionsHistIdx+i) % SIZE_POSITIONS_HIST];
-        if (!isnan(pos.x) && !isnan(pos.y) && !isnan(pos.z) && pos.t >= time)
-            return time-prevPos.t >= pos.t-time ? pos : prevPos;
-        prevPos = pos;
+        int step = count / 2;
+        if (m_positionsHist[(oldest + first + step) % m_positionsHistCapacity].t < time)
+        {
+            first += step + 1;
+            count -= step + 1;
+        }
+        else
+            count = step;
     }
-    
-    return prevPos;
+
+    if (first == 0)
+        return m_positionsHist[oldest];
+    if (first == m_positionsHistSize)
+        return m_positionsHist[(oldest + first - 1) % m_positionsHistCapacity];
+
+    const StampedPos& prevPos = m_positionsHist[(oldest + first - 1) % m_positionsHistCapacity];
+    const StampedPos& nextPos = m_positionsHist[(oldest + first) % m_positionsHistCapacity];
+    double k = (time - prevPos.t).toSec() / (nextPos.t - prevPos.t).toSec();
+    double deltaZ = atan2(sin(nextPos.z - prevPos.z), cos(nextPos.z - prevPos.z));
+    StampedPos pos;
+    pos.x = prevPos.x + k * (nextPos.x - prevPos.x);
+    pos.y = prevPos.y + k * (nextPos.y - prevPos.y);
+    pos.z = modAngle(prevPos.z + k * deltaZ);
+    pos.t = time;
+    return pos;
 }
 
 /**
@@ -579,6 +209,7 @@ DeadReckoning::StampedPos DeadReckoning::getPosForTime(const ros::Time& time)
  */
 void DeadReckoning::friendsCallback(const detect_friend::FriendsInfos::ConstPtr& friendsInfos)
 {
+    boost::mutex::scoped_lock lock(m_mapMutex);
     for (int i=0 ; i < NB_FRIENDS ; i++)
         m_friendInSight[i] = false;
     for (std::vector<detect_friend::Friend_id>::const_iterator it = friendsInfos->infos.begin() ; it != friendsInfos->infos.end() ; it++)
@@ -606,6 +237,7 @@ void DeadReckoning::friendsCallback(const detect_friend::FriendsInfos::ConstPtr&
  */
 void DeadReckoning::markersCallback(const detect_marker::MarkersInfos::ConstPtr& markersInfos)
 {
+    boost::mutex::scoped_lock lock(m_mapMutex);
     for (int i=0 ; i < 256 ; i++)
         m_markerInSight[i] = false;
     for (std::vector<detect_marker::MarkerInfo>::const_iterator it = markersInfos->infos.begin() ; it != markersInfos->infos.end() ; it++)
@@ -615,10 +247,19 @@ void DeadReckoning::markersCallback(const detect_marker::MarkersInfos::ConstPtr&
         double angle = -atan(it->dx / it->dz);
         double d = hypot(it->dx, it->dz);
         
-        StampedPos pos = getPosForTime(markersInfos->time);
+        int generation;
+        StampedPos pos = getPosForTime(markersInfos->time, &generation);
+        if (m_landmarkCorrection)
+        {
+            LandmarkCorrector::Pose observer = {pos.x, pos.y, pos.z};
+            m_landmarkCorrector.observe(it->id, observer, d, angle, generation);
+        }
         angle += pos.z;
-        m_markersPos[it->id].x = d * cos(angle) + pos.x;
-        m_markersPos[it->id].y = d * sin(angle) + pos.y;
+        if (!m_landmarkCorrection || !m_landmarkCorrector.landmark(it->id, m_markersPos[it->id].x, m_markersPos[it->id].y))
+        {
+            m_markersPos[it->id].x = d * cos(angle) + pos.x;
+            m_markersPos[it->id].y = d * sin(angle) + pos.y;
+        }
         m_markersPos[it->id].t = markersInfos->time;
         m_markerInSight[it->id] = true;
     }
@@ -638,7 +279,9 @@ void DeadReckoning::IMUCallback(const sensor_msgs::Imu::ConstPtr& imu)
         double angle = 2*asin(imu->orientation.z);
         if (isnan(m_offsetZ))
             m_offsetZ = m_position.z - angle;
+        m_poseLock.writeBegin();
         m_position.z = modAngle(angle + m_offsetZ);
+        m_poseLock.writeEnd();
     }
 }
 
@@ -660,12 +303,21 @@ void DeadReckoning::odomCallback(const nav_msgs::Odometry::ConstPtr& odom)
             m_offsetY = m_position.y - odom->pose.pose.position.y;
             m_offsetZOdom = m_position.z - angle;
         }
+        m_poseLock.writeBegin();
+        applyLandmarkCorrection();
         m_position.x = odom->pose.pose.position.x * cos(m_offsetZOdom) - odom->pose.pose.position.y * sin(m_offsetZOdom) + m_offsetX;
         m_position.y = odom->pose.pose.position.x * sin(m_offsetZOdom) + odom->pose.pose.position.y * cos(m_offsetZOdom) + m_offsetY;
         m_position.t = odom->header.stamp;
         
+        if (m_positionsHistSize > 0 && m_position.t < m_positionsHist[(m_positionsHistIdx - 1 + m_positionsHistCapacity) % m_positionsHistCapacity].t)
+        {
+            ROS_WARN("Odometry went back in time, clearing the positions history.");
+            m_positionsHistSize = 0;
+        }
         m_positionsHist[m_positionsHistIdx] = m_position;
-        m_positionsHistIdx = (m_positionsHistIdx+1) % SIZE_POSITIONS_HIST;
+        m_positionsHistIdx = (m_positionsHistIdx+1) % m_positionsHistCapacity;
+        m_positionsHistSize = std::min(m_positionsHistSize+1, m_positionsHistCapacity);
+        m_poseLock.writeEnd();
     }
 }
 
@@ -679,8 +331,10 @@ void DeadReckoning::odomCallback(const nav_msgs::Odometry::ConstPtr& odom)
 void DeadReckoning::moveOrderCallback(const geometry_msgs::Twist::ConstPtr& order)
 {
     //ROS_INFO("Received order: v=%.3f, r=%.3f", order->linear.x, order->angular.z);
+    m_poseLock.writeBegin();
     if (m_simulation)
     {
+        applyLandmarkCorrection();
         ros::Time t = ros::Time::now();
         double deltaTime = (t - m_position.t).toSec();
         m_position.t = t;
@@ -702,6 +356,39 @@ void DeadReckoning::moveOrderCallback(const geometry_msgs::Twist::ConstPtr& orde
 
     m_linearSpeed = order->linear.x;
     m_angularSpeed = order->angular.z;
+    m_poseLock.writeEnd();
+}
+
+/**
+ * @brief Applies the corrections computed from the markers observations and the scan matching (see LandmarkCorrector) to the robot's position.
+ *
+ * The positions history and the offsets between the internal and the robot's coordinate systems are corrected as well,
+ * so that the next positions computed from the odometry and the IMU are corrected too.
+ * Must be called by the m_poseQueue callbacks, between m_poseLock.writeBegin() and m_poseLock.writeEnd().
+ */
+void DeadReckoning::applyLandmarkCorrection()
+{
+    LandmarkCorrector::Correction correction = m_landmarkCorrector.takeCorrection();
+    if (correction.isIdentity())
+        return;
+    m_nbCorrections++;
+
+    correction.applyToPoint(m_position.x, m_position.y);
+    m_position.z = modAngle(m_position.z + correction.z);
+    for (int i=0 ; i < m_positionsHistSize ; i++)
+    {
+        StampedPos& pos = m_positionsHist[(m_positionsHistIdx - 1 - i + m_positionsHistCapacity) % m_positionsHistCapacity];
+        correction.applyToPoint(pos.x, pos.y);
+        pos.z = modAngle(pos.z + correction.z);
+    }
+
+    if (!isnan(m_offsetX) && !isnan(m_offsetY) && !isnan(m_offsetZOdom))
+    {
+        correction.applyToPoint(m_offsetX, m_offsetY);
+        m_offsetZOdom += correction.z;
+    }
+    if (!isnan(m_offsetZ))
+        m_offsetZ += correction.z;
 }
 
 /**
@@ -714,8 +401,10 @@ void DeadReckoning::moveOrderCallback(const geometry_msgs::Twist::ConstPtr& orde
 void DeadReckoning::localMapScanCallback(const nav_msgs::OccupancyGrid::ConstPtr& occ)
 {
     //ROS_INFO("Received local map");
+    boost::mutex::scoped_lock lock(m_mapMutex);
     updateGridFromOccupancy(occ, m_scanGrid);
     publishGrid(m_scanGrid, m_scanGridPub);
+    publishGridDelta(m_scanGrid, m_scanGridDelta);
 }
 
 /**
@@ -728,8 +417,10 @@ void DeadReckoning::localMapScanCallback(const nav_msgs::OccupancyGrid::ConstPtr
 void DeadReckoning::localMapDepthCallback(const nav_msgs::OccupancyGrid::ConstPtr& occ)
 {
     //ROS_INFO("Received local map");
+    boost::mutex::scoped_lock lock(m_mapMutex);
     updateGridFromOccupancy(occ, m_depthGrid);
     publishGrid(m_depthGrid, m_depthGridPub);
+    publishGridDelta(m_depthGrid, m_depthGridDelta);
 }
 
 /**
@@ -741,18 +432,32 @@ void DeadReckoning::localMapDepthCallback(const nav_msgs::OccupancyGrid::ConstPt
 void DeadReckoning::updateGridFromOccupancy(const nav_msgs::OccupancyGrid::ConstPtr& occ, Grid& grid)
 {
     ros::Time t = ros::Time::now();
-    for (int y=0 ; y < occ->info.height ; y++)
+    int w = occ->info.width;
+    int h = occ->info.height;
+    double res = occ->info.resolution;
+    StampedPos pos = getPosition();
+    double minX = pos.x - (w/2)*res;
+    double minY = pos.y - (h/2)*res;
+
+    // The local map is axis-aligned, it can be fused in one go when its resolution divides the grid one.
+    int ratio = round(grid.precision() / res);
+    if (ratio >= 1 && fabs(ratio*res - grid.precision()) < 1e-6 && !occ->data.empty())
+    {
+        grid.blendPatch(&occ->data[0], w, h, grid.toGridCoord(minX), grid.toGridCoord(minY), ratio, t);
+        return;
+    }
+
+    for (int y=0 ; y < h ; y++)
     {
-        int k = y * occ->info.width;
-        double fy = m_position.y + (y-(int)occ->info.height/2)*occ->info.resolution;
-        for (int x=0 ; x < occ->info.width ; x++)
+        int k = y * w;
+        double fy = minY + y*res;
+        for (int x=0 ; x < w ; x++)
         {
             double p = occ->data[k+x] / 100.0;
             if (p >= 0)
             {
                 //ROS_INFO("Point at (%d, %d): %.3f", x, y, p);
-                double fx = m_position.x + (x-(int)occ->info.width/2)*occ->info.resolution;
-                grid.addPoint(fx, fy, t, p);
+                grid.addPoint(minX + x*res, fy, t, p);
             }
         }
     }
@@ -773,6 +478,7 @@ void DeadReckoning::processLaserScan(sensor_msgs::LaserScan& scan, bool invert,
     int nbRanges = ceil((scan.angle_max - scan.angle_min) / scan.angle_increment);
     int prevAngleIdx = -1;
     ros::Time t = ros::Time::now();
+    StampedPos pos = getPosition();
     
     for (int i=0 ; i < nbRanges ; i++)
     {
@@ -797,8 +503,8 @@ void DeadReckoning::processLaserScan(sensor_msgs::LaserScan& scan, bool invert,
         
         if (!std::isinf(range))
         {
-            double endX = range * cos(angle + m_position.z) + m_position.x;
-            double endY = range * sin(angle + m_position.z) + m_position.y;
+            double endX = range * cos(angle + pos.z) + pos.x;
+            double endY = range * sin(angle + pos.z) + pos.y;
             int cloudPointIdx = (i+startIdx) % NB_CLOUDPOINTS;
             cloudPoints[cloudPointIdx].x = endX;
             cloudPoints[cloudPointIdx].y = endY;
@@ -808,6 +514,67 @@ void DeadReckoning::processLaserScan(sensor_msgs::LaserScan& scan, bool invert,
     startIdx += nbRanges;
 }
 
+/**
+ * @brief Refines the robot's position by matching a laser scan against the Grid built from the previous ones (see ScanMatcher).
+ *
+ * The likelihood field of the Grid is rebuilt when the robot gets close to its border or when it is older than SCAN_FIELD_PERIOD.
+ * The matched pose is fused with the estimated one, with a covariance given by the score of the match, and discarded if
+ * it is too far from it (see LandmarkCorrector::correct()).
+ * The resulting correction is applied by the next odometry update (see DeadReckoning::applyLandmarkCorrection()).
+ * Must be called with m_mapMutex locked.
+ *
+ * @param scan The laser scan, with out of range values already replaced by infinity (see DeadReckoning::processLaserScan()).
+ * @param invert True if the laser scan points towards the robot's back.
+ */
+void DeadReckoning::matchScan(const sensor_msgs::LaserScan& scan, bool invert)
+{
+    ros::WallTime start = ros::WallTime::now();
+    ros::Time now = ros::Time::now();
+    int generation;
+    StampedPos pos = getPosForTime(scan.header.stamp, &generation);
+
+    if (!m_scanMatcher.hasField() || (now - m_scanFieldTime).toSec() > SCAN_FIELD_PERIOD
+        || hypot(pos.x - m_scanMatcher.fieldX(), pos.y - m_scanMatcher.fieldY()) > SCAN_FIELD_MARGIN)
+    {
+        m_scanMatcher.updateField(m_scanGrid, pos.x, pos.y);
+        m_scanFieldTime = now;
+    }
+
+    int nbRanges = ceil((scan.angle_max - scan.angle_min) / scan.angle_increment);
+    int step = std::max(1, nbRanges / SCAN_MATCHING_POINTS);
+    m_scanPoints.clear();
+    for (int i=0 ; i < nbRanges && i < (int)scan.ranges.size() ; i += step)
+    {
+        double range = scan.ranges[i];
+        if (std::isinf(range) || std::isnan(range) || range < scan.range_min)
+            continue;
+        double angle = scan.angle_min + i * scan.angle_increment + (invert ? M_PI : 0);
+        ScanMatcher::Point point = {range * cos(angle), range * sin(angle)};
+        m_scanPoints.push_back(point);
+    }
+
+    ScanMatcher::Pose guess = {pos.x, pos.y, pos.z}, matched;
+    double score;
+    if ((int)m_scanPoints.size() >= SCAN_MATCHING_POINTS / 4 && m_scanMatcher.match(m_scanPoints, guess, matched, &score))
+    {
+        LandmarkCorrector::Pose estimated = {guess.x, guess.y, guess.z}, measured = {matched.x, matched.y, matched.z};
+        double cov[3][3];
+        m_scanMatcher.covariance(score, cov);
+        if (m_landmarkCorrector.correct(estimated, measured, cov, generation))
+            m_scanMatchingStats.nbMatched++;
+    }
+
+    double duration = (ros::WallTime::now() - start).toSec();
+    m_scanMatchingStats.totalDuration += duration;
+    m_scanMatchingStats.maxDuration = std::max(m_scanMatchingStats.maxDuration, duration);
+    if (m_reportLatency && ++m_scanMatchingStats.nbScans == LATENCY_REPORT_ITERATIONS)
+    {
+        ROS_INFO("Scan matching over %d scans: %.2f ms on average, %.2f ms at most, %d scans matched.", m_scanMatchingStats.nbScans,
+                 m_scanMatchingStats.totalDuration * 1000 / m_scanMatchingStats.nbScans, m_scanMatchingStats.maxDuration * 1000, m_scanMatchingStats.nbMatched);
+        m_scanMatchingStats = ScanMatchingStats();
+    }
+}
+
 /**
  * @brief Callback of the laser scan topic.
  *
@@ -818,10 +585,14 @@ void DeadReckoning::processLaserScan(sensor_msgs::LaserScan& scan, bool invert,
  */
 void DeadReckoning::scanCallback(const sensor_msgs::LaserScan::ConstPtr& scan)
 {
-    sensor_msgs::LaserScan scanCopy = *scan;
-    processLaserScan(scanCopy, !m_simulation, m_scanRanges, m_scanCloudPoints, m_scanCloudPointsStartIdx);
+    // Published as a new message, which the local map nodes in the same process receive without copy
+    sensor_msgs::LaserScan::Ptr scanCopy(new sensor_msgs::LaserScan(*scan));
+    boost::mutex::scoped_lock lock(m_mapMutex);
+    processLaserScan(*scanCopy, !m_simulation, m_scanRanges, m_scanCloudPoints, m_scanCloudPointsStartIdx);
+    if (m_scanMatching)
+        matchScan(*scanCopy, !m_simulation);
     
-    scanCopy.header.frame_id = LOCALMAP_SCAN_TRANSFORM_NAME;
+    scanCopy->header.frame_id = LOCALMAP_SCAN_TRANSFORM_NAME;
     m_laserScanPub.publish(scanCopy);
 }
 
@@ -835,11 +606,13 @@ void DeadReckoning::scanCallback(const sensor_msgs::LaserScan::ConstPtr& scan)
  */
 void DeadReckoning::depthCallback(const sensor_msgs::PointCloud2::ConstPtr& cloud)
 {
-    sensor_msgs::LaserScan scan;
-    pointCloudToLaserScan(cloud, scan);
-    processLaserScan(scan, false, m_depthRanges, m_depthCloudPoints, m_depthCloudPointsStartIdx);
+    sensor_msgs::LaserScan::Ptr scan(new sensor_msgs::LaserScan);
+    if (!m_depthScan.convert(*cloud, *scan))
+        ROS_WARN_THROTTLE(10, "Unable to convert the depth cloud, it has no float x, y and z fields or is truncated.");
+    boost::mutex::scoped_lock lock(m_mapMutex);
+    processLaserScan(*scan, false, m_depthRanges, m_depthCloudPoints, m_depthCloudPointsStartIdx);
     
-    scan.header.frame_id = LOCALMAP_DEPTH_TRANSFORM_NAME;
+    scan->header.frame_id = LOCALMAP_DEPTH_TRANSFORM_NAME;
     m_laserDepthPub.publish(scan);
 }
 
@@ -850,25 +623,27 @@ void DeadReckoning::publishTransforms()
 {
     tf::Transform transform;
     tf::Quaternion q;
+    StampedPos pos = getPosition();
     
-    transform.setOrigin( tf::Vector3(m_position.x, m_position.y, 0.0) );
-    q.setRPY(0, 0, m_simulation ? m_position.z : modAngle(m_position.z+M_PI));
+    transform.setOrigin( tf::Vector3(pos.x, pos.y, 0.0) );
+    q.setRPY(0, 0, m_simulation ? pos.z : modAngle(pos.z+M_PI));
     transform.setRotation(q);
     m_transformBroadcaster.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", LOCALMAP_SCAN_TRANSFORM_NAME));
     
     if (!m_simulation)
     {
-        transform.setOrigin( tf::Vector3(m_position.x, m_position.y, 0.0) );
-        q.setRPY(0, 0, m_position.z);
+        transform.setOrigin( tf::Vector3(pos.x, pos.y, 0.0) );
+        q.setRPY(0, 0, pos.z);
         transform.setRotation(q);
         m_transformBroadcaster.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", LOCALMAP_DEPTH_TRANSFORM_NAME));
     }
     
-    transform.setOrigin( tf::Vector3(m_position.x, m_position.y, 0.0) );
-    q.setRPY(0, 0, m_position.z);
+    transform.setOrigin( tf::Vector3(pos.x, pos.y, 0.0) );
+    q.setRPY(0, 0, pos.z);
     transform.setRotation(q);
     m_transformBroadcaster.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", ROBOTPOS_TRANSFORM_NAME));
     
+    boost::mutex::scoped_lock lock(m_mapMutex);
     transform.setOrigin( tf::Vector3(m_scanGrid.minX(), m_scanGrid.minY(), 0.0) );
     q.setRPY(0, 0, 0);
     transform.setRotation(q);
@@ -884,60 +659,93 @@ void DeadReckoning::publishTransforms()
 }
 
 /**
- * @brief Publishes all known positions of the markers via transforms.
+ * @brief Adds the transformation of a marker or a friend to the batch sent by publishLandmarksTransforms(), if needed.
+ *
+ * The transformation is only sent if the landmark is in sight, if its position has changed since it was last sent,
+ * or if it was last sent more than LANDMARK_REFRESH_PERIOD seconds ago, so that the tf listeners keep it in their cache.
+ *
+ * @param pos The last known position of the landmark.
+ * @param inSight Indicates if the landmark is in sight.
+ * @param landmark The publishing state of the landmark.
+ * @param now The current time.
  */
-void DeadReckoning::publishMarkersTransforms()
+void DeadReckoning::batchLandmarkTransform(const StampedPos& pos, bool inSight, LandmarkTransform& landmark, const ros::Time& now)
 {
+    if (isnan(pos.x) || isnan(pos.y))
+        return;
+    if (!inSight && pos.t == landmark.positionStamp && (now - landmark.lastSent).toSec() < LANDMARK_REFRESH_PERIOD)
+        return;
+
     tf::Transform transform;
-    tf::Quaternion q;
-    char transformName[100];
-    
-    q.setRPY(0, 0, 0);
-    transform.setRotation(q);
-        
-    for (int i=0 ; i < 256 ; i++)
-    {
-        if (isnan(m_markersPos[i].x) || isnan(m_markersPos[i].y))
-            continue;
-        snprintf(transformName, 100, "%s_%d", MARKERPOS_TRANSFORM_NAME.c_str(), i);
-        transform.setOrigin( tf::Vector3(m_markersPos[i].x, m_markersPos[i].y, 0.0) );
-        m_transformBroadcaster.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", transformName));
-    }
+    transform.setOrigin( tf::Vector3(pos.x, pos.y, 0.0) );
+    transform.setRotation( tf::Quaternion(0, 0, 0, 1) );
+    m_landmarksBatch.push_back(tf::StampedTransform(transform, now, "world", landmark.frame));
+    landmark.positionStamp = pos.t;
+    landmark.lastSent = now;
 }
 
 /**
- * @brief Publishes all known positions of the friends via transforms.
+ * @brief Publishes the known positions of the markers and of the friends via transforms, all sent at once.
+ *
+ * Landmarks which are out of sight and have not moved are only published every LANDMARK_REFRESH_PERIOD seconds.
  */
-void DeadReckoning::publishFriendsTransforms()
+void DeadReckoning::publishLandmarksTransforms()
 {
-    tf::Transform transform;
-    tf::Quaternion q;
-    char transformName[100];
-    
-    q.setRPY(0, 0, 0);
-    transform.setRotation(q);
-        
-    for (int i=0 ; i < NB_FRIENDS ; i++)
+    const ros::Time now = ros::Time::now();
+    m_landmarksBatch.clear();
     {
-        if (isnan(m_friendsPos[i].x) || isnan(m_friendsPos[i].y))
-            continue;
-        snprintf(transformName, 100, "%s_%d", FRIENDPOS_TRANSFORM_NAME.c_str(), i);
-        transform.setOrigin( tf::Vector3(m_friendsPos[i].x, m_friendsPos[i].y, 0.0) );
-        m_transformBroadcaster.sendTransform(tf::StampedTransform(transform, ros::Time::now(), "world", transformName));
+        boost::mutex::scoped_lock lock(m_mapMutex);
+        for (int i=0 ; i < 256 ; i++)
+            batchLandmarkTransform(m_markersPos[i], m_markerInSight[i], m_markersTransforms[i], now);
+        for (int i=0 ; i < NB_FRIENDS ; i++)
+            batchLandmarkTransform(m_friendsPos[i], m_friendInSight[i], m_friendsTransforms[i], now);
     }
+    if (!m_landmarksBatch.empty())
+        m_transformBroadcaster.sendTransform(m_landmarksBatch);
+    m_nbLandmarksSent += m_landmarksBatch.size();
 }
 
 /**
  * @brief Publishes a Grid through a given pusblisher.
  *
- * The grid is published under the form of a dead_reckoning::Grid message, basically a 1D array containing obstacle probabilities stored in column-major order.
- * See Grid::getAll() for more information.
+ * The grid is published under the form of a dead_reckoning::Grid message, basically a 1D array containing obstacle probabilities stored in column-major order,
+ * or of a dead_reckoning::CompactGrid message, depending on m_gridFormat. See Grid::getAll() for more information.
+ * Nothing is done if nobody listens, see DeadReckoning::publishGridDelta() for a lighter alternative.
  *
  * @param grid The Grid to publish.
  * @param pub The publisher to use to publish the Grid.
  */
 void DeadReckoning::publishGrid(const Grid& grid, ros::Publisher& pub)
 {
+    if (pub.getNumSubscribers() == 0)
+        return;
+
+    if (m_gridFormat != GRID_FORMAT_FULL)
+    {
+        dead_reckoning::CompactGrid gridMsg;
+        int width, height;
+        double scale;
+        if (m_gridFormat == GRID_FORMAT_COMPACT_RLE)
+        {
+            std::vector<int8_t> data;
+            grid.getAll(data, &width, &height, &scale);
+            runLengthEncode(data, gridMsg.data);
+            gridMsg.encoding = dead_reckoning::CompactGrid::ENCODING_RLE;
+        }
+        else
+        {
+            grid.getAll(gridMsg.data, &width, &height, &scale);
+            gridMsg.encoding = dead_reckoning::CompactGrid::ENCODING_RAW;
+        }
+        gridMsg.width = width;
+        gridMsg.height = height;
+        gridMsg.scale = scale;
+        gridMsg.x = grid.minX();
+        gridMsg.y = grid.minY();
+        pub.publish(gridMsg);
+        return;
+    }
+
     dead_reckoning::Grid gridMsg;
     int width, height;
     double scale;
@@ -951,7 +759,85 @@ void DeadReckoning::publishGrid(const Grid& grid, ros::Publisher& pub)
     gridMsg.x = grid.minX();
     gridMsg.y = grid.minY();
     pub.publish(gridMsg);
-    delete data;
+    delete[] data;
+}
+
+/**
+ * @brief Run-length encodes occupancy values, as expected in dead_reckoning::CompactGrid messages.
+ *
+ * Runs of at least 3 unknown or free cells are replaced by RUN_UNKNOWN / RUN_FREE followed by their length,
+ * other values are left as they are.
+ *
+ * @param data The occupancy values (between 0 and 100, -1 means unknown).
+ * @param encoded A vector which will receive the encoded values, any previous content is removed.
+ */
+void DeadReckoning::runLengthEncode(const std::vector<int8_t>& data, std::vector<int8_t>& encoded)
+{
+    encoded.clear();
+    encoded.reserve(data.size() / 4);
+    size_t i = 0;
+    while (i < data.size())
+    {
+        int8_t value = data[i];
+        size_t n = 1;
+        if (value == dead_reckoning::CompactGrid::UNKNOWN || value == 0)
+        {
+            while (i + n < data.size() && data[i+n] == value && n < 255)
+                n++;
+        }
+        if (n >= 3)
+        {
+            encoded.push_back(value == 0 ? dead_reckoning::CompactGrid::RUN_FREE : dead_reckoning::CompactGrid::RUN_UNKNOWN);
+            encoded.push_back((int8_t)(uint8_t)n);
+        }
+        else
+            encoded.insert(encoded.end(), n, value);
+        i += n;
+    }
+}
+
+/**
+ * @brief Publishes the tiles of a Grid which changed since the previous call.
+ *
+ * The tiles are published under the form of a dead_reckoning::GridDelta message, with probabilities quantized on 8 bits (see Grid::getQuantizedTile()).
+ * All the tiles are published (keyframe) every GRID_KEYFRAME_PERIOD seconds and when a new subscriber shows up, so that late subscribers can resync.
+ *
+ * @param grid The Grid to publish.
+ * @param deltaPub The publisher to use and its state.
+ */
+void DeadReckoning::publishGridDelta(Grid& grid, GridDeltaPublisher& deltaPub)
+{
+    ros::Time now = ros::Time::now();
+    uint32_t nbSubscribers = deltaPub.pub.getNumSubscribers();
+    bool keyframe = nbSubscribers > deltaPub.nbSubscribers || now - deltaPub.lastKeyframe >= ros::Duration(GRID_KEYFRAME_PERIOD);
+    deltaPub.nbSubscribers = nbSubscribers;
+
+    // The tracking is reset even if nobody listens, a keyframe will be sent to the first subscriber.
+    std::vector<Grid::TileCoord> tiles;
+    grid.popDirtyTiles(tiles, keyframe);
+    if (nbSubscribers == 0)
+        return;
+
+    dead_reckoning::GridDelta deltaMsg;
+    deltaMsg.seq = deltaPub.seq++;
+    deltaMsg.keyframe = keyframe;
+    deltaMsg.tile_size = Grid::TILE_SIZE;
+    deltaMsg.scale = grid.precision();
+    deltaMsg.width = grid.width();
+    deltaMsg.height = grid.height();
+    deltaMsg.x = grid.minX();
+    deltaMsg.y = grid.minY();
+    deltaMsg.tiles.resize(tiles.size());
+    for (size_t i=0 ; i < tiles.size() ; i++)
+    {
+        deltaMsg.tiles[i].x = tiles[i].x;
+        deltaMsg.tiles[i].y = tiles[i].y;
+        deltaMsg.tiles[i].data.resize(Grid::TILE_CELLS);
+        grid.getQuantizedTile(tiles[i].x, tiles[i].y, &deltaMsg.tiles[i].data[0]);
+    }
+    deltaPub.pub.publish(deltaMsg);
+    if (keyframe)
+        deltaPub.lastKeyframe = now;
 }
 
 /**
@@ -996,6 +882,8 @@ bool DeadReckoning::initSDL()
     m_friendSurf = new SDL_Surface*[NB_FRIENDS];
     m_friendSurfTransparent = new SDL_Surface*[NB_FRIENDS];
     //TODO check if not NULL
+    for (int i=0 ; i < NB_FRIENDS ; i++)
+        m_friendSurf[i] = m_friendSurfTransparent[i] = NULL;
     
     if ((m_friendSurf[0] = loadImg(packagePath + "/star_small.png")) == NULL)
         return false;
@@ -1010,79 +898,236 @@ bool DeadReckoning::initSDL()
     if ((m_friendSurfTransparent[1] = loadImg(packagePath + "/mushroom_small_tr.png")) == NULL)
         return false;
     
-    m_gridSurf = SDL_CreateRGBSurface(SDL_HWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 32,0,0,0,0);
-    if (!m_gridSurf)
+    return true;
+}
+
+/**
+ * @brief Frees the surfaces allocated by DeadReckoning::initSDL() and closes the display.
+ */
+void DeadReckoning::quitSDL()
+{
+    if (m_gridSurf != NULL)
+        SDL_FreeSurface(m_gridSurf);
+    if (m_robotSurf != NULL)
+        SDL_FreeSurface(m_robotSurf);
+    if (m_markerSurf != NULL)
+        SDL_FreeSurface(m_markerSurf);
+    if (m_markerSurfTransparent != NULL)
+        SDL_FreeSurface(m_markerSurfTransparent);
+    if (m_friendSurf != NULL)
     {
-        ROS_ERROR("Unable to create the grid surface.");
-        return false;
+        for (int i=0 ; i < NB_FRIENDS ; i++)
+        {
+            if (m_friendSurf[i] != NULL)
+                SDL_FreeSurface(m_friendSurf[i]);
+        }
+        delete[] m_friendSurf;
     }
-    SDL_SetColorKey(m_gridSurf, SDL_SRCCOLORKEY, SDL_MapRGB(m_gridSurf->format, 0,0,0));
-    
-    return true;
+    if (m_friendSurfTransparent != NULL)
+    {
+        for (int i=0 ; i < NB_FRIENDS ; i++)
+        {
+            if (m_friendSurfTransparent[i] != NULL)
+                SDL_FreeSurface(m_friendSurfTransparent[i]);
+        }
+        delete[] m_friendSurfTransparent;
+    }
+    m_gridSurf = m_robotSurf = m_markerSurf = m_markerSurfTransparent = NULL;
+    m_friendSurf = m_friendSurfTransparent = NULL;
+    IMG_Quit();
+    SDL_Quit();
 }
 
 /**
  * @brief Updates the display according to current internal data.
+ *
+ * Depending on m_displayMode, the display is either drawn right away, or a snapshot is handed over to the display thread
+ * (see DeadReckoning::displayLoop()), or nothing is done at all.
  */
 void DeadReckoning::updateDisplay()
+{
+    if (m_displayMode == DISPLAY_WINDOW)
+    {
+        captureDisplay(m_displayStates[0]);
+        renderDisplay(m_displayStates[0]);
+    }
+    else if (m_displayMode == DISPLAY_THREAD)
+    {
+        captureDisplay(m_displayStates[m_writtenDisplay]);
+        boost::mutex::scoped_lock lock(m_displayMutex);
+        std::swap(m_writtenDisplay, m_readyDisplay);
+        m_displayFresh = true;
+        m_displayCond.notify_one();
+    }
+}
+
+/**
+ * @brief Takes a snapshot of the internal data shown on the display.
+ *
+ * The map is not drawn here, as this runs in the main loop and holds m_mapMutex: only the tiles covering the display which have
+ * been modified since this snapshot was last written are copied, quantized, and renderDisplay() draws them.
+ * The display is centered on the robot again whenever the robot gets closer to one of its borders than an eighth of its size,
+ * so that it follows the robot over the whole map.
+ *
+ * @param state The snapshot to fill.
+ */
+void DeadReckoning::captureDisplay(DisplayState& state)
+{
+    unsigned seq;
+    do
+    {
+        seq = m_poseLock.readBegin();
+        state.position = m_position;
+        state.linearSpeed = m_linearSpeed;
+        state.angularSpeed = m_angularSpeed;
+    } while (m_poseLock.readRetry(seq));
+
+    double width = m_maxX - m_minX;
+    double height = m_maxY - m_minY;
+    if (state.position.x < m_minX + width/8 || state.position.x > m_maxX - width/8
+        || state.position.y < m_minY + height/8 || state.position.y > m_maxY - height/8)
+    {
+        m_minX = state.position.x - width/2;
+        m_maxX = m_minX + width;
+        m_minY = state.position.y - height/2;
+        m_maxY = m_minY + height;
+    }
+    state.minX = m_minX;
+    state.maxX = m_maxX;
+    state.minY = m_minY;
+    state.maxY = m_maxY;
+
+    boost::mutex::scoped_lock lock(m_mapMutex);
+    state.scanCloudPoints.assign(m_scanCloudPoints, m_scanCloudPoints + NB_CLOUDPOINTS);
+    state.depthCloudPoints.assign(m_depthCloudPoints, m_depthCloudPoints + NB_CLOUDPOINTS);
+    memcpy(state.markersPos, m_markersPos, sizeof(m_markersPos));
+    memcpy(state.markerInSight, m_markerInSight, sizeof(m_markerInSight));
+    state.friendsPos.assign(m_friendsPos, m_friendsPos + NB_FRIENDS);
+    state.friendInSight.assign(m_friendInSight, m_friendInSight + NB_FRIENDS);
+
+    Grid::TileCoord tileMin = m_scanGrid.tileAt(m_minX, m_minY);
+    Grid::TileCoord tileMax = m_scanGrid.tileAt(m_maxX, m_maxY);
+    int nbTilesX = tileMax.x - tileMin.x + 1;
+    int nbTiles = nbTilesX * (tileMax.y - tileMin.y + 1);
+    if (state.gridTileVersions.empty() || tileMin.x != state.tileMin.x || tileMin.y != state.tileMin.y
+        || tileMax.x != state.tileMax.x || tileMax.y != state.tileMax.y)
+    {
+        // The display moved since this snapshot was last written, all its tiles are copied again.
+        state.tileMin = tileMin;
+        state.tileMax = tileMax;
+        state.gridTileVersions.assign(nbTiles, 0);
+        state.gridTiles.assign(nbTiles * Grid::TILE_CELLS, Grid::QUANTIZED_UNKNOWN);
+    }
+    for (int i=0 ; i < nbTiles ; i++)
+    {
+        int tx = tileMin.x + i % nbTilesX;
+        int ty = tileMin.y + i / nbTilesX;
+        uint32_t version = m_scanGrid.tileVersion(tx, ty);
+        if (version == state.gridTileVersions[i])
+            continue;
+        m_scanGrid.getQuantizedTile(tx, ty, &state.gridTiles[i * Grid::TILE_CELLS]);
+        state.gridTileVersions[i] = version;
+    }
+}
+
+/**
+ * @brief Draws a snapshot of the internal data on the display.
+ *
+ * The tiles of the map which changed since the last drawn snapshot are loaded into m_displayGrid, which is drawn instead of
+ * m_scanGrid, so that the main loop and the map callbacks are not blocked meanwhile.
+ *
+ * @param state The snapshot to draw.
+ */
+void DeadReckoning::renderDisplay(const DisplayState& state)
 {
     //ROS_INFO("Updating display");
     
-    Vector pos = {m_position.x, m_position.y};
-    Vector speed = {m_linearSpeed * cos(m_position.z), m_linearSpeed * sin(m_position.z)};
-    Vector acceleration = {-m_linearSpeed * m_angularSpeed * sin(m_position.z), m_linearSpeed * m_angularSpeed * cos(m_position.z)};
+    const StampedPos& position = state.position;
+    Vector speed = {state.linearSpeed * cos(position.z), state.linearSpeed * sin(position.z)};
+    Vector acceleration = {-state.linearSpeed * state.angularSpeed * sin(position.z), state.linearSpeed * state.angularSpeed * cos(position.z)};
     
     SDL_Rect rect = {0};
     SDL_FillRect(m_screen, 0, SDL_MapRGB(m_screen->format, 255,255,255));
     
-    SDL_FillRect(m_gridSurf, NULL, SDL_MapRGB(m_gridSurf->format, 0,0,0));
-    m_scanGrid.draw(SCREEN_WIDTH, SCREEN_HEIGHT, m_minX, m_maxX, m_minY, m_maxY, m_gridSurf);
-    SDL_BlitSurface(m_gridSurf, NULL, m_screen, &rect);
+    if (state.tileMin.x != m_displayTileMin.x || state.tileMin.y != m_displayTileMin.y
+        || state.tileMax.x != m_displayTileMax.x || state.tileMax.y != m_displayTileMax.y)
+    {
+        // The display moved, the tiles it does not cover any more are dropped (the copy of a Grid is empty).
+        m_displayGrid = Grid(m_displayGrid);
+        m_displayGridVersions.clear();
+        m_displayTileMin = state.tileMin;
+        m_displayTileMax = state.tileMax;
+    }
+    int nbTilesX = m_displayTileMax.x - m_displayTileMin.x + 1;
+    m_displayGridVersions.resize(state.gridTileVersions.size(), 0);
+    ros::Time now = ros::Time::now();
+    for (size_t i=0 ; i < state.gridTileVersions.size() ; i++)
+    {
+        if (state.gridTileVersions[i] == m_displayGridVersions[i])
+            continue;
+        m_displayGrid.setQuantizedTile(m_displayTileMin.x + i % nbTilesX, m_displayTileMin.y + i / nbTilesX,
+                                       &state.gridTiles[i * Grid::TILE_CELLS], now);
+        m_displayGridVersions[i] = state.gridTileVersions[i];
+    }
+
+    if (m_gridSurf == NULL)
+    {
+        m_gridSurf = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 32,0,0,0,0);
+        if (m_gridSurf == NULL)
+            ROS_ERROR("Unable to create the grid surface.");
+        else
+            SDL_SetColorKey(m_gridSurf, SDL_SRCCOLORKEY, SDL_MapRGB(m_gridSurf->format, 0,0,0));
+    }
+    if (m_gridSurf != NULL)
+    {
+        m_displayGrid.draw(SCREEN_WIDTH, SCREEN_HEIGHT, state.minX, state.maxX, state.minY, state.maxY, m_gridSurf, Grid::DRAW_BOX);
+        SDL_BlitSurface(m_gridSurf, NULL, m_screen, &rect);
+    }
     
     /*if (!m_simulation)
     {
         SDL_FillRect(m_gridSurf, NULL, SDL_MapRGB(m_gridSurf->format, 0,0,0));
-        m_depthGrid.draw(SCREEN_WIDTH, SCREEN_HEIGHT, m_minX, m_maxX, m_minY, m_maxY, m_gridSurf);
+        m_depthGrid.draw(SCREEN_WIDTH, SCREEN_HEIGHT, state.minX, state.maxX, state.minY, state.maxY, m_gridSurf);
         SDL_BlitSurface(m_gridSurf, NULL, m_screen, &rect);
     }*/
     
-    double kx = SCREEN_WIDTH / (m_maxX - m_minX);
-    double ky = SCREEN_HEIGHT / (m_maxY - m_minY);
+    double kx = SCREEN_WIDTH / (state.maxX - state.minX);
+    double ky = SCREEN_HEIGHT / (state.maxY - state.minY);
     
     Uint32 green = SDL_MapRGB(m_screen->format, 0,128,0);
     Uint32 blue = SDL_MapRGB(m_screen->format, 0,0,255);
     for (int i=0 ; i < NB_CLOUDPOINTS ; i++)
     {
-        if (!isnan(m_scanCloudPoints[i].x) && !isnan(m_scanCloudPoints[i].y))
-            putPixel(m_screen, (m_scanCloudPoints[i].x-m_minX) * kx, SCREEN_HEIGHT - (m_scanCloudPoints[i].y-m_minY) * ky, green);
-        if (!m_simulation && !isnan(m_depthCloudPoints[i].x) && !isnan(m_depthCloudPoints[i].y))
-            putPixel(m_screen, (m_depthCloudPoints[i].x-m_minX) * kx, SCREEN_HEIGHT - (m_depthCloudPoints[i].y-m_minY) * ky, blue);
+        if (!isnan(state.scanCloudPoints[i].x) && !isnan(state.scanCloudPoints[i].y))
+            putPixel(m_screen, (state.scanCloudPoints[i].x-state.minX) * kx, SCREEN_HEIGHT - (state.scanCloudPoints[i].y-state.minY) * ky, green);
+        if (!m_simulation && !isnan(state.depthCloudPoints[i].x) && !isnan(state.depthCloudPoints[i].y))
+            putPixel(m_screen, (state.depthCloudPoints[i].x-state.minX) * kx, SCREEN_HEIGHT - (state.depthCloudPoints[i].y-state.minY) * ky, blue);
     }
 
     int x, y;
     for (int i=0 ; i < 256 ; i++)
     {
-        if (isnan(m_markersPos[i].x) || isnan(m_markersPos[i].y))
+        if (isnan(state.markersPos[i].x) || isnan(state.markersPos[i].y))
             continue;
-        convertPosToDisplayCoord(m_markersPos[i].x, m_markersPos[i].y, x, y);
+        convertPosToDisplayCoord(state, state.markersPos[i].x, state.markersPos[i].y, x, y);
         rect.x = x-m_markerSurf->w/2;
         rect.y = y-m_markerSurf->h/2;
-        SDL_BlitSurface(m_markerInSight[i] ? m_markerSurf : m_markerSurfTransparent, NULL, m_screen, &rect);
+        SDL_BlitSurface(state.markerInSight[i] ? m_markerSurf : m_markerSurfTransparent, NULL, m_screen, &rect);
     }
     
     for (int i=0 ; i < NB_FRIENDS ; i++)
     {
-        if (isnan(m_friendsPos[i].x) || isnan(m_friendsPos[i].y))
+        if (isnan(state.friendsPos[i].x) || isnan(state.friendsPos[i].y))
             continue;
-        convertPosToDisplayCoord(m_friendsPos[i].x, m_friendsPos[i].y, x, y);
+        convertPosToDisplayCoord(state, state.friendsPos[i].x, state.friendsPos[i].y, x, y);
         rect.x = x-m_friendSurf[i]->w/2;
         rect.y = y-m_friendSurf[i]->h/2;
-        SDL_BlitSurface(m_friendInSight[i] ? m_friendSurf[i] : m_friendSurfTransparent[i], NULL, m_screen, &rect);
+        SDL_BlitSurface(state.friendInSight[i] ? m_friendSurf[i] : m_friendSurfTransparent[i], NULL, m_screen, &rect);
     }
     
-    convertPosToDisplayCoord(m_position.x, m_position.y, x, y);
+    convertPosToDisplayCoord(state, position.x, position.y, x, y);
     
-    SDL_Surface *robotSurf = rotozoomSurface(m_robotSurf, m_position.z*180/M_PI, 1.0, 1);
+    SDL_Surface *robotSurf = rotozoomSurface(m_robotSurf, position.z*180/M_PI, 1.0, 1);
     rect.x = x-robotSurf->w/2;
     rect.y = y-robotSurf->h/2;
     SDL_BlitSurface(robotSurf, NULL, m_screen, &rect);
@@ -1090,27 +1135,60 @@ void DeadReckoning::updateDisplay()
     
     drawLine(m_screen, x, y, x + 3*speed.x*kx, y - 3*speed.y*ky, createColor(0,0,255));
     drawLine(m_screen, x, y, x + 3*acceleration.x*kx, y - 3*acceleration.y*ky, createColor(255,0,0));
-    drawLine(m_screen, x, y, x+30*cos(m_position.z), y-30*sin(m_position.z), createColor(0,0,0));
+    drawLine(m_screen, x, y, x+30*cos(position.z), y-30*sin(position.z), createColor(0,0,0));
     
     SDL_Flip(m_screen);
     
     //ROS_INFO("Display updated.");
 }
 
+/**
+ * @brief Main function of the display thread, in DISPLAY_THREAD mode.
+ *
+ * The SDL is initialized and used only by this thread, which draws each new snapshot taken by the main loop, until m_displayStop is set.
+ * Three snapshots are used, so that neither the main loop nor this thread ever waits for the other one: the main loop writes one,
+ * this thread draws another one and the last one is the latest complete snapshot, swapped with one of the others under m_displayMutex.
+ */
+void DeadReckoning::displayLoop()
+{
+    if (!initSDL())
+    {
+        ROS_ERROR("Unable to initialize the display, running without display.");
+        quitSDL();
+        return;
+    }
+
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(m_displayMutex);
+            while (!m_displayFresh && !m_displayStop)
+                m_displayCond.wait(lock);
+            if (m_displayStop)
+                break;
+            std::swap(m_readyDisplay, m_renderedDisplay);
+            m_displayFresh = false;
+        }
+        renderDisplay(m_displayStates[m_renderedDisplay]);
+    }
+    quitSDL();
+}
+
 /**
  * @brief Converts a real world position into display coordinates.
  *
+ * @param state The snapshot being drawn, giving the real world area covered by the display.
  * @param fx The x-coordinate of the real world position.
  * @param fy The y-coordinate of the real world position.
  * @param x A reference to the variable in which the x display coordinate will be stored.
  * @param y A reference to the variable in which the y display coordinate will be stored.
  */
-void DeadReckoning::convertPosToDisplayCoord(double fx, double fy, int& x, int& y)
+void DeadReckoning::convertPosToDisplayCoord(const DisplayState& state, double fx, double fy, int& x, int& y)
 {
-    double kx = SCREEN_WIDTH / (m_maxX - m_minX);
-    double ky = SCREEN_HEIGHT / (m_maxY - m_minY);
-    x = (fx-m_minX) * kx;
-    y = SCREEN_HEIGHT - (fy-m_minY) * ky;
+    double kx = SCREEN_WIDTH / (state.maxX - state.minX);
+    double ky = SCREEN_HEIGHT / (state.maxY - state.minY);
+    x = (fx-state.minX) * kx;
+    y = SCREEN_HEIGHT - (fy-state.minY) * ky;
 }
 
 /**
@@ -1124,15 +1202,72 @@ void DeadReckoning::convertPosToDisplayCoord(double fx, double fy, int& x, int&
  * @param maxX The x-coordinate of the point mapped to the lower-right corner of the display in the real world.
  * @param minY The y-coordinate of the point mapped to the upper-left corner of the display in the real world.
  * @param maxY The y-coordinate of the point mapped to the lower-right corner of the display in the real world.
+ * @param nodelet True if the instance runs in a nodelet (see DeadReckoningNodelet), the display then defaults to "thread" and "window" is refused.
  */
-DeadReckoning::DeadReckoning(ros::NodeHandle& node, bool simulation, double minX, double maxX, double minY, double maxY):
-    m_node(node), m_simulation(simulation), m_ok(false),
+DeadReckoning::DeadReckoning(ros::NodeHandle& node, bool simulation, double minX, double maxX, double minY, double maxY, bool nodelet):
+    m_node(node), m_simulation(simulation), m_nodelet(nodelet), m_ok(false),
+    m_scanRanges(NULL), m_depthRanges(NULL), m_positionsHist(NULL),
+    m_scanCloudPoints(NULL), m_depthCloudPoints(NULL), m_friendsPos(NULL), m_friendInSight(NULL),
     m_scanCloudPointsStartIdx(0), m_depthCloudPointsStartIdx(0),
     m_angularSpeed(0), m_linearSpeed(0),
-    m_minX(minX), m_maxX(maxX), m_minY(minY), m_maxY(maxY)
+    m_minX(minX), m_maxX(maxX), m_minY(minY), m_maxY(maxY),
+    m_screen(NULL), m_gridSurf(NULL), m_robotSurf(NULL), m_markerSurf(NULL), m_markerSurfTransparent(NULL),
+    m_friendSurf(NULL), m_friendSurfTransparent(NULL),
+    m_writtenDisplay(0), m_readyDisplay(1), m_renderedDisplay(2), m_displayFresh(false), m_displayStop(false),
+    m_poseNode(node), m_mapNode(node), m_stopRequested(false),
+    m_depthScan(ANGLE_PRECISION * M_PI / 180)
 {
-    if (!initSDL())
+    // Position updates and heavy sensor / map processing are handled by separate queues, each one served by its own thread.
+    m_poseNode.setCallbackQueue(&m_poseQueue);
+    m_mapNode.setCallbackQueue(&m_mapQueue);
+    m_node.param("async_callbacks", m_asyncCallbacks, true);
+    m_poseSpinner = new ros::AsyncSpinner(1, &m_poseQueue);
+    m_mapSpinner = new ros::AsyncSpinner(1, &m_mapQueue);
+
+    std::string displayMode;
+    m_node.param<std::string>("display", displayMode, m_nodelet ? "thread" : "window");
+    m_node.param("report_latency", m_reportLatency, false);
+    bool resizeableGrid;
+    m_node.param("resizeable_grid", resizeableGrid, true);
+
+    m_node.param("landmark_correction", m_landmarkCorrection, false);
+    m_node.param("scan_matching", m_scanMatching, false);
+    m_nbCorrections = 0;
+
+    int depthStride;
+    m_node.param("depth_stride", depthStride, 1);
+    m_depthScan.setStride(depthStride);
+    double depthFx, depthCx;
+    int depthWidth;
+    m_node.param("depth_fx", depthFx, 0.0);
+    m_node.param("depth_cx", depthCx, 319.5);
+    m_node.param("depth_width", depthWidth, 640);
+    if (depthFx > 0)
+        m_depthScan.setIntrinsics(depthFx, depthCx, depthWidth);
+    if (displayMode == "none")
+        m_displayMode = DISPLAY_NONE;
+    else if (displayMode == "thread" || (m_nodelet && displayMode != "window"))
+    {
+        if (displayMode != "thread")
+            ROS_WARN("Unknown display mode '%s', it will default to 'thread'.", displayMode.c_str());
+        m_displayMode = DISPLAY_THREAD;
+        m_displayThread = boost::thread(&DeadReckoning::displayLoop, this);
+    }
+    else if (m_nodelet)
+    {
+        // The SDL would be initialized by the nodelet manager's thread and used by the reckoning thread.
+        ROS_ERROR("The 'window' display mode cannot be used in a nodelet, use 'thread' or 'none'.");
+        m_displayMode = DISPLAY_NONE;
         return;
+    }
+    else
+    {
+        if (displayMode != "window")
+            ROS_WARN("Unknown display mode '%s', it will default to 'window'.", displayMode.c_str());
+        m_displayMode = DISPLAY_WINDOW;
+        if (!initSDL())
+            return;
+    }
     
     if (m_simulation)
     {
@@ -1152,15 +1287,18 @@ DeadReckoning::DeadReckoning(ros::NodeHandle& node, bool simulation, double minX
     m_offsetZ = nan("");
     m_offsetZOdom = nan("");
     
-    m_positionsHist = new StampedPos[SIZE_POSITIONS_HIST];
+    double historyDuration;
+    m_node.param("history_duration", historyDuration, DEFAULT_HISTORY_DURATION);
+    m_positionsHistCapacity = std::max(1, (int)ceil(historyDuration * MAX_POSE_RATE));
+    m_positionsHist = new StampedPos[m_positionsHistCapacity];
     checkPointerOk(m_positionsHist, "Unable to allocate positions buffer.");
-    for (int i=0 ; i < SIZE_POSITIONS_HIST ; i++)
-    {
-        m_positionsHist[i].x = nan("");
-        m_positionsHist[i].y = nan("");
-        m_positionsHist[i].z = nan("");
-    }
     m_positionsHistIdx = 0;
+    m_positionsHistSize = 0;
+
+    m_scanGridDelta.seq = 0;
+    m_scanGridDelta.nbSubscribers = 0;
+    m_depthGridDelta.seq = 0;
+    m_depthGridDelta.nbSubscribers = 0;
     
     for (int i=0 ; i < 256 ; i++)
     {
@@ -1169,6 +1307,23 @@ DeadReckoning::DeadReckoning(ros::NodeHandle& node, bool simulation, double minX
         m_markerInSight[i] = false;
     }
     
+    // The names of the transformations are only built once.
+    char transformName[100];
+    m_markersTransforms.resize(256);
+    for (int i=0 ; i < 256 ; i++)
+    {
+        snprintf(transformName, 100, "%s_%d", MARKERPOS_TRANSFORM_NAME.c_str(), i);
+        m_markersTransforms[i].frame = transformName;
+    }
+    m_friendsTransforms.resize(NB_FRIENDS);
+    for (int i=0 ; i < NB_FRIENDS ; i++)
+    {
+        snprintf(transformName, 100, "%s_%d", FRIENDPOS_TRANSFORM_NAME.c_str(), i);
+        m_friendsTransforms[i].frame = transformName;
+    }
+    m_landmarksBatch.reserve(256 + NB_FRIENDS);
+    m_nbLandmarksSent = 0;
+    
     m_friendsPos = new StampedPos[NB_FRIENDS];
     checkPointerOk(m_friendsPos, "Unable to allocate friends positions buffer.");
     m_friendInSight = new bool[NB_FRIENDS];
@@ -1180,8 +1335,12 @@ DeadReckoning::DeadReckoning(ros::NodeHandle& node, bool simulation, double minX
         m_friendInSight[i] = false;
     }
     
-    m_scanGrid = Grid(0.05, ros::Duration(120.0), m_minX, m_maxX, m_minY, m_maxY, false);
+    // The maps start with the extent of the display and, unless disabled, grow with the area seen by the robot.
+    m_scanGrid = Grid(0.05, ros::Duration(120.0), m_minX, m_maxX, m_minY, m_maxY, resizeableGrid);
     m_depthGrid = m_scanGrid;
+    m_displayGrid = m_scanGrid;
+    m_displayTileMin = m_scanGrid.tileAt(m_minX, m_minY);
+    m_displayTileMax = m_scanGrid.tileAt(m_maxX, m_maxY);
     
     int nbRanges = ceil(360 / ANGLE_PRECISION);
     m_scanRanges = new double[nbRanges];
@@ -1205,155 +1364,221 @@ DeadReckoning::DeadReckoning(ros::NodeHandle& node, bool simulation, double minX
     checkPointerOk(m_depthCloudPoints, "Unable to allocate depth cloud points.");
     memcpy(m_depthCloudPoints, m_scanCloudPoints, sizeof(Vector)*NB_CLOUDPOINTS);
     
-    // Subscribe to the robot's laser scan topic
-    m_laserSub = m_node.subscribe<sensor_msgs::LaserScan>("/scan", 1, &DeadReckoning::scanCallback, this);
-    ROS_INFO("Waiting for laser scan...");
+    // Subscribe to the topics, reckon() waits for their publishers
+    m_laserSub = m_mapNode.subscribe<sensor_msgs::LaserScan>("/scan", 1, &DeadReckoning::scanCallback, this);
+    m_depthSub = m_mapNode.subscribe<sensor_msgs::PointCloud2>("/camera/depth/points", 1, &DeadReckoning::depthCallback, this);
+    m_orderSub = m_poseNode.subscribe<geometry_msgs::Twist>("/mobile_base/commands/velocity", 1000, &DeadReckoning::moveOrderCallback, this);
+    m_odomSub = m_poseNode.subscribe<nav_msgs::Odometry>("/odom", 1000, &DeadReckoning::odomCallback, this);
+    m_imuSub = m_poseNode.subscribe<sensor_msgs::Imu>("/mobile_base/sensors/imu_data", 1000, &DeadReckoning::IMUCallback, this);
+    m_laserScanPub = m_node.advertise<sensor_msgs::LaserScan>("/local_map_scan/scan", 10);
+    m_localMapScanSub = m_mapNode.subscribe<nav_msgs::OccupancyGrid>("/local_map_scan/local_map", 10, &DeadReckoning::localMapScanCallback, this);
+    m_laserDepthPub = m_node.advertise<sensor_msgs::LaserScan>("/local_map_depth/scan", 10);
+    m_localMapDepthSub = m_mapNode.subscribe<nav_msgs::OccupancyGrid>("/local_map_depth/local_map", 10, &DeadReckoning::localMapDepthCallback, this);
+    m_markersSub = m_mapNode.subscribe<detect_marker::MarkersInfos>("/markerinfo", 10, &DeadReckoning::markersCallback, this);
+    m_friendsSub = m_mapNode.subscribe<detect_friend::FriendsInfos>("/friendinfo", 10, &DeadReckoning::friendsCallback, this);
+    
+    ROS_INFO("Creating grids publishers...");
+    std::string gridFormat;
+    m_node.param<std::string>("grid_format", gridFormat, "full");
+    if (gridFormat == "compact" || gridFormat == "compact_rle")
+    {
+        m_gridFormat = gridFormat == "compact" ? GRID_FORMAT_COMPACT : GRID_FORMAT_COMPACT_RLE;
+        m_scanGridPub = m_node.advertise<dead_reckoning::CompactGrid>("/dead_reckoning/scan_grid", 10);
+        m_depthGridPub = m_node.advertise<dead_reckoning::CompactGrid>("/dead_reckoning/depth_grid", 10);
+    }
+    else
+    {
+        if (gridFormat != "full")
+            ROS_WARN("Unknown grid format '%s', it will default to 'full'.", gridFormat.c_str());
+        m_gridFormat = GRID_FORMAT_FULL;
+        m_scanGridPub = m_node.advertise<dead_reckoning::Grid>("/dead_reckoning/scan_grid", 10);
+        m_depthGridPub = m_node.advertise<dead_reckoning::Grid>("/dead_reckoning/depth_grid", 10);
+    }
+    m_scanGridDelta.pub = m_node.advertise<dead_reckoning::GridDelta>("/dead_reckoning/scan_grid_delta", 10);
+    m_depthGridDelta.pub = m_node.advertise<dead_reckoning::GridDelta>("/dead_reckoning/depth_grid_delta", 10);
+    
+    m_ok = true;
+    ROS_INFO("Ok, let's go.");
+}
+
+/**
+ * @brief Destructor.
+ *
+ * Frees internal storage.
+ */
+DeadReckoning::~DeadReckoning()
+{
+    delete m_poseSpinner;
+    delete m_mapSpinner;
+    if (m_positionsHist != NULL)
+        delete[] m_positionsHist;
+    if (m_scanRanges != NULL)
+        delete[] m_scanRanges;
+    if (m_scanCloudPoints != NULL)
+        delete[] m_scanCloudPoints;
+    if (m_depthRanges != NULL)
+        delete[] m_depthRanges;
+    if (m_depthCloudPoints != NULL)
+        delete[] m_depthCloudPoints;
+    if (m_friendsPos != NULL)
+        delete[] m_friendsPos;
+    if (m_friendInSight != NULL)
+        delete[] m_friendInSight;
+
+    if (m_displayMode == DISPLAY_THREAD)
+    {
+        {
+            boost::mutex::scoped_lock lock(m_displayMutex);
+            m_displayStop = true;
+            m_displayCond.notify_one();
+        }
+        m_displayThread.join();
+    }
+    else if (m_displayMode == DISPLAY_WINDOW)
+        quitSDL();
+}
+
+/**
+ * @brief Waits until the topics subscribed by the constructor have publishers, and the local maps nodes are connected.
+ *
+ * @return False if the wait was interrupted by stop() or because ROS stopped working.
+ */
+bool DeadReckoning::waitForPublishers()
+{
     ros::Rate rate(10);
-    while (ros::ok() && m_laserSub.getNumPublishers() <= 0)
+    ROS_INFO("Waiting for laser scan...");
+    while (running() && m_laserSub.getNumPublishers() <= 0)
         rate.sleep();
-    checkRosOk_v();
     
-    // Subscribe to the robot's depth cloud topic
-    m_depthSub = m_node.subscribe<sensor_msgs::PointCloud2>("/camera/depth/points", 1, &DeadReckoning::depthCallback, this);
     if (!m_simulation)
     {
         ROS_INFO("Waiting for depth cloud...");
-        while (ros::ok() && m_depthSub.getNumPublishers() <= 0)
+        while (running() && m_depthSub.getNumPublishers() <= 0)
             rate.sleep();
-        checkRosOk_v();
     }
     
-    m_orderSub = m_node.subscribe<geometry_msgs::Twist>("/mobile_base/commands/velocity", 1000, &DeadReckoning::moveOrderCallback, this);
     if (m_simulation)
     {
         ROS_INFO("Waiting for commands publisher...");
-        while (ros::ok() && m_orderSub.getNumPublishers() <= 0)
+        while (running() && m_orderSub.getNumPublishers() <= 0)
             rate.sleep();
-        checkRosOk_v();
     }
-    
-    m_odomSub = m_node.subscribe<nav_msgs::Odometry>("/odom", 1000, &DeadReckoning::odomCallback, this);
-    if (!m_simulation)
+    else
     {
         ROS_INFO("Waiting for odometry...");
-        while (ros::ok() && m_odomSub.getNumPublishers() <= 0)
+        while (running() && m_odomSub.getNumPublishers() <= 0)
             rate.sleep();
-        checkRosOk_v();
-    }
-    
-    m_imuSub = m_node.subscribe<sensor_msgs::Imu>("/mobile_base/sensors/imu_data", 1000, &DeadReckoning::IMUCallback, this);
-    if (!m_simulation)
-    {
         ROS_INFO("Waiting for IMU...");
-        while (ros::ok() && m_imuSub.getNumPublishers() <= 0)
+        while (running() && m_imuSub.getNumPublishers() <= 0)
             rate.sleep();
-        checkRosOk_v();
     }
     
-    m_laserScanPub = m_node.advertise<sensor_msgs::LaserScan>("/local_map_scan/scan", 10);
-    m_localMapScanSub = m_node.subscribe<nav_msgs::OccupancyGrid>("/local_map_scan/local_map", 10, &DeadReckoning::localMapScanCallback, this);
     ROS_INFO("Waiting for scan local map...");
-    while (ros::ok() && (m_localMapScanSub.getNumPublishers() <= 0 || m_laserScanPub.getNumSubscribers() <= 0))
+    while (running() && (m_localMapScanSub.getNumPublishers() <= 0 || m_laserScanPub.getNumSubscribers() <= 0))
         rate.sleep();
-    checkRosOk_v();
     
-    m_laserDepthPub = m_node.advertise<sensor_msgs::LaserScan>("/local_map_depth/scan", 10);
-    m_localMapDepthSub = m_node.subscribe<nav_msgs::OccupancyGrid>("/local_map_depth/local_map", 10, &DeadReckoning::localMapDepthCallback, this);
     if (!m_simulation)
     {
         ROS_INFO("Waiting for depth local map...");
-        while (ros::ok() && (m_localMapDepthSub.getNumPublishers() <= 0 || m_laserDepthPub.getNumSubscribers() <= 0))
+        while (running() && (m_localMapDepthSub.getNumPublishers() <= 0 || m_laserDepthPub.getNumSubscribers() <= 0))
             rate.sleep();
-        checkRosOk_v();
     }
     
-    m_markersSub = m_node.subscribe<detect_marker::MarkersInfos>("/markerinfo", 10, &DeadReckoning::markersCallback, this);
     ROS_INFO("Waiting for marker infos...");
-    while (ros::ok() && m_markersSub.getNumPublishers() <= 0)
+    while (running() && m_markersSub.getNumPublishers() <= 0)
         rate.sleep();
-    checkRosOk_v();
     
-    m_friendsSub = m_node.subscribe<detect_friend::FriendsInfos>("/friendinfo", 10, &DeadReckoning::friendsCallback, this);
     ROS_INFO("Waiting for friends infos...");
-    while (ros::ok() && m_friendsSub.getNumPublishers() <= 0)
+    while (running() && m_friendsSub.getNumPublishers() <= 0)
         rate.sleep();
-    checkRosOk_v();
-    
-    ROS_INFO("Creating grids publishers...");
-    m_scanGridPub = m_node.advertise<dead_reckoning::Grid>("/dead_reckoning/scan_grid", 10);
-    m_depthGridPub = m_node.advertise<dead_reckoning::Grid>("/dead_reckoning/depth_grid", 10);
     
-    m_ok = true;
-    ROS_INFO("Ok, let's go.");
+    if (!running())
+    {
+        ROS_ERROR("ROS interrupted.");
+        return false;
+    }
+    return true;
 }
 
 /**
- * @brief Destructor.
+ * @brief Makes reckon() return, can be called from any thread.
+ */
+void DeadReckoning::stop()
+{
+    m_stopRequested.store(true);
+}
+
+/**
+ * @brief Tells if reckon() should go on.
  *
- * Frees internal storage.
+ * @return False once stop() has been called or ROS stopped working.
  */
-DeadReckoning::~DeadReckoning()
+bool DeadReckoning::running() const
 {
-    if (m_positionsHist != NULL)
-        delete m_positionsHist;
-    if (m_scanRanges != NULL)
-        delete m_scanRanges;
-    if (m_scanCloudPoints != NULL)
-        delete m_scanCloudPoints;
-    if (m_depthRanges != NULL)
-        delete m_depthRanges;
-    if (m_depthCloudPoints != NULL)
-        delete m_depthCloudPoints;
-    if (m_gridSurf != NULL)
-        SDL_FreeSurface(m_gridSurf);
-    if (m_markerSurf != NULL)
-        SDL_FreeSurface(m_markerSurf);
-    if (m_markerSurfTransparent != NULL)
-        SDL_FreeSurface(m_markerSurfTransparent);
-    if (m_friendsPos != NULL)
-        delete m_friendsPos;
-    if (m_friendInSight != NULL)
-        delete m_friendInSight;
-    if (m_friendSurf != NULL)
-    {
-        for (int i=0 ; i < NB_FRIENDS ; i++)
-        {
-            if (m_friendSurf[i] != NULL)
-                SDL_FreeSurface(m_friendSurf[i]);
-        }
-        delete m_friendSurf;
-    }
-    if (m_friendSurfTransparent != NULL)
-    {
-        for (int i=0 ; i < NB_FRIENDS ; i++)
-        {
-            if (m_friendSurfTransparent[i] != NULL)
-                SDL_FreeSurface(m_friendSurfTransparent[i]);
-        }
-        delete m_friendSurfTransparent;
-    }
-    IMG_Quit();
-    SDL_Quit();
+    return ros::ok() && !m_stopRequested.load();
 }
 
 /**
  * @brief Starts processing.
  *
- * This function does not return until a SIGTERM is received or ROS stops working.
+ * This function waits for the publishers of the subscribed topics, then does not return until stop() is called, a SIGTERM
+ * is received or ROS stops working.
  */
 void DeadReckoning::reckon()
 {
+    if (!waitForPublishers())
+        return;
     ROS_INFO("Starting reckoning.");
+    if (m_asyncCallbacks)
+    {
+        m_poseSpinner->start();
+        m_mapSpinner->start();
+    }
+
     ros::Rate rate(10);
-    while (ros::ok())
+    int nbIterations = 0;
+    double totalDuration = 0, maxDuration = 0;
+    while (running())
     {
-        ros::spinOnce();
+        ros::WallTime start = ros::WallTime::now();
+        // None of the subscriptions use the global queue. In a nodelet, it is the manager's queue and is not ours to serve.
+        if (!m_nodelet)
+            ros::spinOnce();
+        if (!m_asyncCallbacks)
+        {
+            m_poseQueue.callAvailable();
+            m_mapQueue.callAvailable();
+        }
         publishTransforms();
-        publishMarkersTransforms();
-        publishFriendsTransforms();
+        publishLandmarksTransforms();
+        {
+            boost::mutex::scoped_lock lock(m_mapMutex);
+            m_scanGrid.expire(ros::Time::now(), GRID_EXPIRY_TILES);
+            m_depthGrid.expire(ros::Time::now(), GRID_EXPIRY_TILES);
+        }
         updateDisplay();
+
+        if (m_reportLatency)
+        {
+            double duration = (ros::WallTime::now() - start).toSec();
+            totalDuration += duration;
+            maxDuration = std::max(maxDuration, duration);
+            if (++nbIterations == LATENCY_REPORT_ITERATIONS)
+            {
+                ROS_INFO("Main loop duration over %d iterations: %.2f ms on average, %.2f ms at most, %.1f landmark transforms sent per iteration.", nbIterations, totalDuration * 1000 / nbIterations, maxDuration * 1000, (double)m_nbLandmarksSent / nbIterations);
+                nbIterations = 0;
+                m_nbLandmarksSent = 0;
+                totalDuration = maxDuration = 0;
+            }
+        }
         rate.sleep();
     }
+
+    if (m_asyncCallbacks)
+    {
+        m_poseSpinner->stop();
+        m_mapSpinner->stop();
+    }
 }
 
 /**
@@ -1378,5 +1603,13 @@ const std::string DeadReckoning::SCANGRIDPOS_TRANSFORM_NAME = "deadreckoning_sca
 const std::string DeadReckoning::DEPTHGRIDPOS_TRANSFORM_NAME = "deadreckoning_depthgridpos";    /*!< The name of the transformation through which the position (upper-left corner) of the Grid based on depth image data is published. */
 const std::string DeadReckoning::MARKERPOS_TRANSFORM_NAME = "deadreckoning_markerpos";          /*!< The name of the transformation through which the estimated markers positions are published. */
 const std::string DeadReckoning::FRIENDPOS_TRANSFORM_NAME = "deadreckoning_friendpos";          /*!< The name of the transformation through which the estimated friends positions are published. */
-const int DeadReckoning::SIZE_POSITIONS_HIST = 1000;                                            /*!< The size of the internal positions history. */
+const double DeadReckoning::DEFAULT_HISTORY_DURATION = 10.0;                                    /*!< The default duration covered by the internal positions history, in seconds (see the "history_duration" parameter). */
+const double DeadReckoning::MAX_POSE_RATE = 200.0;                                              /*!< The highest expected rate of odometry messages, in Hz, used to size the internal positions history. */
 const int DeadReckoning::NB_FRIENDS = 3;                                                        /*!< Number of friends currently registered. */
+const double DeadReckoning::GRID_KEYFRAME_PERIOD = 5.0;                                         /*!< Period of the full publishing of the grids through GridDelta messages, in seconds. */
+const double DeadReckoning::SCAN_FIELD_PERIOD = 1.0;                                             /*!< Maximum age of the likelihood field used by the scan matching, in seconds. */
+const double DeadReckoning::SCAN_FIELD_MARGIN = 2.0;                                             /*!< Maximum distance between the robot and the center of the likelihood field used by the scan matching, in meters. */
+const int DeadReckoning::SCAN_MATCHING_POINTS = 180;                                             /*!< Approximate number of points of the laser scans used by the scan matching. */
+const double DeadReckoning::LANDMARK_REFRESH_PERIOD = 1.0;                                       /*!< Period at which the positions of the markers and friends are published when they do not change, in seconds. */
+const int DeadReckoning::LATENCY_REPORT_ITERATIONS = 100;                                       /*!< Number of iterations of the main loop between two reports of its duration (see the "report_latency" parameter). */
+const int DeadReckoning::GRID_EXPIRY_TILES = 16;                                                /*!< Number of tiles of each grid checked for expired cells at each iteration of the main loop. */
@@ -8,68 +8,28 @@
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
 #include <sensor_msgs/PointCloud2.h>
-#include <sensor_msgs/point_cloud2_iterator.h>
 #include <sensor_msgs/Imu.h>
 #include <nav_msgs/OccupancyGrid.h>
 #include <nav_msgs/Odometry.h>
 #include <tf/transform_broadcaster.h>
+#include <ros/callback_queue.h>
+#include <ros/spinner.h>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <vector>
+#include "dead_reckoning/CompactGrid.h"
 #include "dead_reckoning/Grid.h"
+#include "dead_reckoning/GridDelta.h"
 #include "detect_marker/MarkerInfo.h"
 #include "detect_marker/MarkersInfos.h"
 #include "detect_friend/Friend_id.h"
 #include "detect_friend/FriendsInfos.h"
 #include "sdl_gfx/SDL_rotozoom.h"
-
-/**
- * @class Grid
- * @brief Represents the discretized world as a grid containing probabilities of obstacles.
- */
-class Grid
-{
-    public:
-        /**
-         * @struct ProbabilisticPoint
-         * @brief A point in the grid, with time stamp and probability of obstacle.
-         */
-        struct ProbabilisticPoint
-        {
-            double x;       /*!< x-coordinate of the point in the world, not discretized. */
-            double y;       /*!< y-coordinate of the point in the world, not discretized. */
-            ros::Time t;    /*!< Time of the last update of this point. */
-            double p;       /*!< Probability of the presence of an obstacle, between 0 and 1. */
-        };
-
-        Grid(double precision=0.05, ros::Duration ttl=ros::Duration(120.0), double minX=-10, double maxX=10, double minY=-10, double maxY=10, bool resizeable=true);
-        Grid(const Grid& grid);
-        Grid& operator=(const Grid& grid);
-        ~Grid();
-        
-        double precision() const;
-        double minX() const;
-        double minY() const;
-        bool addPoint(double x, double y, ros::Time t, double p);
-        bool addPoint(ProbabilisticPoint point);
-        double get(double x, double y);
-        double* getAll(int* width=NULL, int *height=NULL, double *scale=NULL) const;
-        SDL_Surface* draw(int w, int h, double minX, double maxX, double minY, double maxY, SDL_Surface *surf=NULL);
-    
-    private:
-        double m_precision;             /*!< Precision of the grid (m / unit). */
-        ros::Duration m_ttl;            /*!< Time To Live of the points inside the grid. */
-        double m_minX;                  /*!< x-coordinate of the upper-left corner of the grid in the real world. */
-        double m_maxX;                  /*!< x-coordinate of the lower-right corner of the grid in the real world. */
-        double m_minY;                  /*!< y-coordinate of the upper-left corner of the grid in the real world. */
-        double m_maxY;                  /*!< y-coordinate of the lower-right corner of the grid in the real world. */
-        ProbabilisticPoint** m_data;    /*!< Raw data of the grid, as a 1D array of pointers. */
-        int m_height;                   /*!< Height of the grid (units). */
-        int m_width;                    /*!< Width of the grid (units). */
-        bool m_resizeable;              /*!< Indicates if the grid can be dynamically resized or not. */
-        
-        void init();
-        void empty();
-        void updateSize();
-        double _get(int ix, int iy);
-};
+#include "depthscan.h"
+#include "grid.h"
+#include "landmarkcorrector.h"
+#include "scanmatcher.h"
+#include "seqlock.h"
 
 /**
  * @class DeadReckoning
@@ -110,6 +70,90 @@ class DeadReckoning
             ros::Time t;    /*!< Time stamp of the point. */
         };
 
+        /**
+         * @enum DisplayMode
+         * @brief How the display is updated (see the "display" parameter).
+         */
+        enum DisplayMode
+        {
+            DISPLAY_WINDOW,     /*!< The display is updated by the main loop ("window"). */
+            DISPLAY_THREAD,     /*!< The display is updated by its own thread, from snapshots taken by the main loop ("thread"). */
+            DISPLAY_NONE        /*!< No display at all, the SDL is not even initialized ("none"). */
+        };
+
+        /**
+         * @struct DisplayState
+         * @brief Snapshot of everything shown on the display (see DeadReckoning::captureDisplay()).
+         */
+        struct DisplayState
+        {
+            StampedPos position;                    /*!< Estimation of the robot's position. */
+            double linearSpeed;                     /*!< Linear velocity order sent to the robot. */
+            double angularSpeed;                    /*!< Angular velocity order sent to the robot. */
+            std::vector<Vector> scanCloudPoints;    /*!< Cloud points representing the laser scan data. */
+            std::vector<Vector> depthCloudPoints;   /*!< Cloud points representing the depth image data. */
+            StampedPos markersPos[256];             /*!< Positions of all markers. */
+            bool markerInSight[256];                /*!< Indicates which markers are in sight. */
+            std::vector<StampedPos> friendsPos;     /*!< Positions of all friends. */
+            std::vector<bool> friendInSight;        /*!< Indicates which friends are in sight. */
+            double minX;                            /*!< x-coordinate of the upper-left corner of the display in the real world. */
+            double maxX;                            /*!< x-coordinate of the lower-right corner of the display in the real world. */
+            double minY;                            /*!< y-coordinate of the upper-left corner of the display in the real world. */
+            double maxY;                            /*!< y-coordinate of the lower-right corner of the display in the real world. */
+            Grid::TileCoord tileMin;                /*!< Coordinates of the upper-left tile of gridTiles. */
+            Grid::TileCoord tileMax;                /*!< Coordinates of the lower-right tile of gridTiles. */
+            std::vector<uint8_t> gridTiles;         /*!< Quantized probabilities of the tiles of the map covering the display (see Grid::getQuantizedTile()), one tile after the other, row by row. */
+            std::vector<uint32_t> gridTileVersions; /*!< Version of each tile of gridTiles (see Grid::tileVersion()). */
+        };
+
+        /**
+         * @struct GridDeltaPublisher
+         * @brief State of the incremental publishing of a Grid (see DeadReckoning::publishGridDelta()).
+         */
+        struct GridDeltaPublisher
+        {
+            ros::Publisher pub;         /*!< Publisher of the dead_reckoning::GridDelta messages. */
+            uint32_t seq;               /*!< Sequence number of the next message. */
+            ros::Time lastKeyframe;     /*!< Time of the last published keyframe. */
+            uint32_t nbSubscribers;     /*!< Number of subscribers when the last message was published. */
+        };
+
+        /**
+         * @struct ScanMatchingStats
+         * @brief Durations of the scan matching, reported with the "report_latency" parameter.
+         */
+        struct ScanMatchingStats
+        {
+            int nbScans;            /*!< Number of matched scans. */
+            int nbMatched;          /*!< Number of scans which gave a correction. */
+            double totalDuration;   /*!< Total duration of the matching (s). */
+            double maxDuration;     /*!< Maximum duration of the matching (s). */
+
+            ScanMatchingStats(): nbScans(0), nbMatched(0), totalDuration(0), maxDuration(0) {}
+        };
+
+        /**
+         * @struct LandmarkTransform
+         * @brief State of the publishing of the position of a marker or a friend (see DeadReckoning::publishLandmarksTransforms()).
+         */
+        struct LandmarkTransform
+        {
+            std::string frame;          /*!< Name of the transformation. */
+            ros::Time positionStamp;    /*!< Time stamp of the last published position. */
+            ros::Time lastSent;         /*!< Time at which the transformation was last sent. */
+        };
+
+        /**
+         * @enum GridFormat
+         * @brief Formats in which the grids can be published (see the "grid_format" parameter).
+         */
+        enum GridFormat
+        {
+            GRID_FORMAT_FULL,           /*!< dead_reckoning::Grid messages, with probabilities as float64 ("full"). */
+            GRID_FORMAT_COMPACT,        /*!< dead_reckoning::CompactGrid messages, with occupancy values as int8 ("compact"). */
+            GRID_FORMAT_COMPACT_RLE     /*!< dead_reckoning::CompactGrid messages, run-length encoded ("compact_rle"). */
+        };
+
         static const double ANGLE_PRECISION;  //deg
         static const int NB_CLOUDPOINTS;
         static const double MAX_RANGE;
@@ -122,14 +166,30 @@ class DeadReckoning
         static const std::string DEPTHGRIDPOS_TRANSFORM_NAME;
         static const std::string MARKERPOS_TRANSFORM_NAME;
         static const std::string FRIENDPOS_TRANSFORM_NAME;
-        static const int SIZE_POSITIONS_HIST;
+        static const double DEFAULT_HISTORY_DURATION;
+        static const double MAX_POSE_RATE;
         static const int NB_FRIENDS;
+        static const double GRID_KEYFRAME_PERIOD;
+        static const int GRID_EXPIRY_TILES;
+        static const int LATENCY_REPORT_ITERATIONS;
+        static const double LANDMARK_REFRESH_PERIOD;
+        static const double SCAN_FIELD_PERIOD;
+        static const double SCAN_FIELD_MARGIN;
+        static const int SCAN_MATCHING_POINTS;
         
         static double modAngle(double rad);
-        static void pointCloudToLaserScan(const sensor_msgs::PointCloud2ConstPtr &cloud_msg, sensor_msgs::LaserScan& output);
         static SDL_Surface* loadImg(std::string path);
         
         ros::NodeHandle& m_node;                            /*!< Main node handle. */
+        ros::NodeHandle m_poseNode;                         /*!< Node handle of the subscribers updating the robot's position, bound to m_poseQueue. */
+        ros::NodeHandle m_mapNode;                          /*!< Node handle of the subscribers processing sensor data and maps, bound to m_mapQueue. */
+        ros::CallbackQueue m_poseQueue;                     /*!< Queue of the callbacks updating the robot's position (odometry, IMU, velocity orders). */
+        ros::CallbackQueue m_mapQueue;                      /*!< Queue of the callbacks processing sensor data and maps (laser scan, depth image, local maps, markers, friends). */
+        ros::AsyncSpinner *m_poseSpinner;                   /*!< Thread serving m_poseQueue. */
+        ros::AsyncSpinner *m_mapSpinner;                    /*!< Thread serving m_mapQueue. */
+        bool m_asyncCallbacks;                              /*!< Indicates if the queues are served by their own threads, or by the main loop. */
+        SeqLock m_poseLock;                                 /*!< Protects m_position, the positions history and the velocities, written by the m_poseQueue callbacks only. */
+        boost::mutex m_mapMutex;                            /*!< Protects the grids, the ranges, the cloud points, the markers and the friends. */
         ros::Subscriber m_orderSub;                         /*!< Subscriber to the robot's orders (mobile_base/commands/velocity). */
         ros::Subscriber m_odomSub;                          /*!< Subscriber to the robot's odometry (/odom). */
         ros::Subscriber m_laserSub;                         /*!< Subscriber to the robot's laser scan (/scan). */
@@ -141,14 +201,20 @@ class DeadReckoning
         ros::Subscriber m_friendsSub;                       /*!< Subscriber to the friends information, provided by the detect_friend node based on camera data (/friendinfo). */
         ros::Publisher m_laserScanPub;                      /*!< Publisher of the filtered laser scan for the local_map node (/local_map_scan/scan). */
         ros::Publisher m_laserDepthPub;                     /*!< Publisher of the depth image as a laser scan for the local_map node (/local_map_depth/scan). */
-        ros::Publisher m_scanGridPub;                       /*!< Publisher of the map created from laser scan data (/dead_reckoning/scan_grid). */
-        ros::Publisher m_depthGridPub;                      /*!< Publisher of the map created from depth image data (/dead_reckoning/depth_grid). */
+        ros::Publisher m_scanGridPub;                       /*!< Publisher of the map created from laser scan data, in the format given by m_gridFormat (/dead_reckoning/scan_grid). */
+        ros::Publisher m_depthGridPub;                      /*!< Publisher of the map created from depth image data, in the format given by m_gridFormat (/dead_reckoning/depth_grid). */
+        GridFormat m_gridFormat;                            /*!< Format of the published maps. */
+        GridDeltaPublisher m_scanGridDelta;                 /*!< Incremental publisher of the map created from laser scan data (/dead_reckoning/scan_grid_delta). */
+        GridDeltaPublisher m_depthGridDelta;                /*!< Incremental publisher of the map created from depth image data (/dead_reckoning/depth_grid_delta). */
         double *m_scanRanges;                               /*!< Buffer of the last 360° known scan ranges, especially useful when dealing with a non 360° laser scan. */
         double *m_depthRanges;                              /*!< Buffer of the last 360° known ranges, computed from depth image data. */
         bool m_simulation;                                  /*!< Indicates if we run in simulation mode or not. */
+        bool m_nodelet;                                     /*!< Indicates if the instance runs in a nodelet. */
         StampedPos m_position;                              /*!< Last estimation of the robot's position in the real world. */
-        StampedPos *m_positionsHist;                        /*!< History of estimations of the robot's position in the real world. */
-        int m_positionsHistIdx;                             /*!< Start index for the position estimations history. */
+        StampedPos *m_positionsHist;                        /*!< History of estimations of the robot's position in the real world, ring buffer sorted by time. */
+        int m_positionsHistCapacity;                        /*!< Size of the position estimations history buffer. */
+        int m_positionsHistIdx;                             /*!< Index at which the next position estimation will be stored in the history. */
+        int m_positionsHistSize;                            /*!< Number of position estimations stored in the history. */
         double m_offsetX;                                   /*!< Offset along the x-axis between the internal coordinate system and the robot's odometry coordinates system. */
         double m_offsetY;                                   /*!< Offset along the y-axis between the internal coordinate system and the robot's odometry coordinates system. */
         double m_offsetZ;                                   /*!< Orientation offset between the internal coordinate system and the robot's IMU coordinates system. */
@@ -161,30 +227,65 @@ class DeadReckoning
         int m_depthCloudPointsStartIdx;                     /*!< Start index for the depth image cloud points. */
         Grid m_scanGrid;                                    /*!< Current map of the world built from laser scan data. */
         Grid m_depthGrid;                                   /*!< Current map of the world built from depth image data. */
+        Grid m_displayGrid;                                 /*!< Copy of the tiles of m_scanGrid covering the display, only used to draw the display. */
+        std::vector<uint32_t> m_displayGridVersions;        /*!< Version of each tile of m_displayGrid, in the order of DisplayState::gridTiles. */
+        Grid::TileCoord m_displayTileMin;                   /*!< Coordinates of the upper-left tile of m_displayGrid, as in the last drawn snapshot. */
+        Grid::TileCoord m_displayTileMax;                   /*!< Coordinates of the lower-right tile of m_displayGrid, as in the last drawn snapshot. */
+        DepthScan m_depthScan;                              /*!< Converts the depth clouds into laser scans. */
         SDL_Surface *m_screen;                              /*!< Main display surface. */
+        SDL_Surface *m_gridSurf;                            /*!< Internal bitmap used to draw the map. */
         SDL_Surface *m_robotSurf;                           /*!< Internal bitmap used to draw the robot. */
         SDL_Surface *m_markerSurf;                          /*!< Internal bitmap used to draw a marker. */
         SDL_Surface *m_markerSurfTransparent;               /*!< Internal bitmap used to draw a half-transparent marker. */
         SDL_Surface **m_friendSurf;                         /*!< Internal bitmap used to draw a friend. */
         SDL_Surface **m_friendSurfTransparent;              /*!< Internal bitmap used to draw a half-transparent friend. */
-        SDL_Surface *m_gridSurf;                            /*!< Internal bitmap on which the map is drawn. */
-        double m_minX;                                      /*!< x-coordinate of the upper-left corner of the display in the real world. */
-        double m_maxX;                                      /*!< x-coordinate of the lower-right corner of the display in the real world. */
-        double m_minY;                                      /*!< y-coordinate of the upper-left corner of the display in the real world. */
-        double m_maxY;                                      /*!< y-coordinate of the lower-right corner of the display in the real world. */
+        DisplayMode m_displayMode;                          /*!< How the display is updated. */
+        DisplayState m_displayStates[3];                    /*!< Display snapshots: being written by the main loop, ready and being displayed (only the first one is used if the display has no thread). */
+        int m_writtenDisplay;                               /*!< Index of the display snapshot being written by the main loop. */
+        int m_readyDisplay;                                 /*!< Index of the last complete display snapshot. */
+        int m_renderedDisplay;                              /*!< Index of the display snapshot being displayed by the display thread. */
+        bool m_displayFresh;                                /*!< Indicates if the ready display snapshot has not been displayed yet. */
+        bool m_displayStop;                                 /*!< Indicates that the display thread should stop. */
+        boost::mutex m_displayMutex;                        /*!< Protects the display snapshots indexes and flags. */
+        boost::condition_variable m_displayCond;            /*!< Signals a new display snapshot or a stop request to the display thread. */
+        boost::thread m_displayThread;                      /*!< Thread updating the display, in DISPLAY_THREAD mode. */
+        bool m_reportLatency;                               /*!< Indicates if the duration of the main loop iterations should be logged. */
+        double m_minX;                                      /*!< x-coordinate of the upper-left corner of the display in the real world, moved to follow the robot. */
+        double m_maxX;                                      /*!< x-coordinate of the lower-right corner of the display in the real world, moved to follow the robot. */
+        double m_minY;                                      /*!< y-coordinate of the upper-left corner of the display in the real world, moved to follow the robot. */
+        double m_maxY;                                      /*!< y-coordinate of the lower-right corner of the display in the real world, moved to follow the robot. */
         tf::TransformBroadcaster m_transformBroadcaster;    /*!< Main transformation broadcaster. */
         StampedPos m_markersPos[256];                       /*!< Last known positions of all markers (IDs from 0 to 255).*/
         bool m_markerInSight[256];                          /*!< Indicates which markers are still in sight (IDs from 0 to 255).*/
         StampedPos *m_friendsPos;                           /*!< Last known positions of all friends.*/
         bool *m_friendInSight;                              /*!< Indicates which friends are still in sight.*/
+        std::vector<LandmarkTransform> m_markersTransforms; /*!< Publishing state of the markers positions (IDs from 0 to 255). */
+        std::vector<LandmarkTransform> m_friendsTransforms; /*!< Publishing state of the friends positions. */
+        std::vector<tf::StampedTransform> m_landmarksBatch; /*!< Transformations of the markers and friends sent at once by publishLandmarksTransforms(). */
+        LandmarkCorrector m_landmarkCorrector;              /*!< Corrects the robot's position with the re-observations of the markers. */
+        bool m_landmarkCorrection;                          /*!< Indicates if the markers are used to correct the robot's position. */
+        int m_nbCorrections;                                /*!< Number of corrections applied to the robot's position, protected by m_poseLock (see LandmarkCorrector). */
+        ScanMatcher m_scanMatcher;                          /*!< Matches the laser scans against m_scanGrid. */
+        bool m_scanMatching;                                /*!< Indicates if the laser scans are used to correct the robot's position. */
+        ros::Time m_scanFieldTime;                          /*!< Time at which the likelihood field of m_scanMatcher was built. */
+        std::vector<ScanMatcher::Point> m_scanPoints;       /*!< Points of the last matched laser scan, in the robot's coordinate system. */
+        ScanMatchingStats m_scanMatchingStats;              /*!< Durations of the scan matching since the last report. */
+        int m_nbLandmarksSent;                              /*!< Number of markers and friends transformations sent since the last latency report. */
         bool m_ok;                                          /*!< Indicates the instance is ready to start reckoning. */
+        boost::atomic<bool> m_stopRequested;                /*!< Indicates that reckon() should return, set by stop(). */
         
-        StampedPos getPosForTime(const ros::Time& time);
+        StampedPos getPosition(int *generation=NULL) const;
+        StampedPos getPosForTime(const ros::Time& time, int *generation=NULL);
+        StampedPos searchPosForTime(const ros::Time& time) const;
         void friendsCallback(const detect_friend::FriendsInfos::ConstPtr& friendsInfos);
         void markersCallback(const detect_marker::MarkersInfos::ConstPtr& markersInfos);
         void IMUCallback(const sensor_msgs::Imu::ConstPtr& imu);
         void odomCallback(const nav_msgs::Odometry::ConstPtr& odom);
         void moveOrderCallback(const geometry_msgs::Twist::ConstPtr& order);
+        bool waitForPublishers();
+        bool running() const;
+        void applyLandmarkCorrection();
+        void matchScan(const sensor_msgs::LaserScan& scan, bool invert);
         void localMapScanCallback(const nav_msgs::OccupancyGrid::ConstPtr& occ);
         void localMapDepthCallback(const nav_msgs::OccupancyGrid::ConstPtr& occ);
         void updateGridFromOccupancy(const nav_msgs::OccupancyGrid::ConstPtr& occ, Grid& grid);
@@ -192,18 +293,26 @@ class DeadReckoning
         void scanCallback(const sensor_msgs::LaserScan::ConstPtr& scan);
         void depthCallback(const sensor_msgs::PointCloud2::ConstPtr& cloud);
         void publishTransforms();
-        void publishMarkersTransforms();
-        void publishFriendsTransforms();
+        void batchLandmarkTransform(const StampedPos& pos, bool inSight, LandmarkTransform& landmark, const ros::Time& now);
+        void publishLandmarksTransforms();
         void publishGrid(const Grid& grid, ros::Publisher& pub);
+        void publishGridDelta(Grid& grid, GridDeltaPublisher& deltaPub);
         bool initSDL();
+        void quitSDL();
         void updateDisplay();
-        void convertPosToDisplayCoord(double fx, double fy, int& x, int& y);
+        void captureDisplay(DisplayState& state);
+        void renderDisplay(const DisplayState& state);
+        void displayLoop();
+        void convertPosToDisplayCoord(const DisplayState& state, double fx, double fy, int& x, int& y);
 
     public:
-        DeadReckoning(ros::NodeHandle& node, bool simulation=true, double minX=-5, double maxX=5, double minY=-5, double maxY=5);
+        DeadReckoning(ros::NodeHandle& node, bool simulation=true, double minX=-5, double maxX=5, double minY=-5, double maxY=5, bool nodelet=false);
         ~DeadReckoning();
         void reckon();
+        void stop();
         bool ready();
+
+        static void runLengthEncode(const std::vector<int8_t>& data, std::vector<int8_t>& encoded);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include "deadreckoning.h"
+
+namespace dead_reckoning
+{
+
+/**
+ * @class DeadReckoningNodelet
+ * @brief Runs DeadReckoning as a nodelet.
+ *
+ * Loaded in the same nodelet manager as the camera driver and the local_map nodelets, the depth clouds, the laser scans
+ * and the local maps are passed as shared pointers, without serialization. The parameters are the ones of the
+ * deadreckoning node, except that the "display" parameter defaults to "thread". reckon() runs in its own thread, so
+ * "window" is refused: the display would be created and updated by different threads.
+ */
+class DeadReckoningNodelet : public nodelet::Nodelet
+{
+    public:
+        ~DeadReckoningNodelet();
+
+    private:
+        boost::scoped_ptr<DeadReckoning> m_deadReckoning;   /*!< The dead reckoning, NULL until onInit(). */
+        boost::thread m_thread;                             /*!< Thread running DeadReckoning::reckon(). */
+
+        virtual void onInit();
+};
+
+/**
+ * @brief Destructor.
+ *
+ * Stops the reckoning thread.
+ */
+DeadReckoningNodelet::~DeadReckoningNodelet()
+{
+    if (m_deadReckoning)
+    {
+        m_deadReckoning->stop();
+        m_thread.join();
+    }
+}
+
+/**
+ * @brief Creates the DeadReckoning instance and starts the reckoning thread, the same way as the deadreckoning node.
+ */
+void DeadReckoningNodelet::onInit()
+{
+    ros::NodeHandle& node = getPrivateNodeHandle();
+
+    bool simulation = true;
+    std::string mode;
+    if (node.getParam("mode", mode))
+        simulation = mode != "realworld";
+    NODELET_INFO("Mode: %s", simulation ? "Simulation" : "Real world");
+
+    srand(time(0));
+
+    double minX=-5, maxX=5, minY=-5, maxY=5;
+    if (simulation)
+    {
+        minX = 0; maxX = 10;
+        minY = 0; maxY = 10;
+    }
+    m_deadReckoning.reset(new DeadReckoning(node, simulation, minX, maxX, minY, maxY, true));
+    if (m_deadReckoning->ready())
+        m_thread = boost::thread(&DeadReckoning::reckon, m_deadReckoning.get());
+    else
+        NODELET_ERROR("Unable to initialize the dead reckoning, the nodelet will do nothing.");
+}
+
+}
+
+PLUGINLIB_EXPORT_CLASS(dead_reckoning::DeadReckoningNodelet, nodelet::Nodelet)
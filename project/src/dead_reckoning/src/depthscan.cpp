@@ -0,0 +1,259 @@
+#include "depthscan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+const double DepthScan::ANGLE_MIN = -30.0 * M_PI / 180;
+const double DepthScan::ANGLE_MAX = 30.0 * M_PI / 180;
+const double DepthScan::RANGE_MIN = 0.45;
+const double DepthScan::RANGE_MAX = 15.0;
+const double DepthScan::BAND_HEIGHT = 0.5;
+
+const int DepthScan::COLUMN_UNKNOWN;
+const int DepthScan::COLUMN_OUTSIDE;
+
+/**
+ * @brief Constructor.
+ *
+ * @param angleIncrement The angle delta between two consecutive rays of the laser scans (rad).
+ * @param stride Only one row and one column out of stride are converted, 1 to convert all the points.
+ */
+DepthScan::DepthScan(double angleIncrement, int stride):
+    m_angleIncrement(angleIncrement), m_fx(0), m_cx(0), m_intrinsicsWidth(0), m_width(0), m_height(0), m_unknownColumns(0)
+{
+    // Same computation as with the (single precision) fields of the laser scan message.
+    m_nbRays = std::ceil(((float)ANGLE_MAX - (float)ANGLE_MIN) / (float)m_angleIncrement);
+    setStride(stride);
+}
+
+/**
+ * @brief Gets the decimation of the converted clouds.
+ */
+int DepthScan::stride() const
+{
+    return m_stride;
+}
+
+/**
+ * @brief Sets the decimation of the converted clouds: only one row and one column out of stride are converted.
+ *
+ * @param stride The new stride, values lower than 1 are replaced by 1.
+ */
+void DepthScan::setStride(int stride)
+{
+    m_stride = std::max(stride, 1);
+}
+
+/**
+ * @brief Sets the intrinsics of the camera, used to compute the bearing of the columns of organised clouds.
+ *
+ * Without intrinsics, the bearings are computed from the points of the first clouds.
+ * The intrinsics are scaled if the clouds are not as wide as the images they are given for.
+ *
+ * @param fx The horizontal focal length (pixels), 0 to forget the intrinsics.
+ * @param cx The column of the optical center (pixels).
+ * @param width The width of the images (pixels).
+ */
+void DepthScan::setIntrinsics(double fx, double cx, int width)
+{
+    m_fx = fx;
+    m_cx = cx;
+    m_intrinsicsWidth = width;
+    m_width = 0;
+    m_height = 0;
+}
+
+/**
+ * @brief Gets the offset of a float field inside the points of a cloud.
+ *
+ * @param cloud The points cloud.
+ * @param name The name of the field.
+ * @return The offset of the field in bytes, or -1 if the cloud has no such float field.
+ */
+int DepthScan::fieldOffset(const sensor_msgs::PointCloud2& cloud, const std::string& name)
+{
+    for (size_t i=0 ; i < cloud.fields.size() ; i++)
+    {
+        const sensor_msgs::PointField& field = cloud.fields[i];
+        if (field.name == name && field.datatype == sensor_msgs::PointField::FLOAT32 && field.offset + sizeof(float) <= cloud.point_step)
+            return field.offset;
+    }
+    return -1;
+}
+
+/**
+ * @brief Gets the laser scan ray covering a bearing.
+ *
+ * @param angle The bearing (rad).
+ * @return The index of the ray, or COLUMN_OUTSIDE if the bearing is outside of the laser scans' field of view.
+ */
+int DepthScan::angleToRay(double angle) const
+{
+    // Same computation as with the (single precision) fields of the laser scan message.
+    const float angleMin = ANGLE_MIN, angleMax = ANGLE_MAX, angleIncrement = m_angleIncrement;
+    if (angle < angleMin || angle > angleMax)
+        return COLUMN_OUTSIDE;
+    const uint32_t index = (angle - angleMin) / angleIncrement;
+    return index < m_nbRays ? index : COLUMN_OUTSIDE;
+}
+
+/**
+ * @brief Clears the lookup table of the columns, for clouds of the given dimensions, and fills it from the intrinsics if known.
+ */
+void DepthScan::resetColumns(uint32_t width, uint32_t height)
+{
+    m_width = width;
+    m_height = height;
+    m_columnRays.assign(width, COLUMN_UNKNOWN);
+    m_columnScales.assign(width, 0);
+    m_unknownColumns = width;
+    if (m_fx <= 0)
+        return;
+
+    const double ratio = (double)width / m_intrinsicsWidth;
+    for (uint32_t col=0 ; col < width ; col++)
+        setColumn(col, ((col + 0.5) / ratio - 0.5 - m_cx) / m_fx);
+}
+
+/**
+ * @brief Sets the entry of a column in the lookup table.
+ *
+ * @param col The column.
+ * @param slope The ratio x / z shared by all the points of the column.
+ */
+void DepthScan::setColumn(uint32_t col, double slope)
+{
+    m_columnRays[col] = angleToRay(-atan(slope));
+    m_columnScales[col] = std::sqrt(1 + slope*slope);
+    m_unknownColumns--;
+}
+
+/**
+ * @brief Fills the lookup table entries of the columns which are not known yet, from their first valid point in a cloud.
+ */
+void DepthScan::learnColumns(const sensor_msgs::PointCloud2& cloud, int xOffset, int zOffset)
+{
+    for (uint32_t row=0 ; row < cloud.height && m_unknownColumns > 0 ; row++)
+    {
+        const uint8_t *point = &cloud.data[(size_t)row * cloud.row_step];
+        for (uint32_t col=0 ; col < cloud.width ; col++, point += cloud.point_step)
+        {
+            if (m_columnRays[col] != COLUMN_UNKNOWN)
+                continue;
+            float x, z;
+            memcpy(&x, point + xOffset, sizeof(float));
+            memcpy(&z, point + zOffset, sizeof(float));
+            if (z > 0 && std::isfinite(x))
+                setColumn(col, x / z);
+        }
+    }
+}
+
+/**
+ * @brief Converts a points cloud message into a laser scan message, possibly loosing information.
+ *
+ * For each ray of the laser scan, keeps the closest point of the cloud whose y-coordinate is within BAND_HEIGHT of the
+ * camera. The cloud is expected in the camera optical frame (x to the right, y downwards, z forwards).
+ *
+ * @param cloud The points cloud message to convert.
+ * @param output A reference to the laser scan message to fill.
+ * @return False if the cloud has no float "x", "y" and "z" fields or is truncated, in which case the scan is left empty.
+ */
+bool DepthScan::convert(const sensor_msgs::PointCloud2& cloud, sensor_msgs::LaserScan& output)
+{
+    output.angle_min = ANGLE_MIN;
+    output.angle_max = ANGLE_MAX;
+    output.angle_increment = m_angleIncrement;
+    output.time_increment = 0.0;
+    output.scan_time = 1.0 / 30.0;
+    output.range_min = RANGE_MIN;
+    output.range_max = RANGE_MAX;
+    output.ranges.assign(m_nbRays, std::numeric_limits<double>::infinity());
+
+    const int xOffset = fieldOffset(cloud, "x");
+    const int yOffset = fieldOffset(cloud, "y");
+    const int zOffset = fieldOffset(cloud, "z");
+    if (xOffset < 0 || yOffset < 0 || zOffset < 0)
+        return false;
+    if ((uint64_t)cloud.width * cloud.point_step > cloud.row_step || (uint64_t)cloud.height * cloud.row_step > cloud.data.size())
+        return false;
+    if (cloud.width == 0 || cloud.height == 0)
+        return true;
+
+    if (cloud.height > 1)
+    {
+        if (cloud.width != m_width || cloud.height != m_height)
+            resetColumns(cloud.width, cloud.height);
+        if (m_unknownColumns > 0)
+            learnColumns(cloud, xOffset, zOffset);
+        convertOrganised(cloud, yOffset, zOffset, output);
+    }
+    else
+        convertUnorganised(cloud, xOffset, yOffset, zOffset, output);
+    return true;
+}
+
+/**
+ * @brief Converts an organised cloud using the lookup table of the columns.
+ */
+void DepthScan::convertOrganised(const sensor_msgs::PointCloud2& cloud, int yOffset, int zOffset, sensor_msgs::LaserScan& output)
+{
+    const float bandHeight = BAND_HEIGHT, rangeMin = output.range_min, rangeMax = output.range_max;
+    const float *scales = &m_columnScales[0];
+    m_columnMins.assign(cloud.width, std::numeric_limits<float>::infinity());
+    float *mins = &m_columnMins[0];
+
+    // Minimum range of each column. The comparisons are false for NaN coordinates, which are rejected at the same time.
+    const size_t step = (size_t)cloud.point_step * m_stride;
+    for (uint32_t row=0 ; row < cloud.height ; row += m_stride)
+    {
+        const uint8_t *point = &cloud.data[(size_t)row * cloud.row_step];
+        for (uint32_t col=0 ; col < cloud.width ; col += m_stride, point += step)
+        {
+            float y, z;
+            memcpy(&y, point + yOffset, sizeof(float));
+            memcpy(&z, point + zOffset, sizeof(float));
+            const float range = z * scales[col];
+            const bool keep = std::fabs(y) <= bandHeight && range >= rangeMin && range <= rangeMax && range < mins[col];
+            mins[col] = keep ? range : mins[col];
+        }
+    }
+
+    //overwrite range at laserscan ray if new range is smaller
+    for (uint32_t col=0 ; col < cloud.width ; col += m_stride)
+    {
+        const int ray = m_columnRays[col];
+        if (ray >= 0 && mins[col] < output.ranges[ray])
+            output.ranges[ray] = mins[col];
+    }
+}
+
+/**
+ * @brief Converts an unorganised cloud, computing the bearing of each point.
+ */
+void DepthScan::convertUnorganised(const sensor_msgs::PointCloud2& cloud, int xOffset, int yOffset, int zOffset, sensor_msgs::LaserScan& output)
+{
+    const uint8_t *point = &cloud.data[0];
+    const size_t step = (size_t)cloud.point_step * m_stride;
+    for (uint32_t i=0 ; i < cloud.width ; i += m_stride, point += step)
+    {
+        float x, y, z;
+
+        // The comparisons are false for NaN coordinates, which are rejected at the same time.
+        memcpy(&y, point + yOffset, sizeof(float));
+        if (!(std::fabs(y) <= BAND_HEIGHT))
+            continue;
+
+        memcpy(&x, point + xOffset, sizeof(float));
+        memcpy(&z, point + zOffset, sizeof(float));
+        const double range = std::sqrt((double)x*x + (double)z*z);
+        if (!(range >= output.range_min && range <= output.range_max))
+            continue;
+
+        const int ray = angleToRay(-atan2(x, z));
+        if (ray >= 0 && range < output.ranges[ray])
+            output.ranges[ray] = range;
+    }
+}
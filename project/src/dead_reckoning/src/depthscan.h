@@ -0,0 +1,66 @@
+#ifndef DEPTHSCAN_H
+#define DEPTHSCAN_H
+
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * @class DepthScan
+ * @brief Converts depth points clouds into laser scans, keeping the closest point of a horizontal band for each bearing.
+ *
+ * The points are read directly from the packed buffer of the message, using the offsets of its "x", "y" and "z" fields,
+ * and the points outside the band are rejected before computing any range or bearing.
+ * When the cloud is organised (height > 1), the bearing of a point only depends on its column. A lookup table gives the
+ * scan ray of each column and the ratio between the range and the depth (z) of its points, so that the conversion is a
+ * branchless column-wise min-reduction of the depths followed by one update of the scan per column. The table is built
+ * from the camera intrinsics if they are known (see setIntrinsics()), else from the valid points of the first clouds,
+ * and rebuilt when the dimensions of the cloud change.
+ * The cloud can also be decimated, only keeping one row and one column out of a given stride.
+ */
+class DepthScan
+{
+    public:
+        static const double ANGLE_MIN;      /*!< Bearing of the first ray of the laser scans (rad). */
+        static const double ANGLE_MAX;      /*!< Bearing of the last ray of the laser scans (rad). */
+        static const double RANGE_MIN;      /*!< Minimum range of the laser scans (m). */
+        static const double RANGE_MAX;      /*!< Maximum range of the laser scans (m). */
+        static const double BAND_HEIGHT;    /*!< Points further than this distance from the camera's horizontal plane are ignored (m). */
+
+        DepthScan(double angleIncrement, int stride=1);
+
+        int stride() const;
+        void setStride(int stride);
+        void setIntrinsics(double fx, double cx, int width);
+        bool convert(const sensor_msgs::PointCloud2& cloud, sensor_msgs::LaserScan& output);
+
+    private:
+        static const int COLUMN_UNKNOWN = -2;   /*!< Ray of a column whose bearing is not known yet (see m_columnRays). */
+        static const int COLUMN_OUTSIDE = -1;   /*!< Ray of a column outside of the laser scans' field of view (see m_columnRays). */
+
+        double m_angleIncrement;                /*!< The angle delta between two consecutive rays of the laser scans (rad). */
+        uint32_t m_nbRays;                      /*!< Number of rays of the laser scans. */
+        int m_stride;                           /*!< Only one row and one column out of m_stride are converted. */
+        double m_fx;                            /*!< Horizontal focal length of the camera (pixels), 0 if unknown. */
+        double m_cx;                            /*!< Column of the camera's optical center (pixels). */
+        int m_intrinsicsWidth;                  /*!< Width of the images m_fx and m_cx are given for (pixels). */
+        uint32_t m_width;                       /*!< Width of the cloud the lookup table was built for. */
+        uint32_t m_height;                      /*!< Height of the cloud the lookup table was built for. */
+        int m_unknownColumns;                   /*!< Number of columns whose bearing is not known yet. */
+        std::vector<int> m_columnRays;          /*!< Index of the scan ray of each column, or COLUMN_UNKNOWN / COLUMN_OUTSIDE. */
+        std::vector<float> m_columnScales;      /*!< Ratio between the range and the depth of the points of each column. */
+        std::vector<float> m_columnMins;        /*!< Minimum range of each column in the cloud being converted. */
+
+        static int fieldOffset(const sensor_msgs::PointCloud2& cloud, const std::string& name);
+        int angleToRay(double angle) const;
+
+        void resetColumns(uint32_t width, uint32_t height);
+        void setColumn(uint32_t col, double slope);
+        void learnColumns(const sensor_msgs::PointCloud2& cloud, int xOffset, int zOffset);
+        void convertOrganised(const sensor_msgs::PointCloud2& cloud, int yOffset, int zOffset, sensor_msgs::LaserScan& output);
+        void convertUnorganised(const sensor_msgs::PointCloud2& cloud, int xOffset, int yOffset, int zOffset, sensor_msgs::LaserScan& output);
+};
+
+#endif
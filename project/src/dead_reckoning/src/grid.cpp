@@ -0,0 +1,1418 @@
+#include "grid.h"
+#include "sdlutils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+const int Grid::TILE_SHIFT;
+const int Grid::TILE_SIZE;
+const int Grid::TILE_CELLS;
+const uint8_t Grid::QUANTIZED_MAX;
+const uint8_t Grid::QUANTIZED_UNKNOWN;
+const float Grid::OBSTACLE = 0.5f;
+const int32_t Grid::NO_OBSTACLE = std::numeric_limits<int32_t>::min();
+
+/**
+ * @brief Sets the initial extent of the Grid, without any allocated tile.
+ *
+ * @param minX The x-coordinate of the upper-left corner of the Grid in the real world.
+ * @param maxX The x-coordinate of the lower-right corner of the Grid in the real world.
+ * @param minY The y-coordinate of the upper-left corner of the Grid in the real world.
+ * @param maxY The y-coordinate of the lower-right corner of the Grid in the real world.
+ */
+void Grid::init(double minX, double maxX, double minY, double maxY)
+{
+    m_minIx = toGridCoord(minX);
+    m_maxIx = toGridCoord(maxX);
+    m_minIy = toGridCoord(minY);
+    m_maxIy = toGridCoord(maxY);
+    m_epoch = ros::Time();
+    m_lastTile = NULL;
+    m_lastDistanceTile = NULL;
+}
+
+/**
+ * @brief Frees internal storage.
+ */
+void Grid::empty()
+{
+    for (TileMap::iterator it = m_tiles.begin() ; it != m_tiles.end() ; it++)
+        delete it->second;
+    m_tiles.clear();
+    m_dirtyTiles.clear();
+    m_sweepQueue.clear();
+    m_lastTile = NULL;
+    emptyDistances();
+}
+
+/**
+ * @brief Frees the distance layer storage, the distance layer stays enabled.
+ */
+void Grid::emptyDistances()
+{
+    for (DistanceTileMap::iterator it = m_distanceTiles.begin() ; it != m_distanceTiles.end() ; it++)
+        delete it->second;
+    m_distanceTiles.clear();
+    m_distanceChanges.clear();
+    m_distanceQueue.clear();
+    m_freedDistanceTiles.clear();
+    m_lastDistanceTile = NULL;
+}
+
+/**
+ * @brief Converts a real world coordinate into a grid coordinate.
+ *
+ * Grid coordinates are absolute: the cell of grid coordinates (0, 0) is centered on the origin of the real world.
+ */
+int Grid::toGridCoord(double f) const
+{
+    return round(f / m_precision);
+}
+
+/**
+ * @brief Gets the coordinate of the tile containing a given grid coordinate.
+ */
+int Grid::tileCoord(int i)
+{
+    return i >= 0 ? i / TILE_SIZE : -((-i - 1) / TILE_SIZE) - 1;
+}
+
+/**
+ * @brief Computes the key of a tile in the tiles hash map.
+ */
+uint64_t Grid::tileKey(int tx, int ty)
+{
+    return ((uint64_t)(uint32_t)tx << 32) | (uint32_t)ty;
+}
+
+/**
+ * @brief Converts a time into a cell time stamp.
+ *
+ * Cell time stamps are stored as milliseconds elapsed since the first point was added to the Grid,
+ * times older than that are clamped to 0 and times more than 49 days later saturate.
+ *
+ * @param t The time to convert.
+ * @return The cell time stamp.
+ */
+uint32_t Grid::toStamp(const ros::Time& t) const
+{
+    if (t <= m_epoch)
+        return 0;
+    ros::Duration d = t - m_epoch;
+    if (d.sec >= 4294967)
+        return 0xffffffff;
+    return (uint32_t)d.sec * 1000 + d.nsec / 1000000;
+}
+
+/**
+ * @brief Tells if a cell has been seen at least once.
+ *
+ * @param tile The tile containing the cell.
+ * @param c The index of the cell in the tile.
+ */
+bool Grid::isKnown(const Tile *tile, int c)
+{
+    return (tile->known[c >> 5] >> (c & 31)) & 1;
+}
+
+/**
+ * @brief Marks a cell as seen.
+ *
+ * @param tile The tile containing the cell.
+ * @param c The index of the cell in the tile.
+ */
+void Grid::setKnown(Tile *tile, int c)
+{
+    tile->known[c >> 5] |= 1u << (c & 31);
+}
+
+/**
+ * @brief Tells if a cell is an obstacle for the distance layer.
+ *
+ * @param tile The tile containing the cell.
+ * @param c The index of the cell in the tile.
+ */
+bool Grid::isObstacle(const Tile *tile, int c)
+{
+    return isKnown(tile, c) && tile->p[c] >= OBSTACLE;
+}
+
+/**
+ * @brief Looks up a tile.
+ *
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ * @return The tile, or NULL if it has never been allocated.
+ */
+Grid::Tile* Grid::findTile(int tx, int ty)
+{
+    uint64_t key = tileKey(tx, ty);
+    if (m_lastTile != NULL && key == m_lastKey)
+        return m_lastTile;
+
+    TileMap::const_iterator it = m_tiles.find(key);
+    if (it == m_tiles.end())
+        return NULL;
+    m_lastKey = key;
+    m_lastTile = it->second;
+    return m_lastTile;
+}
+
+/**
+ * @brief Marks a tile as modified: gives it a new version (see tileVersion()) and reports it to the next call to popDirtyTiles().
+ *
+ * @param tile The tile.
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ */
+void Grid::setDirty(Tile *tile, int tx, int ty)
+{
+    if (++m_version == 0)
+        m_version = 1;
+    tile->version = m_version;
+    if (tile->dirty)
+        return;
+    tile->dirty = true;
+    m_dirtyTiles.push_back(tileKey(tx, ty));
+}
+
+/**
+ * @brief Looks up a tile, allocating it if needed.
+ *
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ * @return The tile.
+ */
+Grid::Tile* Grid::getTile(int tx, int ty)
+{
+    Tile *tile = findTile(tx, ty);
+    if (tile != NULL)
+        return tile;
+
+    // Unknown cells have a null probability, so that blendPatch() can combine them without checking the known bitmap.
+    tile = new Tile;
+    memset(tile, 0, sizeof(Tile));
+    m_lastKey = tileKey(tx, ty);
+    m_lastTile = tile;
+    m_tiles[m_lastKey] = tile;
+    return tile;
+}
+
+/**
+ * @brief Accesses the probability of a point at given grid coordinates.
+ *
+ * @param ix The x-coordinate of the point to access.
+ * @param iy The y-coordinate of the point to access.
+ * @param minStamp The time stamp under which cells are considered as expired.
+ * @return The obstacle probability  at this point, between 0 and 1, negative means unknown.
+ */
+double Grid::_get(int ix, int iy, uint32_t minStamp)
+{
+    int tx = tileCoord(ix);
+    int ty = tileCoord(iy);
+    Tile *tile = findTile(tx, ty);
+    if (tile == NULL)
+        return -1;
+
+    int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+    if (!isKnown(tile, c) || tile->t[c] < minStamp)
+        return -1;
+
+    return tile->p[c];
+}
+
+/**
+ * @brief Gets the time stamp under which cells are considered as expired at a given time.
+ */
+uint32_t Grid::expiryStamp(const ros::Time& t) const
+{
+    if (t.toSec() <= m_ttl.toSec())
+        return 0;
+    return toStamp(t - m_ttl);
+}
+
+/**
+ * @brief Constructor, see Grid::at().
+ *
+ * @param grid The viewed Grid.
+ * @param minStamp The time stamp under which cells are considered as expired.
+ */
+Grid::View::View(Grid *grid, uint32_t minStamp):
+    m_grid(grid), m_minStamp(minStamp)
+{
+}
+
+/**
+ * @brief Gets the obstacle probability at a given point.
+ *
+ * @param x The x-coordinate of the point in the real world.
+ * @param y The y-coordinate of the point in the real world.
+ * @return The obstacle probability  at this point, between 0 and 1, negative means unknown or expired.
+ */
+double Grid::View::get(double x, double y) const
+{
+    return m_grid->_get(m_grid->toGridCoord(x), m_grid->toGridCoord(y), m_minStamp);
+}
+
+/**
+ * @brief Standard constructor.
+ *
+ * Creates an empty Grid mapped at specified coordinates in the real world.
+ *
+ * @param precision The precision of the discretization, in m / unit.
+ * @param ttl The Time To Live of a point in the Grid.
+ * @param minX The x-coordinate of the upper-left corner of the Grid in the real world.
+ * @param maxX The x-coordinate of the lower-right corner of the Grid in the real world.
+ * @param minY The y-coordinate of the upper-left corner of the Grid in the real world.
+ * @param maxY The y-coordinate of the lower-right corner of the Grid in the real world.
+ * @param resizeable True if the grid can grow beyond these coordinates to integrate new points.
+ */
+Grid::Grid(double precision, ros::Duration ttl, double minX, double maxX, double minY, double maxY, bool resizeable):
+    m_precision(precision), m_ttl(ttl), m_version(0), m_resizeable(resizeable), m_maxDistance(0)
+{
+    init(minX, maxX, minY, maxY);
+}
+
+/**
+ * @brief Copy constructor.
+ *
+ * Creates an EMPTY Grid with the same settings as the one provided, the distance layer included.
+ *
+ * @param grid The Grid to copy.
+ */
+Grid::Grid(const Grid& grid):
+    m_precision(grid.m_precision), m_ttl(grid.m_ttl), m_version(0), m_resizeable(grid.m_resizeable), m_maxDistance(grid.m_maxDistance)
+{
+    init(grid.minX(), grid.m_maxIx * grid.m_precision, grid.minY(), grid.m_maxIy * grid.m_precision);
+}
+
+/**
+ * @brief Assignment operator.
+ *
+ * Empties the Grid and assigns the same settings as the one provided. The Grid is EMPTY after the operation and needs to be filled again.
+ *
+ * @param grid The Grid to copy.
+ * @return This Grid.
+ */
+Grid& Grid::operator=(const Grid& grid)
+{
+    if (&grid == this)
+        return *this;
+    empty();
+    m_precision = grid.m_precision;
+    m_ttl = grid.m_ttl;
+    m_resizeable = grid.m_resizeable;
+    m_maxDistance = grid.m_maxDistance;
+    init(grid.minX(), grid.m_maxIx * grid.m_precision, grid.minY(), grid.m_maxIy * grid.m_precision);
+    return *this;
+}
+
+/**
+ * @brief Destructor.
+ *
+ * Frees internal storage.
+ */
+Grid::~Grid()
+{
+    empty();
+}
+
+/**
+ * @brief Gets the Grid precision, in m / unit.
+ */
+double Grid::precision() const
+{
+    return m_precision;
+}
+
+/**
+ * @brief Gets x-coordinate of the upper-left corner of the Grid in the real world.
+ */
+double Grid::minX() const
+{
+    return m_minIx * m_precision;
+}
+
+/**
+ * @brief Gets y-coordinate of the upper-left corner of the Grid in the real world.
+ */
+double Grid::minY() const
+{
+    return m_minIy * m_precision;
+}
+
+/**
+ * @brief Gets the width of the Grid, in Grid units.
+ */
+int Grid::width() const
+{
+    return m_maxIx - m_minIx + 1;
+}
+
+/**
+ * @brief Gets the height of the Grid, in Grid units.
+ */
+int Grid::height() const
+{
+    return m_maxIy - m_minIy + 1;
+}
+
+/**
+ * @brief Gets the number of allocated tiles.
+ */
+size_t Grid::nbTiles() const
+{
+    return m_tiles.size();
+}
+
+/**
+ * @brief Adds a new point in the Grid.
+ *
+ * @param x The x-coordinate of the point in the real world.
+ * @param y The y-coordinate of the point in the real world.
+ * @param t The time stamp of the point.
+ * @param p The obstacle probability  at this point.
+ * @return True if the point was successfully added.
+ */
+bool Grid::addPoint(double x, double y, ros::Time t, double p)
+{
+    ProbabilisticPoint point = {x, y, t, p};
+    return addPoint(point);
+}
+
+/**
+ * @brief Adds a new point in the Grid.
+ *
+ * If the cell was already updated with the same time stamp, both probabilities are combined.
+ *
+ * @param point The point to add, with coordinates expressed in the real world.
+ * @return True if the point was successfully added.
+ */
+bool Grid::addPoint(ProbabilisticPoint point)
+{
+    int ix = toGridCoord(point.x);
+    int iy = toGridCoord(point.y);
+
+    //ROS_INFO("Add point to grid at (%d, %d)", ix, iy);
+
+    if (ix < m_minIx || ix > m_maxIx || iy < m_minIy || iy > m_maxIy)
+    {
+        //ROS_INFO("Out of grid: (%d, %d)", ix, iy);
+        if (!m_resizeable)
+            return false;
+
+        // Only the extent changes, existing tiles stay where they are.
+        m_minIx = std::min(m_minIx, ix);
+        m_maxIx = std::max(m_maxIx, ix);
+        m_minIy = std::min(m_minIy, iy);
+        m_maxIy = std::max(m_maxIy, iy);
+    }
+
+    int tx = tileCoord(ix);
+    int ty = tileCoord(iy);
+    Tile *tile = getTile(tx, ty);
+    int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+    setDirty(tile, tx, ty);
+
+    if (m_epoch.isZero())
+        m_epoch = point.t;
+    uint32_t stamp = toStamp(point.t);
+
+    bool wasObstacle = isObstacle(tile, c);
+    if (!isKnown(tile, c))
+        setKnown(tile, c);
+    else if (stamp == tile->t[c])
+        point.p = 1 - (1-point.p)*(1-tile->p[c]);
+    tile->p[c] = point.p;
+    tile->t[c] = stamp;
+    if (isObstacle(tile, c) != wasObstacle)
+        distanceChanged(ix, iy);
+
+    //ROS_INFO("Added to grid");
+    return true;
+}
+
+/**
+ * @brief Fuses a whole axis-aligned patch of occupancy values into the Grid.
+ *
+ * This is equivalent to calling addPoint() for every known cell of the patch, but works one tile row at a time
+ * instead of rounding, bounds-checking and looking up a tile for every cell.
+ * The patch cell (x, y) is fused into the grid cell (offsetX + x / ratio, offsetY + y / ratio).
+ *
+ * @param data The patch, as occupancy values in [0, 100] (negative means unknown) arranged in row-major order.
+ * @param width The width of the patch (patch units).
+ * @param height The height of the patch (patch units).
+ * @param offsetX The grid x-coordinate of the first column of the patch.
+ * @param offsetY The grid y-coordinate of the first row of the patch.
+ * @param ratio The number of patch units per grid unit, at least 1.
+ * @param t The time stamp of the patch.
+ * @return True if at least a part of the patch lies in the Grid, always true for a resizeable Grid.
+ */
+bool Grid::blendPatch(const int8_t *data, int width, int height, int offsetX, int offsetY, int ratio, ros::Time t)
+{
+    if (ratio < 1 || width <= 0 || height <= 0)
+        return false;
+
+    // Range of patch columns and rows which lie in the grid.
+    int xStart = 0, xEnd = width;
+    int yStart = 0, yEnd = height;
+    if (!m_resizeable)
+    {
+        int maxIx = offsetX + (width - 1) / ratio;
+        int maxIy = offsetY + (height - 1) / ratio;
+        if (offsetX > m_maxIx || maxIx < m_minIx || offsetY > m_maxIy || maxIy < m_minIy)
+            return false;
+        xStart = std::max(0, (m_minIx - offsetX) * ratio);
+        xEnd = std::min(width, (m_maxIx - offsetX + 1) * ratio);
+        yStart = std::max(0, (m_minIy - offsetY) * ratio);
+        yEnd = std::min(height, (m_maxIy - offsetY + 1) * ratio);
+    }
+
+    if (m_epoch.isZero())
+        m_epoch = t;
+    const uint32_t stamp = toStamp(t);
+
+    // Patch columns [knownXStart, knownXEnd[ and rows [knownYStart, knownYEnd[ hold the known cells written.
+    int knownXStart = xEnd, knownXEnd = xStart;
+    int knownYStart = yEnd, knownYEnd = yStart;
+
+    for (int y=yStart ; y < yEnd ; y++)
+    {
+        const int8_t *row = data + y * width;
+        int iy = offsetY + y / ratio;
+        int ty = tileCoord(iy);
+
+        for (int x=xStart ; x < xEnd ; )
+        {
+            // Patch columns [x, runEnd[ fall into the same tile.
+            int tx = tileCoord(offsetX + x / ratio);
+            int runEnd = std::min(xEnd, ((tx+1)*TILE_SIZE - offsetX) * ratio);
+            const int8_t *src = row + x;
+            int n = runEnd - x;
+
+            Tile *tile = findTile(tx, ty);
+            if (tile == NULL)
+            {
+                // Do not allocate a tile for a run of unknown cells.
+                int i = 0;
+                while (i < n && src[i] < 0)
+                    i++;
+                if (i == n)
+                {
+                    x = runEnd;
+                    continue;
+                }
+                tile = getTile(tx, ty);
+            }
+            setDirty(tile, tx, ty);
+
+            int first = (iy - ty*TILE_SIZE) * TILE_SIZE + offsetX + x / ratio - tx*TILE_SIZE;
+            int knownBegin = n, knownEnd = 0;
+            if (ratio == 1)
+            {
+                // A run holds at most TILE_SIZE cells, their obstacle states fit in a 64-bit mask.
+                uint64_t wasObstacle = 0;
+                if (m_maxDistance > 0)
+                {
+                    for (int i=0 ; i < n ; i++)
+                        wasObstacle |= (uint64_t)isObstacle(tile, first + i) << i;
+                }
+
+                // Branch-free loop over contiguous cells, which the compiler can vectorize.
+                float *p = tile->p + first;
+                uint32_t *ts = tile->t + first;
+                for (int i=0 ; i < n ; i++)
+                {
+                    float q = src[i] * 0.01f;
+                    float blended = ts[i] == stamp ? 1 - (1-q)*(1-p[i]) : q;
+                    bool known = src[i] >= 0;
+                    p[i] = known ? blended : p[i];
+                    ts[i] = known ? stamp : ts[i];
+                }
+                for (int i=0 ; i < n ; i++)
+                {
+                    if (src[i] >= 0)
+                    {
+                        setKnown(tile, first + i);
+                        knownBegin = std::min(knownBegin, i);
+                        knownEnd = i + 1;
+                    }
+                }
+
+                if (m_maxDistance > 0)
+                {
+                    for (int i=0 ; i < n ; i++)
+                    {
+                        if (isObstacle(tile, first + i) != (bool)((wasObstacle >> i) & 1))
+                            distanceChanged(offsetX + x + i, iy);
+                    }
+                }
+            }
+            else
+            {
+                // Several patch cells fall into each grid cell, they are combined as if added one by one.
+                for (int i=0 ; i < n ; i++)
+                {
+                    if (src[i] < 0)
+                        continue;
+                    int c = first + (x + i) / ratio - x / ratio;
+                    bool wasObstacle = isObstacle(tile, c);
+                    float q = src[i] * 0.01f;
+                    tile->p[c] = tile->t[c] == stamp ? 1 - (1-q)*(1-tile->p[c]) : q;
+                    tile->t[c] = stamp;
+                    setKnown(tile, c);
+                    knownBegin = std::min(knownBegin, i);
+                    knownEnd = i + 1;
+                    if (isObstacle(tile, c) != wasObstacle)
+                        distanceChanged(offsetX + (x + i) / ratio, iy);
+                }
+            }
+            if (knownBegin < knownEnd)
+            {
+                knownXStart = std::min(knownXStart, x + knownBegin);
+                knownXEnd = std::max(knownXEnd, x + knownEnd);
+                knownYStart = std::min(knownYStart, y);
+                knownYEnd = y + 1;
+            }
+            x = runEnd;
+        }
+    }
+
+    if (m_resizeable && knownXStart < knownXEnd)
+    {
+        // As in addPoint(), only the extent changes, and only over the known cells: unknown borders leave it as is.
+        m_minIx = std::min(m_minIx, offsetX + knownXStart / ratio);
+        m_maxIx = std::max(m_maxIx, offsetX + (knownXEnd - 1) / ratio);
+        m_minIy = std::min(m_minIy, offsetY + knownYStart / ratio);
+        m_maxIy = std::max(m_maxIy, offsetY + (knownYEnd - 1) / ratio);
+    }
+    return true;
+}
+
+/**
+ * @brief Gets the obstacle probability at a given point.
+ *
+ * @param x The x-coordinate of the point in the real world.
+ * @param y The y-coordinate of the point in the real world.
+ * @return The obstacle probability  at this point, between 0 and 1, negative means unknown.
+ */
+double Grid::get(double x, double y)
+{
+    return _get(toGridCoord(x), toGridCoord(y), expiryStamp(ros::Time::now()));
+}
+
+/**
+ * @brief Creates a View of the Grid at a given time.
+ *
+ * The expiry of the cells is computed once for all the reads done through the View,
+ * which should be preferred to get() when reading many points.
+ *
+ * @param t The time at which the Grid is seen, usually ros::Time::now().
+ * @return The View, valid as long as the Grid exists.
+ */
+Grid::View Grid::at(const ros::Time& t)
+{
+    return View(this, expiryStamp(t));
+}
+
+/**
+ * @brief Removes cells older than the Time To Live of the Grid, a few tiles at a time.
+ *
+ * Successive calls go through all the tiles in turn, and tiles left without any known cell are freed,
+ * so that the memory used by the Grid stays bounded. Modified tiles are reported by popDirtyTiles().
+ * This is also when expired obstacles are removed from the distance layer.
+ *
+ * @param t The current time.
+ * @param maxTiles The maximum number of tiles to check during this call.
+ * @return The number of freed tiles.
+ */
+int Grid::expire(const ros::Time& t, int maxTiles)
+{
+    uint32_t minStamp = expiryStamp(t);
+    int freed = 0;
+    for (int n=0 ; n < maxTiles ; n++)
+    {
+        if (m_sweepQueue.empty())
+        {
+            // Start a new sweep, new tiles will be checked during the next one.
+            if (m_tiles.empty())
+                break;
+            for (TileMap::const_iterator it = m_tiles.begin() ; it != m_tiles.end() ; it++)
+                m_sweepQueue.push_back(it->first);
+        }
+        uint64_t key = m_sweepQueue.back();
+        m_sweepQueue.pop_back();
+        TileMap::iterator it = m_tiles.find(key);
+        if (it == m_tiles.end())
+            continue;
+
+        Tile *tile = it->second;
+        int tx = (int32_t)(key >> 32);
+        int ty = (int32_t)(key & 0xffffffff);
+        bool empty = true;
+        for (int w=0 ; w < TILE_CELLS / 32 ; w++)
+        {
+            uint32_t known = tile->known[w];
+            for (int b=0 ; known != 0 && b < 32 ; b++)
+            {
+                if (!((known >> b) & 1))
+                    continue;
+                int c = w*32 + b;
+                if (tile->t[c] >= minStamp)
+                    continue;
+                known &= ~(1u << b);
+                if (tile->p[c] >= OBSTACLE)
+                    distanceChanged(tx*TILE_SIZE + c % TILE_SIZE, ty*TILE_SIZE + c / TILE_SIZE);
+                tile->p[c] = 0;
+                tile->t[c] = 0;
+                setDirty(tile, tx, ty);
+            }
+            tile->known[w] = known;
+            empty = empty && known == 0;
+        }
+
+        if (empty)
+        {
+            setDirty(tile, tx, ty);
+            if (m_lastTile == tile)
+                m_lastTile = NULL;
+            delete tile;
+            m_tiles.erase(it);
+            freed++;
+        }
+    }
+    return freed;
+}
+
+/**
+ * @brief Gets obstacle probabilities for all points in the Grid.
+ *
+ * Only the allocated tiles are visited, the rest of the Grid is reported as unknown.
+ *
+ * @param width Pointer to a variable which will receive the width of the Grid in Grid units, can be NULL.
+ * @param height Pointer to a variable which will receive the height of the Grid in Grid units, can be NULL.
+ * @param scale Pointer to a variable which will receive the scale of the grid in m / unit, can be NULL.
+ * @return Pointer to newly allocated data (must be freed with delete[] when not needed anymore) containing the obstacles probabilities
+ * (between 0 and 1, negative means unknown) as a 1D array arranged in column-major order.
+ */
+double* Grid::getAll(int* width, int *height, double *scale) const
+{
+    int w = m_maxIx - m_minIx + 1;
+    int h = m_maxIy - m_minIy + 1;
+    double *data = new double[w*h];
+    if (data == NULL)
+    {
+        ROS_ERROR("Unable to create double array (%dx%d)", w, h);
+        return NULL;
+    }
+    fillAll(data, -1.0, 1.0f, 0.0f);
+
+    if (width != NULL)
+        *width = w;
+    if (height != NULL)
+        *height = h;
+    if (scale != NULL)
+        *scale = m_precision;
+    return data;
+}
+
+/**
+ * @brief Gets occupancy values for all points in the Grid.
+ *
+ * Same as getAll(int*, int*, double*), with probabilities quantized as in nav_msgs::OccupancyGrid messages.
+ *
+ * @param data A vector which will receive the occupancy values (between 0 and 100, -1 means unknown) arranged in column-major order.
+ * @param width Pointer to a variable which will receive the width of the Grid in Grid units, can be NULL.
+ * @param height Pointer to a variable which will receive the height of the Grid in Grid units, can be NULL.
+ * @param scale Pointer to a variable which will receive the scale of the grid in m / unit, can be NULL.
+ */
+void Grid::getAll(std::vector<int8_t>& data, int* width, int *height, double *scale) const
+{
+    int w = m_maxIx - m_minIx + 1;
+    int h = m_maxIy - m_minIy + 1;
+    data.resize(w*h);
+    fillAll(&data[0], (int8_t)-1, 100.0f, 0.5f);
+
+    if (width != NULL)
+        *width = w;
+    if (height != NULL)
+        *height = h;
+    if (scale != NULL)
+        *scale = m_precision;
+}
+
+/**
+ * @brief Copies the probabilities of all points in the Grid to an array arranged in column-major order.
+ *
+ * Only the allocated tiles are visited, the rest of the Grid is reported as unknown.
+ *
+ * @param data The array, which should contain width() * height() values.
+ * @param unknown The value of the unknown cells.
+ * @param factor The factor applied to the probabilities.
+ * @param offset The offset added to the probabilities after applying the factor, before converting them to T.
+ */
+template <typename T>
+void Grid::fillAll(T *data, T unknown, float factor, float offset) const
+{
+    int h = m_maxIy - m_minIy + 1;
+    std::fill(data, data + (m_maxIx - m_minIx + 1)*h, unknown);
+
+    for (TileMap::const_iterator it = m_tiles.begin() ; it != m_tiles.end() ; it++)
+    {
+        const Tile *tile = it->second;
+        int x0 = (int32_t)(it->first >> 32) * TILE_SIZE;
+        int y0 = (int32_t)(it->first & 0xffffffff) * TILE_SIZE;
+        int xStart = std::max(x0, m_minIx), xEnd = std::min(x0 + TILE_SIZE - 1, m_maxIx);
+        int yStart = std::max(y0, m_minIy), yEnd = std::min(y0 + TILE_SIZE - 1, m_maxIy);
+        for (int ix=xStart ; ix <= xEnd ; ix++)
+        {
+            T *column = data + (ix - m_minIx) * h - m_minIy;
+            for (int iy=yStart ; iy <= yEnd ; iy++)
+            {
+                int c = (iy - y0) * TILE_SIZE + ix - x0;
+                if (isKnown(tile, c))
+                    column[iy] = (T)(tile->p[c] * factor + offset);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Gets the tiles which have been modified since the last call, and resets the tracking.
+ *
+ * @param tiles A vector which will receive the coordinates of the tiles, any previous content is removed.
+ * @param all True to get all the allocated tiles instead of only the modified ones.
+ */
+void Grid::popDirtyTiles(std::vector<TileCoord>& tiles, bool all)
+{
+    tiles.clear();
+    if (all)
+    {
+        tiles.reserve(m_tiles.size());
+        for (TileMap::const_iterator it = m_tiles.begin() ; it != m_tiles.end() ; it++)
+        {
+            TileCoord coord = {(int32_t)(it->first >> 32), (int32_t)(it->first & 0xffffffff)};
+            tiles.push_back(coord);
+            it->second->dirty = false;
+        }
+    }
+    else
+    {
+        tiles.reserve(m_dirtyTiles.size());
+        for (size_t i=0 ; i < m_dirtyTiles.size() ; i++)
+        {
+            TileCoord coord = {(int32_t)(m_dirtyTiles[i] >> 32), (int32_t)(m_dirtyTiles[i] & 0xffffffff)};
+            tiles.push_back(coord);
+            // Tiles removed by expire() are reported too, they are now fully unknown.
+            TileMap::iterator it = m_tiles.find(m_dirtyTiles[i]);
+            if (it != m_tiles.end())
+                it->second->dirty = false;
+        }
+    }
+    m_dirtyTiles.clear();
+}
+
+/**
+ * @brief Gets the quantized obstacle probabilities of a tile.
+ *
+ * Probabilities are stored as round(p * QUANTIZED_MAX), unknown cells (or cells of a tile which was never allocated) as QUANTIZED_UNKNOWN.
+ *
+ * @param tx The x-coordinate of the tile, its first cell has grid coordinates (tx * TILE_SIZE, ty * TILE_SIZE).
+ * @param ty The y-coordinate of the tile.
+ * @param data An array of TILE_CELLS values which will receive the probabilities, arranged in row-major order.
+ */
+void Grid::getQuantizedTile(int tx, int ty, uint8_t *data) const
+{
+    TileMap::const_iterator it = m_tiles.find(tileKey(tx, ty));
+    if (it == m_tiles.end())
+    {
+        memset(data, QUANTIZED_UNKNOWN, TILE_CELLS);
+        return;
+    }
+
+    const Tile *tile = it->second;
+    for (int c=0 ; c < TILE_CELLS ; c++)
+        data[c] = isKnown(tile, c) ? (uint8_t)(tile->p[c] * QUANTIZED_MAX + 0.5f) : QUANTIZED_UNKNOWN;
+}
+
+/**
+ * @brief Sets the obstacle probabilities of a tile from quantized values, the reverse of getQuantizedTile().
+ *
+ * The extent of the Grid is not changed. Cells set to QUANTIZED_UNKNOWN become unknown, but the tile stays allocated.
+ *
+ * @param tx The x-coordinate of the tile, its first cell has grid coordinates (tx * TILE_SIZE, ty * TILE_SIZE).
+ * @param ty The y-coordinate of the tile.
+ * @param data An array of TILE_CELLS quantized probabilities, arranged in row-major order.
+ * @param t The time stamp of the known cells.
+ */
+void Grid::setQuantizedTile(int tx, int ty, const uint8_t *data, ros::Time t)
+{
+    Tile *tile = findTile(tx, ty);
+    if (tile == NULL)
+    {
+        // Do not allocate a tile which would stay fully unknown.
+        int c = 0;
+        while (c < TILE_CELLS && data[c] == QUANTIZED_UNKNOWN)
+            c++;
+        if (c == TILE_CELLS)
+            return;
+        tile = getTile(tx, ty);
+    }
+    setDirty(tile, tx, ty);
+
+    if (m_epoch.isZero())
+        m_epoch = t;
+    const uint32_t stamp = toStamp(t);
+
+    for (int c=0 ; c < TILE_CELLS ; c++)
+    {
+        bool wasObstacle = isObstacle(tile, c);
+        if (data[c] == QUANTIZED_UNKNOWN)
+        {
+            tile->known[c >> 5] &= ~(1u << (c & 31));
+            tile->p[c] = 0;
+            tile->t[c] = 0;
+        }
+        else
+        {
+            tile->p[c] = data[c] / (float)QUANTIZED_MAX;
+            tile->t[c] = stamp;
+            setKnown(tile, c);
+        }
+        if (isObstacle(tile, c) != wasObstacle)
+            distanceChanged(tx*TILE_SIZE + c % TILE_SIZE, ty*TILE_SIZE + c / TILE_SIZE);
+    }
+}
+
+/**
+ * @brief Gets the coordinates of the tile containing a given point.
+ *
+ * @param x The x-coordinate of the point in the real world.
+ * @param y The y-coordinate of the point in the real world.
+ */
+Grid::TileCoord Grid::tileAt(double x, double y) const
+{
+    TileCoord coord = {tileCoord(toGridCoord(x)), tileCoord(toGridCoord(y))};
+    return coord;
+}
+
+/**
+ * @brief Gets the version of a tile, which changes each time one of its cells is modified.
+ *
+ * Unlike popDirtyTiles(), this does not reset anything, so that several readers can follow the changes of the Grid,
+ * each one by remembering the versions it has already seen.
+ *
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ * @return The version of the tile, 0 if it is not allocated.
+ */
+uint32_t Grid::tileVersion(int tx, int ty) const
+{
+    TileMap::const_iterator it = m_tiles.find(tileKey(tx, ty));
+    return it == m_tiles.end() ? 0 : it->second->version;
+}
+
+/**
+ * @brief Draws the Grid on an SDL Surface.
+ *
+ * The surface is drawn row by row, walking the cells of the tiles overlapping each row of pixels. Colors come from a lookup table
+ * of quantized probabilities and are written directly to the pixels of 32-bit surfaces.
+ *
+ * @param w The surface's width.
+ * @param h The surface's height.
+ * @param minX The real world x-coordinate of the point which should be mapped to the surface's upper-left pixel.
+ * @param maxX The real world x-coordinate of the point which should be mapped to the surface's lower-right pixel.
+ * @param minY The real world y-coordinate of the point which should be mapped to the surface's upper-left pixel.
+ * @param maxY The real world y-coordinate of the point which should be mapped to the surface's lower-right pixel.
+ * @param surf The surface to draw on, can be NULL, in this case it will be created (deletion is caller's job - see SDL_FreeSurface()).
+ * @param filter How to draw a pixel covering several cells, when zoomed out.
+ * @return The surface with the Grid drawn on it.
+ */
+SDL_Surface* Grid::draw(int w, int h, double minX, double maxX, double minY, double maxY, SDL_Surface *surf, DrawFilter filter)
+{
+    //ROS_INFO("Drawing grid");
+    if (surf == NULL)
+        surf = SDL_CreateRGBSurface(SDL_HWSURFACE, w, h, 32,0,0,0,0);
+    if (surf == NULL)
+        return NULL;
+
+    // Colors of the unknown cells and of the probabilities quantized from 0 to 255.
+    Uint32 background = SDL_MapRGB(surf->format, 200, 200, 255);
+    Uint32 colors[256];
+    for (int i=0 ; i < 256 ; i++)
+        colors[i] = SDL_MapRGB(surf->format, 255, 255-i, 255-i);
+
+    // Grid coordinates of the edges of each column and row of pixels, columns go increasing and rows decreasing.
+    std::vector<int> ixEdge(w+1), iyEdge(h+1);
+    for (int x=0 ; x <= w ; x++)
+        ixEdge[x] = toGridCoord(x * (maxX-minX) / w + minX);
+    for (int y=0 ; y <= h ; y++)
+        iyEdge[y] = toGridCoord((h-y) * (maxY-minY) / h + minY);
+    if ((maxX-minX) / w <= m_precision && (maxY-minY) / h <= m_precision)
+        filter = DRAW_NEAREST;
+    uint32_t minStamp = expiryStamp(ros::Time::now());
+
+    // 32-bit surfaces are written directly, others through a line buffer.
+    bool direct = surf->format->BytesPerPixel == 4;
+    std::vector<Uint32> buffer(direct ? 0 : w);
+    std::vector<int> sum(filter == DRAW_BOX ? w : 0), count(filter == DRAW_BOX ? w : 0);
+
+    //ROS_INFO("Surface created");
+    SDL_LockSurface(surf);
+    for (int y=0 ; y < h ; y++)
+    {
+        Uint32 *line = direct ? (Uint32*)((Uint8*)surf->pixels + y * surf->pitch) : &buffer[0];
+
+        if (filter == DRAW_NEAREST)
+        {
+            int iy = iyEdge[y];
+            int ty = tileCoord(iy);
+            int rowOffset = (iy - ty*TILE_SIZE) * TILE_SIZE;
+            for (int x=0 ; x < w ; )
+            {
+                // Pixels [x, end[ fall into the same tile.
+                int tx = tileCoord(ixEdge[x]);
+                int end = x;
+                while (end < w && ixEdge[end] < (tx+1)*TILE_SIZE)
+                    end++;
+                const Tile *tile = findTile(tx, ty);
+                if (tile == NULL)
+                {
+                    std::fill(line + x, line + end, background);
+                    x = end;
+                    continue;
+                }
+                for ( ; x < end ; x++)
+                {
+                    int c = rowOffset + ixEdge[x] - tx*TILE_SIZE;
+                    bool valid = isKnown(tile, c) && tile->t[c] >= minStamp;
+                    line[x] = valid ? colors[(int)(tile->p[c] * 255 + 0.5f)] : background;
+                }
+            }
+        }
+        else
+        {
+            // Average of the valid cells covered by each pixel.
+            std::fill(sum.begin(), sum.end(), 0);
+            std::fill(count.begin(), count.end(), 0);
+            for (int iy=std::min(iyEdge[y], iyEdge[y+1]+1) ; iy <= iyEdge[y] ; iy++)
+            {
+                int ty = tileCoord(iy);
+                int rowOffset = (iy - ty*TILE_SIZE) * TILE_SIZE;
+                for (int x=0 ; x < w ; x++)
+                {
+                    int ixEnd = std::max(ixEdge[x], ixEdge[x+1]-1);
+                    for (int ix=ixEdge[x] ; ix <= ixEnd ; ix++)
+                    {
+                        int tx = tileCoord(ix);
+                        const Tile *tile = findTile(tx, ty);
+                        if (tile == NULL)
+                        {
+                            ix = (tx+1)*TILE_SIZE - 1;
+                            continue;
+                        }
+                        int c = rowOffset + ix - tx*TILE_SIZE;
+                        if (isKnown(tile, c) && tile->t[c] >= minStamp)
+                        {
+                            sum[x] += (int)(tile->p[c] * 255 + 0.5f);
+                            count[x]++;
+                        }
+                    }
+                }
+            }
+            for (int x=0 ; x < w ; x++)
+                line[x] = count[x] > 0 ? colors[sum[x] / count[x]] : background;
+        }
+
+        if (!direct)
+        {
+            for (int x=0 ; x < w ; x++)
+                putPixel(surf, x, y, line[x], false);
+        }
+    }
+    SDL_UnlockSurface(surf);
+
+    //ROS_INFO("Grid drawn");
+    return surf;
+}
+
+
+/**
+ * @brief Orders the entries of the brushfire queue, the heap gives the closest cell first.
+ */
+bool Grid::DistanceEntry::operator<(const DistanceEntry& entry) const
+{
+    return d > entry.d;
+}
+
+/**
+ * @brief Enables the distance layer, which maintains the distance from each cell to the closest obstacle.
+ *
+ * Obstacles are the known cells with a probability of at least OBSTACLE. Cells which have expired but have not yet been
+ * removed by expire() are still considered as obstacles. The distances of the current obstacles are computed by the next
+ * call to updateDistances(), then only the changes of the Grid are propagated.
+ *
+ * @param maxDistance The maximum distance maintained (m), cells farther from any obstacle only know that they are. 0 disables the layer.
+ */
+void Grid::enableDistances(double maxDistance)
+{
+    emptyDistances();
+    m_maxDistance = std::max(0.0, maxDistance / m_precision);
+    if (m_maxDistance <= 0)
+        return;
+
+    for (TileMap::const_iterator it = m_tiles.begin() ; it != m_tiles.end() ; it++)
+    {
+        int x0 = (int32_t)(it->first >> 32) * TILE_SIZE;
+        int y0 = (int32_t)(it->first & 0xffffffff) * TILE_SIZE;
+        for (int c=0 ; c < TILE_CELLS ; c++)
+        {
+            if (isObstacle(it->second, c))
+                distanceChanged(x0 + c % TILE_SIZE, y0 + c / TILE_SIZE);
+        }
+    }
+}
+
+/**
+ * @brief Tells if the distance layer is enabled (see enableDistances()).
+ */
+bool Grid::hasDistances() const
+{
+    return m_maxDistance > 0;
+}
+
+/**
+ * @brief Gets the maximum distance maintained by the distance layer (m), 0 if it is disabled.
+ */
+double Grid::maxDistance() const
+{
+    return m_maxDistance * m_precision;
+}
+
+/**
+ * @brief Records a cell whose obstacle state changed, for the next distances update.
+ *
+ * @param ix The x-coordinate of the cell.
+ * @param iy The y-coordinate of the cell.
+ */
+void Grid::distanceChanged(int ix, int iy)
+{
+    if (m_maxDistance > 0)
+        m_distanceChanges.push_back(tileKey(ix, iy));
+}
+
+/**
+ * @brief Looks up a distance tile.
+ *
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ * @return The distance tile, or NULL if none of its cells has an obstacle within the maximum distance.
+ */
+Grid::DistanceTile* Grid::findDistanceTile(int tx, int ty)
+{
+    uint64_t key = tileKey(tx, ty);
+    if (m_lastDistanceTile != NULL && key == m_lastDistanceKey)
+        return m_lastDistanceTile;
+
+    DistanceTileMap::const_iterator it = m_distanceTiles.find(key);
+    if (it == m_distanceTiles.end())
+        return NULL;
+    m_lastDistanceKey = key;
+    m_lastDistanceTile = it->second;
+    return m_lastDistanceTile;
+}
+
+/**
+ * @brief Looks up a distance tile, allocating it if needed.
+ *
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ * @return The distance tile.
+ */
+Grid::DistanceTile* Grid::getDistanceTile(int tx, int ty)
+{
+    DistanceTile *tile = findDistanceTile(tx, ty);
+    if (tile != NULL)
+        return tile;
+
+    tile = new DistanceTile;
+    std::fill(tile->d, tile->d + TILE_CELLS, std::numeric_limits<float>::infinity());
+    std::fill(tile->obstacleX, tile->obstacleX + TILE_CELLS, NO_OBSTACLE);
+    std::fill(tile->obstacleY, tile->obstacleY + TILE_CELLS, 0);
+    memset(tile->raise, 0, sizeof(tile->raise));
+    tile->nbSet = 0;
+    m_lastDistanceKey = tileKey(tx, ty);
+    m_lastDistanceTile = tile;
+    m_distanceTiles[m_lastDistanceKey] = tile;
+    return tile;
+}
+
+/**
+ * @brief Tells if a cell is an obstacle in the distance layer, which is its own closest obstacle.
+ *
+ * @param ix The x-coordinate of the cell.
+ * @param iy The y-coordinate of the cell.
+ */
+bool Grid::isDistanceObstacle(int ix, int iy)
+{
+    int tx = tileCoord(ix);
+    int ty = tileCoord(iy);
+    DistanceTile *tile = findDistanceTile(tx, ty);
+    if (tile == NULL)
+        return false;
+    int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+    return tile->obstacleX[c] == ix && tile->obstacleY[c] == iy;
+}
+
+/**
+ * @brief Sets the closest obstacle of a cell.
+ *
+ * @param tile The distance tile containing the cell.
+ * @param c The index of the cell in the tile.
+ * @param ox The x-coordinate of the obstacle.
+ * @param oy The y-coordinate of the obstacle.
+ * @param d The distance between the cell and the obstacle (units).
+ */
+void Grid::setClosestObstacle(DistanceTile *tile, int c, int ox, int oy, float d)
+{
+    if (tile->obstacleX[c] == NO_OBSTACLE)
+        tile->nbSet++;
+    tile->obstacleX[c] = ox;
+    tile->obstacleY[c] = oy;
+    tile->d[c] = d;
+}
+
+/**
+ * @brief Removes the closest obstacle of a cell, the distance tile is freed at the end of the update if it has no closest obstacle left.
+ *
+ * @param tile The distance tile containing the cell.
+ * @param c The index of the cell in the tile.
+ * @param tx The x-coordinate of the tile.
+ * @param ty The y-coordinate of the tile.
+ */
+void Grid::clearClosestObstacle(DistanceTile *tile, int c, int tx, int ty)
+{
+    if (tile->obstacleX[c] == NO_OBSTACLE)
+        return;
+    if (--tile->nbSet == 0)
+        m_freedDistanceTiles.push_back(tileKey(tx, ty));
+    tile->obstacleX[c] = NO_OBSTACLE;
+    tile->d[c] = std::numeric_limits<float>::infinity();
+}
+
+/**
+ * @brief Adds a cell to the queue of the brushfire.
+ */
+void Grid::pushDistance(float d, int ix, int iy)
+{
+    DistanceEntry entry = {d, ix, iy};
+    m_distanceQueue.push_back(entry);
+    std::push_heap(m_distanceQueue.begin(), m_distanceQueue.end());
+}
+
+/**
+ * @brief Propagates the closest obstacle of a cell to its neighbours which are farther from any obstacle.
+ *
+ * @param ix The x-coordinate of the cell.
+ * @param iy The y-coordinate of the cell.
+ * @param ox The x-coordinate of the closest obstacle of the cell.
+ * @param oy The y-coordinate of the closest obstacle of the cell.
+ */
+void Grid::lowerDistances(int ix, int iy, int ox, int oy)
+{
+    for (int ny=iy-1 ; ny <= iy+1 ; ny++)
+    {
+        for (int nx=ix-1 ; nx <= ix+1 ; nx++)
+        {
+            float dx = nx - ox, dy = ny - oy;
+            float d = sqrtf(dx*dx + dy*dy);
+            if (d > m_maxDistance)
+                continue;
+
+            int tx = tileCoord(nx);
+            int ty = tileCoord(ny);
+            DistanceTile *tile = getDistanceTile(tx, ty);
+            int c = (ny - ty*TILE_SIZE) * TILE_SIZE + nx - tx*TILE_SIZE;
+            if ((tile->raise[c >> 5] >> (c & 31)) & 1)
+                continue;
+            if (d < tile->d[c])
+            {
+                setClosestObstacle(tile, c, ox, oy, d);
+                pushDistance(d, nx, ny);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Removes the closest obstacles of the neighbours of a cell when they are not obstacles anymore, and queues the
+ * neighbours which still have an obstacle so that they propagate it to the cleared cells.
+ *
+ * @param ix The x-coordinate of the cell, whose closest obstacle was removed.
+ * @param iy The y-coordinate of the cell.
+ */
+void Grid::raiseDistances(int ix, int iy)
+{
+    for (int ny=iy-1 ; ny <= iy+1 ; ny++)
+    {
+        for (int nx=ix-1 ; nx <= ix+1 ; nx++)
+        {
+            int tx = tileCoord(nx);
+            int ty = tileCoord(ny);
+            DistanceTile *tile = findDistanceTile(tx, ty);
+            if (tile == NULL)
+                continue;
+            int c = (ny - ty*TILE_SIZE) * TILE_SIZE + nx - tx*TILE_SIZE;
+            if (tile->obstacleX[c] == NO_OBSTACLE || ((tile->raise[c >> 5] >> (c & 31)) & 1))
+                continue;
+
+            pushDistance(tile->d[c], nx, ny);
+            if (!isDistanceObstacle(tile->obstacleX[c], tile->obstacleY[c]))
+            {
+                clearClosestObstacle(tile, c, tx, ty);
+                tile->raise[c >> 5] |= 1u << (c & 31);
+            }
+        }
+    }
+
+    int tx = tileCoord(ix);
+    int ty = tileCoord(iy);
+    int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+    findDistanceTile(tx, ty)->raise[c >> 5] &= ~(1u << (c & 31));
+}
+
+/**
+ * @brief Propagates the changes of the obstacles since the last update to the distance layer.
+ *
+ * This is called by distance() and nearestObstacle(), it can be called earlier to control when the work is done.
+ * The cost is proportional to the number of cells whose distance changes.
+ *
+ * @return The number of cells processed by the brushfire, 0 if the distance layer is disabled or up to date.
+ */
+int Grid::updateDistances()
+{
+    if (m_maxDistance <= 0)
+        return 0;
+
+    // Sources of the brushfire: new obstacles lower the distances around them, removed ones raise them.
+    for (size_t i=0 ; i < m_distanceChanges.size() ; i++)
+    {
+        int ix = (int32_t)(m_distanceChanges[i] >> 32);
+        int iy = (int32_t)(m_distanceChanges[i] & 0xffffffff);
+        int tx = tileCoord(ix);
+        int ty = tileCoord(iy);
+        int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+        const Tile *tile = findTile(tx, ty);
+        bool obstacle = tile != NULL && isObstacle(tile, c);
+        if (obstacle == isDistanceObstacle(ix, iy))
+            continue;
+
+        DistanceTile *distanceTile = getDistanceTile(tx, ty);
+        if (obstacle)
+        {
+            setClosestObstacle(distanceTile, c, ix, iy, 0);
+            distanceTile->raise[c >> 5] &= ~(1u << (c & 31));
+        }
+        else
+        {
+            clearClosestObstacle(distanceTile, c, tx, ty);
+            distanceTile->raise[c >> 5] |= 1u << (c & 31);
+        }
+        pushDistance(0, ix, iy);
+    }
+    m_distanceChanges.clear();
+
+    int processed = 0;
+    while (!m_distanceQueue.empty())
+    {
+        std::pop_heap(m_distanceQueue.begin(), m_distanceQueue.end());
+        DistanceEntry entry = m_distanceQueue.back();
+        m_distanceQueue.pop_back();
+        processed++;
+
+        int tx = tileCoord(entry.ix);
+        int ty = tileCoord(entry.iy);
+        int c = (entry.iy - ty*TILE_SIZE) * TILE_SIZE + entry.ix - tx*TILE_SIZE;
+        DistanceTile *tile = findDistanceTile(tx, ty);
+        if ((tile->raise[c >> 5] >> (c & 31)) & 1)
+            raiseDistances(entry.ix, entry.iy);
+        else if (tile->obstacleX[c] != NO_OBSTACLE && entry.d <= tile->d[c])
+        {
+            // Entries queued before the cell got closer to another obstacle are outdated.
+            int ox = tile->obstacleX[c], oy = tile->obstacleY[c];
+            if (isDistanceObstacle(ox, oy))
+                lowerDistances(entry.ix, entry.iy, ox, oy);
+        }
+    }
+
+    for (size_t i=0 ; i < m_freedDistanceTiles.size() ; i++)
+    {
+        DistanceTileMap::iterator it = m_distanceTiles.find(m_freedDistanceTiles[i]);
+        if (it == m_distanceTiles.end() || it->second->nbSet > 0)
+            continue;
+        if (m_lastDistanceTile == it->second)
+            m_lastDistanceTile = NULL;
+        delete it->second;
+        m_distanceTiles.erase(it);
+    }
+    m_freedDistanceTiles.clear();
+    return processed;
+}
+
+/**
+ * @brief Gets the distance from a point to the closest obstacle (see enableDistances()).
+ *
+ * @param x The x-coordinate of the point in the real world.
+ * @param y The y-coordinate of the point in the real world.
+ * @return The distance between the centers of the cells of the point and of the obstacle (m), the maximum distance if there
+ * is no obstacle within it, negative if the distance layer is disabled.
+ */
+double Grid::distance(double x, double y)
+{
+    if (m_maxDistance <= 0)
+        return -1;
+    updateDistances();
+
+    int ix = toGridCoord(x);
+    int iy = toGridCoord(y);
+    int tx = tileCoord(ix);
+    int ty = tileCoord(iy);
+    const DistanceTile *tile = findDistanceTile(tx, ty);
+    if (tile == NULL)
+        return m_maxDistance * m_precision;
+    int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+    return std::min(tile->d[c], m_maxDistance) * m_precision;
+}
+
+/**
+ * @brief Gets the closest obstacle of a point (see enableDistances()).
+ *
+ * @param x The x-coordinate of the point in the real world.
+ * @param y The y-coordinate of the point in the real world.
+ * @param obstacleX A reference to store the x-coordinate of the center of the obstacle's cell.
+ * @param obstacleY A reference to store the y-coordinate of the center of the obstacle's cell.
+ * @return False if there is no obstacle within the maximum distance, or if the distance layer is disabled.
+ */
+bool Grid::nearestObstacle(double x, double y, double& obstacleX, double& obstacleY)
+{
+    if (m_maxDistance <= 0)
+        return false;
+    updateDistances();
+
+    int ix = toGridCoord(x);
+    int iy = toGridCoord(y);
+    int tx = tileCoord(ix);
+    int ty = tileCoord(iy);
+    const DistanceTile *tile = findDistanceTile(tx, ty);
+    if (tile == NULL)
+        return false;
+    int c = (iy - ty*TILE_SIZE) * TILE_SIZE + ix - tx*TILE_SIZE;
+    if (tile->obstacleX[c] == NO_OBSTACLE)
+        return false;
+    obstacleX = tile->obstacleX[c] * m_precision;
+    obstacleY = tile->obstacleY[c] * m_precision;
+    return true;
+}
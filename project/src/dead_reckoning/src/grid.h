@@ -0,0 +1,210 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <ros/ros.h>
+#include <SDL/SDL.h>
+#include <stdint.h>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+/**
+ * @class Grid
+ * @brief Represents the discretized world as a grid containing probabilities of obstacles.
+ *
+ * The world is split into square tiles of TILE_SIZE x TILE_SIZE cells, which are allocated the first time one
+ * of their cells is updated and stored in a hash map keyed by tile coordinates. Untouched space uses no memory
+ * and the Grid can grow in any direction without moving the existing cells.
+ * Inside a tile, the cells are stored as a structure of arrays: the probabilities and the time stamps live in
+ * two dense row-major arrays, and a bitmap tells which cells have already been seen.
+ *
+ * The Grid can also maintain the distance from each cell to the closest obstacle (see enableDistances()), up to a
+ * maximum distance. The distances are stored in separate tiles, and are updated incrementally by a dynamic brushfire:
+ * the cells whose obstacle state changed since the last update are the only sources of the propagation, which stops
+ * where the distances do not change.
+ */
+class Grid
+{
+    public:
+        /**
+         * @struct ProbabilisticPoint
+         * @brief A point in the grid, with time stamp and probability of obstacle.
+         */
+        struct ProbabilisticPoint
+        {
+            double x;       /*!< x-coordinate of the point in the world, not discretized. */
+            double y;       /*!< y-coordinate of the point in the world, not discretized. */
+            ros::Time t;    /*!< Time of the last update of this point. */
+            double p;       /*!< Probability of the presence of an obstacle, between 0 and 1. */
+        };
+
+        /**
+         * @struct TileCoord
+         * @brief Coordinates of a tile, the tile (x, y) contains the cells from (x * TILE_SIZE, y * TILE_SIZE) to ((x+1) * TILE_SIZE - 1, (y+1) * TILE_SIZE - 1).
+         */
+        struct TileCoord
+        {
+            int x;  /*!< x-coordinate of the tile. */
+            int y;  /*!< y-coordinate of the tile. */
+        };
+
+        /**
+         * @class View
+         * @brief Read access to a Grid at a given time, see Grid::at().
+         */
+        class View
+        {
+            public:
+                double get(double x, double y) const;
+
+            private:
+                friend class Grid;
+                View(Grid *grid, uint32_t minStamp);
+
+                Grid *m_grid;           /*!< The viewed Grid. */
+                uint32_t m_minStamp;    /*!< Time stamp under which cells are considered as expired. */
+        };
+
+        /**
+         * @enum DrawFilter
+         * @brief How draw() renders a pixel covering several cells.
+         */
+        enum DrawFilter
+        {
+            DRAW_NEAREST,   /*!< Use the cell at the upper-left corner of the pixel. */
+            DRAW_BOX        /*!< Use the average of all the cells covered by the pixel. */
+        };
+
+        static const int TILE_SHIFT = 6;                        /*!< log2 of the tile size. */
+        static const int TILE_SIZE = 1 << TILE_SHIFT;           /*!< Width and height of a tile (units). */
+        static const int TILE_CELLS = TILE_SIZE * TILE_SIZE;    /*!< Number of cells in a tile. */
+        static const uint8_t QUANTIZED_MAX = 254;               /*!< Quantized value of a probability of 1 (see getQuantizedTile()). */
+        static const uint8_t QUANTIZED_UNKNOWN = 255;           /*!< Quantized value of an unknown cell (see getQuantizedTile()). */
+        static const float OBSTACLE;                            /*!< Minimum probability of the cells considered as obstacles by the distance layer. */
+
+        Grid(double precision=0.05, ros::Duration ttl=ros::Duration(120.0), double minX=-10, double maxX=10, double minY=-10, double maxY=10, bool resizeable=true);
+        Grid(const Grid& grid);
+        Grid& operator=(const Grid& grid);
+        ~Grid();
+
+        double precision() const;
+        double minX() const;
+        double minY() const;
+        int width() const;
+        int height() const;
+        size_t nbTiles() const;
+        int toGridCoord(double f) const;
+        bool addPoint(double x, double y, ros::Time t, double p);
+        bool addPoint(ProbabilisticPoint point);
+        bool blendPatch(const int8_t *data, int width, int height, int offsetX, int offsetY, int ratio, ros::Time t);
+        double get(double x, double y);
+        View at(const ros::Time& t);
+        int expire(const ros::Time& t, int maxTiles);
+        double* getAll(int* width=NULL, int *height=NULL, double *scale=NULL) const;
+        void getAll(std::vector<int8_t>& data, int* width=NULL, int *height=NULL, double *scale=NULL) const;
+        void popDirtyTiles(std::vector<TileCoord>& tiles, bool all=false);
+        void getQuantizedTile(int tx, int ty, uint8_t *data) const;
+        void setQuantizedTile(int tx, int ty, const uint8_t *data, ros::Time t);
+        TileCoord tileAt(double x, double y) const;
+        uint32_t tileVersion(int tx, int ty) const;
+        SDL_Surface* draw(int w, int h, double minX, double maxX, double minY, double maxY, SDL_Surface *surf=NULL, DrawFilter filter=DRAW_NEAREST);
+        void enableDistances(double maxDistance);
+        bool hasDistances() const;
+        double maxDistance() const;
+        int updateDistances();
+        double distance(double x, double y);
+        bool nearestObstacle(double x, double y, double& obstacleX, double& obstacleY);
+
+    private:
+        /**
+         * @struct Tile
+         * @brief A square block of cells, stored in row-major order.
+         */
+        struct Tile
+        {
+            float p[TILE_CELLS];                /*!< Obstacle probability of each cell. */
+            uint32_t t[TILE_CELLS];             /*!< Time stamp of the last update of each cell, in ms since Grid::m_epoch. */
+            uint32_t known[TILE_CELLS / 32];    /*!< Bitmap of the cells which have been seen at least once. */
+            bool dirty;                         /*!< Indicates if the tile has been modified since the last call to popDirtyTiles(). */
+            uint32_t version;                   /*!< Value of Grid::m_version when the tile was last modified (see tileVersion()). */
+        };
+        typedef boost::unordered_map<uint64_t, Tile*> TileMap;
+
+        /**
+         * @struct DistanceTile
+         * @brief Distances to the closest obstacles of the cells of a tile, stored in row-major order.
+         */
+        struct DistanceTile
+        {
+            float d[TILE_CELLS];                /*!< Distance of each cell to its closest obstacle (units), infinite if there is none within the maximum distance. */
+            int32_t obstacleX[TILE_CELLS];      /*!< Grid x-coordinate of the closest obstacle of each cell, NO_OBSTACLE if there is none. */
+            int32_t obstacleY[TILE_CELLS];      /*!< Grid y-coordinate of the closest obstacle of each cell. */
+            uint32_t raise[TILE_CELLS / 32];    /*!< Bitmap of the cells whose closest obstacle was removed and which are waiting for a new one. */
+            int nbSet;                          /*!< Number of cells with a closest obstacle. */
+        };
+        typedef boost::unordered_map<uint64_t, DistanceTile*> DistanceTileMap;
+
+        /**
+         * @struct DistanceEntry
+         * @brief A cell waiting in the queue of the brushfire.
+         */
+        struct DistanceEntry
+        {
+            float d;    /*!< Distance of the cell when it was queued (units). */
+            int ix;     /*!< Grid x-coordinate of the cell. */
+            int iy;     /*!< Grid y-coordinate of the cell. */
+
+            bool operator<(const DistanceEntry& entry) const;
+        };
+
+        static const int32_t NO_OBSTACLE;   /*!< Value of DistanceTile::obstacleX for the cells without closest obstacle. */
+
+        double m_precision;                 /*!< Precision of the grid (m / unit). */
+        ros::Duration m_ttl;                /*!< Time To Live of the points inside the grid. */
+        int m_minIx;                        /*!< Grid x-coordinate of the left-most column of the grid. */
+        int m_maxIx;                        /*!< Grid x-coordinate of the right-most column of the grid. */
+        int m_minIy;                        /*!< Grid y-coordinate of the upper row of the grid. */
+        int m_maxIy;                        /*!< Grid y-coordinate of the lower row of the grid. */
+        ros::Time m_epoch;                  /*!< Origin of the cells time stamps, set by the first added point. */
+        TileMap m_tiles;                    /*!< Allocated tiles, indexed by tile coordinates (see tileKey()). */
+        std::vector<uint64_t> m_dirtyTiles; /*!< Keys of the tiles modified since the last call to popDirtyTiles(). */
+        uint32_t m_version;                 /*!< Version given to the last modified tile, never 0 once a tile has been modified. */
+        std::vector<uint64_t> m_sweepQueue; /*!< Keys of the tiles left to check during the current expiry sweep (see expire()). */
+        uint64_t m_lastKey;                 /*!< Key of the last accessed tile. */
+        Tile *m_lastTile;                   /*!< Last accessed tile, NULL if none. */
+        bool m_resizeable;                  /*!< Indicates if the grid can be dynamically resized or not. */
+        float m_maxDistance;                /*!< Maximum distance maintained by the distance layer (units), 0 if it is disabled. */
+        DistanceTileMap m_distanceTiles;    /*!< Allocated distance tiles, indexed by tile coordinates (see tileKey()). */
+        std::vector<uint64_t> m_distanceChanges;    /*!< Grid coordinates (see tileKey()) of the cells whose obstacle state changed since the last distances update. */
+        std::vector<DistanceEntry> m_distanceQueue; /*!< Priority queue of the brushfire, as a heap. */
+        std::vector<uint64_t> m_freedDistanceTiles; /*!< Keys of the distance tiles left without any closest obstacle during the current update. */
+        uint64_t m_lastDistanceKey;         /*!< Key of the last accessed distance tile. */
+        DistanceTile *m_lastDistanceTile;   /*!< Last accessed distance tile, NULL if none. */
+
+        static int tileCoord(int i);
+        static uint64_t tileKey(int tx, int ty);
+        static bool isKnown(const Tile *tile, int c);
+        static void setKnown(Tile *tile, int c);
+        static bool isObstacle(const Tile *tile, int c);
+
+        void init(double minX, double maxX, double minY, double maxY);
+        void empty();
+        uint32_t toStamp(const ros::Time& t) const;
+        Tile* findTile(int tx, int ty);
+        Tile* getTile(int tx, int ty);
+        void setDirty(Tile *tile, int tx, int ty);
+        uint32_t expiryStamp(const ros::Time& t) const;
+        double _get(int ix, int iy, uint32_t minStamp);
+        template <typename T> void fillAll(T *data, T unknown, float factor, float offset) const;
+        void emptyDistances();
+        void distanceChanged(int ix, int iy);
+        DistanceTile* findDistanceTile(int tx, int ty);
+        DistanceTile* getDistanceTile(int tx, int ty);
+        bool isDistanceObstacle(int ix, int iy);
+        void setClosestObstacle(DistanceTile *tile, int c, int ox, int oy, float d);
+        void clearClosestObstacle(DistanceTile *tile, int c, int tx, int ty);
+        void pushDistance(float d, int ix, int iy);
+        void lowerDistances(int ix, int iy, int ox, int oy);
+        void raiseDistances(int ix, int iy);
+};
+
+#endif
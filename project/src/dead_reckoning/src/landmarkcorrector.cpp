@@ -0,0 +1,430 @@
+#include "landmarkcorrector.h"
+
+#include <cmath>
+
+const LandmarkCorrector::Correction LandmarkCorrector::IDENTITY = {0, 0, 0};
+const double LandmarkCorrector::GATE = 9.21;    // 99% of the chi-squared distribution with 2 degrees of freedom
+const double LandmarkCorrector::POSE_GATE = 11.34;  // 99% of the chi-squared distribution with 3 degrees of freedom
+const int LandmarkCorrector::MAX_REJECTIONS = 10;
+const double LandmarkCorrector::TRANSLATION_NOISE = 0.05;
+const double LandmarkCorrector::ROTATION_NOISE = 0.15;
+const double LandmarkCorrector::DRIFT_NOISE = 0.06;
+const double LandmarkCorrector::RANGE_NOISE = 0.05;
+const double LandmarkCorrector::RANGE_NOISE_RATIO = 0.03;
+const double LandmarkCorrector::BEARING_NOISE = 2.0 * M_PI / 180;
+
+/**
+ * @brief Normalizes an angle between -PI and PI.
+ */
+static double wrapAngle(double rad)
+{
+    return atan2(sin(rad), cos(rad));
+}
+
+/**
+ * @brief Inverts a symmetric positive definite 3x3 matrix.
+ *
+ * @return False if the matrix is not invertible.
+ */
+static bool invertCovariance(const double a[3][3], double inv[3][3])
+{
+    inv[0][0] = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+    inv[0][1] = a[0][2] * a[2][1] - a[0][1] * a[2][2];
+    inv[0][2] = a[0][1] * a[1][2] - a[0][2] * a[1][1];
+    inv[1][0] = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+    inv[1][1] = a[0][0] * a[2][2] - a[0][2] * a[2][0];
+    inv[1][2] = a[0][2] * a[1][0] - a[0][0] * a[1][2];
+    inv[2][0] = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+    inv[2][1] = a[0][1] * a[2][0] - a[0][0] * a[2][1];
+    inv[2][2] = a[0][0] * a[1][1] - a[0][1] * a[1][0];
+    const double det = a[0][0] * inv[0][0] + a[0][1] * inv[1][0] + a[0][2] * inv[2][0];
+    if (det <= 0)
+        return false;
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            inv[i][j] /= det;
+    return true;
+}
+
+/**
+ * @brief Applies the correction to a pose.
+ */
+LandmarkCorrector::Pose LandmarkCorrector::Correction::apply(const Pose& pose) const
+{
+    Pose result = pose;
+    applyToPoint(result.x, result.y);
+    result.z = pose.z + z;
+    return result;
+}
+
+/**
+ * @brief Applies the correction to a point, in place.
+ */
+void LandmarkCorrector::Correction::applyToPoint(double& px, double& py) const
+{
+    const double c = cos(z), s = sin(z);
+    const double qx = c * px - s * py + x;
+    py = s * px + c * py + y;
+    px = qx;
+}
+
+/**
+ * @brief Composes two corrections.
+ *
+ * @param first The correction to apply first.
+ * @return The correction equivalent to first, then this one.
+ */
+LandmarkCorrector::Correction LandmarkCorrector::Correction::after(const Correction& first) const
+{
+    Correction result;
+    result.x = first.x;
+    result.y = first.y;
+    applyToPoint(result.x, result.y);
+    result.z = first.z + z;
+    return result;
+}
+
+/**
+ * @brief Gets the correction moving a pose onto another one: rotation around the first pose, then translation.
+ */
+LandmarkCorrector::Correction LandmarkCorrector::Correction::between(const Pose& from, const Pose& to)
+{
+    Correction correction = {0, 0, to.z - from.z};
+    double rx = from.x, ry = from.y;
+    correction.applyToPoint(rx, ry);
+    correction.x = to.x - rx;
+    correction.y = to.y - ry;
+    return correction;
+}
+
+/**
+ * @brief Tells if the correction does nothing.
+ */
+bool LandmarkCorrector::Correction::isIdentity() const
+{
+    return x == 0 && y == 0 && z == 0;
+}
+
+/**
+ * @brief Constructor.
+ *
+ * The pose given at the first observation is considered as exact.
+ *
+ * @param nbLandmarks The number of landmarks, with IDs from 0 to nbLandmarks-1.
+ */
+LandmarkCorrector::LandmarkCorrector(int nbLandmarks):
+    m_landmarks(nbLandmarks), m_started(false), m_nbRejected(0), m_pending(IDENTITY), m_lastTaken(IDENTITY), m_generation(0)
+{
+    for (int i=0 ; i < nbLandmarks ; i++)
+        m_landmarks[i].known = false;
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            m_cov[i][j] = 0;
+}
+
+/**
+ * @brief Gets the estimated position of a landmark.
+ *
+ * @param id The ID of the landmark.
+ * @param x A reference to store the x-coordinate of the landmark.
+ * @param y A reference to store the y-coordinate of the landmark.
+ * @return False if the landmark has never been observed.
+ */
+bool LandmarkCorrector::landmark(int id, double& x, double& y) const
+{
+    if (id < 0 || id >= (int)m_landmarks.size() || !m_landmarks[id].known)
+        return false;
+    x = m_landmarks[id].x;
+    y = m_landmarks[id].y;
+    return true;
+}
+
+/**
+ * @brief Gets the corrections computed since the last call, and forgets them.
+ *
+ * The returned correction has to be applied to the pose estimated by the dead reckoning, and to anything expressed in the
+ * same coordinates system (positions history, odometry offsets...).
+ */
+LandmarkCorrector::Correction LandmarkCorrector::takeCorrection()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    Correction correction = m_pending;
+    m_pending = IDENTITY;
+    if (!correction.isIdentity())
+    {
+        m_lastTaken = correction;
+        m_generation++;
+    }
+    return correction;
+}
+
+/**
+ * @brief Applies to a pose the corrections which are not applied to it yet.
+ *
+ * @param pose The pose to correct, in place.
+ * @param generation The number of non-identity corrections taken by the owner of the pose when it was estimated, -1 if
+ * it is up to date.
+ * @return False if the pose is too old to be corrected.
+ */
+bool LandmarkCorrector::toCorrected(Pose& pose, int generation)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (generation >= 0 && generation != m_generation)
+    {
+        if (generation != m_generation - 1)
+            return false;
+        pose = m_lastTaken.apply(pose);
+    }
+    pose = m_pending.apply(pose);
+    return true;
+}
+
+/**
+ * @brief Merges a pose measured by other means than the landmarks, such as scan matching.
+ *
+ * The measured pose is an observation of the whole pose: the correction moves the estimated pose towards it according
+ * to both uncertainties, and the uncertainty of the pose decreases. Measurements which are too far from the estimated
+ * pose, given both uncertainties, are discarded.
+ *
+ * @param pose The pose estimated by the dead reckoning, without the corrections not taken yet.
+ * @param measured The measured pose, in the same coordinates system.
+ * @param cov The covariance of the measured pose (x, y, orientation).
+ * @param generation The number of non-identity corrections taken by the owner of the pose when it was estimated, -1 if
+ * it is up to date.
+ * @return False if the pose is too old to be corrected, or if the measurement has been discarded.
+ */
+bool LandmarkCorrector::correct(const Pose& pose, const Pose& measured, const double cov[3][3], int generation)
+{
+    Pose p = pose, m = measured;
+    if (!toCorrected(p, generation) || !toCorrected(m, generation))
+        return false;
+    predict(p);
+
+    // The observation is the pose itself (H = I), so that S = P + R and K = P S^-1.
+    const double innovation[3] = {m.x - p.x, m.y - p.y, wrapAngle(m.z - p.z)};
+    const double (&P)[3][3] = m_cov;
+    double S[3][3], Si[3][3];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            S[i][j] = P[i][j] + cov[i][j];
+    if (!invertCovariance(S, Si))
+        return false;
+
+    double distance = 0;
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            distance += innovation[i] * Si[i][j] * innovation[j];
+    if (distance > POSE_GATE)
+    {
+        m_nbRejected++;
+        return false;
+    }
+
+    double K[3][3];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            K[i][j] = P[i][0] * Si[0][j] + P[i][1] * Si[1][j] + P[i][2] * Si[2][j];
+
+    // P -= K P
+    double newCov[3][3];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            newCov[i][j] = P[i][j] - K[i][0] * P[0][j] - K[i][1] * P[1][j] - K[i][2] * P[2][j];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            m_cov[i][j] = (newCov[i][j] + newCov[j][i]) / 2;
+
+    Pose updated = p;
+    updated.x += K[0][0] * innovation[0] + K[0][1] * innovation[1] + K[0][2] * innovation[2];
+    updated.y += K[1][0] * innovation[0] + K[1][1] * innovation[1] + K[1][2] * innovation[2];
+    updated.z += K[2][0] * innovation[0] + K[2][1] * innovation[1] + K[2][2] * innovation[2];
+    const Correction correction = Correction::between(p, updated);
+    m_lastPose = updated;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_pending = correction.after(m_pending);
+    return true;
+}
+
+/**
+ * @brief Gets the number of observations and measured poses discarded so far because they were too far from their prediction.
+ */
+int LandmarkCorrector::nbRejected() const
+{
+    return m_nbRejected;
+}
+
+/**
+ * @brief Increases the uncertainty of the pose according to the motion since the last observation.
+ *
+ * @param pose The corrected pose at the time of the new observation.
+ */
+void LandmarkCorrector::predict(const Pose& pose)
+{
+    if (!m_started)
+    {
+        m_lastPose = pose;
+        m_started = true;
+        return;
+    }
+
+    const double dx = pose.x - m_lastPose.x;
+    const double dy = pose.y - m_lastPose.y;
+    const double ds = hypot(dx, dy);
+    const double dz = fabs(wrapAngle(pose.z - m_lastPose.z));
+
+    // P = F P F^T + Q, an orientation error at the last pose moves the new one perpendicularly to the motion.
+    const double F[3][3] = {{1, 0, -dy}, {0, 1, dx}, {0, 0, 1}};
+    double FP[3][3];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            FP[i][j] = F[i][0] * m_cov[0][j] + F[i][1] * m_cov[1][j] + F[i][2] * m_cov[2][j];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            m_cov[i][j] = FP[i][0] * F[j][0] + FP[i][1] * F[j][1] + FP[i][2] * F[j][2];
+
+    const double translationNoise = TRANSLATION_NOISE * ds;
+    const double rotationNoise = ROTATION_NOISE * dz + DRIFT_NOISE * ds;
+    m_cov[0][0] += translationNoise * translationNoise;
+    m_cov[1][1] += translationNoise * translationNoise;
+    m_cov[2][2] += rotationNoise * rotationNoise;
+    m_lastPose = pose;
+}
+
+/**
+ * @brief Processes an observation of a landmark.
+ *
+ * The first observation of a landmark places it on the map, the next ones correct the pose and the landmark position.
+ * A landmark whose observations have been discarded MAX_REJECTIONS times in a row, because it was placed from a wrong
+ * detection or has been moved, is placed again.
+ *
+ * @param id The ID of the landmark.
+ * @param pose The pose estimated by the dead reckoning at the time of the observation, without the corrections not taken yet.
+ * @param range The distance between the robot and the landmark (m).
+ * @param bearing The direction of the landmark relatively to the robot's orientation (rad).
+ * @param generation The number of non-identity corrections taken by the owner of the pose when it was estimated, -1 if
+ * it is up to date.
+ * @return False if the observation has been discarded.
+ */
+bool LandmarkCorrector::observe(int id, const Pose& pose, double range, double bearing, int generation)
+{
+    if (id < 0 || id >= (int)m_landmarks.size() || !std::isfinite(range) || !std::isfinite(bearing))
+        return false;
+
+    Pose p = pose;
+    if (!toCorrected(p, generation))
+        return false;
+    predict(p);
+
+    const double rangeNoise = RANGE_NOISE + RANGE_NOISE_RATIO * range;
+    const double R[2] = {rangeNoise * rangeNoise, BEARING_NOISE * BEARING_NOISE};
+    Landmark& l = m_landmarks[id];
+    const double (&P)[3][3] = m_cov;
+
+    if (!l.known || l.nbRejected >= MAX_REJECTIONS)
+    {
+        // Covariance of the landmark from the ones of the pose and of the observation.
+        const double a = p.z + bearing, c = cos(a), s = sin(a);
+        const double Jp[2][3] = {{1, 0, -range * s}, {0, 1, range * c}};
+        const double Jz[2][2] = {{c, -range * s}, {s, range * c}};
+        l.x = p.x + range * c;
+        l.y = p.y + range * s;
+        for (int i=0 ; i < 2 ; i++)
+        {
+            for (int j=0 ; j < 2 ; j++)
+            {
+                double v = 0;
+                for (int k=0 ; k < 3 ; k++)
+                    for (int m=0 ; m < 3 ; m++)
+                        v += Jp[i][k] * P[k][m] * Jp[j][m];
+                v += Jz[i][0] * R[0] * Jz[j][0] + Jz[i][1] * R[1] * Jz[j][1];
+                l.cov[i][j] = v;
+            }
+        }
+        l.known = true;
+        l.nbRejected = 0;
+        return true;
+    }
+
+    // Predicted observation and its Jacobians with respect to the pose (H) and to the landmark (G).
+    const double dx = l.x - p.x, dy = l.y - p.y;
+    const double q = dx*dx + dy*dy, r = sqrt(q);
+    if (r < 1e-6)
+        return false;
+    const double innovation[2] = {range - r, wrapAngle(bearing - (atan2(dy, dx) - p.z))};
+    const double H[2][3] = {{-dx / r, -dy / r, 0}, {dy / q, -dx / q, -1}};
+    const double G[2][2] = {{dx / r, dy / r}, {-dy / q, dx / q}};
+
+    // S = H P H^T + G L G^T + R, the correlations between the pose and the landmarks are neglected.
+    double PHt[3][2], LGt[2][2], S[2][2];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 2 ; j++)
+            PHt[i][j] = P[i][0] * H[j][0] + P[i][1] * H[j][1] + P[i][2] * H[j][2];
+    for (int i=0 ; i < 2 ; i++)
+        for (int j=0 ; j < 2 ; j++)
+            LGt[i][j] = l.cov[i][0] * G[j][0] + l.cov[i][1] * G[j][1];
+    for (int i=0 ; i < 2 ; i++)
+    {
+        for (int j=0 ; j < 2 ; j++)
+        {
+            S[i][j] = H[i][0] * PHt[0][j] + H[i][1] * PHt[1][j] + H[i][2] * PHt[2][j]
+                    + G[i][0] * LGt[0][j] + G[i][1] * LGt[1][j];
+        }
+        S[i][i] += R[i];
+    }
+    const double det = S[0][0] * S[1][1] - S[0][1] * S[1][0];
+    if (det <= 0)
+        return false;
+    const double Si[2][2] = {{S[1][1] / det, -S[0][1] / det}, {-S[1][0] / det, S[0][0] / det}};
+
+    const double Siv[2] = {Si[0][0] * innovation[0] + Si[0][1] * innovation[1], Si[1][0] * innovation[0] + Si[1][1] * innovation[1]};
+    if (innovation[0] * Siv[0] + innovation[1] * Siv[1] > GATE)
+    {
+        m_nbRejected++;
+        l.nbRejected++;
+        return false;
+    }
+    l.nbRejected = 0;
+
+    // Gains, state and covariances updates.
+    double K[3][2], KL[2][2];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 2 ; j++)
+            K[i][j] = PHt[i][0] * Si[0][j] + PHt[i][1] * Si[1][j];
+    for (int i=0 ; i < 2 ; i++)
+        for (int j=0 ; j < 2 ; j++)
+            KL[i][j] = LGt[i][0] * Si[0][j] + LGt[i][1] * Si[1][j];
+
+    Pose delta;
+    delta.x = K[0][0] * innovation[0] + K[0][1] * innovation[1];
+    delta.y = K[1][0] * innovation[0] + K[1][1] * innovation[1];
+    delta.z = K[2][0] * innovation[0] + K[2][1] * innovation[1];
+    l.x += KL[0][0] * innovation[0] + KL[0][1] * innovation[1];
+    l.y += KL[1][0] * innovation[0] + KL[1][1] * innovation[1];
+
+    // P -= K H P = K (P H^T)^T, L -= KL G L = KL (L G^T)^T
+    double newCov[3][3], newL[2][2];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            newCov[i][j] = P[i][j] - K[i][0] * PHt[j][0] - K[i][1] * PHt[j][1];
+    for (int i=0 ; i < 2 ; i++)
+        for (int j=0 ; j < 2 ; j++)
+            newL[i][j] = l.cov[i][j] - KL[i][0] * LGt[j][0] - KL[i][1] * LGt[j][1];
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            m_cov[i][j] = (newCov[i][j] + newCov[j][i]) / 2;
+    for (int i=0 ; i < 2 ; i++)
+        for (int j=0 ; j < 2 ; j++)
+            l.cov[i][j] = (newL[i][j] + newL[j][i]) / 2;
+
+    Pose updated = p;
+    updated.x += delta.x;
+    updated.y += delta.y;
+    updated.z += delta.z;
+    const Correction correction = Correction::between(p, updated);
+    m_lastPose = updated;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_pending = correction.after(m_pending);
+    return true;
+}
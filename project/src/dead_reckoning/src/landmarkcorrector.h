@@ -0,0 +1,101 @@
+#ifndef LANDMARKCORRECTOR_H
+#define LANDMARKCORRECTOR_H
+
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+/**
+ * @class LandmarkCorrector
+ * @brief Corrects the drift of the dead reckoning with the re-observations of landmarks (markers) at fixed positions.
+ *
+ * This is an extended Kalman filter over the robot's pose (x, y, orientation) and the positions of the landmarks.
+ * Between two observations, the uncertainty of the pose grows with the distance travelled and the rotation, as
+ * estimated by the dead reckoning. A landmark is placed on the map the first time it is observed, and each later
+ * observation (range and bearing) corrects both the pose and the position of the landmark. Observations which are
+ * too far from the prediction are discarded.
+ *
+ * The filter does not own the pose: it is given the dead reckoning estimation at the time of each observation and
+ * accumulates the resulting corrections, which the owner of the pose applies with takeCorrection(). takeCorrection()
+ * can be called from another thread than the other functions: the owner of the pose then tells which corrections were
+ * already applied to the given poses with the number of non-identity corrections it has taken (the generation).
+ * Poses measured by other means, such as scan matching, are merged with correct() as observations of the whole pose.
+ */
+class LandmarkCorrector
+{
+    public:
+        /**
+         * @struct Pose
+         * @brief A 2D position with orientation.
+         */
+        struct Pose
+        {
+            double x;   /*!< x-coordinate. */
+            double y;   /*!< y-coordinate. */
+            double z;   /*!< Rotation around the z-axis (rad). */
+        };
+
+        /**
+         * @struct Correction
+         * @brief A rigid transformation of the plane: rotation of z around the origin, then translation of (x, y).
+         */
+        struct Correction
+        {
+            double x;   /*!< Translation along the x-axis. */
+            double y;   /*!< Translation along the y-axis. */
+            double z;   /*!< Rotation around the z-axis (rad). */
+
+            Pose apply(const Pose& pose) const;
+            void applyToPoint(double& px, double& py) const;
+            Correction after(const Correction& first) const;
+            bool isIdentity() const;
+            static Correction between(const Pose& from, const Pose& to);
+        };
+
+        static const Correction IDENTITY;       /*!< The correction which does nothing. */
+        static const double GATE;               /*!< Maximum squared Mahalanobis distance between an observation and its prediction. */
+        static const double POSE_GATE;          /*!< Maximum squared Mahalanobis distance between a measured pose and the estimated one. */
+        static const int MAX_REJECTIONS;        /*!< Number of consecutive discarded observations after which a landmark is placed again. */
+        static const double TRANSLATION_NOISE;  /*!< Standard deviation of the error of the dead reckoning per travelled meter (m/m). */
+        static const double ROTATION_NOISE;     /*!< Standard deviation of the orientation error of the dead reckoning per radian of rotation (rad/rad). */
+        static const double DRIFT_NOISE;        /*!< Standard deviation of the orientation error of the dead reckoning per travelled meter (rad/m). */
+        static const double RANGE_NOISE;        /*!< Standard deviation of the range of the observations (m). */
+        static const double RANGE_NOISE_RATIO;  /*!< Additional standard deviation of the range of the observations, per meter of range. */
+        static const double BEARING_NOISE;      /*!< Standard deviation of the bearing of the observations (rad). */
+
+        LandmarkCorrector(int nbLandmarks=256);
+
+        bool observe(int id, const Pose& pose, double range, double bearing, int generation=-1);
+        bool correct(const Pose& pose, const Pose& measured, const double cov[3][3], int generation=-1);
+        bool landmark(int id, double& x, double& y) const;
+        Correction takeCorrection();
+        int nbRejected() const;
+
+    private:
+        /**
+         * @struct Landmark
+         * @brief Estimated position of a landmark.
+         */
+        struct Landmark
+        {
+            bool known;         /*!< Indicates if the landmark has already been observed. */
+            double x;           /*!< Estimated x-coordinate. */
+            double y;           /*!< Estimated y-coordinate. */
+            double cov[2][2];   /*!< Covariance of the position. */
+            int nbRejected;     /*!< Number of consecutive discarded observations. */
+        };
+
+        std::vector<Landmark> m_landmarks;  /*!< Estimated positions of the landmarks, indexed by ID. */
+        double m_cov[3][3];                 /*!< Covariance of the pose. */
+        Pose m_lastPose;                    /*!< Corrected pose at the last observation. */
+        bool m_started;                     /*!< Indicates if m_lastPose is set. */
+        int m_nbRejected;                   /*!< Number of observations discarded by the gate. */
+        Correction m_pending;               /*!< Corrections not yet taken by takeCorrection(). */
+        Correction m_lastTaken;             /*!< Last non-identity correction returned by takeCorrection(). */
+        int m_generation;                   /*!< Number of non-identity corrections returned by takeCorrection(). */
+        boost::mutex m_mutex;               /*!< Protects m_pending, m_lastTaken and m_generation. */
+
+        bool toCorrected(Pose& pose, int generation);
+        void predict(const Pose& pose);
+};
+
+#endif
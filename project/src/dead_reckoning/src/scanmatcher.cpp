@@ -0,0 +1,312 @@
+#include "scanmatcher.h"
+
+#include <algorithm>
+#include <cmath>
+
+const int ScanMatcher::NB_LEVELS;
+const double ScanMatcher::MAX_DISTANCE_SIGMAS = 4.0;
+
+/**
+ * @brief Orders the nodes by increasing upper bound.
+ */
+bool ScanMatcher::Node::operator<(const Node& node) const
+{
+    return bound < node.bound;
+}
+
+/**
+ * @brief Constructor.
+ *
+ * The search window defaults to 0.3 m and 10 degrees around the guess, with a step of 0.5 degree, and the minimum score to 0.3.
+ *
+ * @param fieldRadius Half of the width of the likelihood field built around the robot (m).
+ * @param sigma Standard deviation of the distance of the scan points to the obstacles (m).
+ */
+ScanMatcher::ScanMatcher(double fieldRadius, double sigma):
+    m_fieldRadius(fieldRadius), m_resolution(0), m_size(0), m_sigma(sigma), m_minScore(0.3),
+    m_originX(0), m_originY(0), m_hasField(false)
+{
+    setSearchWindow(0.3, 10.0 * M_PI / 180, 0.5 * M_PI / 180);
+}
+
+/**
+ * @brief Sets the poses explored around the guess.
+ *
+ * @param linear The maximum translation along each axis (m).
+ * @param angular The maximum rotation (rad).
+ * @param angularStep The step between two candidate orientations (rad).
+ */
+void ScanMatcher::setSearchWindow(double linear, double angular, double angularStep)
+{
+    m_linearWindow = linear;
+    m_angularWindow = angular;
+    m_angularStep = angularStep;
+}
+
+/**
+ * @brief Sets the minimum score of an accepted match, between 0 and 1.
+ */
+void ScanMatcher::setMinScore(double minScore)
+{
+    m_minScore = minScore;
+}
+
+/**
+ * @brief Tells if the likelihood field has been computed (see updateField()).
+ */
+bool ScanMatcher::hasField() const
+{
+    return m_hasField;
+}
+
+/**
+ * @brief Gets the x-coordinate of the center of the likelihood field.
+ */
+double ScanMatcher::fieldX() const
+{
+    return m_originX + (m_size / 2) * m_resolution;
+}
+
+/**
+ * @brief Gets the y-coordinate of the center of the likelihood field.
+ */
+double ScanMatcher::fieldY() const
+{
+    return m_originY + (m_size / 2) * m_resolution;
+}
+
+/**
+ * @brief Computes the likelihood field, and the coarser fields, from the distance layer of a Grid around a given position.
+ *
+ * The distance layer of the Grid is enabled if needed, up to MAX_DISTANCE_SIGMAS standard deviations. It is kept up to date
+ * by the Grid itself, so that the field only costs one lookup per cell.
+ *
+ * @param grid The Grid to match the scans against.
+ * @param x The x-coordinate of the center of the field.
+ * @param y The y-coordinate of the center of the field.
+ */
+void ScanMatcher::updateField(Grid& grid, double x, double y)
+{
+    if (!grid.hasDistances())
+        grid.enableDistances(MAX_DISTANCE_SIGMAS * m_sigma);
+
+    m_resolution = grid.precision();
+    m_size = 2 * (int)ceil(m_fieldRadius / m_resolution) + 1;
+    m_originX = (grid.toGridCoord(x) - m_size / 2) * m_resolution;
+    m_originY = (grid.toGridCoord(y) - m_size / 2) * m_resolution;
+
+    std::vector<float>& field = m_fields[0];
+    field.resize(m_size * m_size);
+    const float k = 1 / (2 * m_sigma * m_sigma);
+    for (int cy=0 ; cy < m_size ; cy++)
+    {
+        for (int cx=0 ; cx < m_size ; cx++)
+        {
+            float d = grid.distance(m_originX + cx * m_resolution, m_originY + cy * m_resolution);
+            field[cy * m_size + cx] = exp(-k * d * d);
+        }
+    }
+
+    // Level k holds the maximum of the four level k-1 blocks making its 2^k x 2^k block.
+    for (int level=1 ; level < NB_LEVELS ; level++)
+    {
+        const int half = 1 << (level - 1);
+        m_fields[level].resize(m_size * m_size);
+        for (int cy=0 ; cy < m_size ; cy++)
+        {
+            for (int cx=0 ; cx < m_size ; cx++)
+            {
+                m_fields[level][cy * m_size + cx] = std::max(std::max(lookup(level - 1, cx, cy), lookup(level - 1, cx + half, cy)),
+                                                             std::max(lookup(level - 1, cx, cy + half), lookup(level - 1, cx + half, cy + half)));
+            }
+        }
+    }
+    m_hasField = true;
+}
+
+/**
+ * @brief Gets a value of a field, 0 outside of it.
+ *
+ * The blocks of the coarser fields which start before the first row or column but overlap the field are bounded by
+ * the block starting at the first row or column.
+ */
+float ScanMatcher::lookup(int level, int cx, int cy) const
+{
+    const int overlap = (1 << level) - 1;
+    if (cx < -overlap || cy < -overlap || cx >= m_size || cy >= m_size)
+        return 0;
+    cx = std::max(cx, 0);
+    cy = std::max(cy, 0);
+    return m_fields[level][cy * m_size + cx];
+}
+
+/**
+ * @brief Sums the values of a field at the given cells, translated by (dx, dy).
+ */
+float ScanMatcher::sum(int level, const std::vector<int>& cells, int dx, int dy) const
+{
+    float total = 0;
+    for (size_t i=0 ; i < cells.size() ; i += 2)
+        total += lookup(level, cells[i] + dx, cells[i+1] + dy);
+    return total;
+}
+
+/**
+ * @brief Computes the field cells of scan points placed at a given pose.
+ *
+ * @param points The scan points, in the robot's coordinate system.
+ * @param pose The pose of the robot.
+ * @param cells A vector to fill with the x and y field coordinates of each point.
+ */
+void ScanMatcher::discretize(const std::vector<Point>& points, const Pose& pose, std::vector<int>& cells) const
+{
+    const double c = cos(pose.z), s = sin(pose.z);
+    cells.resize(2 * points.size());
+    for (size_t i=0 ; i < points.size() ; i++)
+    {
+        cells[2*i] = round((pose.x + c * points[i].x - s * points[i].y - m_originX) / m_resolution);
+        cells[2*i+1] = round((pose.y + s * points[i].x + c * points[i].y - m_originY) / m_resolution);
+    }
+}
+
+/**
+ * @brief Computes the score of a pose, the average likelihood of the scan points placed at this pose.
+ *
+ * @param points The scan points, in the robot's coordinate system.
+ * @param pose The pose of the robot.
+ * @return The score, between 0 and 1.
+ */
+double ScanMatcher::score(const std::vector<Point>& points, const Pose& pose) const
+{
+    if (!m_hasField || points.empty())
+        return 0;
+    std::vector<int> cells;
+    discretize(points, pose, cells);
+    return sum(0, cells, 0, 0) / points.size();
+}
+
+/**
+ * @brief Gets the covariance of a pose found by match(), from its score.
+ *
+ * The standard deviations are the steps of the search, one cell of the field and one angular step, divided by the
+ * score: the lower the score, the farther the scan points are from the obstacles and the less certain the pose is.
+ *
+ * @param score The score of the pose, greater than the minimum score.
+ * @param cov A reference to store the covariance of the pose (x, y, orientation).
+ */
+void ScanMatcher::covariance(double score, double cov[3][3]) const
+{
+    const double k = 1.0 / std::max(score, 0.01);
+    for (int i=0 ; i < 3 ; i++)
+        for (int j=0 ; j < 3 ; j++)
+            cov[i][j] = 0;
+    cov[0][0] = cov[1][1] = (m_resolution * k) * (m_resolution * k);
+    cov[2][2] = (m_angularStep * k) * (m_angularStep * k);
+}
+
+/**
+ * @brief Finds the pose with the best score within the search window around a guess.
+ *
+ * @param points The scan points, in the robot's coordinate system.
+ * @param guess The estimated pose of the robot.
+ * @param result A reference to store the best pose.
+ * @param score A pointer to store the score of the best pose, can be NULL.
+ * @param exhaustive True to score all the poses of the window instead of using the branch and bound.
+ * @return False if no pose of the window has a score greater than the minimum score.
+ */
+bool ScanMatcher::match(const std::vector<Point>& points, const Pose& guess, Pose& result, double *score, bool exhaustive) const
+{
+    if (!m_hasField || points.empty())
+        return false;
+
+    const int window = ceil(m_linearWindow / m_resolution);
+    const int nbAngles = floor(m_angularWindow / m_angularStep);
+    std::vector<std::vector<int> > cells(2 * nbAngles + 1);
+    for (int a=0 ; a <= 2 * nbAngles ; a++)
+    {
+        Pose pose = guess;
+        pose.z += (a - nbAngles) * m_angularStep;
+        discretize(points, pose, cells[a]);
+    }
+
+    float best = m_minScore * points.size();
+    int bestAngle = -1, bestDx = 0, bestDy = 0;
+    if (exhaustive)
+    {
+        for (int a=0 ; a <= 2 * nbAngles ; a++)
+        {
+            for (int dy=-window ; dy <= window ; dy++)
+            {
+                for (int dx=-window ; dx <= window ; dx++)
+                {
+                    const float value = sum(0, cells[a], dx, dy);
+                    if (value > best)
+                    {
+                        best = value;
+                        bestAngle = a;
+                        bestDx = dx;
+                        bestDy = dy;
+                    }
+                }
+            }
+        }
+    }
+    else
+    {
+        // Depth-first search, the most promising blocks first.
+        const int top = NB_LEVELS - 1;
+        std::vector<Node> stack;
+        for (int a=0 ; a <= 2 * nbAngles ; a++)
+        {
+            for (int dy=-window ; dy <= window ; dy += 1 << top)
+            {
+                for (int dx=-window ; dx <= window ; dx += 1 << top)
+                {
+                    Node node = {a, dx, dy, top, sum(top, cells[a], dx, dy)};
+                    stack.push_back(node);
+                }
+            }
+        }
+        std::sort(stack.begin(), stack.end());
+
+        while (!stack.empty())
+        {
+            const Node node = stack.back();
+            stack.pop_back();
+            if (node.bound <= best)
+                continue;
+            if (node.level == 0)
+            {
+                best = node.bound;
+                bestAngle = node.angle;
+                bestDx = node.dx;
+                bestDy = node.dy;
+                continue;
+            }
+
+            const int half = 1 << (node.level - 1);
+            Node children[4];
+            int nbChildren = 0;
+            for (int i=0 ; i < 4 ; i++)
+            {
+                Node child = {node.angle, node.dx + (i & 1) * half, node.dy + (i >> 1) * half, node.level - 1, 0};
+                if (child.dx > window || child.dy > window)
+                    continue;
+                child.bound = sum(child.level, cells[child.angle], child.dx, child.dy);
+                if (child.bound > best)
+                    children[nbChildren++] = child;
+            }
+            std::sort(children, children + nbChildren);
+            stack.insert(stack.end(), children, children + nbChildren);
+        }
+    }
+
+    if (bestAngle < 0)
+        return false;
+    result.x = guess.x + bestDx * m_resolution;
+    result.y = guess.y + bestDy * m_resolution;
+    result.z = guess.z + (bestAngle - nbAngles) * m_angularStep;
+    if (score != NULL)
+        *score = best / points.size();
+    return true;
+}
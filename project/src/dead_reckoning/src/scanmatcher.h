@@ -0,0 +1,93 @@
+#ifndef SCANMATCHER_H
+#define SCANMATCHER_H
+
+#include <ros/ros.h>
+#include <stdint.h>
+#include <vector>
+#include "grid.h"
+
+/**
+ * @class ScanMatcher
+ * @brief Estimates the pose of the robot by matching laser scans against a Grid.
+ *
+ * The Grid around the robot is turned into a likelihood field: each cell holds exp(-d^2 / 2 sigma^2), where d is the
+ * distance to the closest obstacle, read from the distance layer of the Grid (see Grid::enableDistances()). The score of a pose is the average likelihood of the scan points placed at this pose.
+ * The best pose within a search window around the estimation of the dead reckoning is found by a correlative search:
+ * for each candidate orientation the scan points are rotated once, and the translations are explored by branch and
+ * bound, using precomputed coarser fields which hold the maximum of the likelihood over 2^k x 2^k blocks of cells as
+ * upper bounds of the scores.
+ */
+class ScanMatcher
+{
+    public:
+        /**
+         * @struct Pose
+         * @brief A 2D position with orientation.
+         */
+        struct Pose
+        {
+            double x;   /*!< x-coordinate. */
+            double y;   /*!< y-coordinate. */
+            double z;   /*!< Rotation around the z-axis (rad). */
+        };
+
+        /**
+         * @struct Point
+         * @brief A scan point, in the robot's coordinate system.
+         */
+        struct Point
+        {
+            double x;   /*!< x-coordinate. */
+            double y;   /*!< y-coordinate. */
+        };
+
+        static const int NB_LEVELS = 4;             /*!< Number of fields used by the branch and bound, the finest included. */
+        static const double MAX_DISTANCE_SIGMAS;    /*!< Maximum distance of the distance layer enabled by updateField(), in standard deviations. */
+
+        ScanMatcher(double fieldRadius=6.0, double sigma=0.1);
+
+        void setSearchWindow(double linear, double angular, double angularStep);
+        void setMinScore(double minScore);
+        void updateField(Grid& grid, double x, double y);
+        bool hasField() const;
+        double fieldX() const;
+        double fieldY() const;
+        double score(const std::vector<Point>& points, const Pose& pose) const;
+        bool match(const std::vector<Point>& points, const Pose& guess, Pose& result, double *score=NULL, bool exhaustive=false) const;
+        void covariance(double score, double cov[3][3]) const;
+
+    private:
+        /**
+         * @struct Node
+         * @brief A block of 2^level x 2^level candidate translations, for a given orientation.
+         */
+        struct Node
+        {
+            int angle;      /*!< Index of the orientation. */
+            int dx;         /*!< Smallest x-translation of the block (cells). */
+            int dy;         /*!< Smallest y-translation of the block (cells). */
+            int level;      /*!< Level of the block. */
+            float bound;    /*!< Upper bound of the score of all the translations of the block. */
+
+            bool operator<(const Node& node) const;
+        };
+
+        double m_fieldRadius;                           /*!< Half of the width of the likelihood field (m). */
+        double m_resolution;                            /*!< Size of the cells of the likelihood field, the precision of the Grid (m). */
+        int m_size;                                     /*!< Width and height of the likelihood field (cells). */
+        double m_sigma;                                 /*!< Standard deviation of the distance of the scan points to the obstacles (m). */
+        double m_linearWindow;                          /*!< Maximum translation searched around the guess (m). */
+        double m_angularWindow;                         /*!< Maximum rotation searched around the guess (rad). */
+        double m_angularStep;                           /*!< Step between two candidate orientations (rad). */
+        double m_minScore;                              /*!< Minimum score of an accepted match. */
+        double m_originX;                               /*!< x-coordinate of the center of the cell (0, 0) of the fields. */
+        double m_originY;                               /*!< y-coordinate of the center of the cell (0, 0) of the fields. */
+        bool m_hasField;                                /*!< Indicates if the fields have been computed. */
+        std::vector<float> m_fields[NB_LEVELS];         /*!< Likelihood field (level 0), and maximum of the likelihood over the 2^k x 2^k blocks starting at each cell (level k). */
+
+        float lookup(int level, int cx, int cy) const;
+        float sum(int level, const std::vector<int>& cells, int dx, int dy) const;
+        void discretize(const std::vector<Point>& points, const Pose& pose, std::vector<int>& cells) const;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SDLUTILS_H
+#define SDLUTILS_H
+
+#include <SDL/SDL.h>
+
+/**
+ * @brief Sets a pixel of an SDL Surface to a specific color.
+ *
+ * The surface should be locked (see SDL_LockSurface()) before calling this function.
+ * This function comes from the SDL documentation.
+ *
+ * @param surface The SDL Surface.
+ * @param x The x-coordinate of the pixel to set.
+ * @param y The y-coordinate of the pixel to set.
+ * @param pixel The color to set to the pixel, as a 32-bits unsigned integer (use SDL_MapRGB() / SDL_MapRGBA() to create it).
+ * @param check True if the provided coordinates must be checked before setting the pixel. If check is False and invalid coordinates are set, this might cause a segfault.
+ * @return True if the pixel was successfully set.
+ */
+inline bool putPixel(SDL_Surface *surface, int x, int y, Uint32 pixel, bool check=true)
+{
+    if (check)
+    {
+        if (x < 0 || y < 0 || x >= surface->w || y >= surface->h)
+            return false;
+    }
+
+    int bpp = surface->format->BytesPerPixel;
+    /* Here p is the address to the pixel we want to set */
+    Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
+
+    switch(bpp)
+    {
+        case 1:
+            *p = pixel;
+            break;
+
+        case 2:
+            *(Uint16 *)p = pixel;
+            break;
+
+        case 3:
+            if(SDL_BYTEORDER == SDL_BIG_ENDIAN)
+            {
+                p[0] = (pixel >> 16) & 0xff;
+                p[1] = (pixel >> 8) & 0xff;
+                p[2] = pixel & 0xff;
+            }
+            else
+            {
+                p[0] = pixel & 0xff;
+                p[1] = (pixel >> 8) & 0xff;
+                p[2] = (pixel >> 16) & 0xff;
+            }
+            break;
+
+        case 4:
+            *(Uint32 *)p = pixel;
+            break;
+    }
+
+    return true;
+}
+
+#endif
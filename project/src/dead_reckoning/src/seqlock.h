@@ -0,0 +1,76 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <boost/atomic.hpp>
+
+/**
+ * @class SeqLock
+ * @brief Sequence lock, letting a single writer update data which is read by other threads without any lock.
+ *
+ * The writer surrounds its updates with writeBegin() and writeEnd(). Readers copy the data between readBegin() and readRetry(),
+ * and start again while readRetry() returns true, so that they never keep a half-updated copy:
+ *
+ * @code
+ * unsigned seq;
+ * do
+ * {
+ *     seq = lock.readBegin();
+ *     copy = data;
+ * } while (lock.readRetry(seq));
+ * @endcode
+ */
+class SeqLock
+{
+    public:
+        SeqLock():
+            m_seq(0)
+        {
+        }
+
+        /**
+         * @brief Starts an update of the protected data, must only be called by the writer thread.
+         */
+        void writeBegin()
+        {
+            m_seq.store(m_seq.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_release);
+        }
+
+        /**
+         * @brief Ends an update of the protected data.
+         */
+        void writeEnd()
+        {
+            m_seq.store(m_seq.load(boost::memory_order_relaxed) + 1, boost::memory_order_release);
+        }
+
+        /**
+         * @brief Starts reading the protected data, waiting for the end of the current update if any.
+         *
+         * @return The sequence number to give to readRetry().
+         */
+        unsigned readBegin() const
+        {
+            unsigned seq;
+            while ((seq = m_seq.load(boost::memory_order_acquire)) & 1)
+                ;
+            return seq;
+        }
+
+        /**
+         * @brief Tells if the data read since readBegin() may be inconsistent, in which case it has to be read again.
+         *
+         * @param seq The sequence number returned by readBegin().
+         * @return True if the data has been modified during the read.
+         */
+        bool readRetry(unsigned seq) const
+        {
+            boost::atomic_thread_fence(boost::memory_order_acquire);
+            return m_seq.load(boost::memory_order_relaxed) != seq;
+        }
+
+    private:
+        boost::atomic<unsigned> m_seq;  /*!< Sequence number, odd while an update is in progress. */
+};
+
+#endif
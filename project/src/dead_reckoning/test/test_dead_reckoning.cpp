@@ -0,0 +1,970 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <ros/ros.h>
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+
+#include "../src/deadreckoning.h"
+#include "../src/depthscan.h"
+#include "../src/grid.h"
+#include "../src/landmarkcorrector.h"
+#include "../src/scanmatcher.h"
+
+typedef LandmarkCorrector::Pose Pose;
+
+const double g_resolution = 0.05;
+
+/* Uniform noise of the given standard deviation.
+ */
+double noise(double stddev)
+{
+  return stddev * sqrt(3.0) * (2.0 * rand() / RAND_MAX - 1);
+}
+
+/* Random local map patch, with 30% unknown cells, as int8 occupancy in [0, 100].
+ */
+std::vector<int8_t> createPatch(int width, int height)
+{
+  std::vector<int8_t> patch(width * height);
+  for (size_t i = 0; i < patch.size(); ++i)
+  {
+    patch[i] = (rand() % 10 < 3) ? -1 : rand() % 101;
+  }
+  return patch;
+}
+
+/* Fuse a patch cell by cell with Grid::addPoint, the way Grid::blendPatch is documented to do it.
+ */
+void addPatch(Grid& grid, const std::vector<int8_t>& patch, int width, int height, int offset_x, int offset_y, int ratio,
+              ros::Time t)
+{
+  for (int y = 0; y < height; ++y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      const int8_t value = patch[y * width + x];
+      if (value >= 0)
+      {
+        grid.addPoint((offset_x + x / ratio) * g_resolution, (offset_y + y / ratio) * g_resolution, t, value * 0.01);
+      }
+    }
+  }
+}
+
+/* Check that two grids hold the same probabilities over a range of grid coordinates.
+ */
+void expectSameCells(Grid& expected, Grid& grid, int min_ix, int max_ix, int min_iy, int max_iy)
+{
+  for (int iy = min_iy; iy <= max_iy; ++iy)
+  {
+    for (int ix = min_ix; ix <= max_ix; ++ix)
+    {
+      ASSERT_NEAR(expected.get(ix * g_resolution, iy * g_resolution), grid.get(ix * g_resolution, iy * g_resolution), 1e-6)
+          << "cell (" << ix << ", " << iy << ")";
+    }
+  }
+}
+
+/* Decode the data of a dead_reckoning::CompactGrid message with ENCODING_RLE, as documented in CompactGrid.msg.
+ */
+void runLengthDecode(const std::vector<int8_t>& encoded, std::vector<int8_t>& data)
+{
+  data.clear();
+  for (size_t i = 0; i < encoded.size(); ++i)
+  {
+    const int8_t value = encoded[i];
+    if (value == dead_reckoning::CompactGrid::RUN_UNKNOWN || value == dead_reckoning::CompactGrid::RUN_FREE)
+    {
+      ASSERT_LT(i + 1, encoded.size()) << "run without length at " << i;
+      const uint8_t length = static_cast<uint8_t>(encoded[++i]);
+      ASSERT_GE(length, 1) << "empty run at " << i;
+      data.insert(data.end(), length, (value == dead_reckoning::CompactGrid::RUN_FREE) ? 0 : -1);
+    }
+    else
+    {
+      ASSERT_TRUE(value == dead_reckoning::CompactGrid::UNKNOWN || (value >= 0 && value <= 100))
+          << "value " << static_cast<int>(value) << " at " << i;
+      data.push_back(value);
+    }
+  }
+}
+
+/* Local map patch of a room with walls on its border, a box and a moving box at the given column, with 10% unknown
+ * cells.
+ */
+std::vector<int8_t> createRoomPatch(int size, int box_col)
+{
+  std::vector<int8_t> patch(size * size);
+  for (int row = 0; row < size; ++row)
+  {
+    for (int col = 0; col < size; ++col)
+    {
+      const bool wall = row < 2 || col < 2 || row >= size - 2 || col >= size - 2;
+      const bool box = (row >= 30 && row < 45 && col >= 30 && col < 45) ||
+                       (row >= 100 && row < 106 && col >= box_col && col < box_col + 6);
+      patch[row * size + col] = (wall || box) ? 100 : (rand() % 10 == 0) ? -1 : 0;
+    }
+  }
+  return patch;
+}
+
+/* Check the distance layer of a Grid against a brute force search of the closest obstacles.
+ */
+void expectDistances(Grid& grid, int min_ix, int max_ix, int min_iy, int max_iy)
+{
+  const double max_distance = grid.maxDistance();
+  const int radius = ceil(max_distance / g_resolution);
+  const Grid::View view = grid.at(ros::Time::now());
+  for (int iy = min_iy; iy <= max_iy; ++iy)
+  {
+    for (int ix = min_ix; ix <= max_ix; ++ix)
+    {
+      double expected = max_distance;
+      for (int oy = iy - radius; oy <= iy + radius; ++oy)
+      {
+        for (int ox = ix - radius; ox <= ix + radius; ++ox)
+        {
+          if (view.get(ox * g_resolution, oy * g_resolution) >= Grid::OBSTACLE)
+          {
+            expected = std::min(expected, hypot(ox - ix, oy - iy) * g_resolution);
+          }
+        }
+      }
+      const double x = ix * g_resolution, y = iy * g_resolution;
+      ASSERT_NEAR(expected, grid.distance(x, y), 1e-4) << "cell (" << ix << ", " << iy << ")";
+
+      double obstacle_x, obstacle_y;
+      if (grid.nearestObstacle(x, y, obstacle_x, obstacle_y) && expected < max_distance)
+      {
+        EXPECT_NEAR(expected, hypot(obstacle_x - x, obstacle_y - y), 1e-4);
+        EXPECT_GE(view.get(obstacle_x, obstacle_y), Grid::OBSTACLE);
+      }
+    }
+  }
+}
+
+/* Former depth cloud to laser scan conversion.
+ *
+ * COPIED FROM ../src/deadreckoning.cpp (DeadReckoning::pointCloudToLaserScan)
+ */
+void legacyPointCloudToLaserScan(const sensor_msgs::PointCloud2& cloud_msg, sensor_msgs::LaserScan& output)
+{
+  output.angle_min = -30.0 * M_PI / 180;
+  output.angle_max = 30.0 * M_PI / 180;
+  output.angle_increment = 0.1 * M_PI / 180;
+  output.time_increment = 0.0;
+  output.scan_time = 1.0 / 30.0;
+  output.range_min = 0.45;
+  output.range_max = 15.0;
+
+  uint32_t ranges_size = std::ceil((output.angle_max - output.angle_min) / output.angle_increment);
+  output.ranges.assign(ranges_size, std::numeric_limits<double>::infinity());
+
+  for (sensor_msgs::PointCloud2ConstIterator<float> iter_x(cloud_msg, "x"), iter_y(cloud_msg, "y"), iter_z(cloud_msg, "z");
+       iter_x != iter_x.end(); ++iter_x, ++iter_y, ++iter_z)
+  {
+    if (std::isnan(*iter_x) || std::isnan(*iter_y) || std::isnan(*iter_z))
+      continue;
+    if (*iter_y > 0.5 || *iter_y < -0.5)
+      continue;
+    double range = hypot(*iter_x, *iter_z);
+    if (range < output.range_min || range > output.range_max)
+      continue;
+    double angle = -atan2(*iter_x, *iter_z);
+    if (angle < output.angle_min || angle > output.angle_max)
+      continue;
+    int index = (angle - output.angle_min) / output.angle_increment;
+    if (range < output.ranges[index])
+      output.ranges[index] = range;
+  }
+}
+
+/* Organised xyz cloud seen by a pinhole camera with the Kinect intrinsics, in a 6x4x3 m room with a box on the floor,
+ * and 10% of invalid (NaN) points.
+ *
+ * COPIED FROM ../tests/depthscan_benchmark.cpp
+ */
+sensor_msgs::PointCloud2 createCloud()
+{
+  const int width = 640, height = 480;
+  const double fx = 525, cx = 319.5, fy = 525, cy = 239.5;
+  const char* names[] = { "x", "y", "z" };
+
+  sensor_msgs::PointCloud2 cloud;
+  cloud.width = width;
+  cloud.height = height;
+  cloud.is_bigendian = false;
+  cloud.is_dense = false;
+  for (int i = 0; i < 3; ++i)
+  {
+    sensor_msgs::PointField field;
+    field.name = names[i];
+    field.offset = 4 * i;
+    field.datatype = sensor_msgs::PointField::FLOAT32;
+    field.count = 1;
+    cloud.fields.push_back(field);
+  }
+  cloud.point_step = 16;
+  cloud.row_step = cloud.point_step * width;
+  cloud.data.resize(cloud.row_step * height);
+
+  for (int v = 0; v < height; ++v)
+  {
+    for (int u = 0; u < width; ++u)
+    {
+      const double dx = (u - cx) / fx, dy = (v - cy) / fy;
+      // Distance along the optical axis to the closest of the walls, floor, ceiling and box.
+      double z = 6.0;
+      if (dx != 0)
+        z = std::min(z, 2.0 / fabs(dx));
+      z = std::min(z, (dy > 0 ? 0.4 : 2.6) / std::max(fabs(dy), 1e-6));
+      if (dx > -0.2 && dx < 0.1 && dy > 0.3 / 2.5)
+        z = std::min(z, 2.5);
+
+      float point[4] = { static_cast<float>(dx * z), static_cast<float>(dy * z), static_cast<float>(z), 0 };
+      if (rand() % 10 == 0)
+        point[0] = point[1] = point[2] = std::numeric_limits<float>::quiet_NaN();
+      memcpy(&cloud.data[v * cloud.row_step + u * cloud.point_step], point, sizeof(point));
+    }
+  }
+  return cloud;
+}
+
+/* Check that two scans have the same ranges.
+ */
+void expectSameScans(const sensor_msgs::LaserScan& expected, const sensor_msgs::LaserScan& scan)
+{
+  ASSERT_EQ(expected.ranges.size(), scan.ranges.size());
+  for (size_t i = 0; i < scan.ranges.size(); ++i)
+  {
+    if (!std::isinf(expected.ranges[i]) || !std::isinf(scan.ranges[i]))
+    {
+      EXPECT_NEAR(expected.ranges[i], scan.ranges[i], 1e-4) << "ray " << i;
+    }
+  }
+}
+
+struct Segment
+{
+  double x1, y1, x2, y2;
+};
+
+/* Walls of a 10x8 m room, and boxes.
+ *
+ * COPIED FROM ../tests/scanmatcher_benchmark.cpp
+ */
+std::vector<Segment> createWorld()
+{
+  const double polygons[][4][2] = {
+    { { -2, -2 }, { 8, -2 }, { 8, 6 }, { -2, 6 } },
+    { { 1.5, 1.5 }, { 2.5, 1.5 }, { 2.5, 2.5 }, { 1.5, 2.5 } },
+    { { 4, 3 }, { 4.6, 3 }, { 4.6, 4.2 }, { 4, 4.2 } },
+    { { 6.5, -1.5 }, { 7.5, -1.5 }, { 7.5, -0.8 }, { 6.5, -0.8 } },
+  };
+  std::vector<Segment> world;
+  for (size_t p = 0; p < sizeof(polygons) / sizeof(polygons[0]); ++p)
+  {
+    for (int i = 0; i < 4; ++i)
+    {
+      Segment s = { polygons[p][i][0], polygons[p][i][1], polygons[p][(i + 1) % 4][0], polygons[p][(i + 1) % 4][1] };
+      world.push_back(s);
+    }
+  }
+  return world;
+}
+
+/* Simulate a 270 degrees laser scan at the given pose, returned as points in the robot's coordinate system.
+ *
+ * COPIED FROM ../tests/scanmatcher_benchmark.cpp
+ */
+void simulateScan(const std::vector<Segment>& world, const Pose& pose, std::vector<ScanMatcher::Point>& points)
+{
+  const int rays = 540;
+  const double fov = 270 * M_PI / 180, max_range = 8.0;
+  points.clear();
+  for (int i = 0; i < rays; ++i)
+  {
+    const double angle = -fov / 2 + i * fov / (rays - 1);
+    const double dx = cos(pose.z + angle), dy = sin(pose.z + angle);
+    double range = max_range;
+    for (size_t s = 0; s < world.size(); ++s)
+    {
+      // Intersection of the ray with the segment.
+      const double ex = world[s].x2 - world[s].x1, ey = world[s].y2 - world[s].y1;
+      const double det = dx * (-ey) - dy * (-ex);
+      if (fabs(det) < 1e-9)
+        continue;
+      const double wx = world[s].x1 - pose.x, wy = world[s].y1 - pose.y;
+      const double t = (wx * (-ey) - wy * (-ex)) / det;
+      const double u = (dx * wy - dy * wx) / det;
+      if (t > 0 && u >= 0 && u <= 1)
+        range = std::min(range, t);
+    }
+    if (range < max_range)
+    {
+      range += noise(0.01);
+      ScanMatcher::Point point = { range * cos(angle), range * sin(angle) };
+      points.push_back(point);
+    }
+  }
+}
+
+/* Add scan points seen from a pose to a Grid.
+ */
+void addScan(Grid& grid, const std::vector<ScanMatcher::Point>& points, const Pose& pose, ros::Time t)
+{
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    grid.addPoint(pose.x + cos(pose.z) * points[i].x - sin(pose.z) * points[i].y,
+                  pose.y + sin(pose.z) * points[i].x + cos(pose.z) * points[i].y, t, 0.9);
+  }
+}
+
+TEST(TestSuite, testGridCells)
+{
+  Grid grid(g_resolution, ros::Duration(1e6), -1, 1, -2, 2, false);
+  const ros::Time t = ros::Time::now();
+  EXPECT_DOUBLE_EQ(-1, grid.minX());
+  EXPECT_DOUBLE_EQ(-2, grid.minY());
+  EXPECT_EQ(41, grid.width());
+  EXPECT_EQ(81, grid.height());
+
+  // Points are stored in the closest cell, a fixed Grid rejects the points outside of it.
+  EXPECT_DOUBLE_EQ(-1, grid.get(0.5, -1.5));
+  EXPECT_TRUE(grid.addPoint(0.5, -1.5, t, 0.3));
+  EXPECT_TRUE(grid.addPoint(-1, 2, t, 0.8));
+  EXPECT_FALSE(grid.addPoint(1.5, 0, t, 0.5));
+  EXPECT_NEAR(0.3, grid.get(0.51, -1.49), 1e-6);
+  EXPECT_NEAR(0.8, grid.get(-1, 2), 1e-6);
+  EXPECT_DOUBLE_EQ(-1, grid.get(0.45, -1.5));
+
+  int width, height;
+  double scale;
+  double* data = grid.getAll(&width, &height, &scale);
+  EXPECT_EQ(41, width);
+  EXPECT_EQ(81, height);
+  EXPECT_DOUBLE_EQ(g_resolution, scale);
+  // Column-major order, from the upper-left corner.
+  EXPECT_NEAR(0.3, data[30 * height + 10], 1e-6);
+  EXPECT_NEAR(0.8, data[80], 1e-6);
+  EXPECT_EQ(width * height - 2, std::count(data, data + width * height, -1.0));
+  delete[] data;
+
+  // Probabilities of the same time are combined, the last one wins otherwise.
+  grid.addPoint(0.5, -1.5, t, 0.5);
+  EXPECT_NEAR(1 - (1 - 0.5) * (1 - 0.3), grid.get(0.5, -1.5), 1e-6);
+  grid.addPoint(0.5, -1.5, t + ros::Duration(1), 0.2);
+  EXPECT_NEAR(0.2, grid.get(0.5, -1.5), 1e-6);
+}
+
+TEST(TestSuite, testGridTiles)
+{
+  Grid grid(g_resolution, ros::Duration(1e6), -10, 10, -10, 10, false);
+  const ros::Time t = ros::Time::now();
+  // Grid coordinates on both sides of the tile boundaries, negative ones included.
+  const int coords[] = { -65, -64, -1, 0, 63, 64 };
+  const int nb_coords = sizeof(coords) / sizeof(coords[0]);
+  for (int i = 0; i < nb_coords; ++i)
+  {
+    for (int j = 0; j < nb_coords; ++j)
+    {
+      EXPECT_TRUE(grid.addPoint(coords[i] * g_resolution, coords[j] * g_resolution, t, 0.01 * (i * nb_coords + j + 1)));
+    }
+  }
+  EXPECT_EQ(16u, grid.nbTiles());
+  EXPECT_FALSE(grid.addPoint(10.5, 0, t, 0.5));
+  EXPECT_DOUBLE_EQ(-1, grid.get(-1, -1));
+
+  int width, height;
+  double scale;
+  double* data = grid.getAll(&width, &height, &scale);
+  EXPECT_EQ(401, width);
+  EXPECT_EQ(401, height);
+  EXPECT_DOUBLE_EQ(g_resolution, scale);
+  for (int i = 0; i < nb_coords; ++i)
+  {
+    for (int j = 0; j < nb_coords; ++j)
+    {
+      const double x = coords[i] * g_resolution, y = coords[j] * g_resolution;
+      EXPECT_NEAR(0.01 * (i * nb_coords + j + 1), grid.get(x, y), 1e-6);
+      // Column-major order, from the upper-left corner.
+      EXPECT_NEAR(grid.get(x, y), data[(coords[i] + 200) * height + coords[j] + 200], 1e-6);
+    }
+  }
+  EXPECT_DOUBLE_EQ(-1, data[0]);
+  delete[] data;
+
+  // A resizeable Grid grows without moving the existing cells.
+  Grid resizeable(g_resolution, ros::Duration(1e6), -1, 1, -1, 1, true);
+  resizeable.addPoint(0.5, 0.5, t, 0.7);
+  EXPECT_TRUE(resizeable.addPoint(-4, 6, t, 0.3));
+  EXPECT_DOUBLE_EQ(-4, resizeable.minX());
+  EXPECT_DOUBLE_EQ(-1, resizeable.minY());
+  EXPECT_EQ(101, resizeable.width());
+  EXPECT_EQ(141, resizeable.height());
+  EXPECT_NEAR(0.7, resizeable.get(0.5, 0.5), 1e-6);
+  EXPECT_NEAR(0.3, resizeable.get(-4, 6), 1e-6);
+}
+
+TEST(TestSuite, testBlendPatch)
+{
+  const int width = 300, height = 200;
+  srand(0);
+  const std::vector<int8_t> patch = createPatch(width, height);
+  const ros::Time t = ros::Time::now();
+
+  for (int ratio = 1; ratio <= 2; ++ratio)
+  {
+    // Patches overlapping the border of a fixed Grid, and growing a resizeable one.
+    for (int resizeable = 0; resizeable <= 1; ++resizeable)
+    {
+      Grid added(g_resolution, ros::Duration(1e6), -2, 2, -2, 2, resizeable);
+      Grid blended(added);
+      for (int i = 0; i < 3; ++i)
+      {
+        // The second patch is fused with the same time stamp as the first one.
+        const ros::Time stamp = t + ros::Duration(i / 2);
+        const int offset_x = -170 + 37 * i, offset_y = -90 + 11 * i;
+        addPatch(added, patch, width, height, offset_x, offset_y, ratio, stamp);
+        EXPECT_TRUE(blended.blendPatch(&patch[0], width, height, offset_x, offset_y, ratio, stamp));
+      }
+      EXPECT_EQ(added.nbTiles(), blended.nbTiles());
+      EXPECT_EQ(added.width(), blended.width());
+      EXPECT_EQ(added.height(), blended.height());
+      EXPECT_DOUBLE_EQ(added.minX(), blended.minX());
+      EXPECT_DOUBLE_EQ(added.minY(), blended.minY());
+      expectSameCells(added, blended, -180, 250, -100, 180);
+    }
+
+    // A resizeable Grid only grows over the known cells of a patch, not over its unknown border.
+    std::vector<int8_t> bordered(width * height, -1);
+    for (int y = 50; y < 121; ++y)
+    {
+      std::fill(bordered.begin() + y * width + 80, bordered.begin() + y * width + 211, 40);
+    }
+    Grid added(g_resolution, ros::Duration(1e6), 0, 0, 0, 0, true);
+    Grid blended(added);
+    addPatch(added, bordered, width, height, -145 / ratio, -85 / ratio, ratio, t);
+    EXPECT_TRUE(blended.blendPatch(&bordered[0], width, height, -145 / ratio, -85 / ratio, ratio, t));
+    EXPECT_EQ(130 / ratio + 1, blended.width());
+    EXPECT_EQ(70 / ratio + 1, blended.height());
+    EXPECT_EQ(added.width(), blended.width());
+    EXPECT_EQ(added.height(), blended.height());
+    EXPECT_DOUBLE_EQ(added.minX(), blended.minX());
+    EXPECT_DOUBLE_EQ(added.minY(), blended.minY());
+    expectSameCells(added, blended, -180, 250, -100, 180);
+  }
+
+  // Patches outside of a fixed Grid are rejected, unknown patches do not allocate tiles.
+  Grid grid(g_resolution, ros::Duration(1e6), -2, 2, -2, 2, false);
+  EXPECT_FALSE(grid.blendPatch(&patch[0], width, height, 100, 0, 1, t));
+  const std::vector<int8_t> unknown(width * height, -1);
+  EXPECT_TRUE(grid.blendPatch(&unknown[0], width, height, -100, -100, 1, t));
+  EXPECT_EQ(0u, grid.nbTiles());
+}
+
+TEST(TestSuite, testDirtyTiles)
+{
+  Grid grid(g_resolution, ros::Duration(1e6), -10, 10, -10, 10, false);
+  const ros::Time t = ros::Time::now();
+  std::vector<Grid::TileCoord> tiles;
+  grid.addPoint(0, 0, t, 0.9);
+  grid.addPoint(0.1, 0, t, 0.9);
+  grid.addPoint(-0.05, -3.2, t, 0.2);
+  grid.popDirtyTiles(tiles);
+  ASSERT_EQ(2u, tiles.size());
+  EXPECT_EQ(0, tiles[0].x);
+  EXPECT_EQ(0, tiles[0].y);
+  EXPECT_EQ(-1, tiles[1].x);
+  EXPECT_EQ(-1, tiles[1].y);
+
+  // A modified tile is reported once.
+  grid.popDirtyTiles(tiles);
+  EXPECT_TRUE(tiles.empty());
+  grid.addPoint(0, 0.1, t, 0.5);
+  grid.popDirtyTiles(tiles);
+  EXPECT_EQ(1u, tiles.size());
+
+  // A keyframe reports all the allocated tiles, which are clean afterwards.
+  grid.addPoint(3.2, 0, t, 0.5);
+  grid.popDirtyTiles(tiles, true);
+  EXPECT_EQ(3u, tiles.size());
+  grid.popDirtyTiles(tiles);
+  EXPECT_TRUE(tiles.empty());
+
+  // A patch only dirties the allocated tiles it covers, and the ones where it has known cells.
+  std::vector<int8_t> patch(128 * 64, -1);
+  patch[10] = 50;
+  grid.blendPatch(&patch[0], 128, 64, -64, -64, 1, t);
+  grid.popDirtyTiles(tiles);
+  ASSERT_EQ(1u, tiles.size());
+  EXPECT_EQ(-1, tiles[0].x);
+  EXPECT_EQ(-1, tiles[0].y);
+}
+
+TEST(TestSuite, testQuantizedTile)
+{
+  Grid grid(g_resolution, ros::Duration(1e6), -10, 10, -10, 10, false);
+  srand(0);
+  const std::vector<int8_t> patch = createPatch(100, 100);
+  grid.blendPatch(&patch[0], 100, 100, -30, -30, 1, ros::Time::now());
+
+  Grid copy(grid);
+  std::vector<uint8_t> data(Grid::TILE_CELLS), copied(Grid::TILE_CELLS);
+  for (int ty = -1; ty <= 1; ++ty)
+  {
+    for (int tx = -1; tx <= 1; ++tx)
+    {
+      grid.getQuantizedTile(tx, ty, &data[0]);
+      copy.setQuantizedTile(tx, ty, &data[0], ros::Time::now());
+      copy.getQuantizedTile(tx, ty, &copied[0]);
+      EXPECT_TRUE(data == copied) << "tile (" << tx << ", " << ty << ")";
+    }
+  }
+  for (int iy = -64; iy < 128; ++iy)
+  {
+    for (int ix = -64; ix < 128; ++ix)
+    {
+      const double p = grid.get(ix * g_resolution, iy * g_resolution);
+      const double q = copy.get(ix * g_resolution, iy * g_resolution);
+      ASSERT_EQ(p < 0, q < 0);
+      EXPECT_NEAR(p, q, 0.5 / Grid::QUANTIZED_MAX + 1e-6);
+    }
+  }
+  // Fully unknown tiles are not allocated.
+  EXPECT_EQ(grid.nbTiles(), copy.nbTiles());
+}
+
+TEST(TestSuite, testRunLengthEncoding)
+{
+  // Runs of unknown and free cells around the run length limits, between single cells.
+  std::vector<int8_t> data;
+  const size_t lengths[] = {1, 2, 3, 254, 255, 256, 510, 511, 1000};
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+  {
+    data.insert(data.end(), lengths[i], -1);
+    data.push_back(100);
+    data.insert(data.end(), lengths[i], 0);
+    data.push_back(50);
+    data.insert(data.end(), lengths[i], 0);
+    data.insert(data.end(), lengths[i], -1);
+  }
+  std::vector<int8_t> encoded, decoded;
+  DeadReckoning::runLengthEncode(data, encoded);
+  runLengthDecode(encoded, decoded);
+  EXPECT_TRUE(data == decoded);
+  EXPECT_LT(encoded.size(), data.size() / 20);
+
+  DeadReckoning::runLengthEncode(std::vector<int8_t>(), encoded);
+  EXPECT_TRUE(encoded.empty());
+
+  // Grid of a room, as published in dead_reckoning::CompactGrid messages.
+  Grid grid(g_resolution, ros::Duration(1e6), -10, 10, -10, 10, true);
+  srand(0);
+  const std::vector<int8_t> patch = createRoomPatch(150, 80);
+  grid.blendPatch(&patch[0], 150, 150, -40, -60, 1, ros::Time::now());
+  int width, height;
+  grid.getAll(data, &width, &height);
+  ASSERT_EQ(static_cast<size_t>(width * height), data.size());
+  DeadReckoning::runLengthEncode(data, encoded);
+  runLengthDecode(encoded, decoded);
+  EXPECT_TRUE(data == decoded);
+  EXPECT_LT(encoded.size(), data.size());
+}
+
+TEST(TestSuite, testExpire)
+{
+  Grid grid(g_resolution, ros::Duration(10), -10, 10, -10, 10, false);
+  const ros::Time t(1000);
+  grid.addPoint(0, 0, t, 0.9);
+  grid.addPoint(5, 5, t + ros::Duration(5), 0.9);
+  grid.addPoint(5.05, 5, t, 0.2);
+  std::vector<Grid::TileCoord> tiles;
+  grid.popDirtyTiles(tiles);
+  EXPECT_EQ(2u, tiles.size());
+
+  // The first cell expires and its tile is freed, the one of the second cell is only modified.
+  EXPECT_EQ(1, grid.expire(t + ros::Duration(12), 100));
+  EXPECT_EQ(1u, grid.nbTiles());
+  grid.popDirtyTiles(tiles);
+  EXPECT_EQ(2u, tiles.size());
+  const Grid::View view = grid.at(t + ros::Duration(12));
+  EXPECT_DOUBLE_EQ(-1, view.get(0, 0));
+  EXPECT_DOUBLE_EQ(-1, view.get(5.05, 5));
+  EXPECT_NEAR(0.9, view.get(5, 5), 1e-6);
+
+  // Nothing left to expire, no tile is reported.
+  EXPECT_EQ(0, grid.expire(t + ros::Duration(12), 100));
+  grid.popDirtyTiles(tiles);
+  EXPECT_TRUE(tiles.empty());
+
+  // A few tiles at a time.
+  for (int i = 0; i < 5; ++i)
+  {
+    grid.addPoint(-5 + 3.2 * i, -5, t + ros::Duration(12), 0.9);
+  }
+  EXPECT_EQ(6u, grid.nbTiles());
+  int freed = 0;
+  for (int i = 0; i < 3; ++i)
+  {
+    const int n = grid.expire(t + ros::Duration(30), 2);
+    EXPECT_LE(n, 2);
+    freed += n;
+  }
+  EXPECT_EQ(6, freed);
+  EXPECT_EQ(0u, grid.nbTiles());
+}
+
+TEST(TestSuite, testTileVersions)
+{
+  Grid grid(g_resolution, ros::Duration(10), -10, 10, -10, 10, false);
+  const ros::Time t(1000);
+  EXPECT_EQ(0u, grid.tileVersion(0, 0));
+  grid.addPoint(0, 0, t, 0.9);
+  grid.addPoint(5, 5, t + ros::Duration(5), 0.9);
+  const uint32_t version = grid.tileVersion(0, 0), other = grid.tileVersion(1, 1);
+  EXPECT_NE(0u, version);
+  EXPECT_NE(version, other);
+  const Grid::TileCoord tile = grid.tileAt(5, 5);
+  EXPECT_EQ(1, tile.x);
+  EXPECT_EQ(1, tile.y);
+
+  // The versions do not depend on popDirtyTiles(), which the GridDelta publisher consumes.
+  std::vector<Grid::TileCoord> tiles;
+  grid.popDirtyTiles(tiles);
+  EXPECT_EQ(version, grid.tileVersion(0, 0));
+  grid.addPoint(0.05, 0, t, 0.5);
+  EXPECT_GT(grid.tileVersion(0, 0), other);
+  EXPECT_EQ(other, grid.tileVersion(1, 1));
+
+  // A freed tile has no version any more, a tile modified by expire() gets a new one.
+  grid.addPoint(5.05, 5, t, 0.2);
+  const uint32_t before = grid.tileVersion(1, 1);
+  EXPECT_EQ(1, grid.expire(t + ros::Duration(12), 100));
+  EXPECT_EQ(0u, grid.tileVersion(0, 0));
+  EXPECT_NE(before, grid.tileVersion(1, 1));
+}
+
+TEST(TestSuite, testDepthScan)
+{
+  srand(0);
+  const sensor_msgs::PointCloud2 cloud = createCloud();
+  sensor_msgs::LaserScan legacy_scan, scan;
+  legacyPointCloudToLaserScan(cloud, legacy_scan);
+
+  DepthScan organised(0.1 * M_PI / 180);
+  ASSERT_TRUE(organised.convert(cloud, scan));
+  expectSameScans(legacy_scan, scan);
+
+  // The same points as an unorganised cloud.
+  sensor_msgs::PointCloud2 unorganised = cloud;
+  unorganised.width = cloud.width * cloud.height;
+  unorganised.height = 1;
+  unorganised.row_step = unorganised.width * cloud.point_step;
+  DepthScan unorganised_scan(0.1 * M_PI / 180);
+  ASSERT_TRUE(unorganised_scan.convert(unorganised, scan));
+  expectSameScans(legacy_scan, scan);
+
+  // A decimated cloud is a subset of the points: no range can get shorter.
+  DepthScan decimated(0.1 * M_PI / 180, 2);
+  EXPECT_EQ(2, decimated.stride());
+  ASSERT_TRUE(decimated.convert(cloud, scan));
+  ASSERT_EQ(legacy_scan.ranges.size(), scan.ranges.size());
+  for (size_t i = 0; i < scan.ranges.size(); ++i)
+  {
+    EXPECT_GE(scan.ranges[i] + 1e-4, legacy_scan.ranges[i]) << "ray " << i;
+  }
+}
+
+TEST(TestSuite, testDepthScanLookupTable)
+{
+  srand(0);
+  const sensor_msgs::PointCloud2 cloud = createCloud();
+  sensor_msgs::LaserScan legacy_scan, scan;
+  legacyPointCloudToLaserScan(cloud, legacy_scan);
+
+  // Bearings of the columns learnt from the cloud, then from the intrinsics.
+  DepthScan learnt(0.1 * M_PI / 180);
+  ASSERT_TRUE(learnt.convert(cloud, scan));
+  expectSameScans(legacy_scan, scan);
+  DepthScan intrinsics(0.1 * M_PI / 180);
+  intrinsics.setIntrinsics(525, 319.5, 640);
+  ASSERT_TRUE(intrinsics.convert(cloud, scan));
+  expectSameScans(legacy_scan, scan);
+
+  // The tables are rebuilt when the dimensions of the cloud change.
+  sensor_msgs::PointCloud2 half = cloud;
+  half.height = cloud.height / 2;
+  half.data.resize(half.row_step * half.height);
+  legacyPointCloudToLaserScan(half, legacy_scan);
+  ASSERT_TRUE(learnt.convert(half, scan));
+  expectSameScans(legacy_scan, scan);
+  ASSERT_TRUE(intrinsics.convert(half, scan));
+  expectSameScans(legacy_scan, scan);
+
+  // Intrinsics given for another resolution are scaled to the width of the cloud.
+  DepthScan decimated(0.1 * M_PI / 180, 2);
+  decimated.setIntrinsics(525, 319.5, 640);
+  legacyPointCloudToLaserScan(cloud, legacy_scan);
+  ASSERT_TRUE(decimated.convert(cloud, scan));
+  ASSERT_EQ(legacy_scan.ranges.size(), scan.ranges.size());
+  for (size_t i = 0; i < scan.ranges.size(); ++i)
+  {
+    EXPECT_GE(scan.ranges[i] + 1e-4, legacy_scan.ranges[i]) << "ray " << i;
+  }
+}
+
+TEST(TestSuite, testCorrection)
+{
+  const Pose from = { 1, 2, 0.3 }, to = { -0.5, 4, -1.2 }, other = { 3, -1, 2.5 };
+  const LandmarkCorrector::Correction a = LandmarkCorrector::Correction::between(from, to);
+  const Pose moved = a.apply(from);
+  EXPECT_NEAR(to.x, moved.x, 1e-9);
+  EXPECT_NEAR(to.y, moved.y, 1e-9);
+  EXPECT_NEAR(to.z, moved.z, 1e-9);
+
+  const LandmarkCorrector::Correction b = LandmarkCorrector::Correction::between(to, other);
+  const Pose composed = b.after(a).apply(from);
+  EXPECT_NEAR(other.x, composed.x, 1e-9);
+  EXPECT_NEAR(other.y, composed.y, 1e-9);
+  EXPECT_NEAR(cos(other.z), cos(composed.z), 1e-9);
+  EXPECT_NEAR(sin(other.z), sin(composed.z), 1e-9);
+
+  double px = other.x, py = other.y;
+  a.applyToPoint(px, py);
+  const Pose point = a.apply(other);
+  EXPECT_NEAR(point.x, px, 1e-9);
+  EXPECT_NEAR(point.y, py, 1e-9);
+  EXPECT_TRUE(LandmarkCorrector::IDENTITY.isIdentity());
+  EXPECT_FALSE(a.isIdentity());
+}
+
+TEST(TestSuite, testLandmarkCorrection)
+{
+  // Replay of landmark_benchmark: laps of a 5x5 m square with markers on the walls, odometry with a scale error and a
+  // gyroscope bias, and 1% of detections with a wrong ID.
+  srand(0);
+  std::vector<double> markers_x, markers_y;
+  for (int i = 0; i < 4; ++i)
+  {
+    const double offsets[] = { -3, 0, 3 };
+    for (int j = 0; j < 3; ++j)
+    {
+      const double u = offsets[j] + 2.5, v = (i < 2) ? -2 : 7;
+      markers_x.push_back((i % 2 == 0) ? u : v);
+      markers_y.push_back((i % 2 == 0) ? v : u);
+    }
+  }
+
+  LandmarkCorrector corrector;
+  LandmarkCorrector::Correction correction = LandmarkCorrector::IDENTITY;
+  Pose truth = { 0, 0, 0 }, odom = truth;
+  double open_loop_sq = 0, corrected_sq = 0;
+  int count = 0;
+  double next_camera = 0;
+  for (int side = 0; side < 12; ++side)
+  {
+    const int straight_steps = 5.0 / (0.3 * 0.02);
+    const int turn_steps = (M_PI / 2) / (0.5 * 0.02);
+    for (int step = 0; step < straight_steps + turn_steps; ++step)
+    {
+      const bool turning = step >= straight_steps;
+      const double ds = turning ? 0 : 0.3 * 0.02;
+      const double dz = turning ? 0.5 * 0.02 : 0;
+      truth.x += ds * cos(truth.z);
+      truth.y += ds * sin(truth.z);
+      truth.z += dz;
+      const double odom_ds = ds * 1.03 + noise(0.0005);
+      const double odom_dz = dz + 0.1 * M_PI / 180 * 0.02 + noise(0.0005);
+      odom.x += odom_ds * cos(odom.z);
+      odom.y += odom_ds * sin(odom.z);
+      odom.z += odom_dz;
+
+      next_camera -= 0.02;
+      if (next_camera <= 0)
+      {
+        next_camera += 0.1;
+        for (size_t m = 0; m < markers_x.size(); ++m)
+        {
+          const double dx = markers_x[m] - truth.x, dy = markers_y[m] - truth.y;
+          const double range = hypot(dx, dy);
+          const double bearing = atan2(sin(atan2(dy, dx) - truth.z), cos(atan2(dy, dx) - truth.z));
+          if (range < 0.5 || range > 4 || fabs(bearing) > 30 * M_PI / 180)
+            continue;
+          const int id = (rand() % 100 == 0) ? (m + 1) % markers_x.size() : m;
+          corrector.observe(id, correction.apply(odom), range * (1 + noise(0.02)), bearing + noise(1.0 * M_PI / 180));
+          correction = corrector.takeCorrection().after(correction);
+        }
+      }
+
+      const Pose corrected = correction.apply(odom);
+      open_loop_sq += pow(odom.x - truth.x, 2) + pow(odom.y - truth.y, 2);
+      corrected_sq += pow(corrected.x - truth.x, 2) + pow(corrected.y - truth.y, 2);
+      ++count;
+    }
+  }
+
+  const double open_loop_rms = sqrt(open_loop_sq / count), corrected_rms = sqrt(corrected_sq / count);
+  EXPECT_LT(corrected_rms, 0.6 * open_loop_rms);
+  // The wrong detections are discarded.
+  EXPECT_GT(corrector.nbRejected(), 0);
+  double x, y;
+  EXPECT_TRUE(corrector.landmark(1, x, y));
+  EXPECT_FALSE(corrector.landmark(100, x, y));
+}
+
+TEST(TestSuite, testPoseCorrection)
+{
+  LandmarkCorrector corrector;
+  const double cov[3][3] = { { 0.0025, 0, 0 }, { 0, 0.0025, 0 }, { 0, 0, 0.001 } };
+  const Pose start = { 0, 0, 0 };
+  EXPECT_TRUE(corrector.correct(start, start, cov));
+  EXPECT_TRUE(corrector.takeCorrection().isIdentity());
+
+  // After 1 m, the measured pose and the estimated one are about as uncertain: the correction goes half way.
+  const Pose estimated = { 1, 0, 0 }, measured = { 1.04, 0, 0 };
+  EXPECT_TRUE(corrector.correct(estimated, measured, cov));
+  const Pose corrected = corrector.takeCorrection().apply(estimated);
+  EXPECT_GT(corrected.x, 1.01);
+  EXPECT_LT(corrected.x, 1.03);
+  EXPECT_NEAR(0, corrected.y, 1e-6);
+
+  // A measurement far away from the estimation is discarded.
+  const Pose wrong = { 2.5, 0, 0 };
+  EXPECT_FALSE(corrector.correct(corrected, wrong, cov));
+  EXPECT_EQ(1, corrector.nbRejected());
+  EXPECT_TRUE(corrector.takeCorrection().isIdentity());
+}
+
+TEST(TestSuite, testScanMatching)
+{
+  srand(0);
+  const std::vector<Segment> world = createWorld();
+  Grid grid(g_resolution, ros::Duration(1e6), -3, 9, -3, 7, false);
+  std::vector<ScanMatcher::Point> points;
+  const ros::Time t = ros::Time::now();
+  const Pose poses[] = { { 0, 0, 0 }, { 3, 0, M_PI / 2 }, { 5, 4.5, M_PI }, { 0, 4, -M_PI / 2 } };
+  for (size_t i = 0; i < sizeof(poses) / sizeof(poses[0]); ++i)
+  {
+    simulateScan(world, poses[i], points);
+    addScan(grid, points, poses[i], t);
+  }
+
+  ScanMatcher matcher;
+  const Pose truth = { 1, 0.5, 0.2 };
+  matcher.updateField(grid, truth.x, truth.y);
+
+  simulateScan(world, truth, points);
+  for (int i = 0; i < 10; ++i)
+  {
+    // Guesses within the search window, the branch and bound must find a pose as good as the exhaustive search.
+    const ScanMatcher::Pose guess = { truth.x + noise(0.1), truth.y + noise(0.1), truth.z + noise(4 * M_PI / 180) };
+    ScanMatcher::Pose result, exhaustive_result;
+    double score, exhaustive_score;
+    ASSERT_TRUE(matcher.match(points, guess, result, &score));
+    ASSERT_TRUE(matcher.match(points, guess, exhaustive_result, &exhaustive_score, true));
+    EXPECT_NEAR(exhaustive_score, score, 1e-6);
+    EXPECT_NEAR(truth.x, result.x, 0.05);
+    EXPECT_NEAR(truth.y, result.y, 0.05);
+    EXPECT_NEAR(truth.z, result.z, 1.0 * M_PI / 180);
+    EXPECT_GE(score + 1e-6, matcher.score(points, guess));
+    EXPECT_NEAR(score, matcher.score(points, result), 1e-4);
+  }
+
+  // Lower scores give larger covariances.
+  double good[3][3], bad[3][3];
+  matcher.covariance(0.9, good);
+  matcher.covariance(0.4, bad);
+  for (int i = 0; i < 3; ++i)
+  {
+    EXPECT_GT(good[i][i], 0);
+    EXPECT_GT(bad[i][i], good[i][i]);
+  }
+
+  // Too far from the guess, or a scan which does not fit the map.
+  ScanMatcher::Pose result;
+  const ScanMatcher::Pose far = { truth.x + 1.5, truth.y - 1.0, truth.z };
+  matcher.setMinScore(0.6);
+  EXPECT_FALSE(matcher.match(points, far, result));
+}
+
+TEST(TestSuite, testDistances)
+{
+  const int size = 160;
+  srand(0);
+  Grid grid(g_resolution, ros::Duration(1e6), -10, 10, -10, 10, false);
+  const ros::Time t = ros::Time::now();
+  std::vector<int8_t> patch = createRoomPatch(size, 60);
+  grid.blendPatch(&patch[0], size, size, -80, -80, 1, t);
+
+  // Built from scratch.
+  grid.enableDistances(0.5);
+  EXPECT_TRUE(grid.hasDistances());
+  expectDistances(grid, -80, 79, -80, 79);
+
+  // Updated while the box moves.
+  for (int i = 1; i <= 5; ++i)
+  {
+    patch = createRoomPatch(size, 60 + 7 * i);
+    grid.blendPatch(&patch[0], size, size, -80, -80, 1, t + ros::Duration(i));
+    expectDistances(grid, -80, 79, 0, 60);
+  }
+
+  // Obstacles removed by expire(): the cells not seen since the first two patches, and an obstacle added in the past.
+  grid.addPoint(-1, -1, t - ros::Duration(10), 1.0);
+  EXPECT_DOUBLE_EQ(0, grid.distance(-1, -1));
+  grid.expire(t + ros::Duration(1e6 + 2), 1000);
+  EXPECT_GT(grid.distance(-1, -1), 0);
+  expectDistances(grid, -80, 79, -80, 79);
+
+  Grid disabled(g_resolution);
+  EXPECT_FALSE(disabled.hasDistances());
+  EXPECT_LT(disabled.distance(0, 0), 0);
+}
+
+TEST(TestSuite, testScanMatcherField)
+{
+  srand(0);
+  const std::vector<Segment> world = createWorld();
+  Grid grid(g_resolution, ros::Duration(1e6), -3, 9, -3, 7, false);
+  std::vector<ScanMatcher::Point> points;
+  const ros::Time t = ros::Time::now();
+  const Pose poses[] = { { 0, 0, 0 }, { 3, 0, M_PI / 2 }, { 5, 4.5, M_PI }, { 0, 4, -M_PI / 2 } };
+  for (size_t i = 0; i < sizeof(poses) / sizeof(poses[0]); ++i)
+  {
+    simulateScan(world, poses[i], points);
+    addScan(grid, points, poses[i], t);
+  }
+
+  // The likelihood field is computed from the distance layer of the Grid, which is enabled if needed.
+  ScanMatcher matcher;
+  EXPECT_FALSE(matcher.hasField());
+  EXPECT_FALSE(grid.hasDistances());
+  const Pose truth = { 1, 0.5, 0.2 };
+  matcher.updateField(grid, truth.x, truth.y);
+  ASSERT_TRUE(matcher.hasField());
+  EXPECT_TRUE(grid.hasDistances());
+  EXPECT_NEAR(truth.x, matcher.fieldX(), g_resolution);
+  EXPECT_NEAR(truth.y, matcher.fieldY(), g_resolution);
+
+  // A scan lying on the obstacles scores higher than the same scan shifted away from them.
+  simulateScan(world, truth, points);
+  const ScanMatcher::Pose exact = { truth.x, truth.y, truth.z };
+  const ScanMatcher::Pose shifted = { truth.x + 0.3, truth.y + 0.15, truth.z + 0.06 };
+  EXPECT_GT(matcher.score(points, exact), 0.5);
+  EXPECT_LT(matcher.score(points, shifted), 0.5 * matcher.score(points, exact));
+}
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
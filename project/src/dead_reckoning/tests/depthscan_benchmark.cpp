@@ -0,0 +1,228 @@
+/*
+ * Micro-benchmark of the depth cloud to laser scan conversion.
+ *
+ * Compares DepthScan against the former conversion (three PointCloud2ConstIterator,
+ * hypot and atan2 for each point), on clouds recorded in a bag file or, when no bag
+ * is given, on a synthetic 640x480 organised cloud as published by the Kinect on
+ * /camera/depth/points. DepthScan is also timed with decimated clouds, and with
+ * the bearings of the columns computed from the Kinect intrinsics instead of
+ * the first cloud.
+ *
+ * Usage: rosrun dead_reckoning depthscan_benchmark [iterations] [bag file] [topic]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+
+#include "../src/depthscan.h"
+
+const double g_angle_increment = 0.1 * M_PI / 180;
+const double g_fx = 525, g_cx = 319.5;
+
+/* Former conversion.
+ *
+ * COPIED FROM ../src/deadreckoning.cpp (DeadReckoning::pointCloudToLaserScan)
+ */
+void legacyPointCloudToLaserScan(const sensor_msgs::PointCloud2& cloud_msg, sensor_msgs::LaserScan& output)
+{
+  output.angle_min = -30.0 * M_PI / 180;
+  output.angle_max = 30.0 * M_PI / 180;
+  output.angle_increment = g_angle_increment;
+  output.time_increment = 0.0;
+  output.scan_time = 1.0 / 30.0;
+  output.range_min = 0.45;
+  output.range_max = 15.0;
+
+  uint32_t ranges_size = std::ceil((output.angle_max - output.angle_min) / output.angle_increment);
+  output.ranges.assign(ranges_size, std::numeric_limits<double>::infinity());
+
+  for (sensor_msgs::PointCloud2ConstIterator<float> iter_x(cloud_msg, "x"), iter_y(cloud_msg, "y"), iter_z(cloud_msg, "z");
+       iter_x != iter_x.end(); ++iter_x, ++iter_y, ++iter_z)
+  {
+    if (std::isnan(*iter_x) || std::isnan(*iter_y) || std::isnan(*iter_z))
+      continue;
+    if (*iter_y > 0.5 || *iter_y < -0.5)
+      continue;
+    double range = hypot(*iter_x, *iter_z);
+    if (range < output.range_min || range > output.range_max)
+      continue;
+    double angle = -atan2(*iter_x, *iter_z);
+    if (angle < output.angle_min || angle > output.angle_max)
+      continue;
+    int index = (angle - output.angle_min) / output.angle_increment;
+    if (range < output.ranges[index])
+      output.ranges[index] = range;
+  }
+}
+
+/* Create an organised xyz cloud seen by a pinhole camera with the Kinect intrinsics, in a 6x4x3 m room
+ * with a box on the floor, and 10% of invalid (NaN) points.
+ */
+sensor_msgs::PointCloud2 createCloud()
+{
+  const int width = 640, height = 480;
+  const double fy = 525, cy = 239.5;
+  const char* names[] = { "x", "y", "z" };
+
+  sensor_msgs::PointCloud2 cloud;
+  cloud.width = width;
+  cloud.height = height;
+  cloud.is_bigendian = false;
+  cloud.is_dense = false;
+  for (int i = 0; i < 3; ++i)
+  {
+    sensor_msgs::PointField field;
+    field.name = names[i];
+    field.offset = 4 * i;
+    field.datatype = sensor_msgs::PointField::FLOAT32;
+    field.count = 1;
+    cloud.fields.push_back(field);
+  }
+  cloud.point_step = 16;
+  cloud.row_step = cloud.point_step * width;
+  cloud.data.resize(cloud.row_step * height);
+
+  for (int v = 0; v < height; ++v)
+  {
+    for (int u = 0; u < width; ++u)
+    {
+      const double dx = (u - g_cx) / g_fx, dy = (v - cy) / fy;
+      // Distance along the optical axis to the closest of the walls, floor, ceiling and box.
+      double z = 6.0;
+      if (dx != 0)
+        z = std::min(z, 2.0 / fabs(dx));
+      z = std::min(z, (dy > 0 ? 0.4 : 2.6) / std::max(fabs(dy), 1e-6));
+      if (dx > -0.2 && dx < 0.1 && dy > 0.3 / 2.5)
+        z = std::min(z, 2.5);
+
+      float point[4] = { static_cast<float>(dx * z), static_cast<float>(dy * z), static_cast<float>(z), 0 };
+      if (rand() % 10 == 0)
+        point[0] = point[1] = point[2] = std::numeric_limits<float>::quiet_NaN();
+      memcpy(&cloud.data[v * cloud.row_step + u * cloud.point_step], point, sizeof(point));
+    }
+  }
+  return cloud;
+}
+
+/* Count the rays with different ranges in two scans.
+ */
+int compareScans(const sensor_msgs::LaserScan& a, const sensor_msgs::LaserScan& b)
+{
+  int differences = 0;
+  for (size_t i = 0; i < a.ranges.size(); ++i)
+  {
+    if (!(a.ranges[i] == b.ranges[i] || fabs(a.ranges[i] - b.ranges[i]) < 1e-4))
+      ++differences;
+  }
+  return differences;
+}
+
+/* Time a DepthScan, and count the rays which differ from the former conversion.
+ */
+void runDepthScan(const char* name, DepthScan& depth_scan, const std::vector<sensor_msgs::PointCloud2>& clouds,
+                  int iterations)
+{
+  sensor_msgs::LaserScan legacy_scan, scan;
+  int differences = 0;
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    for (size_t c = 0; c < clouds.size(); ++c)
+      depth_scan.convert(clouds[c], scan);
+  }
+  const double time = (ros::WallTime::now() - start).toSec() / (iterations * clouds.size());
+
+  for (size_t c = 0; c < clouds.size(); ++c)
+  {
+    legacyPointCloudToLaserScan(clouds[c], legacy_scan);
+    depth_scan.convert(clouds[c], scan);
+    differences += compareScans(legacy_scan, scan);
+  }
+  std::cout << name << ": " << time * 1e3 << " ms" << std::endl;
+  std::cout << "  (" << differences << " different rays in " << clouds.size() << " scans)" << std::endl;
+}
+
+void run(const std::vector<sensor_msgs::PointCloud2>& clouds, int iterations)
+{
+  sensor_msgs::LaserScan legacy_scan, scan;
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    for (size_t c = 0; c < clouds.size(); ++c)
+      legacyPointCloudToLaserScan(clouds[c], legacy_scan);
+  }
+  const double legacy_time = (ros::WallTime::now() - start).toSec() / (iterations * clouds.size());
+
+  std::cout << "Iterators, hypot and atan2 (former conversion): " << legacy_time * 1e3 << " ms" << std::endl;
+
+  {
+    DepthScan depth_scan(g_angle_increment);
+    runDepthScan("DepthScan", depth_scan, clouds, iterations);
+  }
+  {
+    DepthScan depth_scan(g_angle_increment);
+    depth_scan.setIntrinsics(g_fx, g_cx, 640);
+    runDepthScan("DepthScan, bearings from intrinsics", depth_scan, clouds, iterations);
+  }
+  // Decimated clouds give different scans, only the timings are relevant.
+  for (int stride = 2; stride <= 4; stride *= 2)
+  {
+    DepthScan depth_scan(g_angle_increment, stride);
+    ros::WallTime start = ros::WallTime::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+      for (size_t c = 0; c < clouds.size(); ++c)
+        depth_scan.convert(clouds[c], scan);
+    }
+    const double time = (ros::WallTime::now() - start).toSec() / (iterations * clouds.size());
+    std::cout << "DepthScan, stride " << stride << ": " << time * 1e3 << " ms" << std::endl;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  const int iterations = (argc > 1) ? atoi(argv[1]) : 20;
+  std::vector<sensor_msgs::PointCloud2> clouds;
+
+  if (argc > 2)
+  {
+    const std::string topic = (argc > 3) ? argv[3] : "/camera/depth/points";
+    rosbag::Bag bag(argv[2]);
+    rosbag::View view(bag, rosbag::TopicQuery(topic));
+    BOOST_FOREACH(const rosbag::MessageInstance& m, view)
+    {
+      sensor_msgs::PointCloud2::ConstPtr cloud = m.instantiate<sensor_msgs::PointCloud2>();
+      if (cloud)
+        clouds.push_back(*cloud);
+    }
+    std::cout << clouds.size() << " clouds read from " << argv[2] << " (" << topic << ")" << std::endl;
+  }
+  else
+  {
+    srand(0);
+    clouds.push_back(createCloud());
+    std::cout << "Synthetic 640x480 cloud" << std::endl;
+  }
+
+  if (clouds.empty())
+    return 1;
+  run(clouds, iterations);
+  return 0;
+}
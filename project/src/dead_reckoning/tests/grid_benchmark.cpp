@@ -0,0 +1,464 @@
+/*
+ * Micro-benchmark of the Grid storage.
+ *
+ * Compares the update and read throughput of the Grid against the former
+ * layout (one heap allocated ProbabilisticPoint per cell), using the local map
+ * size of deadreckoning_real.launch (600x600 cells at 0.05 m). The last run
+ * starts from a small resizeable Grid, to measure the cost of growing it.
+ * The Grid is also updated through Grid::blendPatch(), which fuses the whole
+ * local map at once, as DeadReckoning::updateGridFromOccupancy does, and read
+ * through a Grid::View, and drawn as DeadReckoning::updateDisplay does. The time m_mapMutex is held by the display
+ * snapshot is measured both when the map was drawn in the snapshot and now that only the modified tiles are copied.
+ * Finally, the distance layer is built on a room-like map, then updated while
+ * a box moves, and compared to a brute force search of the closest obstacles.
+ *
+ * Usage: rosrun dead_reckoning grid_benchmark [iterations]
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "../src/grid.h"
+
+/* Former Grid storage, reduced to what is benchmarked.
+ *
+ * COPIED FROM ../src/deadreckoning.cpp (before the structure-of-arrays layout)
+ */
+class LegacyGrid
+{
+  public:
+    LegacyGrid(double precision, ros::Duration ttl, double minX, double maxX, double minY, double maxY) :
+      m_precision(precision), m_ttl(ttl), m_minX(minX), m_maxX(maxX), m_minY(minY), m_maxY(maxY)
+    {
+      m_height = round((m_maxY - m_minY) / m_precision)+1;
+      m_width = round((m_maxX - m_minX) / m_precision)+1;
+      m_data = new Grid::ProbabilisticPoint*[m_height*m_width];
+      memset(m_data, 0, sizeof(Grid::ProbabilisticPoint*)*m_height*m_width);
+    }
+
+    ~LegacyGrid()
+    {
+      for (int i=0 ; i < m_width*m_height ; i++)
+      {
+        if (m_data[i] != NULL)
+          delete m_data[i];
+      }
+      delete[] m_data;
+    }
+
+    bool addPoint(double x, double y, ros::Time t, double p)
+    {
+      Grid::ProbabilisticPoint point = {x, y, t, p};
+      x = m_precision * round(point.x / m_precision);
+      y = m_precision * round(point.y / m_precision);
+      if (x < m_minX || x > m_maxX || y < m_minY || y > m_maxY)
+        return false;
+      int ix = round((x-m_minX) / m_precision);
+      int iy = round((y-m_minY) / m_precision);
+      int k = ix*m_height+iy;
+      if (m_data[k] == NULL)
+        m_data[k] = new Grid::ProbabilisticPoint;
+      else if (point.t == m_data[k]->t)
+        point.p = 1 - (1-point.p)*(1-m_data[k]->p);
+      *(m_data[k]) = point;
+      return true;
+    }
+
+    double get(double x, double y)
+    {
+      int ix = round((x-m_minX) / m_precision);
+      int iy = round((y-m_minY) / m_precision);
+      if (ix < 0 || iy < 0 || ix >= m_width || iy >= m_height)
+        return -1;
+      int k = ix*m_height+iy;
+      int minTime = ros::Time::now().toSec() - m_ttl.toSec();
+      if (m_data[k] == NULL || m_data[k]->t.toSec() < minTime)
+        return -1;
+      return m_data[k]->p;
+    }
+
+    double* getAll() const
+    {
+      double *data = new double[m_width*m_height];
+      for (int k=0 ; k < m_width*m_height ; k++)
+        data[k] = m_data[k] != NULL ? m_data[k]->p : -1;
+      return data;
+    }
+
+  private:
+    double m_precision;
+    ros::Duration m_ttl;
+    double m_minX, m_maxX, m_minY, m_maxY;
+    Grid::ProbabilisticPoint** m_data;
+    int m_height, m_width;
+};
+
+const int g_patch_size = 600;
+const double g_resolution = 0.05;
+
+/* Create a random local map patch, with 30% unknown cells, as int8 occupancy in [0, 100].
+ */
+std::vector<int8_t> createPatch()
+{
+  std::vector<int8_t> patch(g_patch_size * g_patch_size);
+  for (size_t i = 0; i < patch.size(); ++i)
+  {
+    patch[i] = (rand() % 10 < 3) ? -1 : rand() % 101;
+  }
+  return patch;
+}
+
+/* Feed a patch centred on (x, y), in the same way as DeadReckoning::updateGridFromOccupancy.
+ */
+template <typename G>
+void addPatch(G& grid, const std::vector<int8_t>& patch, double x, double y, ros::Time t)
+{
+  for (int row = 0; row < g_patch_size; ++row)
+  {
+    const double fy = y + (row - g_patch_size / 2) * g_resolution;
+    for (int col = 0; col < g_patch_size; ++col)
+    {
+      const double p = patch[row * g_patch_size + col] / 100.0;
+      if (p >= 0)
+      {
+        grid.addPoint(x + (col - g_patch_size / 2) * g_resolution, fy, t, p);
+      }
+    }
+  }
+}
+
+/* Same as addPatch, with a single call to Grid::blendPatch.
+ */
+void blendPatch(Grid& grid, const std::vector<int8_t>& patch, double x, double y, ros::Time t)
+{
+  grid.blendPatch(&patch[0], g_patch_size, g_patch_size, grid.toGridCoord(x - (g_patch_size / 2) * g_resolution),
+                  grid.toGridCoord(y - (g_patch_size / 2) * g_resolution), 1, t);
+}
+
+template <typename G>
+void run(const char* name, G& grid, const std::vector<int8_t>& patch, int iterations)
+{
+  double checksum = 0;
+  const ros::Time now = ros::Time::now();
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    // Move a bit at each update, as the robot does.
+    addPatch(grid, patch, 0.1 * (i % 10), 0.05 * (i % 10), now + ros::Duration(0.1 * i));
+  }
+  const double update_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    for (int row = 0; row < g_patch_size; ++row)
+    {
+      for (int col = 0; col < g_patch_size; ++col)
+      {
+        checksum += grid.get((col - g_patch_size / 2) * g_resolution, (row - g_patch_size / 2) * g_resolution);
+      }
+    }
+  }
+  const double get_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    double* data = grid.getAll();
+    checksum += data[0];
+    delete[] data;
+  }
+  const double get_all_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  std::cout << name << ":" << std::endl;
+  std::cout << "  update (" << g_patch_size << "x" << g_patch_size << " patch): " << update_time * 1e3 << " ms" << std::endl;
+  std::cout << "  get (" << g_patch_size << "x" << g_patch_size << " reads): " << get_time * 1e3 << " ms" << std::endl;
+  std::cout << "  getAll: " << get_all_time * 1e3 << " ms" << std::endl;
+  std::cout << "  (checksum " << checksum << ")" << std::endl;
+}
+
+/* Time the reads through a Grid::View, which only computes the expiry time once, and the drawing.
+ */
+void runView(Grid& grid, int iterations)
+{
+  double checksum = 0;
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    const Grid::View view = grid.at(ros::Time::now());
+    for (int row = 0; row < g_patch_size; ++row)
+    {
+      for (int col = 0; col < g_patch_size; ++col)
+      {
+        checksum += view.get((col - g_patch_size / 2) * g_resolution, (row - g_patch_size / 2) * g_resolution);
+      }
+    }
+  }
+  const double get_time = (ros::WallTime::now() - start).toSec() / iterations;
+  std::cout << "  View::get (" << g_patch_size << "x" << g_patch_size << " reads): " << get_time * 1e3 << " ms" << std::endl;
+
+  // Same display size as DeadReckoning, zoomed in (10 m wide) and zoomed out (60 m wide).
+  SDL_Surface* surf = NULL;
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    surf = grid.draw(600, 600, -5, 5, -5, 5, surf);
+  }
+  const double draw_time = (ros::WallTime::now() - start).toSec() / iterations;
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    surf = grid.draw(600, 600, -30, 30, -30, 30, surf, Grid::DRAW_BOX);
+  }
+  const double draw_box_time = (ros::WallTime::now() - start).toSec() / iterations;
+  SDL_FreeSurface(surf);
+  std::cout << "  draw (600x600 pixels, 10 m): " << draw_time * 1e3 << " ms" << std::endl;
+  std::cout << "  draw (600x600 pixels, 60 m, box filter): " << draw_box_time * 1e3 << " ms" << std::endl;
+  std::cout << "  (checksum " << checksum << ")" << std::endl;
+}
+
+/* Time the part of DeadReckoning::captureDisplay done under m_mapMutex: formerly drawing the map, now copying the
+ * modified tiles covering the display. The worst case is measured, where all these tiles changed since the last snapshot.
+ * The tiles are then loaded into a copy of the Grid and drawn, as DeadReckoning::renderDisplay does outside the lock.
+ */
+void runDisplaySnapshot(Grid& grid, int iterations)
+{
+  SDL_Surface* surf = NULL;
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    surf = grid.draw(600, 600, -5, 5, -5, 5, surf, Grid::DRAW_BOX);
+  }
+  const double draw_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  const Grid::TileCoord min = grid.tileAt(-5, -5), max = grid.tileAt(5, 5);
+  const int tiles_x = max.x - min.x + 1;
+  const int tiles = tiles_x * (max.y - min.y + 1);
+  std::vector<uint8_t> data(tiles * Grid::TILE_CELLS);
+  std::vector<uint32_t> versions(tiles);
+  int copied = 0;
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    std::fill(versions.begin(), versions.end(), 0);
+    for (int j = 0; j < tiles; ++j)
+    {
+      const uint32_t version = grid.tileVersion(min.x + j % tiles_x, min.y + j / tiles_x);
+      if (version == versions[j])
+        continue;
+      grid.getQuantizedTile(min.x + j % tiles_x, min.y + j / tiles_x, &data[j * Grid::TILE_CELLS]);
+      versions[j] = version;
+      ++copied;
+    }
+  }
+  const double snapshot_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  Grid copy(grid);
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    for (int j = 0; j < tiles; ++j)
+    {
+      copy.setQuantizedTile(min.x + j % tiles_x, min.y + j / tiles_x, &data[j * Grid::TILE_CELLS], ros::Time::now());
+    }
+    surf = copy.draw(600, 600, -5, 5, -5, 5, surf, Grid::DRAW_BOX);
+  }
+  const double render_time = (ros::WallTime::now() - start).toSec() / iterations;
+  SDL_FreeSurface(surf);
+  std::cout << "Display snapshot (600x600 pixels, 10 m)" << std::endl;
+  std::cout << "  under m_mapMutex, drawing the map (former): " << draw_time * 1e3 << " ms" << std::endl;
+  std::cout << "  under m_mapMutex, copying " << tiles << " modified tiles: " << snapshot_time * 1e3 << " ms" << std::endl;
+  std::cout << "  display thread, loading and drawing the tiles: " << render_time * 1e3 << " ms" << std::endl;
+  std::cout << "  (" << copied / iterations << " tiles copied per snapshot)" << std::endl;
+}
+
+/* Compare Grid::addPoint and Grid::blendPatch, on two empty grids with the same settings as the provided one.
+ */
+void runBlend(const char* name, const Grid& settings, const std::vector<int8_t>& patch, int iterations)
+{
+  Grid added(settings), blended(settings);
+  const ros::Time now = ros::Time::now();
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    addPatch(added, patch, 0.1 * (i % 10), 0.05 * (i % 10), now + ros::Duration(0.1 * i));
+  }
+  const double add_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    blendPatch(blended, patch, 0.1 * (i % 10), 0.05 * (i % 10), now + ros::Duration(0.1 * i));
+  }
+  const double blend_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  // Both ways of updating must give the same Grid.
+  int differences = 0;
+  for (int row = -g_patch_size; row < g_patch_size; ++row)
+  {
+    for (int col = -g_patch_size; col < g_patch_size; ++col)
+    {
+      const double x = col * g_resolution;
+      const double y = row * g_resolution;
+      if (fabs(added.get(x, y) - blended.get(x, y)) > 1e-6)
+      {
+        ++differences;
+      }
+    }
+  }
+
+  std::cout << name << ":" << std::endl;
+  std::cout << "  addPoint (" << g_patch_size << "x" << g_patch_size << " patch): " << add_time * 1e3 << " ms" << std::endl;
+  std::cout << "  blendPatch (" << g_patch_size << "x" << g_patch_size << " patch): " << blend_time * 1e3 << " ms"
+            << std::endl;
+  std::cout << "  (" << differences << " different cells)" << std::endl;
+}
+
+/* Create a local map patch of a room with walls on its border, a few boxes and a moving box at the given column,
+ * with 10% unknown cells.
+ */
+std::vector<int8_t> createRoomPatch(int box_col)
+{
+  std::vector<int8_t> patch(g_patch_size * g_patch_size);
+  for (int row = 0; row < g_patch_size; ++row)
+  {
+    for (int col = 0; col < g_patch_size; ++col)
+    {
+      const bool wall = row < 4 || col < 4 || row >= g_patch_size - 4 || col >= g_patch_size - 4;
+      const bool box = (row % 150 < 20 && col % 150 < 20 && row > 100 && col > 100) ||
+                       (row >= 300 && row < 310 && col >= box_col && col < box_col + 10);
+      patch[row * g_patch_size + col] = (wall || box) ? 100 : (rand() % 10 == 0) ? -1 : 0;
+    }
+  }
+  return patch;
+}
+
+/* Time the distance layer, built from scratch and updated while a box moves, and count the cells whose distance
+ * differs from the closest obstacle found by brute force.
+ */
+void runDistances(int iterations)
+{
+  const double max_distance = 1.0;
+  std::vector<std::vector<int8_t> > patches;
+  for (int i = 0; i < 10; ++i)
+  {
+    patches.push_back(createRoomPatch(200 + 4 * i));
+  }
+  Grid grid(g_resolution, ros::Duration(1e6), -20, 20, -20, 20, false);
+  const ros::Time now = ros::Time::now();
+  blendPatch(grid, patches[0], 0, 0, now);
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    grid.enableDistances(max_distance);
+    grid.updateDistances();
+  }
+  const double build_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  double update_time = 0;
+  int processed = 0;
+  for (int i = 1; i <= iterations; ++i)
+  {
+    blendPatch(grid, patches[i % patches.size()], 0, 0, now + ros::Duration(0.1 * i));
+    start = ros::WallTime::now();
+    processed += grid.updateDistances();
+    update_time += (ros::WallTime::now() - start).toSec();
+  }
+  update_time /= iterations;
+
+  double checksum = 0;
+  start = ros::WallTime::now();
+  for (int row = 0; row < g_patch_size; ++row)
+  {
+    for (int col = 0; col < g_patch_size; ++col)
+    {
+      checksum += grid.distance((col - g_patch_size / 2) * g_resolution, (row - g_patch_size / 2) * g_resolution);
+    }
+  }
+  const double get_time = (ros::WallTime::now() - start).toSec();
+
+  // Brute force over the middle of the patch, around the moving box. Cells left unknown by the last patch keep their
+  // previous probability, so the obstacles are read from the Grid.
+  const int radius = ceil(max_distance / g_resolution);
+  std::vector<bool> obstacles(g_patch_size * g_patch_size);
+  for (int row = 0; row < g_patch_size; ++row)
+  {
+    for (int col = 0; col < g_patch_size; ++col)
+    {
+      obstacles[row * g_patch_size + col] =
+          grid.get((col - g_patch_size / 2) * g_resolution, (row - g_patch_size / 2) * g_resolution) >= Grid::OBSTACLE;
+    }
+  }
+  int differences = 0;
+  for (int row = 200; row < 400; ++row)
+  {
+    for (int col = 100; col < 500; ++col)
+    {
+      double expected = max_distance;
+      for (int r = row - radius; r <= row + radius; ++r)
+      {
+        for (int c = col - radius; c <= col + radius; ++c)
+        {
+          if (obstacles[r * g_patch_size + c])
+          {
+            expected = std::min(expected, hypot(r - row, c - col) * g_resolution);
+          }
+        }
+      }
+      const double d = grid.distance((col - g_patch_size / 2) * g_resolution, (row - g_patch_size / 2) * g_resolution);
+      if (fabs(d - expected) > 1e-4)
+      {
+        ++differences;
+      }
+    }
+  }
+
+  std::cout << "Distance layer (" << max_distance << " m):" << std::endl;
+  std::cout << "  build (" << g_patch_size << "x" << g_patch_size << " room): " << build_time * 1e3 << " ms" << std::endl;
+  std::cout << "  update (moving 10x10 box): " << update_time * 1e3 << " ms, " << processed / iterations
+            << " cells processed" << std::endl;
+  std::cout << "  distance (" << g_patch_size << "x" << g_patch_size << " reads): " << get_time * 1e3 << " ms"
+            << std::endl;
+  std::cout << "  (" << differences << " of 80000 cells different from brute force, checksum " << checksum << ")"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  const int iterations = (argc > 1) ? atoi(argv[1]) : 20;
+  srand(0);
+  const std::vector<int8_t> patch = createPatch();
+
+  {
+    LegacyGrid grid(g_resolution, ros::Duration(1e6), -20, 20, -20, 20);
+    run("Pointer per cell (former layout)", grid, patch, iterations);
+  }
+  {
+    Grid grid(g_resolution, ros::Duration(1e6), -20, 20, -20, 20, false);
+    run("Tiles", grid, patch, iterations);
+    runView(grid, iterations);
+    runDisplaySnapshot(grid, iterations);
+    runBlend("Tiles, patch fusion", grid, patch, iterations);
+  }
+  {
+    Grid grid(g_resolution, ros::Duration(1e6), -1, 1, -1, 1, true);
+    run("Tiles, growing from 2x2 m", grid, patch, iterations);
+    std::cout << "  (" << grid.nbTiles() << " tiles allocated)" << std::endl;
+  }
+  {
+    Grid grid(g_resolution, ros::Duration(1e6), -1, 1, -1, 1, true);
+    runBlend("Tiles, patch fusion, growing from 2x2 m", grid, patch, iterations);
+  }
+  runDistances(iterations);
+  return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Replay benchmark of the landmark-aided pose correction.
+ *
+ * Replays a simulated run of the robot: several laps of a 5x5 m square in a room
+ * with markers on the walls. The odometry has a scale error and a gyroscope bias,
+ * and the markers are seen by a camera with the field of view of the Kinect, with
+ * a few wrong detections. The trajectory estimated by the open-loop dead reckoning
+ * and the one corrected by LandmarkCorrector, the way DeadReckoning applies it,
+ * are compared to the ground truth.
+ *
+ * Usage: rosrun dead_reckoning landmark_benchmark [laps]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "../src/landmarkcorrector.h"
+
+typedef LandmarkCorrector::Pose Pose;
+
+const double g_odom_period = 0.02;
+const double g_camera_period = 0.1;
+const double g_speed = 0.3;
+const double g_turn_speed = 0.5;
+
+/* Uniform noise of the given standard deviation.
+ */
+double noise(double stddev)
+{
+  return stddev * sqrt(3.0) * (2.0 * rand() / RAND_MAX - 1);
+}
+
+/* Error statistics of an estimated trajectory.
+ */
+struct Errors
+{
+  double sum_sq;
+  double max;
+  double last;
+  double last_angle;
+  int count;
+
+  Errors() : sum_sq(0), max(0), last(0), last_angle(0), count(0)
+  {
+  }
+
+  void add(const Pose& estimate, const Pose& truth)
+  {
+    last = hypot(estimate.x - truth.x, estimate.y - truth.y);
+    last_angle = fabs(atan2(sin(estimate.z - truth.z), cos(estimate.z - truth.z)));
+    sum_sq += last * last;
+    max = std::max(max, last);
+    ++count;
+  }
+
+  void print(const char* name) const
+  {
+    std::cout << name << ":" << std::endl;
+    std::cout << "  position error: " << sqrt(sum_sq / count) << " m RMS, " << max << " m max, " << last << " m at the end"
+              << std::endl;
+    std::cout << "  orientation error at the end: " << last_angle * 180 / M_PI << " deg" << std::endl;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  const int laps = (argc > 1) ? atoi(argv[1]) : 10;
+  srand(0);
+
+  // Markers on the walls of a 9x9 m room, around the 5x5 m square driven by the robot.
+  std::vector<double> markers_x, markers_y;
+  for (int i = 0; i < 4; ++i)
+  {
+    const double offsets[] = { -3, 0, 3 };
+    for (int j = 0; j < 3; ++j)
+    {
+      const double u = offsets[j] + 2.5, v = (i < 2) ? -2 : 7;
+      markers_x.push_back((i % 2 == 0) ? u : v);
+      markers_y.push_back((i % 2 == 0) ? v : u);
+    }
+  }
+
+  LandmarkCorrector corrector;
+  LandmarkCorrector::Correction correction = LandmarkCorrector::IDENTITY;
+  Pose truth = { 0, 0, 0 }, odom = truth;
+  Errors open_loop, corrected;
+  int nb_observations = 0;
+  double next_camera = 0, observe_time = 0, max_observe_time = 0;
+
+  for (int lap = 0; lap < laps; ++lap)
+  {
+    for (int side = 0; side < 4; ++side)
+    {
+      // Straight line, then quarter turn.
+      const int straight_steps = 5.0 / (g_speed * g_odom_period);
+      const int turn_steps = (M_PI / 2) / (g_turn_speed * g_odom_period);
+      for (int step = 0; step < straight_steps + turn_steps; ++step)
+      {
+        const bool turning = step >= straight_steps;
+        const double ds = turning ? 0 : g_speed * g_odom_period;
+        const double dz = turning ? g_turn_speed * g_odom_period : 0;
+        truth.x += ds * cos(truth.z);
+        truth.y += ds * sin(truth.z);
+        truth.z += dz;
+
+        // Odometry with 3% scale error and a gyroscope bias of 0.1 deg/s.
+        const double odom_ds = ds * 1.03 + noise(0.0005);
+        const double odom_dz = dz + 0.1 * M_PI / 180 * g_odom_period + noise(0.0005);
+        odom.x += odom_ds * cos(odom.z);
+        odom.y += odom_ds * sin(odom.z);
+        odom.z += odom_dz;
+
+        next_camera -= g_odom_period;
+        if (next_camera <= 0)
+        {
+          next_camera += g_camera_period;
+          for (size_t m = 0; m < markers_x.size(); ++m)
+          {
+            const double dx = markers_x[m] - truth.x, dy = markers_y[m] - truth.y;
+            const double range = hypot(dx, dy);
+            const double bearing = atan2(sin(atan2(dy, dx) - truth.z), cos(atan2(dy, dx) - truth.z));
+            if (range < 0.5 || range > 4 || fabs(bearing) > 30 * M_PI / 180)
+              continue;
+
+            // 1% of the detections have a wrong ID.
+            const int id = (rand() % 100 == 0) ? (m + 1) % markers_x.size() : m;
+            const ros::WallTime start = ros::WallTime::now();
+            corrector.observe(id, correction.apply(odom), range * (1 + noise(0.02)), bearing + noise(1.0 * M_PI / 180));
+            correction = corrector.takeCorrection().after(correction);
+            const double duration = (ros::WallTime::now() - start).toSec();
+            observe_time += duration;
+            max_observe_time = std::max(max_observe_time, duration);
+            ++nb_observations;
+          }
+        }
+
+        open_loop.add(odom, truth);
+        corrected.add(correction.apply(odom), truth);
+      }
+    }
+  }
+
+  std::cout << laps << " laps, " << laps * 20 << " m, " << nb_observations << " observations of " << markers_x.size()
+            << " markers" << std::endl;
+  open_loop.print("Open-loop dead reckoning");
+  corrected.print("Corrected with the landmarks");
+  std::cout << "  (" << corrector.nbRejected() << " observations rejected)" << std::endl;
+  std::cout << "LandmarkCorrector::observe: " << observe_time * 1e6 / nb_observations << " us on average, "
+            << max_observe_time * 1e6 << " us at most" << std::endl;
+  return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Replay benchmark of the scan matching.
+ *
+ * Replays a simulated run of the robot in a 10x8 m room with a few boxes: the
+ * odometry has a scale error and a gyroscope bias, and a 270 degrees laser scan
+ * is received at 10 Hz. As in DeadReckoning, each scan is matched against the
+ * Grid built from the previous ones, the resulting correction is merged through
+ * LandmarkCorrector, and the scan is then added to the Grid at the corrected pose.
+ * The corrected and open-loop trajectories are compared to the ground truth, and
+ * the branch and bound is checked against the exhaustive search.
+ *
+ * Usage: rosrun dead_reckoning scanmatcher_benchmark [laps]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "../src/grid.h"
+#include "../src/landmarkcorrector.h"
+#include "../src/scanmatcher.h"
+
+typedef LandmarkCorrector::Pose Pose;
+
+const double g_odom_period = 0.02;
+const double g_scan_period = 0.1;
+const int g_scan_rays = 540;
+const double g_scan_fov = 270 * M_PI / 180;
+const double g_scan_range = 8.0;
+
+struct Segment
+{
+  double x1, y1, x2, y2;
+};
+
+/* Uniform noise of the given standard deviation.
+ */
+double noise(double stddev)
+{
+  return stddev * sqrt(3.0) * (2.0 * rand() / RAND_MAX - 1);
+}
+
+/* Walls of the room and boxes.
+ */
+std::vector<Segment> createWorld()
+{
+  const double polygons[][4][2] = {
+    { { -2, -2 }, { 8, -2 }, { 8, 6 }, { -2, 6 } },
+    { { 1.5, 1.5 }, { 2.5, 1.5 }, { 2.5, 2.5 }, { 1.5, 2.5 } },
+    { { 4, 3 }, { 4.6, 3 }, { 4.6, 4.2 }, { 4, 4.2 } },
+    { { 6.5, -1.5 }, { 7.5, -1.5 }, { 7.5, -0.8 }, { 6.5, -0.8 } },
+  };
+  std::vector<Segment> world;
+  for (size_t p = 0; p < sizeof(polygons) / sizeof(polygons[0]); ++p)
+  {
+    for (int i = 0; i < 4; ++i)
+    {
+      Segment s = { polygons[p][i][0], polygons[p][i][1], polygons[p][(i + 1) % 4][0], polygons[p][(i + 1) % 4][1] };
+      world.push_back(s);
+    }
+  }
+  return world;
+}
+
+/* Simulate a laser scan at the given pose, returned as points in the robot's coordinate system.
+ */
+void simulateScan(const std::vector<Segment>& world, const Pose& pose, std::vector<ScanMatcher::Point>& points)
+{
+  points.clear();
+  for (int i = 0; i < g_scan_rays; ++i)
+  {
+    const double angle = -g_scan_fov / 2 + i * g_scan_fov / (g_scan_rays - 1);
+    const double dx = cos(pose.z + angle), dy = sin(pose.z + angle);
+    double range = g_scan_range;
+    for (size_t s = 0; s < world.size(); ++s)
+    {
+      // Intersection of the ray with the segment.
+      const double ex = world[s].x2 - world[s].x1, ey = world[s].y2 - world[s].y1;
+      const double det = dx * (-ey) - dy * (-ex);
+      if (fabs(det) < 1e-9)
+        continue;
+      const double wx = world[s].x1 - pose.x, wy = world[s].y1 - pose.y;
+      const double t = (wx * (-ey) - wy * (-ex)) / det;
+      const double u = (dx * wy - dy * wx) / det;
+      if (t > 0 && u >= 0 && u <= 1)
+        range = std::min(range, t);
+    }
+    if (range < g_scan_range)
+    {
+      range += noise(0.01);
+      ScanMatcher::Point point = { range * cos(angle), range * sin(angle) };
+      points.push_back(point);
+    }
+  }
+}
+
+/* Position error statistics of an estimated trajectory.
+ */
+struct Errors
+{
+  double sum_sq, max, last;
+  int count;
+
+  Errors() : sum_sq(0), max(0), last(0), count(0)
+  {
+  }
+
+  void add(const Pose& estimate, const Pose& truth)
+  {
+    last = hypot(estimate.x - truth.x, estimate.y - truth.y);
+    sum_sq += last * last;
+    max = std::max(max, last);
+    ++count;
+  }
+
+  void print(const char* name) const
+  {
+    std::cout << name << ": " << sqrt(sum_sq / count) << " m RMS, " << max << " m max, " << last << " m at the end"
+              << std::endl;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  const int laps = (argc > 1) ? atoi(argv[1]) : 5;
+  srand(0);
+
+  const std::vector<Segment> world = createWorld();
+  Grid grid(0.05, ros::Duration(1e6), -3, 9, -3, 7, false);
+  ScanMatcher matcher;
+  LandmarkCorrector corrector;
+  LandmarkCorrector::Correction correction = LandmarkCorrector::IDENTITY;
+  std::vector<ScanMatcher::Point> points, sampled;
+
+  Pose truth = { 0, 0, 0 }, odom = truth;
+  Errors open_loop, corrected;
+  ros::Time t = ros::Time::now();
+  ros::Time field_time;
+  double next_scan = 0, match_time = 0, max_match_time = 0, exhaustive_time = 0, field_time_total = 0;
+  int nb_scans = 0, nb_matched = 0, nb_fields = 0, nb_checked = 0, nb_different = 0;
+
+  for (int lap = 0; lap < laps; ++lap)
+  {
+    for (int side = 0; side < 4; ++side)
+    {
+      // 5x3 m rectangle around the first box: straight line, then quarter turn.
+      const double length = (side % 2 == 0) ? 5.0 : 3.0;
+      const int straight_steps = length / (0.3 * g_odom_period);
+      const int turn_steps = (M_PI / 2) / (0.5 * g_odom_period);
+      for (int step = 0; step < straight_steps + turn_steps; ++step)
+      {
+        const bool turning = step >= straight_steps;
+        const double ds = turning ? 0 : 0.3 * g_odom_period;
+        const double dz = turning ? 0.5 * g_odom_period : 0;
+        truth.x += ds * cos(truth.z);
+        truth.y += ds * sin(truth.z);
+        truth.z += dz;
+        t = t + ros::Duration(g_odom_period);
+
+        // Odometry with 3% scale error and a gyroscope bias of 0.5 deg/s.
+        const double odom_ds = ds * 1.03 + noise(0.0005);
+        const double odom_dz = dz + 0.5 * M_PI / 180 * g_odom_period + noise(0.0005);
+        odom.x += odom_ds * cos(odom.z);
+        odom.y += odom_ds * sin(odom.z);
+        odom.z += odom_dz;
+
+        next_scan -= g_odom_period;
+        if (next_scan <= 0)
+        {
+          next_scan += g_scan_period;
+          simulateScan(world, truth, points);
+          const Pose estimate = correction.apply(odom);
+
+          // Same decimation and field updates as DeadReckoning::matchScan.
+          sampled.clear();
+          for (size_t i = 0; i < points.size(); i += 3)
+            sampled.push_back(points[i]);
+          if (nb_scans > 0)
+          {
+            ros::WallTime start = ros::WallTime::now();
+            if (!matcher.hasField() || (t - field_time).toSec() > 1.0 ||
+                hypot(estimate.x - matcher.fieldX(), estimate.y - matcher.fieldY()) > 2.0)
+            {
+              matcher.updateField(grid, estimate.x, estimate.y);
+              field_time = t;
+              field_time_total += (ros::WallTime::now() - start).toSec();
+              ++nb_fields;
+            }
+
+            const ScanMatcher::Pose guess = { estimate.x, estimate.y, estimate.z };
+            ScanMatcher::Pose matched;
+            double score;
+            const bool ok = matcher.match(sampled, guess, matched, &score);
+            const double duration = (ros::WallTime::now() - start).toSec();
+            match_time += duration;
+            max_match_time = std::max(max_match_time, duration);
+            if (ok)
+            {
+              const Pose measured = { matched.x, matched.y, matched.z };
+              double cov[3][3];
+              matcher.covariance(score, cov);
+              if (corrector.correct(estimate, measured, cov))
+              {
+                correction = corrector.takeCorrection().after(correction);
+                ++nb_matched;
+              }
+            }
+
+            // The branch and bound must find a pose as good as the exhaustive search.
+            if (nb_scans % 10 == 0)
+            {
+              ScanMatcher::Pose exhaustive_matched;
+              double exhaustive_score = 0;
+              start = ros::WallTime::now();
+              const bool exhaustive_ok = matcher.match(sampled, guess, exhaustive_matched, &exhaustive_score, true);
+              exhaustive_time += (ros::WallTime::now() - start).toSec();
+              if (ok != exhaustive_ok || (ok && fabs(score - exhaustive_score) > 1e-6))
+                ++nb_different;
+              ++nb_checked;
+            }
+          }
+          ++nb_scans;
+
+          // Add the scan to the Grid at the corrected pose.
+          const Pose pose = correction.apply(odom);
+          for (size_t i = 0; i < points.size(); ++i)
+          {
+            grid.addPoint(pose.x + cos(pose.z) * points[i].x - sin(pose.z) * points[i].y,
+                          pose.y + sin(pose.z) * points[i].x + cos(pose.z) * points[i].y, t, 0.9);
+          }
+        }
+
+        open_loop.add(odom, truth);
+        corrected.add(correction.apply(odom), truth);
+      }
+    }
+  }
+
+  std::cout << laps << " laps, " << nb_scans << " scans, " << nb_matched << " matched, " << corrector.nbRejected()
+            << " rejected" << std::endl;
+  open_loop.print("Open-loop dead reckoning");
+  corrected.print("Corrected with the scan matching");
+  std::cout << "Scan matching (" << sampled.size() << " points): " << match_time * 1e3 / (nb_scans - 1)
+            << " ms on average, " << max_match_time * 1e3 << " ms at most, including " << nb_fields
+            << " field updates of " << field_time_total * 1e3 / nb_fields << " ms" << std::endl;
+  std::cout << "Exhaustive search: " << exhaustive_time * 1e3 / nb_checked << " ms (" << nb_different << " of "
+            << nb_checked << " scans with a different score)" << std::endl;
+  return 0;
+}
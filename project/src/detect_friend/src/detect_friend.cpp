@@ -23,9 +23,6 @@ DetectFriend::DetectFriend(ros::NodeHandle& nodeHandle): m_nodeHandle(nodeHandle
 {
     ROS_INFO("Subscribing to camera image topic...");
     m_cameraSub = m_nodeHandle.subscribe("/camera/rgb/image_raw", 1, &DetectFriend::cameraSubCallback, this);//subscribing to the camera
-    ros::Rate loopRate(10);
-    while (ros::ok() && m_cameraSub.getNumPublishers() <= 0)
-        loopRate.sleep();
 
     std::string packagePath = "~";
     if (!m_nodeHandle.getParam("package_path", packagePath))
@@ -97,7 +94,7 @@ DetectFriend::DetectFriend(ros::NodeHandle& nodeHandle): m_nodeHandle(nodeHandle
 void DetectFriend::cameraSubCallback(const sensor_msgs::ImageConstPtr& msg)
 {
     ROS_INFO("Received image from camera.");
-    detect_friend::FriendsInfos friendsInfos;
+    detect_friend::FriendsInfos::Ptr friendsInfos(new detect_friend::FriendsInfos); // published as a new message, which the subscribers in the same process receive without copy
     detect_friend::Friend_id friend_details;
     Mat img;
 
@@ -127,7 +124,7 @@ void DetectFriend::cameraSubCallback(const sensor_msgs::ImageConstPtr& msg)
         int id=0;
         friend_details=publish_infos_of_friend(img, id, result1.boundingRect);
         friend_details.Time = msg->header.stamp;
-        friendsInfos.infos.push_back(friend_details);
+        friendsInfos->infos.push_back(friend_details);
         //id_friend.center.x=center_of_friend(int i, cv::Rect rect);
 
     
@@ -138,7 +135,7 @@ void DetectFriend::cameraSubCallback(const sensor_msgs::ImageConstPtr& msg)
         int id=1;
         friend_details=publish_infos_of_friend(img, id, result2.boundingRect);
         friend_details.Time = msg->header.stamp;
-        friendsInfos.infos.push_back(friend_details);
+        friendsInfos->infos.push_back(friend_details);
 
       }
 
@@ -147,10 +144,10 @@ void DetectFriend::cameraSubCallback(const sensor_msgs::ImageConstPtr& msg)
          int id=2;
         friend_details=publish_infos_of_friend(img, id, result3.boundingRect);
         friend_details.Time = msg->header.stamp;
-        friendsInfos.infos.push_back(friend_details);
+        friendsInfos->infos.push_back(friend_details);
  
       }
-      if (friendsInfos.infos.size()>0)
+      if (friendsInfos->infos.size()>0)
         {
           m_friend_idPub.publish(friendsInfos);
         }
@@ -252,6 +249,11 @@ detect_friend::Friend_id DetectFriend::publish_infos_of_friend(const cv::Mat& im
 */
 void DetectFriend::Identification()
 {
+    ROS_INFO("Waiting for camera images...");
+    ros::Rate loopRate(10);
+    while (ros::ok() && m_cameraSub.getNumPublishers() <= 0)
+        loopRate.sleep();
+
     ROS_INFO("Starting identification.");
     ros::spin();
 }
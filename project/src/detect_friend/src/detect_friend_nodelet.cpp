@@ -0,0 +1,26 @@
+#include <boost/scoped_ptr.hpp>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include "detect_friend.h"
+
+namespace detect_friend
+{
+
+/**
+*@class DetectFriendNodelet
+*@brief Runs DetectFriend as a nodelet. Loaded in the same nodelet manager as the camera driver, the images are received as shared pointers, without serialization. The parameters are the ones of the detect_friend node.
+*/
+class DetectFriendNodelet : public nodelet::Nodelet
+{
+    private:
+        boost::scoped_ptr<DetectFriend> m_detectFriend; ///< the friend detection, created by onInit()
+
+        virtual void onInit()
+        {
+            m_detectFriend.reset(new DetectFriend(getPrivateNodeHandle()));
+        }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(detect_friend::DetectFriendNodelet, nodelet::Nodelet)
@@ -7,24 +7,20 @@
 #include "detect_marker/MarkerInfo.h"
 #include "detect_marker/MarkersInfos.h"
 
-DetectMarker::DetectMarker(ros::NodeHandle& nodeHandle): m_nodeHandle(nodeHandle), m_isRotating(false)
+/**
+ * @brief Constructor.
+ * @param nodeHandle ros::NodeHandle, showWindow bool indicating if the markers are drawn in the "Camera view" window
+ */
+DetectMarker::DetectMarker(ros::NodeHandle& nodeHandle, bool showWindow): m_nodeHandle(nodeHandle), m_isRotating(false), m_showWindow(showWindow)
 {
-    ros::Rate loopRate(10);
-    
     ROS_INFO("Subscribing to camera image topic...");
     m_cameraSub = m_nodeHandle.subscribe("/camera/rgb/image_raw", 1, &DetectMarker::cameraSubCallback, this);
-    while (ros::ok() && m_cameraSub.getNumPublishers() <= 0)
-        loopRate.sleep();
     
     ROS_INFO("Subscribing to robot IMU...");
     m_IMUSub = m_nodeHandle.subscribe("/mobile_base/sensors/imu_data", 1000, &DetectMarker::IMUCallback, this);
-    while (ros::ok() && m_IMUSub.getNumPublishers() <= 0)
-        loopRate.sleep();    
 
     ROS_INFO("Creating markers topic...");
     m_markersPub = m_nodeHandle.advertise<detect_marker::MarkersInfos>("/markerinfo", 10);
-    
-    ROS_INFO("Done, everything's ready.");
 }
 /**
  * @brief Callback of the /mobile_base/sensors/imu_data topic.
@@ -170,8 +166,9 @@ void DetectMarker::cameraSubCallback(const sensor_msgs::ImageConstPtr& msg)
 void DetectMarker::publishAndDrawMarkers(cv::Mat& frame, std::vector<aruco::Marker> &markers, ros::Time time)
 {
     cv::Scalar colorScalar(255, 155, 0, 0);
-    detect_marker::MarkersInfos markersInfos;
-    markersInfos.time = time;
+    // Published as a new message, which the subscribers in the same process receive without copy
+    detect_marker::MarkersInfos::Ptr markersInfos(new detect_marker::MarkersInfos);
+    markersInfos->time = time;
     
     int width = frame.cols;
     int height = frame.rows;
@@ -181,7 +178,8 @@ void DetectMarker::publishAndDrawMarkers(cv::Mat& frame, std::vector<aruco::Mark
     for (int i=0 ; i < nbMarkers ; i++)
     {
         aruco::Marker& marker = markers[i];
-        marker.draw(frame, colorScalar);
+        if (m_showWindow)
+            marker.draw(frame, colorScalar);
         
         Point center;
         Point corners[4];
@@ -208,15 +206,18 @@ void DetectMarker::publishAndDrawMarkers(cv::Mat& frame, std::vector<aruco::Mark
             markerInfo.d = sqrt(markerInfo.dy*markerInfo.dy + markerInfo.dx*markerInfo.dx + markerInfo.dz*markerInfo.dz);
             
             markerInfo.id = marker.id;
-            markersInfos.infos.push_back(markerInfo);
+            markersInfos->infos.push_back(markerInfo);
 
             //ROS_INFO("Marker %d: pos = (%.3f, %.3f); d = %.3f", markerInfo.id, markerInfo.x, markerInfo.y, markerInfo.d);
         }
     }
-    cv::imshow("Camera view", frame);
-    cv::waitKey(1);
+    if (m_showWindow)
+    {
+        cv::imshow("Camera view", frame);
+        cv::waitKey(1);
+    }
     
-    //ROS_INFO("Publishing %lu marker infos.", markersInfos.infos.size());
+    //ROS_INFO("Publishing %lu marker infos.", markersInfos->infos.size());
     m_markersPub.publish(markersInfos);
 }
 
@@ -250,6 +251,15 @@ bool DetectMarker::ComputeQuadrilateralCenter(Point points[4], Point *centerPoin
 
 void DetectMarker::detect()
 {
+    ros::Rate loopRate(10);
+    ROS_INFO("Waiting for camera images...");
+    while (ros::ok() && m_cameraSub.getNumPublishers() <= 0)
+        loopRate.sleep();
+    ROS_INFO("Waiting for robot IMU...");
+    while (ros::ok() && m_IMUSub.getNumPublishers() <= 0)
+        loopRate.sleep();
+    ROS_INFO("Done, everything's ready.");
+
     ROS_INFO("Starting detection.");
     ros::spin();
 }
@@ -13,7 +13,7 @@ class DetectMarker
         static const double MARKER_REF_DIST = 480 * 0.2 / 0.175;
         static const double MARKER_SIZE = 0.175;
         
-        DetectMarker(ros::NodeHandle& nodeHandle);
+        DetectMarker(ros::NodeHandle& nodeHandle, bool showWindow=true);
         void detect();
         
     private:
@@ -25,6 +25,7 @@ class DetectMarker
         static bool ComputeLinesIntersection(Point linePoints1[2], Point linePoints2[2], Point *isectPoint);
         static bool ComputeQuadrilateralCenter(Point points[4], Point *centerPoint);
         bool m_isRotating;
+        bool m_showWindow;
         ros::NodeHandle& m_nodeHandle;
         ros::Subscriber m_cameraSub;
         ros::Subscriber	m_IMUSub;
@@ -0,0 +1,31 @@
+#include <boost/scoped_ptr.hpp>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include "detectmarker.h"
+
+namespace detect_marker
+{
+
+/**
+ * @brief Runs DetectMarker as a nodelet.
+ *
+ * Loaded in the same nodelet manager as the camera driver, the images are received as shared pointers, without
+ * serialization. The callbacks run in the threads of the manager and HighGUI is not thread safe, so the "Camera view"
+ * window is only shown if the private parameter show_window is set (false by default).
+ */
+class DetectMarkerNodelet : public nodelet::Nodelet
+{
+    private:
+        boost::scoped_ptr<DetectMarker> m_detectMarker;
+
+        virtual void onInit()
+        {
+            bool showWindow;
+            getPrivateNodeHandle().param("show_window", showWindow, false);
+            m_detectMarker.reset(new DetectMarker(getNodeHandle(), showWindow));
+        }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(detect_marker::DetectMarkerNodelet, nodelet::Nodelet)
@@ -3,9 +3,13 @@
 
 #include <cmath> // For std::exp.
 #include <exception>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/thread/thread.hpp>
 #include <ros/ros.h>
 #include <tf/tf.h>
 #include <tf/transform_listener.h>
@@ -23,33 +27,75 @@ using std::vector;
 using std::abs;
 using std::max;
 
+/* Return index modulo size, within [0, size[
+ */
+inline size_t wrapIndex(long int index, size_t size)
+{
+  const long int wrapped = index % static_cast<long int>(size);
+  return (wrapped < 0) ? wrapped + size : wrapped;
+}
+
+/* Return the index in a ring buffer of a point of an image
+ *
+ * row_origin and col_origin are the row and column of the ring buffer holding
+ * the first row and column of the image.
+ */
+inline size_t ringIndex(size_t idx, size_t ncol, size_t nrow, size_t row_origin, size_t col_origin)
+{
+  size_t row = idx / ncol + row_origin;
+  size_t col = idx % ncol + col_origin;
+  if (row >= nrow)
+  {
+    row -= nrow;
+  }
+  if (col >= ncol)
+  {
+    col -= ncol;
+  }
+  return row * ncol + col;
+}
+
 class MapBuilder
 {
   public:
 
-    MapBuilder(int width, int height, double resolution);
+    MapBuilder(int width, int height, double resolution,
+        const ros::NodeHandle& private_nh = ros::NodeHandle("~"));
+    MapBuilder(int width, int height, double resolution, double angle_resolution, int thread_count);
+    ~MapBuilder();
 
-    bool saveMap(const std::string& name) const;  //!< Save the map on disk
+    bool saveMap(const std::string& name);  //!< Save the map on disk
 
     void grow(const sensor_msgs::LaserScan& scan);
 
-    nav_msgs::OccupancyGrid getMap() const {return map_;}
+    const nav_msgs::OccupancyGrid& getMap();
+    void getMap(nav_msgs::OccupancyGrid& map) const;
+
+    bool updateMap(const sensor_msgs::LaserScan& scan, long int dx, long int dy, double theta);
+
+    /** Return the first row of each band updated by its own thread, followed by the map height
+    */
+    const vector<size_t>& bandRows() const
+    {
+      return band_rows_;
+    }
 
   private:
 
-    bool updateMap(const sensor_msgs::LaserScan& scan, long int dx, long int dy, double theta);
-    bool getRayCastToObstacle(const nav_msgs::OccupancyGrid& map, double angle, double range, vector<size_t>& raycast);
-    void updatePointOccupancy(bool occupied, size_t idx, vector<int8_t>& occupancy, vector<double>& log_odds) const;
+    bool getRayCastToObstacle(const nav_msgs::OccupancyGrid& map, double angle, double range, map_ray_caster::Ray& raycast);
+    void initMap(int width, int height, double resolution);
+    void initLogOdds();
+    void initThreads();
+    void updateRows(size_t row_begin, size_t row_end);
+    void updateRowsLoop(size_t band);
+    void updatePointOccupancy(bool occupied, size_t idx, vector<int8_t>& occupancy, vector<int16_t>& log_odds) const;
+    void updatePointsOccupancy(bool occupied, const map_ray_caster::Ray& indexes, vector<int8_t>& occupancy, vector<int16_t>& log_odds) const;
 
-    /** Update occupancy and log odds for a list of a points
+    /** Return the index in the ring buffers of a point of the map
     */
-    inline void updatePointsOccupancy(bool occupied, const vector<size_t>& indexes, vector<int8_t>& occupancy, vector<double>& log_odds)
+    inline size_t ringIndex(size_t idx) const
     {
-      vector<size_t>::const_iterator idx = indexes.begin();
-      for (; idx != indexes.end(); ++idx)
-      {
-        updatePointOccupancy(occupied, *idx, occupancy, log_odds);
-      }
+      return local_map::ringIndex(idx, map_.info.width, map_.info.height, row_origin_, col_origin_);
     }
 
     // ROS parameters.
@@ -69,12 +115,16 @@ class MapBuilder
                                       //!< belief (exp(max_log_odds_for_belief)
                                       //!< should not overflow).
                                       //!< Defaults to 20.
+    int thread_count_;  //!< Number of threads updating the occupancy, each
+                        //!< one on its own band of rows.
+                        //!< Defaults to 1.
 
 
     // Internals.
-    tf::TransformListener tf_listerner_;
+    boost::scoped_ptr<tf::TransformListener> tf_listerner_;  //!< Created by the first grow() if not by the constructor.
     std::string world_frame_id_; //!< frame_id of the world frame
-    tf::TransformBroadcaster tr_broadcaster_;  //!< To broadcast the transform from LaserScan to local map.
+    boost::scoped_ptr<tf::TransformBroadcaster> tr_broadcaster_;  //!< To broadcast the transform from LaserScan to local map.
+                                                                  //!< Created with tf_listerner_.
     bool has_frame_id_;  //!< true if map frame_id was already set
     std::string map_frame_id_;  //!< map frame id in tf
     double xinit_;  //!< Map x position at initialization
@@ -82,10 +132,29 @@ class MapBuilder
     long int last_xmap_;  //!< Map integer x position at last map move
     long int last_ymap_;  //!< Map integer y position at last map move
 
-    nav_msgs::OccupancyGrid map_; //!< local map with fixed orientation
-    std::vector<double> log_odds_;  //!< log odds ratios for the binary Bayes filter
-                                    //!< log_odd = log(p(x) / (1 - p(x)))
+    nav_msgs::OccupancyGrid map_; //!< local map with fixed orientation, map_.data is
+                                  //!< only updated from occupancy_ by getMap().
+    std::vector<int8_t> occupancy_;  //!< occupancy, in a ring buffer whose first row and
+                                     //!< column are row_origin_ and col_origin_.
+    size_t row_origin_;  //!< Row of the ring buffers holding the first row of the map.
+    size_t col_origin_;  //!< Column of the ring buffers holding the first column of the map.
+    bool map_outdated_;  //!< true if map_.data must be updated from occupancy_.
+    std::vector<int16_t> log_odds_;  //!< log odds ratios for the binary Bayes filter, in a ring buffer
+                                     //!< log_odd = log(p(x) / (1 - p(x))), quantised
+                                     //!< so that large_log_odds_ is the largest int16_t.
+    double log_odds_scale_;  //!< Quantisation steps per unit of log odds.
+    int hit_log_odds_;  //!< Quantised log odds increment when the laser ranger says occupied.
+    int miss_log_odds_;  //!< Quantised log odds increment when the laser ranger says free.
+    int belief_log_odds_;  //!< Quantised max_log_odds_for_belief_.
+    std::vector<int8_t> occupancy_lookup_;  //!< Occupancy for the quantised log odds in
+                                            //!< [-belief_log_odds_, belief_log_odds_].
     map_ray_caster::MapRayCaster ray_caster_;  //!< Ray casting with cache.
+    vector<map_ray_caster::Ray> beam_rays_;  //!< Points touched by each beam of the current scan.
+    vector<char> beam_obstacles_;  //!< true if the last point of beam_rays_[i] is an obstacle.
+    vector<size_t> band_rows_;  //!< First row of each band, followed by the map height.
+    boost::scoped_ptr<boost::barrier> barrier_;  //!< Synchronizes the threads at the start and end of each update.
+    boost::thread_group workers_;  //!< Threads updating the bands other than the first one.
+    bool stopping_;  //!< true when the workers must return.
 };
 
 /* Return the offset from row and column number for a row-major array
@@ -97,8 +166,16 @@ inline int offsetFromRowColNoRangeCheck(int row, int col, size_t ncol)
   return (row * ncol) + col;
 }
 
+map_ray_caster::Ray raySection(const map_ray_caster::Ray& ray, size_t ncol, size_t row_begin, size_t row_end);
+
+void splitRingRay(const map_ray_caster::Ray& ray, size_t ncol, size_t nrow, size_t row_origin, size_t col_origin,
+    const size_t* splits[4]);
+
+template <typename T>
+void clearRingImage(int fill, int dx, int dy, unsigned int ncol, size_t row_origin, size_t col_origin, std::vector<T>& map);
+
 template <typename T>
-void moveAndCopyImage(int fill, int dx, int dy, unsigned int ncol, std::vector<T>& map);
+void linearizeRingImage(const std::vector<T>& map, unsigned int ncol, size_t row_origin, size_t col_origin, std::vector<T>& image);
 
 } // namespace local_map
 
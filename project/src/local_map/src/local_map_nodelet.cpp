@@ -0,0 +1,135 @@
+/*
+ * Local map builder, as a nodelet
+ * The local_map nodelet takes as input a LaserScan message and outputs
+ * a local map as OccupancyGrid. The local map orientation is the same
+ * as the one of the global frame. The position of the map is the same
+ * as the one of the LaserScan.
+ *
+ * Loaded in the same nodelet manager as the publisher of the scans and the
+ * subscribers of the map, the messages are passed as shared pointers,
+ * without serialization.
+ *
+ * Parameters:
+ * - map_width, float, 200, map pixel width (x-direction)
+ * - map_height, float, 200, map pixel height (y-direction)
+ * - map_resolution, float, 0.020, map resolution (m/pixel)
+ * - publish_rate, float, 0, maximum rate of the map publication (Hz),
+ *   0 to publish the map after each scan
+ */
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <ros/ros.h>
+#include <sensor_msgs/LaserScan.h>
+#include <nav_msgs/OccupancyGrid.h>
+
+#include <local_map/map_builder.h>
+#include <local_map/SaveMap.h>
+
+namespace local_map
+{
+
+class LocalMapNodelet : public nodelet::Nodelet
+{
+  private:
+
+    virtual void onInit();
+
+    void publishMap();
+    void handleLaserScan(const sensor_msgs::LaserScanConstPtr& msg);
+    void handlePublishTimer(const ros::TimerEvent&);
+    void handleSubscriberConnect(const ros::SingleSubscriberPublisher&);
+    bool saveMap(SaveMap::Request& req, SaveMap::Response& res);
+
+    boost::scoped_ptr<MapBuilder> map_builder_;
+    ros::Subscriber scan_subscriber_;
+    ros::Publisher map_publisher_;
+    ros::ServiceServer save_map_service_;
+    ros::Timer publish_timer_;
+    bool publish_on_scan_;  //!< true to publish the map after each scan, false to publish it on a timer.
+    bool map_changed_;  //!< true if the map changed since it was last published.
+};
+
+void LocalMapNodelet::onInit()
+{
+  ros::NodeHandle& nh = getPrivateNodeHandle();
+
+  double map_width;
+  double map_height;
+  double map_resolution;
+  double publish_rate;
+  nh.param<double>("map_width", map_width, 200);
+  nh.param<double>("map_height", map_height, 200);
+  nh.param<double>("map_resolution", map_resolution, 0.020);
+  nh.param<double>("publish_rate", publish_rate, 0);
+  if (publish_rate < 0)
+  {
+    NODELET_ERROR_STREAM("Parameter " << nh.getNamespace() << "/publish_rate must be non-negative, setting to default (0)");
+    publish_rate = 0;
+  }
+  publish_on_scan_ = (publish_rate == 0);
+  map_changed_ = false;
+  map_builder_.reset(new MapBuilder(map_width, map_height, map_resolution, nh));
+
+  // All callbacks run in the single-threaded queue of the nodelet,
+  // map_changed_ and the MapBuilder need no lock.
+  scan_subscriber_ = nh.subscribe<sensor_msgs::LaserScan>("scan", 1, &LocalMapNodelet::handleLaserScan, this);
+  map_publisher_ = nh.advertise<nav_msgs::OccupancyGrid>("local_map", 1,
+      boost::bind(&LocalMapNodelet::handleSubscriberConnect, this, _1), ros::SubscriberStatusCallback(),
+      ros::VoidConstPtr(), true);
+  save_map_service_ = nh.advertiseService("save_map", &LocalMapNodelet::saveMap, this);
+  if (!publish_on_scan_)
+  {
+    publish_timer_ = nh.createTimer(ros::Duration(1.0 / publish_rate), &LocalMapNodelet::handlePublishTimer, this);
+  }
+}
+
+/** Publish the map if it changed and somebody listens.
+ *
+ * The occupancy is copied from the ring buffer of the MapBuilder straight
+ * into a new message. Subscribers in the same process receive this message,
+ * the others its serialization. When nobody listens, the publication is
+ * postponed until a subscriber connects.
+ */
+void LocalMapNodelet::publishMap()
+{
+  if (!map_changed_ || map_publisher_.getNumSubscribers() == 0)
+  {
+    return;
+  }
+  nav_msgs::OccupancyGridPtr map(new nav_msgs::OccupancyGrid);
+  map_builder_->getMap(*map);
+  map_publisher_.publish(map);
+  map_changed_ = false;
+}
+
+void LocalMapNodelet::handleLaserScan(const sensor_msgs::LaserScanConstPtr& msg)
+{
+  map_builder_->grow(*msg);
+  map_changed_ = true;
+  if (publish_on_scan_)
+  {
+    publishMap();
+  }
+}
+
+void LocalMapNodelet::handlePublishTimer(const ros::TimerEvent&)
+{
+  publishMap();
+}
+
+void LocalMapNodelet::handleSubscriberConnect(const ros::SingleSubscriberPublisher&)
+{
+  publishMap();
+}
+
+bool LocalMapNodelet::saveMap(SaveMap::Request& req, SaveMap::Response& res)
+{
+  return map_builder_->saveMap(req.name);
+}
+
+} // namespace local_map
+
+PLUGINLIB_EXPORT_CLASS(local_map::LocalMapNodelet, nodelet::Nodelet)
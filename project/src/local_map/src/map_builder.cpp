@@ -1,10 +1,14 @@
 /** Defines a class with a local occupancy grid
 */
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
+#include <limits>
 #include <math.h>  // for round(), std::round() is since C++11.
 
+#include <boost/bind.hpp>
+
 #include <local_map/map_builder.h>
 
 namespace local_map
@@ -50,91 +54,201 @@ double angleFromQuaternion(const tf::Quaternion& q)
   return 2 * std::atan2(q.z(), q.w());
 }
 
-/** In-place move an image represented as a 1D array
+/** Clear the pixels entering an image represented as a ring buffer, after a move
  *
- * The origin of the image moves relativelty to a frame F. All pixels must be
- * moved in the opposite direction, so that what is represented by the pixels
- * is fixed in the frame F.
+ * The origin of the image moves relativelty to a frame F. Instead of moving
+ * all pixels in the opposite direction, the first row and column of the image
+ * in the ring buffer move with the origin, so that what is represented by the
+ * pixels is fixed in the frame F. Only the rows and columns entering the image
+ * are then cleared.
  *
  * @param[in] fill Default fill value
- * @param[in] dx pixel displacement in x (rows)
- * @param[in] dy pixel displacement in y (columns)
+ * @param[in] dx pixel displacement in x (columns)
+ * @param[in] dy pixel displacement in y (rows)
  * @param[in] ncol number of column
- * @param[in,out] map image to be moved
+ * @param[in] row_origin row of the ring buffer holding the first row of the image, after the move
+ * @param[in] col_origin column of the ring buffer holding the first column of the image, after the move
+ * @param[in,out] map ring buffer
  */
 template <typename T>
-void moveAndCopyImage(int fill, int dx, int dy, unsigned int ncol, vector<T>& map)
+void clearRingImage(int fill, int dx, int dy, unsigned int ncol, size_t row_origin, size_t col_origin, vector<T>& map)
 {
-  if (dx == 0 && dy == 0)
+  const unsigned int nrow = map.size() / ncol;
+  const unsigned int row_count = std::abs(dy);
+  const unsigned int col_count = std::abs(dx);
+  if (row_count >= nrow || col_count >= ncol)
   {
+    std::fill(map.begin(), map.end(), fill);
     return;
   }
 
-  const unsigned int nrow = map.size() / ncol;
-  int row_start = 0;
-  int row_end = nrow;
-  int row_increment = 1;
-  if (dy < 0)
-  {
-    row_start = nrow - 1;
-    row_end = -1;
-    row_increment = -1;
-  }
-  int col_start = 0;
-  int col_steps = ncol;
-  int col_increment = 1;
-  if (dx < 0)
-  {
-    col_start = ncol - 1;
-    col_steps = -ncol;
-    col_increment = -1;
-  }
-  for (int new_row = row_start; new_row != row_end; new_row += row_increment)
-  {
-    const int new_idx_start = offsetFromRowColNoRangeCheck(new_row, col_start, ncol);
-    const int row = new_row + dy;  // row in old map, can be outside old map
-    int idx = offsetFromRowColNoRangeCheck(row, col_start + dx, ncol);
-    const int min_idx = std::max(0, offsetFromRowColNoRangeCheck(row, 0, ncol));
-    const int max_idx = std::min(static_cast<int>(map.size()) - 1, offsetFromRowColNoRangeCheck(row, ncol - 1, ncol));
-    const int new_idx_end = new_idx_start + col_steps;
-    for (int new_idx = new_idx_start; new_idx != new_idx_end;)
+  // Rows entering the image, the last ones when moving up.
+  const unsigned int row_start = (dy > 0) ? nrow - row_count : 0;
+  for (unsigned int row = row_start; row < row_start + row_count; ++row)
+  {
+    const typename vector<T>::iterator ring_row = map.begin() + wrapIndex(row + row_origin, nrow) * ncol;
+    std::fill(ring_row, ring_row + ncol, fill);
+  }
+
+  // Columns entering the image, the last ones when moving right. They can
+  // wrap around the ring buffer.
+  if (col_count == 0)
+  {
+    return;
+  }
+  const unsigned int col_start = (dx > 0) ? ncol - col_count : 0;
+  const size_t ring_col_start = wrapIndex(col_start + col_origin, ncol);
+  const size_t ring_col_end = ring_col_start + col_count;
+  for (unsigned int row = 0; row < nrow; ++row)
+  {
+    const typename vector<T>::iterator ring_row = map.begin() + row * ncol;
+    if (ring_col_end <= ncol)
     {
-      if (min_idx <= idx && idx <= max_idx)
-      {
-        map[new_idx] = map[idx];
-      }
-      else
-      {
-        map[new_idx] = fill;
-      }
-      new_idx += col_increment;
-      idx += col_increment;
+      std::fill(ring_row + ring_col_start, ring_row + ring_col_end, fill);
+    }
+    else
+    {
+      std::fill(ring_row + ring_col_start, ring_row + ncol, fill);
+      std::fill(ring_row, ring_row + (ring_col_end - ncol), fill);
     }
   }
 }
 
-MapBuilder::MapBuilder(int width, int height, double resolution) :
+/** Copy an image represented as a ring buffer into a 1D array
+ *
+ * @param[in] map ring buffer
+ * @param[in] ncol number of column
+ * @param[in] row_origin row of the ring buffer holding the first row of the image
+ * @param[in] col_origin column of the ring buffer holding the first column of the image
+ * @param[out] image image, with its first row and column first
+ */
+template <typename T>
+void linearizeRingImage(const vector<T>& map, unsigned int ncol, size_t row_origin, size_t col_origin, vector<T>& image)
+{
+  const unsigned int nrow = map.size() / ncol;
+  image.resize(map.size());
+  for (unsigned int row = 0; row < nrow; ++row)
+  {
+    const typename vector<T>::const_iterator ring_row = map.begin() + wrapIndex(row + row_origin, nrow) * ncol;
+    const typename vector<T>::iterator image_row = std::copy(ring_row + col_origin, ring_row + ncol,
+        image.begin() + row * ncol);
+    std::copy(ring_row, ring_row + col_origin, image_row);
+  }
+}
+
+/** Tell if a point of a ray is on the same side of a row or column as a reference point
+ */
+struct SameSide
+{
+  size_t ncol;  //!< map width
+  bool by_row;  //!< true to compare rows, false to compare columns
+  size_t threshold;  //!< first row or column of the second side
+  bool side;  //!< side of the reference point, true for the second side
+
+  bool operator()(size_t idx, size_t) const
+  {
+    return ((by_row ? idx / ncol : idx % ncol) >= threshold) == side;
+  }
+};
+
+/** Compare a point of a ray and a row, to binary search the rows of a ray
+ */
+struct RowBefore
+{
+  size_t ncol;  //!< map width
+  bool increasing;  //!< true if the rows of the ray are increasing
+
+  bool operator()(size_t idx, size_t row) const
+  {
+    return increasing ? (idx / ncol < row) : (idx / ncol >= row);
+  }
+};
+
+/** Return the points of a ray within a band of rows
+ *
+ * The rows of the points of a ray cast from the map center are monotonic, so
+ * that the points within a band of rows are consecutive.
+ *
+ * @param[in] ray non-empty ray
+ * @param[in] ncol map width
+ * @param[in] row_begin first row of the band
+ * @param[in] row_end row after the last row of the band
+ */
+map_ray_caster::Ray raySection(const map_ray_caster::Ray& ray, size_t ncol, size_t row_begin, size_t row_end)
+{
+  RowBefore before;
+  before.ncol = ncol;
+  before.increasing = (ray.back() / ncol >= ray[0] / ncol);
+  const size_t* begin = std::lower_bound(ray.begin(), ray.end(), before.increasing ? row_begin : row_end, before);
+  const size_t* end = std::lower_bound(begin, ray.end(), before.increasing ? row_end : row_begin, before);
+  return ray.slice(begin - ray.begin(), end - begin);
+}
+
+/** Split a ray where it wraps around the rows and the columns of a ring buffer
+ *
+ * The rows and columns are monotonic along a ray, so that the ray wraps at
+ * most once around the rows and once around the columns of the ring buffer.
+ * The points of each of the three parts are then at a constant offset in the
+ * ring buffer (see ringIndex()), some parts can be empty.
+ *
+ * @param[in] ray ray in the image
+ * @param[in] ncol image width
+ * @param[in] nrow image height
+ * @param[in] row_origin row of the ring buffer holding the first row of the image
+ * @param[in] col_origin column of the ring buffer holding the first column of the image
+ * @param[out] splits the part i is [splits[i], splits[i + 1][, splits[0] and
+ *   splits[3] are the begin and end of the ray
+ */
+void splitRingRay(const map_ray_caster::Ray& ray, size_t ncol, size_t nrow, size_t row_origin, size_t col_origin,
+    const size_t* splits[4])
+{
+  splits[0] = ray.begin();
+  splits[3] = ray.end();
+  if (ray.empty())
+  {
+    splits[1] = splits[2] = ray.end();
+    return;
+  }
+
+  SameSide same_row;
+  same_row.ncol = ncol;
+  same_row.by_row = true;
+  same_row.threshold = nrow - row_origin;
+  same_row.side = (ray[0] / ncol >= same_row.threshold);
+  SameSide same_col;
+  same_col.ncol = ncol;
+  same_col.by_row = false;
+  same_col.threshold = ncol - col_origin;
+  same_col.side = (ray[0] % ncol >= same_col.threshold);
+  const size_t* row_split = std::lower_bound(ray.begin(), ray.end(), 0, same_row);
+  const size_t* col_split = std::lower_bound(ray.begin(), ray.end(), 0, same_col);
+  splits[1] = std::min(row_split, col_split);
+  splits[2] = std::max(row_split, col_split);
+}
+
+/** Constructor
+ *
+ * @param[in] private_nh node handle to read the parameters from, whose
+ *   namespace also prefixes the map frame id.
+ */
+MapBuilder::MapBuilder(int width, int height, double resolution, const ros::NodeHandle& private_nh) :
   angle_resolution_(M_PI / 720),
   p_occupied_when_laser_(g_default_p_occupied_when_laser),
   p_occupied_when_no_laser_(g_default_p_occupied_when_no_laser),
   large_log_odds_(g_default_large_log_odds),
   max_log_odds_for_belief_(g_default_max_log_odds_for_belief),
-  has_frame_id_(false)
+  thread_count_(1),
+  has_frame_id_(false),
+  row_origin_(0),
+  col_origin_(0),
+  map_outdated_(false),
+  stopping_(false)
 {
-  map_frame_id_ = ros::this_node::getName() + "/local_map";
-  map_.header.frame_id = map_frame_id_;
-  map_.info.width = width;
-  map_.info.height = height;
-  map_.info.resolution = resolution;
-  map_.info.origin.position.x = -static_cast<double>(width) / 2 * resolution;
-  map_.info.origin.position.y = -static_cast<double>(height) / 2 * resolution;
-  map_.info.origin.orientation.w = 1.0;
-  map_.data.assign(width * height, -1);  // Fill with "unknown" occupancy.
-  // log_odds = log(occupancy / (1 - occupancy); prefill with
-  // occupancy = 0.5, equiprobability between occupied and free.
-  log_odds_.assign(width * height, 0);
+  map_frame_id_ = private_nh.getNamespace() + "/local_map";
+  initMap(width, height, resolution);
+  tf_listerner_.reset(new tf::TransformListener());
+  tr_broadcaster_.reset(new tf::TransformBroadcaster());
 
-  ros::NodeHandle private_nh("~");
   private_nh.getParam("angle_resolution", angle_resolution_);
   private_nh.getParam("p_occupied_when_laser", p_occupied_when_laser_);
   if (p_occupied_when_laser_ <=0 || p_occupied_when_laser_ >= 1)
@@ -172,12 +286,161 @@ MapBuilder::MapBuilder(int width, int height, double resolution) :
   }
 
 
+  private_nh.getParam("thread_count", thread_count_);
+  if (thread_count_ < 1)
+  {
+    ROS_ERROR_STREAM("Parameter "<< private_nh.getNamespace() << "/thread_count must be positive, setting to default (1)");
+    thread_count_ = 1;
+  }
+
+  initLogOdds();
+
   // Fill in the lookup cache.
-  const double angle_start = -M_PI;
-  const double angle_end = angle_start + 2 * M_PI - 1e-6;
-  for (double a = angle_start; a <= angle_end; a += angle_resolution_)
+  ray_caster_.setAngleResolution(angle_resolution_);
+  ray_caster_.cacheRays(height, width);
+
+  initThreads();
+}
+
+/** Constructor with the settings given directly
+ *
+ * No parameter is read and the tf listener and broadcaster are only created
+ * by the first call to grow(), so that updateMap() can be used without a
+ * roscore, the other settings having their default values.
+ *
+ * @param[in] angle_resolution angle resolution for the ray cast lookup (rad).
+ * @param[in] thread_count number of threads updating the occupancy.
+ */
+MapBuilder::MapBuilder(int width, int height, double resolution, double angle_resolution, int thread_count) :
+  angle_resolution_(angle_resolution),
+  p_occupied_when_laser_(g_default_p_occupied_when_laser),
+  p_occupied_when_no_laser_(g_default_p_occupied_when_no_laser),
+  large_log_odds_(g_default_large_log_odds),
+  max_log_odds_for_belief_(g_default_max_log_odds_for_belief),
+  thread_count_(std::max(thread_count, 1)),
+  has_frame_id_(false),
+  map_frame_id_("local_map"),
+  row_origin_(0),
+  col_origin_(0),
+  map_outdated_(false),
+  stopping_(false)
+{
+  initMap(width, height, resolution);
+  initLogOdds();
+  ray_caster_.setAngleResolution(angle_resolution_);
+  ray_caster_.cacheRays(height, width);
+  initThreads();
+}
+
+MapBuilder::~MapBuilder()
+{
+  if (barrier_)
   {
-    ray_caster_.getRayCastToMapBorder(a, height, width, 0.9 * angle_resolution_);
+    stopping_ = true;
+    barrier_->wait();
+    workers_.join_all();
+  }
+}
+
+/** Set the map geometry and fill the map with "unknown" occupancy
+ */
+void MapBuilder::initMap(int width, int height, double resolution)
+{
+  map_.header.frame_id = map_frame_id_;
+  map_.info.width = width;
+  map_.info.height = height;
+  map_.info.resolution = resolution;
+  map_.info.origin.position.x = -static_cast<double>(width) / 2 * resolution;
+  map_.info.origin.position.y = -static_cast<double>(height) / 2 * resolution;
+  map_.info.origin.orientation.w = 1.0;
+  map_.data.assign(width * height, -1);  // Fill with "unknown" occupancy.
+  occupancy_ = map_.data;
+  // log_odds = log(occupancy / (1 - occupancy); prefill with
+  // occupancy = 0.5, equiprobability between occupied and free.
+  log_odds_.assign(width * height, 0);
+}
+
+/** Split the map in bands of rows and start one thread per band but the first one
+ *
+ * The bands hold the same number of points of the cached rays, so that the
+ * threads get the same amount of work with a 360-deg scan.
+ */
+void MapBuilder::initThreads()
+{
+  const size_t nrow = map_.info.height;
+  const size_t ncol = map_.info.width;
+  band_rows_.assign(1, 0);
+  if (thread_count_ > 1)
+  {
+    vector<size_t> row_points(nrow, 0);
+    size_t total_points = 0;
+    const double resolution = ray_caster_.angleResolution();
+    for (size_t i = 0; i < ray_caster_.lookupSize(); ++i)
+    {
+      const map_ray_caster::Ray ray = ray_caster_.getRayCastToMapBorder(-M_PI + i * resolution, nrow, ncol,
+          0.5 * resolution);
+      for (const size_t* idx = ray.begin(); idx != ray.end(); ++idx)
+      {
+        ++row_points[*idx / ncol];
+      }
+      total_points += ray.size();
+    }
+    size_t points = 0;
+    for (size_t row = 0; row + 1 < nrow && band_rows_.size() < static_cast<size_t>(thread_count_); ++row)
+    {
+      points += row_points[row];
+      if (points * thread_count_ >= total_points * band_rows_.size())
+      {
+        band_rows_.push_back(row + 1);
+      }
+    }
+  }
+  band_rows_.push_back(nrow);
+
+  const size_t band_count = band_rows_.size() - 1;
+  if (band_count > 1)
+  {
+    barrier_.reset(new boost::barrier(band_count));
+    for (size_t band = 1; band < band_count; ++band)
+    {
+      workers_.create_thread(boost::bind(&MapBuilder::updateRowsLoop, this, band));
+    }
+  }
+}
+
+/** Quantise the log odds and fill in the occupancy lookup table
+ *
+ * The log odds are stored as int16_t, large_log_odds_ being the largest
+ * value, so that the update of a point only needs an integer addition and a
+ * table lookup.
+ */
+void MapBuilder::initLogOdds()
+{
+  const int max_log_odds = std::numeric_limits<int16_t>::max();
+  log_odds_scale_ = max_log_odds / large_log_odds_;
+
+  // Original formula: Table 4.2, "Probabilistics robotics", Thrun et al., 2005:
+  // log_odds[idx] = log_odds[idx] +
+  //     std::log(p * (1 - p_occupancy) / (1 - p) / p_occupancy);
+  // With p_occupancy = 0.5, this simplifies to a constant increment,
+  // std::log(p / (1 - p)).
+  const double hit = std::log(p_occupied_when_laser_ / (1 - p_occupied_when_laser_)) * log_odds_scale_;
+  const double miss = std::log(p_occupied_when_no_laser_ / (1 - p_occupied_when_no_laser_)) * log_odds_scale_;
+  hit_log_odds_ = lround(std::min(std::max(hit, -2.0 * max_log_odds), 2.0 * max_log_odds));
+  miss_log_odds_ = lround(std::min(std::max(miss, -2.0 * max_log_odds), 2.0 * max_log_odds));
+  if (hit_log_odds_ == 0 || miss_log_odds_ == 0)
+  {
+    ROS_WARN("Log odds increments are smaller than the quantisation step (%g), some measurements will be ignored",
+        1 / log_odds_scale_);
+  }
+
+  belief_log_odds_ = lround(std::min(std::max(max_log_odds_for_belief_ * log_odds_scale_, 0.0),
+        static_cast<double>(max_log_odds)));
+  occupancy_lookup_.resize(2 * belief_log_odds_ + 1);
+  for (int i = -belief_log_odds_; i <= belief_log_odds_; ++i)
+  {
+    const double log_odds = i / log_odds_scale_;
+    occupancy_lookup_[i + belief_log_odds_] = static_cast<int8_t>(lround((1 - 1 / (1 + std::exp(log_odds))) * 100));
   }
 }
 
@@ -189,7 +452,7 @@ MapBuilder::MapBuilder(int width, int height, double resolution) :
  * @param[in,out] occupancy occupancy map to update
  * @param[in,out] log_odds log odds to update
  */
-void MapBuilder::updatePointOccupancy(bool occupied, size_t idx, vector<int8_t>& occupancy, vector<double>& log_odds) const
+void MapBuilder::updatePointOccupancy(bool occupied, size_t idx, vector<int8_t>& occupancy, vector<int16_t>& log_odds) const
 {
   if (idx >= occupancy.size())
   {
@@ -202,61 +465,120 @@ void MapBuilder::updatePointOccupancy(bool occupied, size_t idx, vector<int8_t>&
     return;
   }
 
-  // Update log_odds.
-  double p;  // Probability of being occupied knowing current measurement.
+  // Update log_odds, increments are precomputed by initLogOdds().
+  const int max_log_odds = std::numeric_limits<int16_t>::max();
+  int new_log_odds = log_odds[idx];
   if (occupied)
   {
-    p = p_occupied_when_laser_;
+    new_log_odds += hit_log_odds_;
   }
   else
   {
-    p = p_occupied_when_no_laser_;
+    new_log_odds += miss_log_odds_;
   }
-  // Original formula: Table 4.2, "Probabilistics robotics", Thrun et al., 2005:
-  // log_odds[idx] = log_odds[idx] +
-  //     std::log(p * (1 - p_occupancy) / (1 - p) / p_occupancy);
-  // With p_occupancy = 0.5, this simplifies to:
-  log_odds[idx] += std::log(p / (1 - p));
-  if (log_odds[idx] < -large_log_odds_)
+  if (new_log_odds < -max_log_odds)
   {
-    log_odds[idx] = -large_log_odds_;
+    new_log_odds = -max_log_odds;
   }
-  else if(log_odds[idx] > large_log_odds_)
+  else if(new_log_odds > max_log_odds)
   {
-    log_odds[idx] = large_log_odds_;
+    new_log_odds = max_log_odds;
   }
+  log_odds[idx] = static_cast<int16_t>(new_log_odds);
   // Update occupancy.
-  if (log_odds[idx] < -max_log_odds_for_belief_)
+  if (new_log_odds < -belief_log_odds_)
   {
     occupancy[idx] = 0;
   }
-  else if (log_odds[idx] > max_log_odds_for_belief_)
+  else if (new_log_odds > belief_log_odds_)
   {
     occupancy[idx] = 100;
   }
   else
   {
-    occupancy[idx] = static_cast<int8_t>(lround((1 - 1 / (1 + std::exp(log_odds[idx]))) * 100));
+    occupancy[idx] = occupancy_lookup_[new_log_odds + belief_log_odds_];
   }
 }
 
+/** Update occupancy and log odds for consecutive points of a ray
+ *
+ * The ray is split where it wraps around the ring buffers (see
+ * splitRingRay()), the points of each part are then at a constant offset in
+ * the ring buffers.
+ *
+ * @param[in] occupied true if the points were measured as occupied
+ * @param[in] indexes pixel indexes in the map
+ * @param[in,out] occupancy occupancy ring buffer to update
+ * @param[in,out] log_odds log odds ring buffer to update
+ */
+void MapBuilder::updatePointsOccupancy(bool occupied, const map_ray_caster::Ray& indexes, vector<int8_t>& occupancy,
+    vector<int16_t>& log_odds) const
+{
+  const size_t* splits[4];
+  splitRingRay(indexes, map_.info.width, map_.info.height, row_origin_, col_origin_, splits);
+  for (size_t part = 0; part < 3; ++part)
+  {
+    if (splits[part] == splits[part + 1])
+    {
+      continue;
+    }
+    const ptrdiff_t offset = static_cast<ptrdiff_t>(ringIndex(*splits[part])) - static_cast<ptrdiff_t>(*splits[part]);
+    for (const size_t* idx = splits[part]; idx != splits[part + 1]; ++idx)
+    {
+      updatePointOccupancy(occupied, *idx + offset, occupancy, log_odds);
+    }
+  }
+}
+
+/** Return the local map
+ *
+ * The occupancy is copied from the ring buffer only when the map is
+ * requested, i.e. when it is published.
+ */
+const nav_msgs::OccupancyGrid& MapBuilder::getMap()
+{
+  if (map_outdated_)
+  {
+    linearizeRingImage(occupancy_, map_.info.width, row_origin_, col_origin_, map_.data);
+    map_outdated_ = false;
+  }
+  return map_;
+}
+
+/** Write the local map into a message
+ *
+ * The occupancy is copied from the ring buffer straight into map, so that
+ * a new message can be published without copying map_.
+ */
+void MapBuilder::getMap(nav_msgs::OccupancyGrid& map) const
+{
+  map.header = map_.header;
+  map.info = map_.info;
+  linearizeRingImage(occupancy_, map_.info.width, row_origin_, col_origin_, map.data);
+}
+
 /** Callback for the LaserScan subscriber.
  *
  * Update (geometrical transformation + probability update) the map with the current scan
  */
 void MapBuilder::grow(const sensor_msgs::LaserScan& scan)
 {
+  if (!tf_listerner_)
+  {
+    tf_listerner_.reset(new tf::TransformListener());
+    tr_broadcaster_.reset(new tf::TransformBroadcaster());
+  }
   if (!has_frame_id_)
   {
     // Wait for a parent.
     std::string parent;
-    bool has_parent = tf_listerner_.getParent(scan.header.frame_id, ros::Time(0), parent);
+    bool has_parent = tf_listerner_->getParent(scan.header.frame_id, ros::Time(0), parent);
     if (!has_parent)
     {
       ROS_DEBUG_STREAM("Frame " << scan.header.frame_id << " has no parent");
       return;
     }
-    world_frame_id_ = getWorldFrame(tf_listerner_, scan.header.frame_id);
+    world_frame_id_ = getWorldFrame(*tf_listerner_, scan.header.frame_id);
     ROS_INFO_STREAM("Found world frame " << world_frame_id_);
     has_frame_id_ = true;
 
@@ -264,9 +586,9 @@ void MapBuilder::grow(const sensor_msgs::LaserScan& scan)
     tf::StampedTransform transform;
     try
     {
-      tf_listerner_.waitForTransform(world_frame_id_, scan.header.frame_id,
+      tf_listerner_->waitForTransform(world_frame_id_, scan.header.frame_id,
           scan.header.stamp, ros::Duration(1.0));
-      tf_listerner_.lookupTransform(world_frame_id_, scan.header.frame_id,
+      tf_listerner_->lookupTransform(world_frame_id_, scan.header.frame_id,
           scan.header.stamp, transform);
     }
     catch (tf::TransformException ex)
@@ -283,7 +605,7 @@ void MapBuilder::grow(const sensor_msgs::LaserScan& scan)
     tf::Transform map_transform;
     map_transform.setOrigin(tf::Vector3(0.0, 0.0, 0.0));
     map_transform.setRotation(tf::Quaternion(1, 0, 0, 0));
-    tr_broadcaster_.sendTransform(tf::StampedTransform(map_transform,
+    tr_broadcaster_->sendTransform(tf::StampedTransform(map_transform,
           scan.header.stamp, scan.header.frame_id, map_frame_id_));
   }
 
@@ -291,9 +613,9 @@ void MapBuilder::grow(const sensor_msgs::LaserScan& scan)
   tf::StampedTransform new_tr;
   try
   {
-    tf_listerner_.waitForTransform(world_frame_id_, scan.header.frame_id,
+    tf_listerner_->waitForTransform(world_frame_id_, scan.header.frame_id,
         scan.header.stamp, ros::Duration(0.2));
-    tf_listerner_.lookupTransform(world_frame_id_, scan.header.frame_id,
+    tf_listerner_->lookupTransform(world_frame_id_, scan.header.frame_id,
         scan.header.stamp, new_tr);
   }
   catch (tf::TransformException ex)
@@ -329,41 +651,109 @@ void MapBuilder::grow(const sensor_msgs::LaserScan& scan)
   tf::Quaternion q;
   q.setRPY(0, 0, -theta);
   map_transform.setRotation(q);
-  tr_broadcaster_.sendTransform(tf::StampedTransform(map_transform, scan.header.stamp, scan.header.frame_id, map_frame_id_));
+  tr_broadcaster_->sendTransform(tf::StampedTransform(map_transform, scan.header.stamp, scan.header.frame_id, map_frame_id_));
 }
 
+/** Move the map and update the occupancy with a scan
+ *
+ * Called by grow() once the displacement is known from tf, and by the
+ * benchmarks.
+ *
+ * @param[in] scan laser scan, whose origin is the map center
+ * @param[in] dx map displacement along x since the last move (cells)
+ * @param[in] dy map displacement along y since the last move (cells)
+ * @param[in] theta scan orientation in the map frame (rad)
+ * @return true if the map moved
+ */
 bool MapBuilder::updateMap(const sensor_msgs::LaserScan& scan, long int dx, long int dy, double theta)
 {
   const bool has_moved = (dx != 0 || dy != 0);
   const int ncol = map_.info.width;
   if (has_moved)
   {
-    // Move the map and log_odds_.
-    moveAndCopyImage(-1, dx, dy, ncol, map_.data);
-    moveAndCopyImage(0, dx, dy, ncol, log_odds_);
+    // Move the origin of occupancy_ and log_odds_.
+    row_origin_ = wrapIndex(row_origin_ + dy, map_.info.height);
+    col_origin_ = wrapIndex(col_origin_ + dx, ncol);
+    clearRingImage(-1, dx, dy, ncol, row_origin_, col_origin_, occupancy_);
+    clearRingImage(0, dx, dy, ncol, row_origin_, col_origin_, log_odds_);
   }
 
-  // Update occupancy.
+  // Ray cast all beams. The tolerance used by getRayCastToObstacle is larger
+  // than half the angle resolution, so that all rays come from the cache of
+  // ray_caster_ and stay valid during the whole update.
+  beam_rays_.resize(scan.ranges.size());
+  beam_obstacles_.resize(scan.ranges.size());
   for (size_t i = 0; i < scan.ranges.size(); ++i)
   {
     const double angle = angles::normalize_angle(scan.angle_min + i * scan.angle_increment + theta);
-    vector<size_t> pts;
-    const bool obstacle_in_map = getRayCastToObstacle(map_, angle, scan.ranges[i], pts);
+    beam_obstacles_[i] = getRayCastToObstacle(map_, angle, scan.ranges[i], beam_rays_[i]);
+  }
+
+  // Update occupancy, one band of rows per thread.
+  if (barrier_)
+  {
+    barrier_->wait();  // Start the workers.
+    updateRows(band_rows_[0], band_rows_[1]);
+    barrier_->wait();  // Wait for the workers.
+  }
+  else
+  {
+    updateRows(0, map_.info.height);
+  }
+  map_outdated_ = true;
+  return has_moved;
+}
+
+/** Update occupancy and log odds with the current scan, within a band of rows
+ *
+ * The beams are processed in the scan order, so that each point gets the same
+ * updates in the same order, whatever the number of bands.
+ *
+ * @param[in] row_begin first row of the band
+ * @param[in] row_end row after the last row of the band
+ */
+void MapBuilder::updateRows(size_t row_begin, size_t row_end)
+{
+  const bool whole_map = (row_begin == 0 && row_end >= map_.info.height);
+  for (size_t i = 0; i < beam_rays_.size(); ++i)
+  {
+    const map_ray_caster::Ray& ray = beam_rays_[i];
+    if (ray.empty())
+    {
+      continue;
+    }
+    map_ray_caster::Ray pts = whole_map ? ray : raySection(ray, map_.info.width, row_begin, row_end);
     if (pts.empty())
     {
       continue;
     }
-    if (obstacle_in_map)
+    if (beam_obstacles_[i] && pts.end() == ray.end())
     {
       // The last point is the point with obstacle.
-      const size_t last_pt = pts.back();
-      updatePointOccupancy(true, last_pt, map_.data, log_odds_);
-      pts.pop_back();
+      updatePointOccupancy(true, ringIndex(pts.back()), occupancy_, log_odds_);
+      pts = pts.slice(0, pts.size() - 1);
     }
     // The remaining points are in free space.
-    updatePointsOccupancy(false, pts, map_.data, log_odds_);
+    updatePointsOccupancy(false, pts, occupancy_, log_odds_);
+  }
+}
+
+/** Update the occupancy within a band of rows for each scan, until the MapBuilder is destroyed
+ *
+ * @param[in] band index of the band in band_rows_
+ */
+void MapBuilder::updateRowsLoop(size_t band)
+{
+  while (true)
+  {
+    barrier_->wait();
+    if (stopping_)
+    {
+      return;
+    }
+    updateRows(band_rows_[band], band_rows_[band + 1]);
+    barrier_->wait();
   }
-  return has_moved;
 }
 
 /** Return the pixel list by ray casting from map origin to map border, first obstacle.
@@ -373,19 +763,20 @@ bool MapBuilder::updateMap(const sensor_msgs::LaserScan& scan, long int dx, long
  * @param[in] map occupancy grid
  * @param[in] angle laser beam angle
  * @param[in] range laser beam range
- * @param[out] raycast list of pixel indexes touched by the laser beam
+ * @param[out] raycast list of pixel indexes touched by the laser beam, a prefix of the ray cached by ray_caster_,
+ *                     valid until the next call
  * @return true if the last point of the pixel list is an obstacle (end of laser beam). 
  */
-bool MapBuilder::getRayCastToObstacle(const nav_msgs::OccupancyGrid& map, double angle, double range, vector<size_t>& raycast)
+bool MapBuilder::getRayCastToObstacle(const nav_msgs::OccupancyGrid& map, double angle, double range, map_ray_caster::Ray& raycast)
 {
   // Do not consider a 0-length range.
   if (range < 1e-10)
   {
-    raycast.clear();
+    raycast = map_ray_caster::Ray();
     return false;
   }
 
-  const vector<size_t>& ray_to_map_border = ray_caster_.getRayCastToMapBorder(angle,
+  const map_ray_caster::Ray ray_to_map_border = ray_caster_.getRayCastToMapBorder(angle,
       map.info.height, map.info.width, 1.1 * angle_resolution_);
   // range in pixel length. The ray length in pixels corresponds to the number
   // of pixels in the bresenham algorithm.
@@ -400,18 +791,15 @@ bool MapBuilder::getRayCastToObstacle(const nav_msgs::OccupancyGrid& map, double
   {
     raycast_size = ray_to_map_border.size();
   }
-  raycast.clear();
-  raycast.reserve(raycast_size);
-  for (size_t i = 0; i < raycast_size; ++i)
-  {
-    raycast.push_back(ray_to_map_border[i]);
-  }
+  raycast = ray_to_map_border.slice(0, raycast_size);
 
   return obstacle_in_map;
 }
 
-bool MapBuilder::saveMap(const std::string& name) const
+bool MapBuilder::saveMap(const std::string& name)
 {
+  getMap();
+
   std::string filename;
   if (name.empty())
   {
@@ -456,5 +844,15 @@ bool MapBuilder::saveMap(const std::string& name) const
   return true;
 }
 
-} // namespace local_map
+// Explicit instantiations, so that the unit tests and the benchmarks can use
+// the ring buffer functions.
+template void clearRingImage<int8_t>(int fill, int dx, int dy, unsigned int ncol, size_t row_origin, size_t col_origin,
+    vector<int8_t>& map);
+template void clearRingImage<int16_t>(int fill, int dx, int dy, unsigned int ncol, size_t row_origin, size_t col_origin,
+    vector<int16_t>& map);
+template void linearizeRingImage<int8_t>(const vector<int8_t>& map, unsigned int ncol, size_t row_origin,
+    size_t col_origin, vector<int8_t>& image);
+template void linearizeRingImage<int16_t>(const vector<int16_t>& map, unsigned int ncol, size_t row_origin,
+    size_t col_origin, vector<int16_t>& image);
 
+} // namespace local_map
@@ -1,9 +1,20 @@
+#include <algorithm>
 #include <vector>
 #include <iostream>
 
 #include <gtest/gtest.h>
 
+#include <local_map/map_builder.h>
+#include <map_ray_caster/map_ray_caster.h>
+
 using std::vector;
+using local_map::clearRingImage;
+using local_map::linearizeRingImage;
+using local_map::offsetFromRowColNoRangeCheck;
+using local_map::raySection;
+using local_map::ringIndex;
+using local_map::splitRingRay;
+using local_map::wrapIndex;
 
 /* Return the offset from row and column number for a row-major array
  */
@@ -12,20 +23,9 @@ inline size_t offsetFromRowCol(const size_t row, const size_t col, const size_t
   return (row * ncol) + col;
 }
 
-/* Return the offset from row and column number for a row-major array
- *
- * COPIED FROM ../include/local_map/map_builder.h
- *
- * offset, row and column can be out of the map range.
- */
-inline int offsetFromRowColNoRangeCheck(const int row, const int col, const size_t ncol)
-{
-  return (row * ncol) + col;
-}
-
 /* In-place move an image represented as a 1D array
  *
- * COPIED FROM ../map_builder.cpp
+ * COPIED FROM ../map_builder.cpp (before the ring buffers)
  *
  * The origin of the image moves relativelty to a frame F. All pixels must be
  * moved in the opposite direction, so that what is represented by the pixels
@@ -88,6 +88,46 @@ void moveAndCopyImage(const int fill, const int dx, const int dy, const unsigned
   }
 }
 
+/* Ring buffer holding an image, moved as in MapBuilder::updateMap
+ */
+struct RingImage
+{
+  vector<int8_t> ring;
+  unsigned int ncol;
+  size_t row_origin;
+  size_t col_origin;
+
+  RingImage(const vector<int8_t>& map, unsigned int ncol) : ring(map), ncol(ncol), row_origin(0), col_origin(0) {}
+
+  void move(int dx, int dy)
+  {
+    row_origin = wrapIndex(row_origin + dy, ring.size() / ncol);
+    col_origin = wrapIndex(col_origin + dx, ncol);
+    clearRingImage(-1, dx, dy, ncol, row_origin, col_origin, ring);
+  }
+
+  vector<int8_t> image() const
+  {
+    vector<int8_t> image;
+    linearizeRingImage(ring, ncol, row_origin, col_origin, image);
+    return image;
+  }
+};
+
+/* Check that moving a ring buffer gives the same image as moveAndCopyImage
+ */
+void expectRingImageEq(const vector<int8_t>& old_map, int dx, int dy, unsigned int ncol, const vector<int8_t>& new_map)
+{
+  RingImage ring(old_map, ncol);
+  ring.move(dx, dy);
+  const vector<int8_t> map = ring.image();
+  for (size_t i = 0; i < map.size(); ++i)
+  {
+    EXPECT_EQ(map[i], new_map[i]) << "Ring image differs at index " << i << " after moving by (" << dx << ", " << dy <<
+      "), map = " << (int) map[i] << ", new_map = " << (int) new_map[i];
+  }
+}
+
 void printMap(std::vector<int8_t>& map, const size_t ncol)
 {
   const size_t nrow = map.size() / ncol;
@@ -128,6 +168,7 @@ TEST(TestSuite, testMoveAndCopyMap)
   std::vector<int8_t> new_map(new_map_m2x);
 
   moveAndCopyImage(-1, -2, 0, 5, map);
+  expectRingImageEq(old_map, -2, 0, 5, new_map);
   //printMap(map, 5);
   for (size_t i = 0; i < map.size(); ++i)
   {
@@ -145,6 +186,7 @@ TEST(TestSuite, testMoveAndCopyMap)
   map = old_map;
   new_map = new_map_p3x;
   moveAndCopyImage(-1, 3, 0, 5, map);
+  expectRingImageEq(old_map, 3, 0, 5, new_map);
   //printMap(map, 5);
   for (size_t i = 0; i < map.size(); ++i)
   {
@@ -162,6 +204,7 @@ TEST(TestSuite, testMoveAndCopyMap)
   map = old_map;
   new_map = new_map_p1y;
   moveAndCopyImage(-1, 0, 1, 5, map);
+  expectRingImageEq(old_map, 0, 1, 5, new_map);
   //printMap(map, 5);
   for (size_t i = 0; i < map.size(); ++i)
   {
@@ -179,6 +222,7 @@ TEST(TestSuite, testMoveAndCopyMap)
   map = old_map;
   new_map = new_map_m1y;
   moveAndCopyImage(-1, 0, -1, 5, map);
+  expectRingImageEq(old_map, 0, -1, 5, new_map);
   //printMap(map, 5);
   for (size_t i = 0; i < map.size(); ++i)
   {
@@ -196,6 +240,7 @@ TEST(TestSuite, testMoveAndCopyMap)
   map = old_map;
   new_map = new_map_m5y;
   moveAndCopyImage(-1, 0, -5, 5, map);
+  expectRingImageEq(old_map, 0, -5, 5, new_map);
   //printMap(map, 5);
   for (size_t i = 0; i < map.size(); ++i)
   {
@@ -213,6 +258,7 @@ TEST(TestSuite, testMoveAndCopyMap)
   map = old_map;
   new_map = new_map_m1x_m1y;
   moveAndCopyImage(-1, -1, -1, 5, map);
+  expectRingImageEq(old_map, -1, -1, 5, new_map);
   //printMap(map, 5);
   for (size_t i = 0; i < map.size(); ++i)
   {
@@ -220,6 +266,146 @@ TEST(TestSuite, testMoveAndCopyMap)
       ", map = " << (int) map[i] << ", new_map = " << (int) new_map[i];
   }
 
+  // Successive moves, the origin of the ring buffer wrapping around.
+  map = old_map;
+  RingImage ring(old_map, 5);
+  const int moves[][2] = {{1, 0}, {2, 1}, {-1, 2}, {3, -1}, {-4, -2}, {0, 3}, {-2, 0}, {1, -3}, {5, 0}, {0, -4}};
+  for (size_t m = 0; m < sizeof(moves) / sizeof(moves[0]); ++m)
+  {
+    moveAndCopyImage(-1, moves[m][0], moves[m][1], 5, map);
+    ring.move(moves[m][0], moves[m][1]);
+    // Mark the cells entering the map, to detect misplaced cells later.
+    for (size_t i = 0; i < map.size(); ++i)
+    {
+      if (map[i] == -1)
+      {
+        map[i] = m;
+      }
+    }
+    for (size_t i = 0; i < ring.ring.size(); ++i)
+    {
+      if (ring.ring[i] == -1)
+      {
+        ring.ring[i] = m;
+      }
+    }
+    const vector<int8_t> ring_map = ring.image();
+    for (size_t i = 0; i < map.size(); ++i)
+    {
+      EXPECT_EQ(map[i], ring_map[i]) << "Ring image differs at index " << i << " after move " << m <<
+        ", map = " << (int) map[i] << ", ring image = " << (int) ring_map[i];
+    }
+  }
+}
+
+TEST(TestSuite, testRaySection)
+{
+  // Rays from the center of a 9x9 map to its border, in the 8 octants.
+  const size_t ncol = 9;
+  const int ends[8][2] = {{8, 6}, {6, 8}, {2, 8}, {0, 6}, {0, 2}, {2, 0}, {6, 0}, {8, 2}};
+  // Bands of rows, as given to the threads.
+  const size_t band_rows[] = {0, 2, 4, 5, 9};
+  for (size_t e = 0; e < 8; ++e)
+  {
+    vector<size_t> points;
+    const int steps = std::max(std::abs(ends[e][0] - 4), std::abs(ends[e][1] - 4));
+    for (int i = 0; i <= steps; ++i)
+    {
+      const int row = 4 + (ends[e][0] - 4) * i / steps;
+      const int col = 4 + (ends[e][1] - 4) * i / steps;
+      points.push_back(offsetFromRowCol(row, col, ncol));
+    }
+    const map_ray_caster::Ray ray(&points[0], points.size());
+
+    // The sections are consecutive and cover the whole ray, with the points of
+    // their band only.
+    size_t covered = 0;
+    for (size_t band = 0; band < 4; ++band)
+    {
+      const map_ray_caster::Ray section = raySection(ray, ncol, band_rows[band], band_rows[band + 1]);
+      for (const size_t* idx = section.begin(); idx != section.end(); ++idx)
+      {
+        EXPECT_GE(*idx / ncol, band_rows[band]) << "Ray " << e << ", band " << band;
+        EXPECT_LT(*idx / ncol, band_rows[band + 1]) << "Ray " << e << ", band " << band;
+      }
+      covered += section.size();
+    }
+    EXPECT_EQ(covered, points.size()) << "Ray " << e;
+  }
+}
+
+TEST(TestSuite, testRingIndex)
+{
+  // A point written at its ring index is found at its place in the linearized image.
+  const unsigned int ncol = 7;
+  const size_t nrow = 5;
+  for (size_t row_origin = 0; row_origin < nrow; ++row_origin)
+  {
+    for (size_t col_origin = 0; col_origin < ncol; ++col_origin)
+    {
+      vector<int8_t> ring(ncol * nrow, -1);
+      for (size_t idx = 0; idx < ring.size(); ++idx)
+      {
+        const size_t ring_idx = ringIndex(idx, ncol, nrow, row_origin, col_origin);
+        ASSERT_LT(ring_idx, ring.size());
+        EXPECT_EQ(-1, ring[ring_idx]) << "Index " << idx << " written twice";
+        ring[ring_idx] = idx;
+      }
+      vector<int8_t> image;
+      linearizeRingImage(ring, ncol, row_origin, col_origin, image);
+      for (size_t idx = 0; idx < image.size(); ++idx)
+      {
+        EXPECT_EQ(idx, static_cast<size_t>(image[idx])) << "Origin (" << row_origin << ", " << col_origin << ")";
+      }
+    }
+  }
+}
+
+TEST(TestSuite, testSplitRingRay)
+{
+  // Rays from the center of a map to its border, for all the origins of the ring buffer.
+  const size_t ncol = 24, nrow = 17;
+  map_ray_caster::MapRayCaster ray_caster;
+  for (int a = 0; a < 64; ++a)
+  {
+    const map_ray_caster::Ray ray = ray_caster.getRayCastToMapBorder(-M_PI + a * M_PI / 32, nrow, ncol);
+    ASSERT_FALSE(ray.empty());
+    for (size_t row_origin = 0; row_origin < nrow; ++row_origin)
+    {
+      for (size_t col_origin = 0; col_origin < ncol; ++col_origin)
+      {
+        const size_t* splits[4];
+        splitRingRay(ray, ncol, nrow, row_origin, col_origin, splits);
+        ASSERT_EQ(ray.begin(), splits[0]);
+        ASSERT_LE(splits[0], splits[1]);
+        ASSERT_LE(splits[1], splits[2]);
+        ASSERT_LE(splits[2], splits[3]);
+        ASSERT_EQ(ray.end(), splits[3]);
+        // The points of a part are at a constant offset in the ring buffer.
+        for (size_t part = 0; part < 3; ++part)
+        {
+          if (splits[part] == splits[part + 1])
+          {
+            continue;
+          }
+          const ptrdiff_t offset = static_cast<ptrdiff_t>(ringIndex(*splits[part], ncol, nrow, row_origin, col_origin)) -
+            static_cast<ptrdiff_t>(*splits[part]);
+          for (const size_t* idx = splits[part]; idx != splits[part + 1]; ++idx)
+          {
+            EXPECT_EQ(static_cast<ptrdiff_t>(ringIndex(*idx, ncol, nrow, row_origin, col_origin)),
+                static_cast<ptrdiff_t>(*idx) + offset) << "Angle " << a << ", origin (" << row_origin << ", " <<
+              col_origin << "), part " << part;
+          }
+        }
+      }
+    }
+  }
+
+  // Empty ray.
+  const map_ray_caster::Ray empty(NULL, 0);
+  const size_t* splits[4];
+  splitRingRay(empty, ncol, nrow, 3, 5, splits);
+  EXPECT_EQ(splits[0], splits[3]);
 }
 
 int main(int argc, char** argv)
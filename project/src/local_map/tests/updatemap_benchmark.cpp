@@ -0,0 +1,427 @@
+/*
+ * Micro-benchmark of the occupancy update of local_map::MapBuilder::updateMap.
+ *
+ * Compares the former update (map moved with moveAndCopyImage, a std::vector of
+ * pixel indexes per beam, filled by copying the cached ray, and double log odds
+ * updated with std::log and std::exp) against the current update (ring buffers,
+ * prefixes of the cached rays, quantised log odds and occupancy lookup table,
+ * bands of rows updated by 1 to N threads), on 200x200 and 600x600 maps with a
+ * 0.25 deg angle resolution, for 720- and 1440-beam scans of a room which partly
+ * lies outside the map, the robot moving by about one cell per scan. The heap
+ * allocations made by the updates are counted. All thread counts must give the
+ * same map, the quantised log odds may change the occupancy by 1 compared to
+ * the former update. The move of the map alone, and the copy of the ring buffer
+ * into the published map, are also timed.
+ *
+ * The current update is the one of local_map::MapBuilder, linked from
+ * local_map_nodelet, built with its settings given directly, so that no roscore
+ * is needed.
+ *
+ * Usage: rosrun local_map updatemap_benchmark [iterations] [max threads]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include <angles/angles.h>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <nav_msgs/OccupancyGrid.h>
+#include <ros/ros.h>
+#include <sensor_msgs/LaserScan.h>
+
+#include <local_map/map_builder.h>
+#include <map_ray_caster/map_ray_caster.h>
+
+using std::vector;
+using local_map::MapBuilder;
+using local_map::raySection;
+using map_ray_caster::MapRayCaster;
+using map_ray_caster::Ray;
+
+const double g_resolution = 0.02;
+const double g_angle_resolution = M_PI / 720;
+
+size_t g_nb_allocations = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+  ++g_nb_allocations;
+  void* p = std::malloc(size ? size : 1);
+  if (!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) throw()
+{
+  std::free(p);
+}
+
+/* COPIED FROM ../src/map_builder.cpp (moveAndCopyImage, before the ring buffers)
+ */
+template <typename T>
+void moveAndCopyImage(int fill, int dx, int dy, unsigned int ncol, vector<T>& map)
+{
+  if (dx == 0 && dy == 0)
+  {
+    return;
+  }
+
+  const unsigned int nrow = map.size() / ncol;
+  int row_start = 0;
+  int row_end = nrow;
+  int row_increment = 1;
+  if (dy < 0)
+  {
+    row_start = nrow - 1;
+    row_end = -1;
+    row_increment = -1;
+  }
+  int col_start = 0;
+  int col_steps = ncol;
+  int col_increment = 1;
+  if (dx < 0)
+  {
+    col_start = ncol - 1;
+    col_steps = -ncol;
+    col_increment = -1;
+  }
+  for (int new_row = row_start; new_row != row_end; new_row += row_increment)
+  {
+    const int new_idx_start = new_row * ncol + col_start;
+    const int row = new_row + dy;
+    int idx = row * ncol + col_start + dx;
+    const int min_idx = std::max(0, static_cast<int>(row * ncol));
+    const int max_idx = std::min(static_cast<int>(map.size()) - 1, static_cast<int>(row * ncol + ncol - 1));
+    const int new_idx_end = new_idx_start + col_steps;
+    for (int new_idx = new_idx_start; new_idx != new_idx_end;)
+    {
+      if (min_idx <= idx && idx <= max_idx)
+      {
+        map[new_idx] = map[idx];
+      }
+      else
+      {
+        map[new_idx] = fill;
+      }
+      new_idx += col_increment;
+      idx += col_increment;
+    }
+  }
+}
+
+/* Occupancy grid and log odds, updated as MapBuilder did before the ring buffers, with its default parameters.
+ */
+struct LegacyMap
+{
+  nav_msgs::OccupancyGrid map_;
+  vector<double> legacy_log_odds_;
+  MapRayCaster ray_caster_;
+  double p_occupied_when_laser_;
+  double p_occupied_when_no_laser_;
+  double large_log_odds_;
+  double max_log_odds_for_belief_;
+
+  LegacyMap(int size) :
+    ray_caster_(60, g_angle_resolution),
+    p_occupied_when_laser_(0.9),
+    p_occupied_when_no_laser_(0.3),
+    large_log_odds_(100),
+    max_log_odds_for_belief_(20)
+  {
+    map_.info.width = size;
+    map_.info.height = size;
+    map_.info.resolution = g_resolution;
+    map_.data.assign(size * size, -1);
+    legacy_log_odds_.assign(size * size, 0);
+    ray_caster_.cacheRays(size, size);
+  }
+
+  /* COPIED FROM ../src/map_builder.cpp (MapBuilder::updatePointOccupancy, before the quantised log odds)
+   */
+  void updatePointOccupancy(bool occupied, size_t idx, vector<int8_t>& occupancy, vector<double>& log_odds) const
+  {
+    if (idx >= occupancy.size())
+    {
+      return;
+    }
+    const double p = occupied ? p_occupied_when_laser_ : p_occupied_when_no_laser_;
+    log_odds[idx] += std::log(p / (1 - p));
+    if (log_odds[idx] < -large_log_odds_)
+    {
+      log_odds[idx] = -large_log_odds_;
+    }
+    else if (log_odds[idx] > large_log_odds_)
+    {
+      log_odds[idx] = large_log_odds_;
+    }
+    if (log_odds[idx] < -max_log_odds_for_belief_)
+    {
+      occupancy[idx] = 0;
+    }
+    else if (log_odds[idx] > max_log_odds_for_belief_)
+    {
+      occupancy[idx] = 100;
+    }
+    else
+    {
+      occupancy[idx] = static_cast<int8_t>(lround((1 - 1 / (1 + std::exp(log_odds[idx]))) * 100));
+    }
+  }
+
+  /* COPIED FROM ../src/map_builder.cpp (MapBuilder::getRayCastToObstacle, before the prefix of the cached ray)
+   */
+  bool legacyGetRayCastToObstacle(double angle, double range, vector<size_t>& raycast)
+  {
+    if (range < 1e-10)
+    {
+      raycast.clear();
+      return false;
+    }
+    const Ray ray_to_map_border = ray_caster_.getRayCastToMapBorder(angle, map_.info.height, map_.info.width,
+        1.1 * g_angle_resolution);
+    const size_t pixel_range = lround(range * std::max(std::abs(std::cos(angle)), std::abs(std::sin(angle))) / g_resolution);
+    const bool obstacle_in_map = pixel_range < ray_to_map_border.size();
+    const size_t raycast_size = obstacle_in_map ? pixel_range : ray_to_map_border.size();
+    raycast.clear();
+    raycast.reserve(raycast_size);
+    for (size_t i = 0; i < raycast_size; ++i)
+    {
+      raycast.push_back(ray_to_map_border[i]);
+    }
+    return obstacle_in_map;
+  }
+
+  /* COPIED FROM ../src/map_builder.cpp (MapBuilder::updateMap, before the prefix of the cached ray)
+   */
+  void legacyUpdate(const sensor_msgs::LaserScan& scan, double theta, int dx, int dy)
+  {
+    moveAndCopyImage(-1, dx, dy, map_.info.width, map_.data);
+    moveAndCopyImage(0, dx, dy, map_.info.width, legacy_log_odds_);
+    for (size_t i = 0; i < scan.ranges.size(); ++i)
+    {
+      const double angle = angles::normalize_angle(scan.angle_min + i * scan.angle_increment + theta);
+      vector<size_t> pts;
+      const bool obstacle_in_map = legacyGetRayCastToObstacle(angle, scan.ranges[i], pts);
+      if (pts.empty())
+      {
+        continue;
+      }
+      if (obstacle_in_map)
+      {
+        const size_t last_pt = pts.back();
+        updatePointOccupancy(true, last_pt, map_.data, legacy_log_odds_);
+        pts.pop_back();
+      }
+      vector<size_t>::const_iterator idx = pts.begin();
+      for (; idx != pts.end(); ++idx)
+      {
+        updatePointOccupancy(false, *idx, map_.data, legacy_log_odds_);
+      }
+    }
+  }
+};
+
+/* MapBuilder with the benchmark resolutions, updating with thread_count threads.
+ */
+MapBuilder* createMapBuilder(int size, int thread_count)
+{
+  return new MapBuilder(size, size, g_resolution, g_angle_resolution, thread_count);
+}
+
+/* 360 deg scan from the center of a room 1.25 times as wide and 0.75 times as
+ * high as the map.
+ */
+sensor_msgs::LaserScan createScan(int beams, int map_size)
+{
+  const double half_width = 0.625 * map_size * g_resolution;
+  const double half_height = 0.375 * map_size * g_resolution;
+  sensor_msgs::LaserScan scan;
+  scan.angle_min = -M_PI;
+  scan.angle_increment = 2 * M_PI / beams;
+  scan.angle_max = scan.angle_min + (beams - 1) * scan.angle_increment;
+  for (int i = 0; i < beams; ++i)
+  {
+    const double angle = scan.angle_min + i * scan.angle_increment;
+    const double rx = (std::cos(angle) == 0) ? 1e10 : half_width / std::abs(std::cos(angle));
+    const double ry = (std::sin(angle) == 0) ? 1e10 : half_height / std::abs(std::sin(angle));
+    scan.ranges.push_back(std::min(rx, ry));
+  }
+  return scan;
+}
+
+/* Orientation of the robot, which slowly turns.
+ */
+double scanTheta(int scan)
+{
+  return 0.003 * scan;
+}
+
+/* Displacement of the map (cells) before a scan, the robot moving forwards
+ * and backwards by about one cell per scan.
+ */
+void scanMove(int scan, int& dx, int& dy)
+{
+  const int direction = ((scan / 100) % 2 == 0) ? 1 : -1;
+  dx = (scan % 3 != 0) ? direction : 0;
+  dy = (scan % 2 == 0) ? direction : 0;
+}
+
+/* Count the cells whose occupancy differs by more than tolerance.
+ */
+int compareMaps(const vector<int8_t>& a, const vector<int8_t>& b, int tolerance)
+{
+  int differences = 0;
+  for (size_t i = 0; i < a.size(); ++i)
+  {
+    if (std::abs(a[i] - b[i]) > tolerance)
+    {
+      ++differences;
+    }
+  }
+  return differences;
+}
+
+/* Return the largest share of the points of a scan updated by a single band of map_builder,
+ * the speedup is at most its inverse.
+ */
+double largestBandShare(LegacyMap& legacy_map, const MapBuilder& map_builder, const sensor_msgs::LaserScan& scan,
+    double theta)
+{
+  const vector<size_t>& band_rows = map_builder.bandRows();
+  const size_t ncol = legacy_map.map_.info.width;
+  size_t total_points = 0;
+  size_t largest_points = 0;
+  for (size_t band = 0; band + 1 < band_rows.size(); ++band)
+  {
+    size_t points = 0;
+    for (size_t i = 0; i < scan.ranges.size(); ++i)
+    {
+      const double angle = angles::normalize_angle(scan.angle_min + i * scan.angle_increment + theta);
+      vector<size_t> pts;
+      legacy_map.legacyGetRayCastToObstacle(angle, scan.ranges[i], pts);
+      if (!pts.empty())
+      {
+        points += raySection(Ray(&pts[0], pts.size()), ncol, band_rows[band], band_rows[band + 1]).size();
+      }
+    }
+    total_points += points;
+    largest_points = std::max(largest_points, points);
+  }
+  return static_cast<double>(largest_points) / total_points;
+}
+
+void run(int map_size, int beams, int iterations, int max_threads)
+{
+  const sensor_msgs::LaserScan scan = createScan(beams, map_size);
+  std::cout << map_size << "x" << map_size << " map, " << beams << " beams:" << std::endl;
+
+  LegacyMap legacy_map(map_size);
+  size_t start_allocations = g_nb_allocations;
+  ros::WallTime start = ros::WallTime::now();
+  for (int s = 0; s < iterations; ++s)
+  {
+    int dx;
+    int dy;
+    scanMove(s, dx, dy);
+    legacy_map.legacyUpdate(scan, scanTheta(s), dx, dy);
+  }
+  const double legacy_time = (ros::WallTime::now() - start).toSec() / iterations;
+  std::cout << "  moveAndCopyImage, vector per beam, double log odds (former update): " << legacy_time * 1e6 << " us per scan, "
+            << 1 / legacy_time << " scans/s, " << static_cast<double>(g_nb_allocations - start_allocations) / iterations
+            << " allocations per scan" << std::endl;
+
+  boost::scoped_ptr<MapBuilder> serial_map;
+  double serial_time = 0;
+  for (int threads = 1; threads <= max_threads; ++threads)
+  {
+    boost::scoped_ptr<MapBuilder> parallel_map(createMapBuilder(map_size, threads));
+    if (threads == 1)
+    {
+      serial_map.swap(parallel_map);
+    }
+    MapBuilder& map = (threads == 1) ? *serial_map : *parallel_map;
+    for (int s = 0; s < iterations; ++s)
+    {
+      // The first scan sizes the beam buffers and is not timed.
+      if (s == 1)
+      {
+        start_allocations = g_nb_allocations;
+        start = ros::WallTime::now();
+      }
+      int dx;
+      int dy;
+      scanMove(s, dx, dy);
+      map.updateMap(scan, dx, dy, scanTheta(s));
+    }
+    const double time = (ros::WallTime::now() - start).toSec() / (iterations - 1);
+    if (threads == 1)
+    {
+      serial_time = time;
+    }
+
+    std::cout << "  " << threads << " thread(s), " << map.bandRows().size() - 1 << " band(s): " << time * 1e6
+              << " us per scan, " << 1 / time << " scans/s, speedup " << serial_time / time << ", "
+              << static_cast<double>(g_nb_allocations - start_allocations) / (iterations - 1) << " allocations per scan"
+              << std::endl;
+    std::cout << "    (largest band: " << largestBandShare(legacy_map, map, scan, scanTheta(iterations - 1)) * 100
+              << "% of the points, " << compareMaps(serial_map->getMap().data, map.getMap().data, 0)
+              << " cells different from 1 thread, " << compareMaps(legacy_map.map_.data, map.getMap().data, 1)
+              << " cells differing by more than 1 from the former update)" << std::endl;
+  }
+}
+
+/* Time the move of the map by one cell in x and y, and the copy of the ring buffer into the published map.
+ */
+void runMove(int map_size, int iterations)
+{
+  LegacyMap legacy_map(map_size);
+  ros::WallTime start = ros::WallTime::now();
+  for (int s = 0; s < iterations; ++s)
+  {
+    const int direction = (s % 2 == 0) ? 1 : -1;
+    moveAndCopyImage(-1, direction, direction, map_size, legacy_map.map_.data);
+    moveAndCopyImage(0, direction, direction, map_size, legacy_map.legacy_log_odds_);
+  }
+  const double legacy_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  boost::scoped_ptr<MapBuilder> map(createMapBuilder(map_size, 1));
+  start = ros::WallTime::now();
+  for (int s = 0; s < iterations; ++s)
+  {
+    map->updateMap(sensor_msgs::LaserScan(), 1, 1, 0);
+  }
+  const double time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  nav_msgs::OccupancyGrid published_map;
+  start = ros::WallTime::now();
+  for (int s = 0; s < iterations; ++s)
+  {
+    map->getMap(published_map);
+  }
+  const double linearize_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  std::cout << map_size << "x" << map_size << " map, move by one cell in x and y:" << std::endl;
+  std::cout << "  moveAndCopyImage (former move): " << legacy_time * 1e6 << " us" << std::endl;
+  std::cout << "  ring buffers: " << time * 1e6 << " us, then " << linearize_time * 1e6 << " us to publish the map"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  const int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+  const int max_threads = (argc > 2) ? atoi(argv[2]) : std::max(1u, boost::thread::hardware_concurrency());
+  run(200, 720, iterations, max_threads);
+  run(200, 1440, iterations, max_threads);
+  run(600, 1440, iterations, max_threads);
+  runMove(200, iterations);
+  runMove(600, iterations);
+  return 0;
+}
@@ -3,7 +3,8 @@
 
 #include <math.h> /* for lround, std::lround not in C++99. */
 #include <cmath>
-#include <map>
+#include <cstddef>
+#include <stdint.h>
 #include <vector>
 
 #include <angles/angles.h>
@@ -17,28 +18,79 @@
 namespace map_ray_caster
 {
 
-typedef std::map<double, std::vector<size_t> > RayLookup;
+/* Contiguous list of pixel indexes from map center to map border
+ *
+ * The rays returned by MapRayCaster also hold the distance from map center
+ * to each pixel, in pixels, which increases along the ray.
+ * A Ray does not own the indexes and distances, see
+ * MapRayCaster::getRayCastToMapBorder for how long they stay valid.
+ */
+class Ray
+{
+  public :
+
+    Ray() : begin_(NULL), distances_(NULL), size_(0) {}
+    Ray(const size_t* begin, const size_t size) : begin_(begin), distances_(NULL), size_(size) {}
+    Ray(const size_t* begin, const float* distances, const size_t size) :
+      begin_(begin), distances_(distances), size_(size) {}
+
+    const size_t* begin() const {return begin_;}
+    const size_t* end() const {return begin_ + size_;}
+    size_t size() const {return size_;}
+    bool empty() const {return size_ == 0;}
+    size_t operator[](const size_t i) const {return begin_[i];}
+    size_t back() const {return begin_[size_ - 1];}
+    bool hasDistances() const {return distances_ != NULL;}
+    const float* distances() const {return distances_;}
+    float distance(const size_t i) const {return distances_[i];}
+
+    /* Return the sub-ray of size points starting at point first, with the matching distances
+     */
+    Ray slice(const size_t first, const size_t size) const
+    {
+      return Ray(begin_ + first, distances_ == NULL ? NULL : distances_ + first, size);
+    }
+
+  private :
+
+    const size_t* begin_;
+    const float* distances_;  //!< Distance from map center to each pixel (pixel), can be NULL.
+    size_t size_;
+};
 
 class MapRayCaster
 {
   public :
 
-    MapRayCaster(const int occupied_threshold = 60);
+    MapRayCaster(const int occupied_threshold = 60, const double angle_resolution = M_PI / 720);
 
     void laserScanCast(const nav_msgs::OccupancyGrid& map, sensor_msgs::LaserScan& scan);
 
-    const std::vector<size_t>& getRayCastToMapBorder(const double angle, const size_t nrow, const size_t ncol, const double tolerance = 0);
+    void setAngleResolution(const double angle_resolution);
+
+    double angleResolution() const {return angle_resolution_;}
+
+    void cacheRays(const size_t nrow, const size_t ncol);
+
+    Ray getRayCastToMapBorder(const double angle, const size_t nrow, const size_t ncol, const double tolerance = 0);
 
-    size_t lookupSize() const {return raycast_lookup_.size();}
+    size_t lookupSize() const {return ray_offsets_.empty() ? 0 : ray_offsets_.size() - 1;}
 
   private :
 
-    RayLookup::const_iterator angleLookup(const double angle, const double tolerance);
+    void castRay(const double angle, const size_t nrow, const size_t ncol,
+        std::vector<size_t>& pts, std::vector<float>& distances) const;
 
     int occupied_threshold_;
+    double angle_resolution_;  //!< Angle between two cached rays (rad), 2 pi divided by the number of rays.
     size_t ncol_; //!< Map width used in the cache.
     size_t nrow_; //!< Map height used in the cache.
-    RayLookup raycast_lookup_;
+    std::vector<size_t> ray_offsets_;  //!< Offset of ray i in ray_cells_ (ray i has angle -pi + i * angle_resolution_),
+                                       //!< with a last element holding the arena size.
+    std::vector<size_t> ray_cells_;  //!< Pixel indexes of all cached rays, stored one after the other.
+    std::vector<float> ray_distances_;  //!< Distance from map center to each pixel of ray_cells_ (pixel).
+    std::vector<size_t> uncached_ray_;  //!< Last ray cast outside the cache tolerance.
+    std::vector<float> uncached_distances_;  //!< Distance from map center to each pixel of uncached_ray_ (pixel).
 };
 
 } // namespace map_ray_caster
@@ -43,7 +43,7 @@ inline void indexToReal(const nav_msgs::OccupancyGrid& map, const size_t index,
 {
   const double xcenter = (map.info.width / 2) * map.info.resolution;
   const double ycenter = (map.info.height / 2) * map.info.resolution;
-  const size_t row = rowFromOffset(index, map.info.height);
+  const size_t row = rowFromOffset(index, map.info.width);
   const size_t col = colFromOffset(index, map.info.width);
   const double xindex = col * map.info.resolution;
   const double yindex = row * map.info.resolution;
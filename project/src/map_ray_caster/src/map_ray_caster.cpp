@@ -3,16 +3,17 @@
 namespace map_ray_caster
 {
 
-MapRayCaster::MapRayCaster(const int occupied_threshold) :
-  occupied_threshold_(occupied_threshold)
-{
-}
-
-/** Return true if the map point is occupied.
-*/
-inline bool pointOccupied(const nav_msgs::OccupancyGrid& map, const int index, const int occupied_threshold)
+/** Constructor
+ *
+ * @param[in] occupied_threshold occupancy above which a map point is an obstacle.
+ * @param[in] angle_resolution angle between two cached rays (rad).
+ */
+MapRayCaster::MapRayCaster(const int occupied_threshold, const double angle_resolution) :
+  occupied_threshold_(occupied_threshold),
+  ncol_(0),
+  nrow_(0)
 {
-  return (map.data[index] > occupied_threshold) || (map.data[index] == -1);
+  setAngleResolution(angle_resolution);
 }
 
 /** Fill the ranges attributes with distances to obstacle
@@ -20,6 +21,10 @@ inline bool pointOccupied(const nav_msgs::OccupancyGrid& map, const int index, c
  * The ray casting will be from scan.angle_min to scan.angle_max, so that the
  * scan message must be initialized with non-default values.
  *
+ * Each ray is followed up to its first occupied point or scan.range_max,
+ * with a single comparison per point, and the distance to this last point is
+ * read from the ray.
+ *
  * @param[in] map occupancy grid.
  * @param[in,out] scan LaserScan.
  *   scan.angle_min, scan.angle_max, scan.increment, scan.range_max will be
@@ -28,70 +33,153 @@ inline bool pointOccupied(const nav_msgs::OccupancyGrid& map, const int index, c
  */
 void MapRayCaster::laserScanCast(const nav_msgs::OccupancyGrid& map, sensor_msgs::LaserScan& scan)
 {
-  scan.ranges.clear();
-  for (double angle = scan.angle_min; angle <= scan.angle_max + 1e-6; angle += scan.angle_increment)
+  const size_t nrow = map.info.height;
+  const size_t ncol = map.info.width;
+  const double resolution = map.info.resolution;
+  // Max pixel count for scan.range_max if it were "bitmapped".
+  const size_t pixel_range = lround(scan.range_max / resolution) + 1;
+  const double max_range = 0.99 * scan.range_max;
+  // As unsigned bytes, the unknown points (-1) are 255, so that a point is
+  // occupied (above occupied_threshold_) or unknown if its byte is above the
+  // threshold.
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(map.data.empty() ? NULL : &map.data[0]);
+  const int threshold = std::min(occupied_threshold_, 254);
+  const size_t beam_count = std::floor((scan.angle_max - scan.angle_min + 1e-6) / scan.angle_increment) + 1;
+
+  scan.ranges.resize(beam_count);
+  for (size_t beam = 0; beam < beam_count; ++beam)
   {
-    // Max pixel count for scan.range_max if it were "bitmapped".
-    const size_t pixel_range = lround(scan.range_max / map.info.resolution) + 1;
-    const std::vector<size_t>& ray = getRayCastToMapBorder(angle,
-        map.info.height, map.info.width, scan.angle_increment / 2);
+    const Ray ray = getRayCastToMapBorder(scan.angle_min + beam * scan.angle_increment,
+        nrow, ncol, scan.angle_increment / 2);
     const size_t max_size = std::min(ray.size(), pixel_range);
-    geometry_msgs::Point32 p;
-    indexToReal(map, ray.back(), p);
-    double range = std::min(0.99 * scan.range_max, (double)std::sqrt(p.x * p.x + p.y * p.y));
-    for (size_t i = 0; i < max_size; ++i)
+    size_t i = 0;
+    while (i < max_size && data[ray[i]] <= threshold)
+    {
+      ++i;
+    }
+    // Distance to the obstacle, or to the map border if there is none within range.
+    double range = ray.distance((i < max_size) ? i : ray.size() - 1) * resolution;
+    if (i == max_size)
     {
-      const size_t idx = ray[i];
-      if (pointOccupied(map, idx, occupied_threshold_))
-      {
-        geometry_msgs::Point32 p;
-        indexToReal(map, idx, p);
-        range = std::sqrt(p.x * p.x + p.y * p.y);
-        break;
-      }
+      range = std::min(max_range, range);
     }
     if (range > scan.range_max)
     {
-      range = 0.99 * scan.range_max;
+      range = max_range;
     }
-    scan.ranges.push_back(range);
+    scan.ranges[beam] = range;
   }
 }
 
+/** Set the angle between two cached rays and erase the cache
+ *
+ * The resolution is rounded so that 2 pi is a multiple of it.
+ *
+ * @param[in] angle_resolution angle between two cached rays (rad).
+ */
+void MapRayCaster::setAngleResolution(const double angle_resolution)
+{
+  const long nrays = std::max(1L, lround(2 * M_PI / angle_resolution));
+  angle_resolution_ = 2 * M_PI / nrays;
+  ray_offsets_.clear();
+  ray_cells_.clear();
+  ray_distances_.clear();
+}
+
+/** Fill the cache with the rays from map center to map border, for all angles
+ *
+ * Ray i has angle -pi + i * angleResolution(). All rays are stored one after
+ * the other in a single array, and their distances in a parallel array.
+ *
+ * @param[in] nrow image height.
+ * @param[in] ncol image width.
+ */
+void MapRayCaster::cacheRays(const size_t nrow, const size_t ncol)
+{
+  nrow_ = nrow;
+  ncol_ = ncol;
+  const size_t nrays = lround(2 * M_PI / angle_resolution_);
+  ray_offsets_.resize(nrays + 1);
+  ray_cells_.clear();
+  ray_distances_.clear();
+  for (size_t i = 0; i < nrays; ++i)
+  {
+    ray_offsets_[i] = ray_cells_.size();
+    castRay(-M_PI + i * angle_resolution_, nrow, ncol, ray_cells_, ray_distances_);
+  }
+  ray_offsets_[nrays] = ray_cells_.size();
+}
+
 /** Return the list of pixel indexes from map center to pixel at map border and given angle
  *
- * The Bresenham algorithm is used.
+ * The closest cached ray is returned if it is within tolerance of the given
+ * angle, it remains valid until the map size or the angle resolution
+ * changes. Otherwise, the ray is cast for the exact angle and remains valid
+ * until the next call.
  *
  * @param[in] angle beam angle.
  * @param[in] nrow image height.
  * @param[in] ncol image width.
+ * @param[in] tolerance maximum angle between the beam and the returned ray.
  *
- * @return The list of pixel indexes from map center to pixel at map border and given angle.
+ * @return The list of pixel indexes from map center to pixel at map border and given angle,
+ *   with their distances to map center.
  */
-const std::vector<size_t>& MapRayCaster::getRayCastToMapBorder(const double angle, const size_t nrow, const size_t ncol, const double tolerance)
+Ray MapRayCaster::getRayCastToMapBorder(const double angle, const size_t nrow, const size_t ncol, const double tolerance)
 {
-  // Check that parameters are compatible with the cache. If not, erase the cache.
-  if (nrow != nrow_ || ncol != ncol_)
+  // Check that parameters are compatible with the cache. If not, rebuild the cache.
+  if (nrow != nrow_ || ncol != ncol_ || ray_offsets_.empty())
   {
-    raycast_lookup_.clear();
-    nrow_ = nrow;
-    ncol_ = ncol;
+    cacheRays(nrow, ncol);
   }
 
-  RayLookup::const_iterator ray = angleLookup(angle, tolerance);
-  if (ray != raycast_lookup_.end())
+  // Closest ray, without normalizing the angle: ray indexes are taken modulo the number of rays.
+  const long nrays = lookupSize();
+  const double position = (angle + M_PI) / angle_resolution_;
+  const long closest = lround(position);
+  const long index = ((closest % nrays) + nrays) % nrays;
+  if (std::abs(position - closest) * angle_resolution_ <= tolerance)
   {
-    return ray->second;
+    const size_t begin = ray_offsets_[index];
+    if (ray_cells_.empty())
+    {
+      return Ray();
+    }
+    return Ray(&ray_cells_[0] + begin, &ray_distances_[0] + begin, ray_offsets_[index + 1] - begin);
   }
 
-  std::vector<size_t> pts;
+  uncached_ray_.clear();
+  uncached_distances_.clear();
+  castRay(angle, nrow, ncol, uncached_ray_, uncached_distances_);
+  if (uncached_ray_.empty())
+  {
+    return Ray();
+  }
+  return Ray(&uncached_ray_[0], &uncached_distances_[0], uncached_ray_.size());
+}
 
+/** Append the pixel indexes from map center to pixel at map border and given angle
+ *
+ * The Bresenham algorithm is used.
+ *
+ * @param[in] angle beam angle.
+ * @param[in] nrow image height.
+ * @param[in] ncol image width.
+ * @param[in,out] pts vector the pixel indexes are appended to.
+ * @param[in,out] distances vector the distances from map center to the
+ *   pixels are appended to (pixel).
+ */
+void MapRayCaster::castRay(const double angle, const size_t nrow, const size_t ncol,
+    std::vector<size_t>& pts, std::vector<float>& distances) const
+{
   // Twice the distance from map center to map corner.
   const double r = std::sqrt((double) nrow * nrow + ncol * ncol);
   // Start point, map center.
   // TODO: the sensor position (map origin)  may not be the map center
-  int x0 = ncol / 2;
-  int y0 = nrow / 2;
+  const int xcenter = ncol / 2;
+  const int ycenter = nrow / 2;
+  int x0 = xcenter;
+  int y0 = ycenter;
   // End point, outside the map.
   int x1 = (int) round(x0 + r * std::cos(angle)); // Can be negative
   int y1 = (int) round(y0 + r * std::sin(angle));
@@ -138,12 +226,14 @@ const std::vector<size_t>& MapRayCaster::getRayCastToMapBorder(const double angl
     if (pointInMap(yDraw, xDraw, nrow, ncol))
     {
       pts.push_back(offsetFromRowCol(yDraw, xDraw, ncol));
+      const double dxDraw = xDraw - xcenter;
+      const double dyDraw = yDraw - ycenter;
+      distances.push_back(std::sqrt(dxDraw * dxDraw + dyDraw * dyDraw));
     }
     else
     {
       // We exit when the first point outside the map is encountered.
-      raycast_lookup_[angle] = pts;
-      return raycast_lookup_[angle];
+      return;
     }
     // next
     if (e > 0)
@@ -158,75 +248,4 @@ const std::vector<size_t>& MapRayCaster::getRayCastToMapBorder(const double angl
   }
 }
 
-/** Return an iterator to the closest key (angle) in the cache.
- *
- * @return The iterator to the closest key (angle) in the cache, if this angle is close enough
- * to the desired angle. Otherwise, return the past the last iterator.
- */
-RayLookup::const_iterator MapRayCaster::angleLookup(const double angle, const double tolerance)
-{
-  if (tolerance == 0)
-  {
-    return raycast_lookup_.find(angle);
-  }
-
-  double dangle_lower;
-  double dangle_upper;
-
-  RayLookup::const_iterator upper_bound = raycast_lookup_.upper_bound(angle);
-  if (upper_bound == raycast_lookup_.begin())
-  {
-    if (std::abs(angles::shortest_angular_distance(angle, upper_bound->first)) <= tolerance)
-    {
-      return upper_bound;
-    }
-    return raycast_lookup_.end();
-  }
-  else if (upper_bound == raycast_lookup_.end())
-  {
-    dangle_upper = raycast_lookup_.begin()->first - angle + 2 * M_PI;
-    upper_bound--;
-    dangle_lower = upper_bound->first - angle;
-    if (dangle_lower < dangle_upper)
-    {
-      if (std::abs(angles::shortest_angular_distance(angle, upper_bound->first)) <= tolerance)
-      {
-        return upper_bound;
-      }
-      return raycast_lookup_.end();
-    }
-    else
-    {
-      if (std::abs(angles::shortest_angular_distance(angle, raycast_lookup_.begin()->first)) <= tolerance)
-      {
-        return raycast_lookup_.begin();
-      }
-      return raycast_lookup_.end();
-    }
-  }
-  else
-  {
-    dangle_upper = upper_bound->first - angle;
-    RayLookup::const_iterator lower_bound = upper_bound;
-    lower_bound--;
-    dangle_lower = angle - lower_bound->first;
-    if (dangle_lower < dangle_upper)
-    {
-      if (std::abs(angles::shortest_angular_distance(angle, lower_bound->first)) <= tolerance)
-      {
-        return lower_bound;
-      }
-      return raycast_lookup_.end();
-    }
-    else
-    {
-      if (std::abs(angles::shortest_angular_distance(angle, upper_bound->first)) <= tolerance)
-      {
-        return upper_bound;
-      }
-      return raycast_lookup_.end();
-    }
-  }
-}
-
 } // namespace map_ray_caster
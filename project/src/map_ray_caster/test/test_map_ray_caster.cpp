@@ -0,0 +1,167 @@
+#include <cstdlib>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <map_ray_caster/map_ray_caster.h>
+
+using map_ray_caster::MapRayCaster;
+using map_ray_caster::Ray;
+
+/* Fill the ranges attributes with distances to obstacle
+ *
+ * COPIED FROM ../src/map_ray_caster.cpp (MapRayCaster::laserScanCast, before the ray distances)
+ */
+void legacyLaserScanCast(MapRayCaster& ray_caster, const int occupied_threshold_,
+    const nav_msgs::OccupancyGrid& map, sensor_msgs::LaserScan& scan)
+{
+  const size_t nrow = map.info.height;
+  const size_t ncol = map.info.width;
+  const double resolution = map.info.resolution;
+  // Max pixel count for scan.range_max if it were "bitmapped".
+  const size_t pixel_range = lround(scan.range_max / resolution) + 1;
+  const double max_range = 0.99 * scan.range_max;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(map.data.empty() ? NULL : &map.data[0]);
+  const int threshold = std::min(occupied_threshold_, 254);
+  const size_t beam_count = std::floor((scan.angle_max - scan.angle_min + 1e-6) / scan.angle_increment) + 1;
+
+  scan.ranges.resize(beam_count);
+  for (size_t beam = 0; beam < beam_count; ++beam)
+  {
+    const Ray ray = ray_caster.getRayCastToMapBorder(scan.angle_min + beam * scan.angle_increment,
+        nrow, ncol, scan.angle_increment / 2);
+    const size_t max_size = std::min(ray.size(), pixel_range);
+    size_t i = 0;
+    while (i < max_size && data[ray[i]] <= threshold)
+    {
+      ++i;
+    }
+    // Distance to the obstacle, or to the map border if there is none within range.
+    const size_t idx = (i < max_size) ? ray[i] : ray.back();
+    const double dx = (static_cast<double>(idx % ncol) - ncol / 2) * resolution;
+    const double dy = (static_cast<double>(idx / ncol) - nrow / 2) * resolution;
+    double range = std::sqrt(dx * dx + dy * dy);
+    if (i == max_size)
+    {
+      range = std::min(max_range, range);
+    }
+    if (range > scan.range_max)
+    {
+      range = max_range;
+    }
+    scan.ranges[beam] = range;
+  }
+}
+
+/* Map with random free, occupied and unknown points, free at the center
+ */
+nav_msgs::OccupancyGrid createMap(size_t width, size_t height, double resolution)
+{
+  nav_msgs::OccupancyGrid map;
+  map.info.width = width;
+  map.info.height = height;
+  map.info.resolution = resolution;
+  map.data.resize(width * height);
+  srand(0);
+  for (size_t i = 0; i < map.data.size(); ++i)
+  {
+    const int r = rand() % 100;
+    map.data[i] = (r < 2) ? -1 : ((r < 5) ? 100 : r % 60);
+  }
+  map.data[(height / 2) * width + width / 2] = 0;
+  return map;
+}
+
+/* Check that the distances of a ray are the distances of its points to map center
+ */
+void checkRayDistances(const nav_msgs::OccupancyGrid& map, const Ray& ray)
+{
+  ASSERT_TRUE(ray.hasDistances());
+  for (size_t i = 0; i < ray.size(); ++i)
+  {
+    geometry_msgs::Point32 p;
+    map_ray_caster::indexToReal(map, ray[i], p);
+    EXPECT_NEAR(std::sqrt(p.x * p.x + p.y * p.y), ray.distance(i) * map.info.resolution, 1e-4);
+    if (i > 0)
+    {
+      EXPECT_LT(ray.distance(i - 1), ray.distance(i));
+    }
+  }
+}
+
+TEST(TestSuite, testIndexToReal)
+{
+  nav_msgs::OccupancyGrid map;
+  map.info.width = 10;
+  map.info.height = 4;
+  map.info.resolution = 0.5;
+  geometry_msgs::Point32 p;
+  // Row 3, column 7.
+  map_ray_caster::indexToReal(map, 37, p);
+  EXPECT_FLOAT_EQ(1.0, p.x);
+  EXPECT_FLOAT_EQ(0.5, p.y);
+}
+
+TEST(TestSuite, testRayDistances)
+{
+  const size_t sizes[][2] = {{41, 41}, {60, 41}, {41, 60}};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+  {
+    const nav_msgs::OccupancyGrid map = createMap(sizes[s][0], sizes[s][1], 0.05);
+    MapRayCaster ray_caster(60, M_PI / 90);
+    for (int i = 0; i < 180; ++i)
+    {
+      const double angle = -M_PI + i * M_PI / 90;
+      // Cached ray.
+      checkRayDistances(map, ray_caster.getRayCastToMapBorder(angle, map.info.height, map.info.width, M_PI / 360));
+      // Uncached ray, half way between two cached rays.
+      checkRayDistances(map, ray_caster.getRayCastToMapBorder(angle + M_PI / 180, map.info.height, map.info.width));
+    }
+  }
+}
+
+TEST(TestSuite, testRaySlice)
+{
+  MapRayCaster ray_caster;
+  const Ray ray = ray_caster.getRayCastToMapBorder(0.3, 50, 50);
+  const Ray slice = ray.slice(3, 10);
+  ASSERT_EQ(10u, slice.size());
+  for (size_t i = 0; i < slice.size(); ++i)
+  {
+    EXPECT_EQ(ray[i + 3], slice[i]);
+    EXPECT_EQ(ray.distance(i + 3), slice.distance(i));
+  }
+  EXPECT_FALSE(Ray(ray.begin(), ray.size()).slice(0, 1).hasDistances());
+}
+
+TEST(TestSuite, testLaserScanCast)
+{
+  const size_t sizes[][2] = {{200, 200}, {240, 160}, {160, 240}};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+  {
+    const nav_msgs::OccupancyGrid map = createMap(sizes[s][0], sizes[s][1], 0.05);
+    sensor_msgs::LaserScan scan;
+    scan.angle_min = -2.0;
+    scan.angle_max = 2.0;
+    scan.angle_increment = 0.003;
+    scan.range_max = 4.0;
+    sensor_msgs::LaserScan legacy_scan = scan;
+
+    MapRayCaster ray_caster;
+    MapRayCaster legacy_ray_caster;
+    ray_caster.laserScanCast(map, scan);
+    legacyLaserScanCast(legacy_ray_caster, 60, map, legacy_scan);
+
+    ASSERT_EQ(legacy_scan.ranges.size(), scan.ranges.size());
+    for (size_t i = 0; i < scan.ranges.size(); ++i)
+    {
+      EXPECT_NEAR(legacy_scan.ranges[i], scan.ranges[i], 1e-5) << "beam " << i;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
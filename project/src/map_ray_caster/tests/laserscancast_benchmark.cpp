@@ -0,0 +1,161 @@
+/*
+ * Benchmark of the virtual laser scan.
+ *
+ * Compares MapRayCaster::laserScanCast against the former implementation,
+ * which tested the occupancy of each point with two comparisons and converted
+ * the map border point of every ray with indexToReal, on 200x200 and 600x600
+ * maps of a room with random obstacles. The ranges of both implementations
+ * are compared.
+ *
+ * Usage: rosrun map_ray_caster laserscancast_benchmark [iterations]
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include <map_ray_caster/map_ray_caster.h>
+
+using map_ray_caster::MapRayCaster;
+using map_ray_caster::Ray;
+
+/* Return true if the map point is occupied.
+ *
+ * COPIED FROM ../src/map_ray_caster.cpp (before the single comparison in laserScanCast)
+ */
+inline bool pointOccupied(const nav_msgs::OccupancyGrid& map, const int index, const int occupied_threshold)
+{
+  return (map.data[index] > occupied_threshold) || (map.data[index] == -1);
+}
+
+/* Fill the ranges attributes with distances to obstacle
+ *
+ * COPIED FROM ../src/map_ray_caster.cpp (MapRayCaster::laserScanCast, before the occupancy bitmask)
+ */
+void legacyLaserScanCast(MapRayCaster& ray_caster, const int occupied_threshold_,
+    const nav_msgs::OccupancyGrid& map, sensor_msgs::LaserScan& scan)
+{
+  scan.ranges.clear();
+  for (double angle = scan.angle_min; angle <= scan.angle_max + 1e-6; angle += scan.angle_increment)
+  {
+    // Max pixel count for scan.range_max if it were "bitmapped".
+    const size_t pixel_range = lround(scan.range_max / map.info.resolution) + 1;
+    const Ray ray = ray_caster.getRayCastToMapBorder(angle,
+        map.info.height, map.info.width, scan.angle_increment / 2);
+    const size_t max_size = std::min(ray.size(), pixel_range);
+    geometry_msgs::Point32 p;
+    map_ray_caster::indexToReal(map, ray.back(), p);
+    double range = std::min(0.99 * scan.range_max, (double)std::sqrt(p.x * p.x + p.y * p.y));
+    for (size_t i = 0; i < max_size; ++i)
+    {
+      const size_t idx = ray[i];
+      if (pointOccupied(map, idx, occupied_threshold_))
+      {
+        geometry_msgs::Point32 p;
+        map_ray_caster::indexToReal(map, idx, p);
+        range = std::sqrt(p.x * p.x + p.y * p.y);
+        break;
+      }
+    }
+    if (range > scan.range_max)
+    {
+      range = 0.99 * scan.range_max;
+    }
+    scan.ranges.push_back(range);
+  }
+}
+
+/* Map of a room whose walls are 1 m inside the map border, with random boxes, free elsewhere.
+ */
+nav_msgs::OccupancyGrid createMap(size_t size, double resolution)
+{
+  nav_msgs::OccupancyGrid map;
+  map.info.width = size;
+  map.info.height = size;
+  map.info.resolution = resolution;
+  map.data.assign(size * size, 0);
+  const size_t wall = 1.0 / resolution;
+  for (size_t i = wall; i < size - wall; ++i)
+  {
+    map.data[wall * size + i] = 100;
+    map.data[(size - wall - 1) * size + i] = 100;
+    map.data[i * size + wall] = 100;
+    map.data[i * size + size - wall - 1] = 100;
+  }
+  srand(0);
+  for (int box = 0; box < 20; ++box)
+  {
+    const size_t row = wall + rand() % (size - 2 * wall - 5);
+    const size_t col = wall + rand() % (size - 2 * wall - 5);
+    for (size_t r = row; r < row + 4; ++r)
+    {
+      for (size_t c = col; c < col + 4; ++c)
+      {
+        map.data[r * size + c] = 100;
+      }
+    }
+  }
+  // Keep the sensor out of the boxes.
+  map.data[(size / 2) * size + size / 2] = 0;
+  return map;
+}
+
+void run(size_t size, int beams, int iterations)
+{
+  const double resolution = 0.05;
+  const nav_msgs::OccupancyGrid map = createMap(size, resolution);
+  sensor_msgs::LaserScan scan;
+  scan.angle_min = -M_PI;
+  scan.angle_increment = 2 * M_PI / beams;
+  scan.angle_max = M_PI - scan.angle_increment;
+  scan.range_max = 10.0;
+  sensor_msgs::LaserScan legacy_scan = scan;
+
+  MapRayCaster ray_caster;
+  MapRayCaster legacy_ray_caster;
+  // Fill the caches.
+  ray_caster.laserScanCast(map, scan);
+  legacyLaserScanCast(legacy_ray_caster, 60, map, legacy_scan);
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    legacyLaserScanCast(legacy_ray_caster, 60, map, legacy_scan);
+  }
+  const double legacy_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    ray_caster.laserScanCast(map, scan);
+  }
+  const double time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  int differences = 0;
+  for (size_t i = 0; i < scan.ranges.size() && i < legacy_scan.ranges.size(); ++i)
+  {
+    if (std::abs(scan.ranges[i] - legacy_scan.ranges[i]) > 1e-5)
+    {
+      ++differences;
+    }
+  }
+
+  std::cout << size << "x" << size << " map, " << beams << " beams:" << std::endl;
+  std::cout << "  former laserScanCast: " << legacy_time * 1e6 << " us per scan" << std::endl;
+  std::cout << "  laserScanCast: " << time * 1e6 << " us per scan, " << 1 / time << " scans/s" << std::endl;
+  std::cout << "  (" << scan.ranges.size() << " and " << legacy_scan.ranges.size() << " ranges, "
+            << differences << " different ranges)" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  const int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+  run(200, 720, iterations);
+  run(200, 1440, iterations);
+  run(600, 720, iterations);
+  run(600, 1440, iterations);
+  return 0;
+}
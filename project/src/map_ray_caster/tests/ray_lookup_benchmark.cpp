@@ -0,0 +1,180 @@
+/*
+ * Micro-benchmark of the ray lookup.
+ *
+ * Compares MapRayCaster::getRayCastToMapBorder against the former cache (a
+ * std::map keyed by angle, searched with upper_bound), looking up the rays of
+ * 720- and 1440-beam scans the way local_map::MapBuilder::updateMap does, on
+ * the default 200x200 local map with a 0.25 deg angle resolution.
+ *
+ * Usage: rosrun map_ray_caster ray_lookup_benchmark [iterations]
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include <map_ray_caster/map_ray_caster.h>
+
+using map_ray_caster::MapRayCaster;
+using map_ray_caster::Ray;
+
+typedef std::map<double, std::vector<size_t> > RayLookup;
+
+const size_t g_map_size = 200;
+const double g_angle_resolution = M_PI / 720;
+
+/* Return an iterator to the closest key (angle) in the cache.
+ *
+ * COPIED FROM ../src/map_ray_caster.cpp (MapRayCaster::angleLookup, before the flat ray table)
+ */
+RayLookup::const_iterator angleLookup(const RayLookup& raycast_lookup_, const double angle, const double tolerance)
+{
+  if (tolerance == 0)
+  {
+    return raycast_lookup_.find(angle);
+  }
+
+  double dangle_lower;
+  double dangle_upper;
+
+  RayLookup::const_iterator upper_bound = raycast_lookup_.upper_bound(angle);
+  if (upper_bound == raycast_lookup_.begin())
+  {
+    if (std::abs(angles::shortest_angular_distance(angle, upper_bound->first)) <= tolerance)
+    {
+      return upper_bound;
+    }
+    return raycast_lookup_.end();
+  }
+  else if (upper_bound == raycast_lookup_.end())
+  {
+    dangle_upper = raycast_lookup_.begin()->first - angle + 2 * M_PI;
+    upper_bound--;
+    dangle_lower = upper_bound->first - angle;
+    if (dangle_lower < dangle_upper)
+    {
+      if (std::abs(angles::shortest_angular_distance(angle, upper_bound->first)) <= tolerance)
+      {
+        return upper_bound;
+      }
+      return raycast_lookup_.end();
+    }
+    else
+    {
+      if (std::abs(angles::shortest_angular_distance(angle, raycast_lookup_.begin()->first)) <= tolerance)
+      {
+        return raycast_lookup_.begin();
+      }
+      return raycast_lookup_.end();
+    }
+  }
+  else
+  {
+    dangle_upper = upper_bound->first - angle;
+    RayLookup::const_iterator lower_bound = upper_bound;
+    lower_bound--;
+    dangle_lower = angle - lower_bound->first;
+    if (dangle_lower < dangle_upper)
+    {
+      if (std::abs(angles::shortest_angular_distance(angle, lower_bound->first)) <= tolerance)
+      {
+        return lower_bound;
+      }
+      return raycast_lookup_.end();
+    }
+    else
+    {
+      if (std::abs(angles::shortest_angular_distance(angle, upper_bound->first)) <= tolerance)
+      {
+        return upper_bound;
+      }
+      return raycast_lookup_.end();
+    }
+  }
+}
+
+
+/* Former cache, filled as local_map::MapBuilder did, the rays themselves come from a MapRayCaster.
+ */
+RayLookup createLegacyLookup()
+{
+  MapRayCaster ray_caster;
+  RayLookup lookup;
+  const double angle_start = -M_PI;
+  const double angle_end = angle_start + 2 * M_PI - 1e-6;
+  for (double a = angle_start; a <= angle_end; a += g_angle_resolution)
+  {
+    const Ray ray = ray_caster.getRayCastToMapBorder(a, g_map_size, g_map_size);
+    lookup[a] = std::vector<size_t>(ray.begin(), ray.end());
+  }
+  return lookup;
+}
+
+/* Angle of the beam of a scan covering 360 deg, rotated as the robot turns.
+ */
+double beamAngle(int scan, int beam, int beams)
+{
+  return angles::normalize_angle(-M_PI + beam * 2 * M_PI / beams + 0.01 * scan);
+}
+
+void run(int beams, int iterations)
+{
+  const RayLookup legacy_lookup = createLegacyLookup();
+  MapRayCaster ray_caster(60, g_angle_resolution);
+  ray_caster.cacheRays(g_map_size, g_map_size);
+  const double tolerance = 1.1 * g_angle_resolution;
+  size_t checksum = 0;
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int s = 0; s < iterations; ++s)
+  {
+    for (int i = 0; i < beams; ++i)
+    {
+      RayLookup::const_iterator ray = angleLookup(legacy_lookup, beamAngle(s, i, beams), tolerance);
+      checksum += ray->second.size();
+    }
+  }
+  const double legacy_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  start = ros::WallTime::now();
+  for (int s = 0; s < iterations; ++s)
+  {
+    for (int i = 0; i < beams; ++i)
+    {
+      checksum += ray_caster.getRayCastToMapBorder(beamAngle(s, i, beams), g_map_size, g_map_size, tolerance).size();
+    }
+  }
+  const double table_time = (ros::WallTime::now() - start).toSec() / iterations;
+
+  // Both caches must give the same rays.
+  int differences = 0;
+  for (int s = 0; s < iterations; ++s)
+  {
+    for (int i = 0; i < beams; ++i)
+    {
+      const std::vector<size_t>& legacy_ray = angleLookup(legacy_lookup, beamAngle(s, i, beams), tolerance)->second;
+      const Ray ray = ray_caster.getRayCastToMapBorder(beamAngle(s, i, beams), g_map_size, g_map_size, tolerance);
+      if (legacy_ray.size() != ray.size() || !std::equal(ray.begin(), ray.end(), legacy_ray.begin()))
+      {
+        ++differences;
+      }
+    }
+  }
+
+  std::cout << beams << " beams:" << std::endl;
+  std::cout << "  std::map with upper_bound (former cache): " << legacy_time * 1e6 << " us per scan" << std::endl;
+  std::cout << "  flat ray table: " << table_time * 1e6 << " us per scan" << std::endl;
+  std::cout << "  (" << differences << " different rays, checksum " << checksum << ")" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  ros::Time::init();
+  const int iterations = (argc > 1) ? atoi(argv[1]) : 1000;
+  run(720, iterations);
+  run(1440, iterations);
+  return 0;
+}